@@ -44,6 +44,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -77,6 +78,8 @@
 #define MC_STATS_INTVL      STATS_DEFAULT_INTVL
 
 #define MC_HASH_MAX_POWER   HASH_MAX_POWER
+#define MC_LOCK_POWER       ITEM_LOCK_POWER
+#define MC_LOCK_MAX_POWER   ITEM_LOCK_MAX_POWER
 
 #define MC_KLOG_INTVL       KLOG_DEFAULT_INTVL
 #define MC_KLOG_SMP_RATE    KLOG_DEFAULT_SMP_RATE
@@ -103,15 +106,30 @@
 #define MC_EVICT_STR        "random slab"
 #define MC_FACTOR           1.25
 #define MC_MAXBYTES         (64 * MB)
+#define MC_EXT_SIZE         (1024 * MB)
 
 struct settings settings;          /* twemcache settings */
 static int show_help;              /* show twemcache help? */
 static int show_version;           /* show twemcache version? */
 static int show_stats_description; /* show twemcache stats description? */
 static int show_sizes;             /* show twemcache struct sizes? */
+static int show_hash_benchmark;    /* show twemcache hash function benchmark? */
 static int parse_profile;          /* parse profile? */
 static char *profile_optarg;       /* profile optarg */
 
+/*
+ * Options with no short option. Only a couple of letters are still
+ * unused, so they are kept for options set on most command lines, and
+ * these rarely used ones are spelled out instead
+ */
+enum {
+    OPT_SNAPSHOT_FILE = UCHAR_MAX + 1,
+    OPT_EXT_FILE,
+    OPT_EXT_SIZE,
+    OPT_ADMISSION,
+    OPT_EVICTION_POLICY,
+};
+
 static struct option long_options[] = {
     { "help",                 no_argument,        NULL,   'h' }, /* help */
     { "version",              no_argument,        NULL,   'V' }, /* version */
@@ -123,7 +141,9 @@ static struct option long_options[] = {
     { "disable-cas",          no_argument,        NULL,   'C' }, /* disable cas */
     { "describe-stats",       no_argument,        NULL,   'D' }, /* print stats description and exit */
     { "show-sizes",           no_argument,        NULL,   'S' }, /* print slab & item struct sizes and exit */
+    { "benchmark-hash",       no_argument,        NULL,   'N' }, /* print hash function benchmark and exit */
     { "enable-hotkey",        no_argument,        NULL,   'H' }, /* enable hotkey detection */
+    { "expiry-wheel",         no_argument,        NULL,   'Q' }, /* reclaim expired items in the background */
     { "output",               required_argument,  NULL,   'o' }, /* output logfile */
     { "verbosity",            required_argument,  NULL,   'v' }, /* log verbosity level */
     { "stats-aggr-interval",  required_argument,  NULL,   'A' }, /* stats aggregation interval in usec */
@@ -135,6 +155,9 @@ static struct option long_options[] = {
     { "hotkey-qps-threshold", required_argument,  NULL,   'T' }, /* hotkey frequency signalling threshold */
     { "hotkey-bw-threshold",  required_argument,  NULL,   'j' }, /* hotkey bandwidth signalling threshold */
     { "hash-power",           required_argument,  NULL,   'e' }, /* fixed sized hash table, as power of 2 */
+    { "lock-power",           required_argument,  NULL,   'K' }, /* # item lock stripes, as power of 2 */
+    { "hash-table",           required_argument,  NULL,   'G' }, /* hash table type */
+    { "hash-function",        required_argument,  NULL,   'F' }, /* hash function for keys */
     { "threads",              required_argument,  NULL,   't' }, /* # of threads */
     { "pidfile",              required_argument,  NULL,   'P' }, /* pid file */
     { "user",                 required_argument,  NULL,   'u' }, /* user identity to run as */
@@ -146,11 +169,21 @@ static struct option long_options[] = {
     { "interface",            required_argument,  NULL,   'l' }, /* interface to listen on */
     { "unix-path",            required_argument,  NULL,   's' }, /* unix socket path to listen on */
     { "access-mask",          required_argument,  NULL,   'a' }, /* access mask for unix socket */
+    { "numa-policy",          required_argument,  NULL,   'Z' }, /* numa placement of slab memory */
+    { "heap-file",            required_argument,  NULL,   'J' }, /* file backing slab memory across restarts */
+    { "snapshot-file",        required_argument,  NULL,   OPT_SNAPSHOT_FILE }, /* file to dump items to and load them from */
+    { "ext-file",             required_argument,  NULL,   OPT_EXT_FILE }, /* file of second tier for evicted items */
+    { "ext-size",             required_argument,  NULL,   OPT_EXT_SIZE }, /* size of second tier file */
+    { "admission",            required_argument,  NULL,   OPT_ADMISSION }, /* admission filter of sets that evict */
+    { "eviction-policy",      required_argument,  NULL,   OPT_EVICTION_POLICY }, /* eviction policy of lru q */
+    { "storage-engine",       required_argument,  NULL,   'W' }, /* storage engine for items */
     { "eviction-strategy",    required_argument,  NULL,   'M' }, /* eviction strategy on OOM */
+    { "slab-automove",        required_argument,  NULL,   'g' }, /* slab rebalancing aggressiveness */
     { "factor",               required_argument,  NULL,   'f' }, /* growth factor for slab items */
     { "max-memory",           required_argument,  NULL,   'm' }, /* max memory for all items in MB */
     { "min-item-chunk-size",  required_argument,  NULL,   'n' }, /* min item chunk size */
     { "slab-size",            required_argument,  NULL,   'I' }, /* slab size */
+    { "max-item-size",        required_argument,  NULL,   'w' }, /* max item size, chunked if need be */
     { "slab-profile",         required_argument,  NULL,   'z' }, /* profile of slab item sizes */
     { NULL,                   0,                  NULL,    0  }
 };
@@ -166,11 +199,16 @@ static char short_options[] =
     "C"  /* disable cas */
     "D"  /* print stats description and exit */
     "S"  /* print slab & item struct sizes and exit */
+    "N"  /* print hash function benchmark and exit */
     "H"  /* enable hotkey detection */
+    "Q"  /* reclaim expired items in the background */
     "o:" /* output logfile */
     "v:" /* log verbosity level */
     "A:" /* stats aggregation interval in msec */
     "e:" /* hash power */
+    "K:" /* item lock power */
+    "G:" /* hash table type */
+    "F:" /* hash function for keys */
     "t:" /* # of threads */
     "P:" /* pid file */
     "u:" /* user identity to run as */
@@ -190,11 +228,16 @@ static char short_options[] =
     "l:" /* interface to listen on */
     "s:" /* unix socket path to listen on */
     "a:" /* access mask for unix socket */
+    "Z:" /* numa placement of slab memory */
+    "J:" /* file backing slab memory across restarts */
+    "W:" /* storage engine for items */
     "M:" /* eviction strategy on OOM */
+    "g:" /* slab rebalancing aggressiveness */
     "f:" /* growth factor for slab items */
     "m:" /* max memory for all items in MB */
     "n:" /* min item size */
-    "I:" /* max item size */
+    "I:" /* slab size */
+    "w:" /* max item size, chunked if need be */
     "z:" /* profile of slab item sizes */
     ;
 
@@ -203,33 +246,48 @@ mc_show_usage(void)
 {
     log_stderr(
         "Usage:" CRLF
-        "twemcache [-?hVCELdkrDSH]" CRLF
+        "twemcache [-?hVCELdkrDSNHQ]" CRLF
         "          [-o output file] [-v verbosity level]" CRLF
         "          [-A stats aggr interval] [-t threads] [-P pid file] [-u user]" CRLF
-        "          [-e hash power] [-M eviction strategy]" CRLF
+        "          [-e hash power] [-K lock power] [-G hash table] [-F hash function]" CRLF
+        "          [-Z numa policy] [-J heap file] [-W storage engine] [-M eviction strategy]" CRLF
+        "          [-g slab automove]" CRLF
         "          [-x command log entry] [-X command log file] [-y command log sample rate]" CRLF
         "          [-q hotkey redline qps] [-Y hotkey sample rate] [-T hotkey qps threshold]" CRLF
         "          [-B hotkey bandwidth threshold] [-p port] [-U udp port] [-R max requests]" CRLF
         "          [-c max conns] [-b backlog] [-l interface] [-s unix path] [-a access mask]" CRLF
         "          [-m max memory] [-f factor] [-n min item chunk size] [-I slab size]" CRLF
-        "          [-z slab profile]"
+        "          [-w max item size] [-z slab profile] [--snapshot-file=S]" CRLF
+        "          [--ext-file=S] [--ext-size=N] [--admission=S]" CRLF
+        "          [--eviction-policy=S]"
         "");
     log_stderr(
         "Options:" CRLF
         "  -h, --help                  show twemcache version, usage, options, and exit" CRLF
         "  -V, --version               show version and exit" CRLF
         "  -E, --prealloc              preallocate memory for all slabs" CRLF
-        "  -L, --use-large-pages       use large pages if available" CRLF
+        "  -L, --use-large-pages       preallocate slab memory on huge pages, or on" CRLF
+        "                              transparent huge pages, if available" CRLF
         "  -k, --lock-pages            preallocate all slab memory and lock the pages" CRLF
         "  -d, --daemonize             run twemcache as a daemon" CRLF
         "  -r, --maximize-core-limit   maximize core file limit" CRLF
         "  -C, --disable-cas           disable cas field in an item, this saves 8 bytes" CRLF
-        "                              per item, but cas/gets commands will not work" CRLF
+        "                              per item, but cas/gets commands will not work"
+        "");
+
+    log_stderr(
         "  -D, --describe-stats        show version, name and description of each stats" CRLF
         "                              metric, and exit" CRLF
         "  -S, --show-sizes            show version, item overhead, minimum item size," CRLF
         "                              slab overhead, default slab size, and exit" CRLF
-        "  -H, --enable-hotkey         enable signalling of hotkey"
+        "  -N, --benchmark-hash        show version, time of each hash function over" CRLF
+        "                              typical key lengths, and exit"
+        "");
+
+    log_stderr(
+        "  -H, --enable-hotkey         enable signalling of hotkey" CRLF
+        "  -Q, --expiry-wheel          index items by expiry time, and reclaim them in" CRLF
+        "                              the background once expired (slab engine only)"
         "");
 
     log_stderr(
@@ -240,14 +298,25 @@ mc_show_usage(void)
         "                              to get a snapshot used by `stats' commands" CRLF
         "  -e, --hash-power=N          create a fixed sized hash table, number of" CRLF
         "                              entries as power of 2 (default: 0, i.e. dynamic)" CRLF
+        "  -K, --lock-power=N          set the number of item lock stripes as power" CRLF
+        "                              of 2, capped by the hash power (default: %d)" CRLF
+        "  -G, --hash-table=S          use a 'chained' hash table or a 'bucketized' one" CRLF
+        "                              of cache line sized buckets (default: chained)" CRLF
+        "  -F, --hash-function=S       hash keys with 'lookup3', 'crc32c' (sse4.2) or" CRLF
+        "                              'xxh32' (default: lookup3)"
+        "",
+        MC_LOG_FILE != NULL ? MC_LOG_FILE : "stderr",
+        MC_LOG_DEFAULT, MC_LOG_MIN, MC_LOG_MAX,
+        MC_STATS_INTVL,
+        MC_LOCK_POWER
+        );
+
+    log_stderr(
         "  -t, --threads=N             set the number of worker threads (default: %d)" CRLF
         "  -P, --pidfile=S             store pid in a file (default: %s)" CRLF
         "  -u, --user=S                user identity to run twemcache as, set this" CRLF
         "                              option if and only if run twemcache as root"
         "",
-        MC_LOG_FILE != NULL ? MC_LOG_FILE : "stderr",
-        MC_LOG_DEFAULT, MC_LOG_MIN, MC_LOG_MAX,
-        MC_STATS_INTVL,
         MC_WORKERS,
         MC_PID_FILE != NULL ? MC_PID_FILE : "not stored"
         );
@@ -299,9 +368,31 @@ mc_show_usage(void)
         MC_UNIX_PATH != NULL ? MC_UNIX_PATH : "disabled", MC_ACCESS_MASK
         );
 
+    log_stderr(
+        "  -Z, --numa-policy=S         place slab memory on the 'local' numa node of" CRLF
+        "                              the thread touching it first, or 'interleave'" CRLF
+        "                              it across all nodes, which preallocates it" CRLF
+        "                              (default: local)" CRLF
+        "  -W, --storage-engine=S      keep items in the 'slab' of their size class, or" CRLF
+        "                              append them to 'segment's grouped by ttl, which" CRLF
+        "                              are reclaimed as a whole once expired, and are" CRLF
+        "                              merged on eviction unless -M is 0" CRLF
+        "                              (default: slab)"
+        "");
+
     log_stderr(
         "  -M, --eviction-strategy=N   use eviction strategy N when running out of free" CRLF
         "                              memory for items (default: %d, i.e. %s)" CRLF
+        "  -g, --slab-automove=N       move slabs in the background from cold slab" CRLF
+        "                              classes to those evicting items, 0 for never," CRLF
+        "                              1 for conservative and 2 for aggressive" CRLF
+        "                              (default: %d)"
+        "",
+        MC_EVICT, MC_EVICT_STR,
+        SLAB_AUTOMOVE_OFF
+        );
+
+    log_stderr(
         "  -f, --factor=D              set the exponential growth factor in deciding" CRLF
         "                              item chunk size for each slab class" CRLF
         "                              (default: %g)" CRLF
@@ -309,15 +400,35 @@ mc_show_usage(void)
         "                              (default: %d)" CRLF
         "  -n, --min-item-chunk-size=N set the minimum item chunk size, in bytes" CRLF
         "                              (default: %d)" CRLF
-        "  -I, --slab-size=N           slab size, in bytes (default: %d)" CRLF
-        "  -z, --slab-profile=S        specify all item chunk sizes to be supported," CRLF
-        "                              e.g. -z 128,256,1024,8192 (default: off)" CRLF
+        "  -I, --slab-size=N           slab size, in bytes (default: %d)"
         "",
-        MC_EVICT, MC_EVICT_STR,
         MC_FACTOR, MC_MAXBYTES / MB,
         MC_CHUNK_SIZE,
         SLAB_SIZE
         );
+
+    log_stderr(
+        "  -w, --max-item-size=N       set the maximum item size, in bytes; items larger" CRLF
+        "                              than the largest item chunk are spread over" CRLF
+        "                              several chunks (default: largest item chunk)" CRLF
+        "  -z, --slab-profile=S        specify all item chunk sizes to be supported," CRLF
+        "                              e.g. -z 128,256,1024,8192 (default: off)" CRLF
+        "  -J, --heap-file=S           back the slab heap by file S, e.g. on /dev/shm," CRLF
+        "                              which preallocates it; items left in it by a" CRLF
+        "                              clean shutdown are restored on restart" CRLF
+        "                              (default: off)" CRLF
+        "      --snapshot-file=S       dump items to file S on 'config snapshot dump'," CRLF
+        "                              and load them from it on startup (default: off)" CRLF
+        "      --ext-file=S            write items evicted from memory out to file S," CRLF
+        "                              and read them back from it on gets (default: off)" CRLF
+        "      --ext-size=N            set the size of the ext file, in MB (default: %d)" CRLF
+        "      --admission=S           once memory is full, store sets with 'none' or" CRLF
+        "                              only those more frequent than their eviction" CRLF
+        "                              victim with 'tinylfu' (default: none)" CRLF
+        "      --eviction-policy=S     evict items with -M 1 in 'lru', 'clock', 'slru'" CRLF
+        "                              or 's3fifo' order (default: lru)" CRLF
+        "",
+        MC_EXT_SIZE / MB);
 }
 
 static rstatus_t
@@ -512,12 +623,25 @@ mc_enable_large_pages(void)
     return 0;
 }
 
+/*
+ * Lock all pages, current and future. Where we can, pages are locked as
+ * they get faulted in rather than right away, so that the slab heap gets
+ * locked by the threads prefaulting it in parallel, instead of by the
+ * kernel while mapping it in one go (see slab_heap_prefault).
+ */
 static rstatus_t
 mc_lock_page(void)
 {
 #ifdef MC_MLOCKALL
     int status;
 
+#ifdef MCL_ONFAULT
+    status = mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT);
+    if (status == 0) {
+        return MC_OK;
+    }
+#endif
+
     status = mlockall(MCL_CURRENT | MCL_FUTURE);
     if (status < 0) {
         log_stderr("twemcache: -k option to mlockall failed: %s",
@@ -536,6 +660,7 @@ mc_set_default_options(void)
 {
     settings.prealloc = MC_SLAB_PREALLOC;
     settings.lock_page = MC_LOCK_PAGES;
+    settings.large_pages = false;
     settings.daemonize = MC_DAEMONIZE;
     settings.max_corefile = MC_MAXIMIZE_CORE;
     settings.use_cas = MC_DISABLE_CAS ? false : true;
@@ -564,14 +689,28 @@ mc_set_default_options(void)
     settings.socketpath = MC_UNIX_PATH;
     settings.access = MC_ACCESS_MASK;
 
+    settings.numa_policy = NUMA_POLICY_LOCAL;
+    settings.heap_file = NULL;
+    settings.snapshot_file = NULL;
+    settings.ext_file = NULL;
+    settings.ext_size = MC_EXT_SIZE;
+    settings.storage = STORAGE_SLAB;
+    settings.admission = ADMIT_NONE;
+    settings.policy = POLICY_LRU;
     settings.evict_opt = MC_EVICT;
+    settings.slab_automove = SLAB_AUTOMOVE_OFF;
     settings.use_freeq = true;
     settings.use_lruq = true;
+    settings.expiry_wheel = false;
     settings.factor = MC_FACTOR;
     settings.maxbytes = MC_MAXBYTES;
     settings.chunk_size = MC_CHUNK_SIZE;
     settings.slab_size = MC_SLAB_SIZE;
+    settings.max_item_size = 0;
     settings.hash_power = 0;
+    settings.lock_power = MC_LOCK_POWER;
+    settings.hash_table = HASH_TABLE_CHAINED;
+    settings.hash_type = HASH_LOOKUP3;
 
     settings.accepting_conns = true;
     settings.oldest_live = 0;
@@ -625,6 +764,7 @@ mc_get_options(int argc, char **argv)
 
         case 'L':
             if (mc_enable_large_pages() == 0) {
+                settings.large_pages = true;
                 settings.prealloc = true;
             }
             break;
@@ -656,10 +796,19 @@ mc_get_options(int argc, char **argv)
             show_version = 1;
             break;
 
+        case 'N':
+            show_hash_benchmark = 1;
+            show_version = 1;
+            break;
+
         case 'H':
             settings.hotkey_enable = true;
             break;
 
+        case 'Q':
+            settings.expiry_wheel = true;
+            break;
+
         case 'o':
             settings.log_filename = optarg;
             break;
@@ -713,6 +862,42 @@ mc_get_options(int argc, char **argv)
             settings.hash_power = value;
             break;
 
+        case 'K':
+            value = mc_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("twemcache: option -K requires a number");
+                return MC_ERROR;
+            }
+
+            if (value > MC_LOCK_MAX_POWER) {
+                log_stderr("twemcache: lock power cannot be greater than %d",
+                           MC_LOCK_MAX_POWER);
+                return MC_ERROR;
+            }
+
+            settings.lock_power = value;
+            break;
+
+        case 'G':
+            if (strcmp(optarg, "chained") == 0) {
+                settings.hash_table = HASH_TABLE_CHAINED;
+            } else if (strcmp(optarg, "bucketized") == 0) {
+                settings.hash_table = HASH_TABLE_BUCKETIZED;
+            } else {
+                log_stderr("twemcache: option -G requires 'chained' or "
+                           "'bucketized'");
+                return MC_ERROR;
+            }
+            break;
+
+        case 'F':
+            if (hash_parse(optarg, &settings.hash_type) != MC_OK) {
+                log_stderr("twemcache: option -F requires 'lookup3', 'crc32c' "
+                           "or 'xxh32'");
+                return MC_ERROR;
+            }
+            break;
+
         case 'x':
             value = mc_atoi(optarg, strlen(optarg));
             if (value <= 0) {
@@ -877,6 +1062,83 @@ mc_get_options(int argc, char **argv)
             settings.access = value;
             break;
 
+        case 'Z':
+            if (strcmp(optarg, "local") == 0) {
+                settings.numa_policy = NUMA_POLICY_LOCAL;
+            } else if (strcmp(optarg, "interleave") == 0) {
+                settings.numa_policy = NUMA_POLICY_INTERLEAVE;
+                settings.prealloc = true;
+            } else {
+                log_stderr("twemcache: option -Z requires 'local' or "
+                           "'interleave'");
+                return MC_ERROR;
+            }
+            break;
+
+        case 'J':
+            settings.heap_file = optarg;
+            settings.prealloc = true;
+            break;
+
+        case OPT_SNAPSHOT_FILE:
+            settings.snapshot_file = optarg;
+            break;
+
+        case OPT_EXT_FILE:
+            settings.ext_file = optarg;
+            break;
+
+        case OPT_EXT_SIZE:
+            value = mc_atoi(optarg, strlen(optarg));
+            if (value <= 0) {
+                log_stderr("twemcache: option --ext-size requires a non zero "
+                           "number");
+                return MC_ERROR;
+            }
+
+            settings.ext_size = (size_t)value * 1024 * 1024;
+            break;
+
+        case OPT_ADMISSION:
+            if (strcmp(optarg, "none") == 0) {
+                settings.admission = ADMIT_NONE;
+            } else if (strcmp(optarg, "tinylfu") == 0) {
+                settings.admission = ADMIT_TINYLFU;
+            } else {
+                log_stderr("twemcache: option --admission requires 'none' or "
+                           "'tinylfu'");
+                return MC_ERROR;
+            }
+            break;
+
+        case OPT_EVICTION_POLICY:
+            if (strcmp(optarg, "lru") == 0) {
+                settings.policy = POLICY_LRU;
+            } else if (strcmp(optarg, "clock") == 0) {
+                settings.policy = POLICY_CLOCK;
+            } else if (strcmp(optarg, "slru") == 0) {
+                settings.policy = POLICY_SLRU;
+            } else if (strcmp(optarg, "s3fifo") == 0) {
+                settings.policy = POLICY_S3FIFO;
+            } else {
+                log_stderr("twemcache: option --eviction-policy requires "
+                           "'lru', 'clock', 'slru' or 's3fifo'");
+                return MC_ERROR;
+            }
+            break;
+
+        case 'W':
+            if (strcmp(optarg, "slab") == 0) {
+                settings.storage = STORAGE_SLAB;
+            } else if (strcmp(optarg, "segment") == 0) {
+                settings.storage = STORAGE_SEG;
+            } else {
+                log_stderr("twemcache: option -W requires 'slab' or "
+                           "'segment'");
+                return MC_ERROR;
+            }
+            break;
+
         case 'M':
             value = mc_atoi(optarg, strlen(optarg));
             if (value < 0) {
@@ -895,6 +1157,17 @@ mc_get_options(int argc, char **argv)
             }
             break;
 
+        case 'g':
+            value = mc_atoi(optarg, strlen(optarg));
+            if (value < SLAB_AUTOMOVE_OFF || value > SLAB_AUTOMOVE_AGGRESSIVE) {
+                log_stderr("twemcache: option -g requires a number between "
+                           "%d and %d", SLAB_AUTOMOVE_OFF,
+                           SLAB_AUTOMOVE_AGGRESSIVE);
+                return MC_ERROR;
+            }
+            settings.slab_automove = value;
+            break;
+
         case 'f':
             settings.factor = atof(optarg);
             if (settings.factor <= 1.0) {
@@ -981,6 +1254,40 @@ mc_get_options(int argc, char **argv)
 
             break;
 
+        case 'w':
+            len = strlen(optarg);
+            switch (optarg[len - 1]) {
+            case 'k':
+                len--;
+                factor = KB;
+                break;
+
+            case 'm':
+            case 'M':
+                len--;
+                factor = MB;
+                break;
+
+            default:
+                factor = 1;
+            }
+
+            value = mc_atoi(optarg, len);
+            if (value <= 0) {
+                log_stderr("twemcache: option -w requires a non zero number");
+                return MC_ERROR;
+            }
+
+            settings.max_item_size = (size_t)value * factor;
+
+            if (settings.max_item_size > ITEM_MAX_SIZE) {
+                log_stderr("twemcache: max item size cannot be larger than "
+                           "%zu bytes", ITEM_MAX_SIZE);
+                return MC_ERROR;
+            }
+
+            break;
+
         case 'z':
             parse_profile = 1;
             profile_optarg = optarg;
@@ -1000,6 +1307,7 @@ mc_get_options(int argc, char **argv)
             case 'v':
             case 'A':
             case 'e':
+            case 'K':
             case 't':
             case 'R':
             case 'c':
@@ -1008,6 +1316,7 @@ mc_get_options(int argc, char **argv)
             case 'U':
             case 'a':
             case 'M':
+            case 'g':
             case 'f':
             case 'm':
             case 'n':
@@ -1017,10 +1326,34 @@ mc_get_options(int argc, char **argv)
             case 'u':
             case 'l':
             case 'I':
+            case 'w':
             case 'z':
+            case 'G':
+            case 'F':
+            case 'W':
+            case 'Z':
+            case 'J':
                 log_stderr("twemcache: option -%c requires a string", optopt);
                 break;
 
+            case OPT_SNAPSHOT_FILE:
+            case OPT_EXT_FILE:
+                log_stderr("twemcache: option --%s requires a file name",
+                           optopt == OPT_EXT_FILE ? "ext-file" :
+                           "snapshot-file");
+                break;
+
+            case OPT_EXT_SIZE:
+                log_stderr("twemcache: option --ext-size requires a number");
+                break;
+
+            case OPT_ADMISSION:
+            case OPT_EVICTION_POLICY:
+                log_stderr("twemcache: option --%s requires a string",
+                           optopt == OPT_ADMISSION ? "admission" :
+                           "eviction-policy");
+                break;
+
             default:
                 log_stderr("twemcache: invalid option -- '%c'", optopt);
                 break;
@@ -1034,6 +1367,43 @@ mc_get_options(int argc, char **argv)
         }
     }
 
+    if (settings.heap_file != NULL && settings.storage == STORAGE_SEG) {
+        log_stderr("twemcache: segment storage engine cannot be backed by a "
+                   "heap file");
+        return MC_ERROR;
+    }
+
+    if (settings.snapshot_file != NULL && settings.storage == STORAGE_SEG) {
+        log_stderr("twemcache: segment storage engine cannot be dumped to a "
+                   "snapshot file");
+        return MC_ERROR;
+    }
+
+    if (settings.ext_file != NULL && settings.storage == STORAGE_SEG) {
+        log_stderr("twemcache: segment storage engine cannot write evicted "
+                   "items out to an ext file");
+        return MC_ERROR;
+    }
+
+    if (settings.admission != ADMIT_NONE && settings.storage == STORAGE_SEG) {
+        log_stderr("twemcache: segment storage engine cannot filter sets on "
+                   "admission");
+        return MC_ERROR;
+    }
+
+    if (settings.policy != POLICY_LRU && settings.storage == STORAGE_SEG) {
+        log_stderr("twemcache: segment storage engine has no eviction policy "
+                   "but its own");
+        return MC_ERROR;
+    }
+
+    if (settings.ext_file != NULL &&
+        settings.ext_size < EXT_MIN_NPAGE * EXT_PAGE_SIZE) {
+        log_stderr("twemcache: ext file must be at least %d MB",
+                   EXT_MIN_NPAGE * EXT_PAGE_SIZE / MB);
+        return MC_ERROR;
+    }
+
     if (tcp_specified && !udp_specified) {
         settings.udpport = settings.port;
     } else if (udp_specified && !tcp_specified) {
@@ -1323,6 +1693,42 @@ mc_set_profile(void)
     return mc_generate_profile();
 }
 
+/*
+ * Settle the maximum item size once the slab profile is known. Items larger
+ * than the largest item chunk are chunked, and their links to chunks must
+ * fit in an item chunk for even the longest of keys.
+ */
+static rstatus_t
+mc_set_max_item_size(void)
+{
+    size_t nchunk, ntotal;
+
+    if (settings.max_item_size == 0) {
+        settings.max_item_size = settings.max_chunk_size;
+    }
+
+    if (settings.max_item_size <= settings.max_chunk_size) {
+        return MC_OK;
+    }
+
+    if (settings.storage == STORAGE_SEG) {
+        log_stderr("twemcache: segment storage engine cannot store items "
+                   "larger than %zu bytes", settings.max_chunk_size);
+        return MC_ERROR;
+    }
+
+    nchunk = settings.max_item_size /
+             (settings.max_chunk_size - ITEM_HDR_SIZE - 1) + 1;
+    ntotal = item_ntotal(KEY_MAX_LEN, nchunk * sizeof(item_link_t), true);
+    if (ntotal > settings.max_chunk_size) {
+        log_stderr("twemcache: max item size of %zu bytes needs item chunks "
+                   "of at least %zu bytes", settings.max_item_size, ntotal);
+        return MC_ERROR;
+    }
+
+    return MC_OK;
+}
+
 static void
 mc_print_sizes(void)
 {
@@ -1339,11 +1745,12 @@ mc_print(void)
          MC_VERSION_STRING, settings.pid, settings.num_workers);
 
     loga("configured with debug logs %s, asserts %s, panic %s, stats %s, "
-         "klog %s", MC_DEBUG_LOG ? "enabled" : "disabled",
+         "klog %s, compact items %s", MC_DEBUG_LOG ? "enabled" : "disabled",
          MC_ASSERT_LOG ? "enabled" : "disabled",
          MC_ASSERT_PANIC ? "enabled" : "disabled",
          MC_DISABLE_STATS ? "disabled" : "enabled",
-         MC_DISABLE_KLOG ? "disabled" : "enabled");
+         MC_DISABLE_KLOG ? "disabled" : "enabled",
+         MC_COMPACT_ITEMS ? "enabled" : "disabled");
 
     slab_print();
 }
@@ -1376,6 +1783,10 @@ main(int argc, char **argv)
             mc_print_sizes();
         }
 
+        if (show_hash_benchmark) {
+            hash_benchmark();
+        }
+
         exit(0);
     }
 
@@ -1424,6 +1835,11 @@ main(int argc, char **argv)
         exit(1);
     }
 
+    status = mc_set_max_item_size();
+    if (status != MC_OK) {
+        exit(1);
+    }
+
     status = core_init();
     if (status != MC_OK) {
         exit(1);
@@ -0,0 +1,187 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <mc_core.h>
+
+extern struct settings settings;
+
+#define ADMIT_COUNTER_MAX   0xfULL
+#define ADMIT_AGE_MASK      0x7777777777777777ULL
+
+/* odd multipliers that spread a key hash over the counters of each row */
+static const uint32_t admit_seed[ADMIT_NROW] = {
+    0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f
+};
+
+static struct {
+    uint64_t *table;        /* counters, 16 to a word, row after row */
+    uint32_t power;         /* log2 of # counters in a row */
+    uint32_t nword;         /* # words in a row */
+    uint64_t nsample;       /* # accesses recorded since last aging */
+    uint64_t max_nsample;   /* # accesses between two agings */
+} admit;
+
+/*
+ * Return the index of the counter of a key with hash hv in a given row.
+ */
+static uint32_t
+admit_index(uint32_t hv, uint32_t row)
+{
+    hv ^= hv >> 15;
+
+    return (hv * admit_seed[row]) >> (32 - admit.power);
+}
+
+static uint64_t *
+admit_word(uint32_t row, uint32_t idx)
+{
+    return &admit.table[row * admit.nword + (idx >> 4)];
+}
+
+static uint32_t
+admit_shift(uint32_t idx)
+{
+    return (idx & 0xf) << 2;
+}
+
+/*
+ * Halve every counter. An increment racing with it may be lost, which
+ * an estimate can well afford.
+ */
+static void
+admit_age(void)
+{
+    uint32_t i;
+    uint64_t w;
+
+    for (i = 0; i < ADMIT_NROW * admit.nword; i++) {
+        w = __atomic_load_n(&admit.table[i], __ATOMIC_RELAXED);
+        __atomic_store_n(&admit.table[i], (w >> 1) & ADMIT_AGE_MASK,
+                         __ATOMIC_RELAXED);
+    }
+
+    log_debug(LOG_VERB, "aged admission sketch after %"PRIu64" accesses",
+              admit.max_nsample);
+}
+
+/*
+ * Record an access to the key with hash hv.
+ */
+void
+admit_record(uint32_t hv)
+{
+    uint32_t row, idx, shift;
+    uint64_t *word, old, new;
+
+    if (settings.admission == ADMIT_NONE) {
+        return;
+    }
+
+    for (row = 0; row < ADMIT_NROW; row++) {
+        idx = admit_index(hv, row);
+        word = admit_word(row, idx);
+        shift = admit_shift(idx);
+
+        old = __atomic_load_n(word, __ATOMIC_RELAXED);
+        do {
+            if (((old >> shift) & ADMIT_COUNTER_MAX) == ADMIT_COUNTER_MAX) {
+                break;
+            }
+            new = old + (1ULL << shift);
+        } while (!__atomic_compare_exchange_n(word, &old, new, true,
+                                              __ATOMIC_RELAXED,
+                                              __ATOMIC_RELAXED));
+    }
+
+    /* only the access that reaches the sample size ages the sketch */
+    if (__atomic_add_fetch(&admit.nsample, 1, __ATOMIC_RELAXED) ==
+        admit.max_nsample) {
+        admit_age();
+        __atomic_store_n(&admit.nsample, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Return how often the key with hash hv was accessed of late.
+ */
+uint32_t
+admit_estimate(uint32_t hv)
+{
+    uint32_t row, idx, count, min;
+
+    min = ADMIT_COUNTER_MAX;
+    for (row = 0; row < ADMIT_NROW; row++) {
+        idx = admit_index(hv, row);
+        count = (uint32_t)((__atomic_load_n(admit_word(row, idx),
+                                            __ATOMIC_RELAXED) >>
+                            admit_shift(idx)) & ADMIT_COUNTER_MAX);
+        min = MIN(min, count);
+    }
+
+    return min;
+}
+
+/*
+ * Size the sketch to about as many counters in a row as there can be
+ * items in memory, counting every item at the minimum item size.
+ */
+rstatus_t
+admit_init(void)
+{
+    size_t nitem;
+
+    if (settings.admission == ADMIT_NONE) {
+        return MC_OK;
+    }
+
+    nitem = settings.maxbytes / settings.chunk_size;
+    for (admit.power = ADMIT_MIN_POWER;
+         admit.power < ADMIT_MAX_POWER && ((size_t)1 << admit.power) < nitem;
+         admit.power++) {
+        /* void */
+    }
+
+    admit.nword = (1U << admit.power) / 16;
+    admit.table = mc_zalloc(ADMIT_NROW * admit.nword * sizeof(uint64_t));
+    if (admit.table == NULL) {
+        return MC_ENOMEM;
+    }
+
+    admit.nsample = 0;
+    admit.max_nsample = ADMIT_SAMPLE_FACTOR * ((uint64_t)1 << admit.power);
+
+    log_debug(LOG_INFO, "admission sketch of %d rows of %"PRIu32" counters, "
+              "aged every %"PRIu64" accesses", ADMIT_NROW, 1U << admit.power,
+              admit.max_nsample);
+
+    return MC_OK;
+}
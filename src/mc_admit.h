@@ -0,0 +1,61 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MC_ADMIT_H_
+#define _MC_ADMIT_H_
+
+/*
+ * The admission filter set with --admission=tinylfu guards the cache
+ * against keys that are set once and never read again, once memory is
+ * full. It keeps an estimate of how often every key was accessed of late
+ * in a count-min sketch: ADMIT_NROW rows of 4-bit counters, of which a key
+ * bumps one per row, and whose smallest one is its frequency. The sketch
+ * ages by halving all its counters every ADMIT_SAMPLE_FACTOR accesses per
+ * counter of a row, so that keys popular long ago fade away.
+ *
+ * A set that can only be stored by evicting an item goes through only if
+ * its key is more frequent than that of the eviction victim, otherwise it
+ * is not stored. Sets that do not need to evict are always stored.
+ */
+#define ADMIT_NROW              4
+#define ADMIT_MIN_POWER         10
+#define ADMIT_MAX_POWER         22
+#define ADMIT_SAMPLE_FACTOR     10
+
+typedef enum admission_type {
+    ADMIT_NONE,     /* every set is stored */
+    ADMIT_TINYLFU,  /* sets that evict are filtered on key frequency */
+} admission_type_t;
+
+rstatus_t admit_init(void);
+
+void admit_record(uint32_t hv);
+uint32_t admit_estimate(uint32_t hv);
+
+#endif
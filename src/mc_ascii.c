@@ -77,6 +77,9 @@ extern struct settings settings;
  * COMMAND   SUBCOMMAND  EVICT_COMMAND
  * config    evict       <num>\r\n
  *
+ * COMMAND   SUBCOMMAND  AUTOMOVE_COMMAND
+ * config    automove    <num>\r\n
+ *
  * COMMAND   SUBCOMMAND  NEW_LIMIT
  * config    maxbytes    <num>\r\n
  *
@@ -95,6 +98,9 @@ extern struct settings settings;
  * config    hotkey      sample_rate   <val>\r\n
  * config    hotkey      qps_threshold <val>\r\n
  * config    hotkey      bw_threshold  <val>\r\n
+ *
+ * COMMAND   SUBCOMMAND  SNAPSHOT_COMMAND
+ * config    snapshot    dump\r\n
  */
 
 #define TOKEN_COMMAND           0
@@ -109,13 +115,17 @@ extern struct settings settings;
 #define TOKEN_CACHEDUMP_LIMIT   3
 #define TOKEN_AGGR_COMMAND      2
 #define TOKEN_EVICT_COMMAND     2
+#define TOKEN_AUTOMOVE_COMMAND  2
 #define TOKEN_MAXBYTES_COMMAND  2
 #define TOKEN_HK_COMMAND        2
 #define TOKEN_HK_SUBCOMMAND     3
 #define TOKEN_KLOG_COMMAND      2
 #define TOKEN_KLOG_SUBCOMMAND   3
+#define TOKEN_SNAPSHOT_COMMAND  2
 #define TOKEN_MAX               8
 
+#define GET_KEY_BATCH 32 /* # keys of a get that are looked up at once */
+
 #define SUFFIX_MAX_LEN 44 /* =11+11+21+1 enough to hold " <uint32_t> <uint32_t> <uint64_t>\0" */
 
 struct token {
@@ -767,10 +777,10 @@ void
 asc_complete_nread(struct conn *c)
 {
     struct item *it;
-    char *end;
+    char end[CRLF_LEN];
 
     it = c->item;
-    end = item_data(it) + it->nbyte;
+    item_data_read(it, it->nbyte, end, CRLF_LEN);
 
     if (!strcrlf(end)) {
         log_hexdump(LOG_NOTICE, c->req, c->req_len, "client error on c %d for "
@@ -883,7 +893,8 @@ asc_respond_get(struct conn *c, unsigned valid_key_iter, struct item *it,
     int sz;
     int total_len = 0;
     uint32_t nbyte = it->nbyte;
-    char *data = item_data(it);
+    uint32_t idx, len;
+    char *data;
 
     status = conn_add_iov(c, VALUE, VALUE_LEN);
     if (status != MC_OK) {
@@ -927,11 +938,19 @@ asc_respond_get(struct conn *c, unsigned valid_key_iter, struct item *it,
     }
     total_len += CRLF_LEN;
 
-    status = conn_add_iov(c, data, nbyte);
-    if (status != MC_OK) {
-        goto get_done;
+    /* data of a chunked item goes out straight from its chunks */
+    for (idx = 0; nbyte > 0; idx++) {
+        data = item_data_span(it, idx, &len);
+        ASSERT(data != NULL);
+
+        len = MIN(len, nbyte);
+        status = conn_add_iov(c, data, len);
+        if (status != MC_OK) {
+            goto get_done;
+        }
+        total_len += len;
+        nbyte -= len;
     }
-    total_len += nbyte;
 
     status = conn_add_iov(c, CRLF, CRLF_LEN);
     if (status != MC_OK) {
@@ -953,15 +972,119 @@ get_done:
     return status;
 }
 
+/*
+ * Look up a batch of keys of a get at once, and build the response for
+ * the keys found, in order. The keys of a get are many and independent,
+ * so looking them up together lets the lookups overlap their cache misses
+ * (see item_get_multi).
+ */
+static rstatus_t
+asc_process_read_batch(struct conn *c, char **key, uint8_t *nkey,
+                       uint32_t *hv, uint32_t nbatch, unsigned *valid_key_iter,
+                       bool return_cas)
+{
+    rstatus_t status;
+    struct item *it[GET_KEY_BATCH];
+    uint32_t i;
+    bool ext;
+
+    ASSERT(nbatch <= GET_KEY_BATCH);
+
+    item_get_multi(key, nkey, hv, it, nbatch);
+
+    for (i = 0; i < nbatch; i++) {
+        /* a stub is answered with the item it stands for, once read */
+        ext = false;
+        if (it[i] != NULL && item_is_ext(it[i])) {
+            it[i] = ext_read(c, it[i]);
+            ext = true;
+        }
+
+        if (it[i] == NULL) {
+            /* item not found */
+            if (return_cas) {
+                stats_thread_incr(gets_key_miss);
+            } else {
+                stats_thread_incr(get_key_miss);
+            }
+            klog_write(c->peer, c->req_type, key[i], nkey[i], 1, 0);
+            continue;
+        }
+
+        /* item found */
+        if (return_cas) {
+            stats_slab_incr(it[i]->id, gets_key_hit);
+        } else {
+            stats_slab_incr(it[i]->id, get_key_hit);
+        }
+
+        if (*valid_key_iter >= c->isize) {
+            struct item **new_list;
+
+            new_list = mc_realloc(c->ilist, sizeof(struct item *) * c->isize * 2);
+            if (new_list != NULL) {
+                stats_thread_incr_by(mem_ilist_curr, sizeof(struct item *) * c->isize);
+                c->isize *= 2;
+                c->ilist = new_list;
+            } else {
+                status = MC_ENOMEM;
+                goto error;
+            }
+        }
+
+        status = asc_respond_get(c, *valid_key_iter, it[i], return_cas);
+        if (status != MC_OK) {
+            log_warn("server error on c %d for req of type %d with %"PRIu32" "
+                     "keys", c->sd, c->req_type, nbatch);
+            goto error;
+        }
+
+        log_debug(LOG_VVERB, ">%d sending key %.*s", c->sd, it[i]->nkey,
+                  item_key(it[i]));
+
+        /* an item being read is not linked yet */
+        if (!ext) {
+            item_touch(it[i]);
+        }
+        *(c->ilist + *valid_key_iter) = it[i];
+        (*valid_key_iter)++;
+    }
+
+    return MC_OK;
+
+error:
+    for (; i < nbatch; i++) {
+        if (it[i] != NULL) {
+            item_remove(it[i]);
+        }
+    }
+
+    return status;
+}
+
+/*
+ * Hold the response to a get back until the items it reads from the
+ * extstore are all in, if any.
+ */
+static void
+asc_wait_ext_read(struct conn *c)
+{
+    if (__atomic_load_n(&c->ext_nread, __ATOMIC_ACQUIRE) != 0) {
+        c->ext_state = c->state;
+        conn_set_state(c, CONN_EXT_READ);
+    }
+}
+
 static inline void
 asc_process_read(struct conn *c, struct token *token, int ntoken)
 {
     rstatus_t status;
-    char *key;
+    char *key[GET_KEY_BATCH];
+    uint8_t nkey[GET_KEY_BATCH];
+    uint32_t hv[GET_KEY_BATCH];
+    uint32_t nbatch;
     size_t keylen;
-    uint8_t nkey;
     unsigned valid_key_iter = 0;
-    struct item *it;
     struct token *key_token;
     bool return_cas;
 
@@ -971,10 +1094,15 @@ asc_process_read(struct conn *c, struct token *token, int ntoken)
 
     return_cas = (c->req_type == REQ_GETS) ? true : false;
     key_token = &token[TOKEN_KEY];
+    nbatch = 0;
+    status = MC_OK;
 
+    /*
+     * Key tokens point into the request, so they stay valid across
+     * tokenizations, and a batch of keys may span several of them
+     */
     do {
         while (key_token->len != 0) {
-            key = key_token->val;
             keylen = key_token->len;
 
             if (keylen > KEY_MAX_LEN) {
@@ -982,9 +1110,8 @@ asc_process_read(struct conn *c, struct token *token, int ntoken)
                           "length key", c->sd, c->req_type, keylen);
 
                 asc_rsp_client_error(c);
+                asc_wait_ext_read(c);
                 return;
-            } else {
-                nkey = (uint8_t)keylen;
             }
 
             if (return_cas) {
@@ -993,56 +1120,25 @@ asc_process_read(struct conn *c, struct token *token, int ntoken)
                 stats_thread_incr(get_key);
             }
 
-            it = item_get(key, nkey);
-            if (it != NULL) {
-                /* item found */
-                if (return_cas) {
-                    stats_slab_incr(it->id, gets_key_hit);
-                } else {
-                    stats_slab_incr(it->id, get_key_hit);
-                }
+            key[nbatch] = key_token->val;
+            nkey[nbatch] = (uint8_t)keylen;
+            hv[nbatch] = hash(key[nbatch], nkey[nbatch], 0);
+            nbatch++;
 
-                if (valid_key_iter >= c->isize) {
-                    struct item **new_list;
-
-                    new_list = mc_realloc(c->ilist, sizeof(struct item *) * c->isize * 2);
-                    if (new_list != NULL) {
-                        stats_thread_incr_by(mem_ilist_curr, sizeof(struct item *) * c->isize);
-                        c->isize *= 2;
-                        c->ilist = new_list;
-                    } else {
-                        item_remove(it);
-                        break;
-                    }
-                }
+            key_token++;
 
-                status = asc_respond_get(c, valid_key_iter, it, return_cas);
+            if (nbatch == GET_KEY_BATCH) {
+                status = asc_process_read_batch(c, key, nkey, hv, nbatch,
+                                                &valid_key_iter, return_cas);
+                nbatch = 0;
                 if (status != MC_OK) {
-                    log_warn("server error on c %d for req of type %d with %d "
-                             "tokens", c->sd, c->req_type, ntoken);
-
-                    asc_rsp_server_error(c);
-                    item_remove(it);
                     break;
                 }
-
-                log_debug(LOG_VVERB, ">%d sending key %.*s", c->sd, it->nkey,
-                          item_key(it));
-
-                item_touch(it);
-                *(c->ilist + valid_key_iter) = it;
-                valid_key_iter++;
-            } else {
-                /* item not found */
-                if (return_cas) {
-                    stats_thread_incr(gets_key_miss);
-                } else {
-                    stats_thread_incr(get_key_miss);
-                }
-                klog_write(c->peer, c->req_type, key, nkey, 1, 0);
             }
+        }
 
-            key_token++;
+        if (status != MC_OK) {
+            break;
         }
 
         /*
@@ -1057,6 +1153,11 @@ asc_process_read(struct conn *c, struct token *token, int ntoken)
 
     } while (key_token->val != NULL);
 
+    if (status == MC_OK && nbatch != 0) {
+        status = asc_process_read_batch(c, key, nkey, hv, nbatch,
+                                        &valid_key_iter, return_cas);
+    }
+
     c->icurr = c->ilist;
     c->ileft = valid_key_iter;
     c->scurr = c->slist;
@@ -1069,7 +1170,7 @@ asc_process_read(struct conn *c, struct token *token, int ntoken)
      * reliable to add END\r\n to the buffer, because it might not end
      * in \r\n. So we send SERVER_ERROR instead.
      */
-    if (key_token->val != NULL || conn_add_iov(c, "END\r\n", 5) != MC_OK ||
+    if (status != MC_OK || conn_add_iov(c, "END\r\n", 5) != MC_OK ||
         (c->udp && conn_build_udp_headers(c) != MC_OK)) {
         log_warn("server error on c %d for req of type %d with enomem", c->sd,
                  c->req_type);
@@ -1079,6 +1180,8 @@ asc_process_read(struct conn *c, struct token *token, int ntoken)
         conn_set_state(c, CONN_MWRITE);
         c->msg_curr = 0;
     }
+
+    asc_wait_ext_read(c);
 }
 
 static void
@@ -1086,10 +1189,11 @@ asc_process_update(struct conn *c, struct token *token, int ntoken)
 {
     char *key;
     uint8_t nkey;
-    uint32_t flags, vlen;
+    uint32_t flags, vlen, nbyte;
     int32_t exptime_int;
     time_t exptime;
     uint64_t req_cas_id;
+    uint32_t hv;
     struct item *it;
     bool handle_cas;
     uint8_t id;
@@ -1140,7 +1244,27 @@ asc_process_update(struct conn *c, struct token *token, int ntoken)
         flags = 0;
     }
 
-    it = item_alloc(id, key, nkey, flags, time_reltime(exptime), vlen);
+    hv = hash(key, nkey, 0);
+    if (c->req_type == REQ_SET && !item_admit(id, hv)) {
+        log_debug(LOG_VERB, "c %d set of key '%.*s' not admitted", c->sd,
+                  nkey, key);
+
+        /* swallow the data line, right away on noreply */
+        c->sbytes = vlen + CRLF_LEN;
+        if (c->noreply) {
+            c->noreply = 0;
+            conn_set_state(c, CONN_SWALLOW);
+        } else {
+            asc_rsp_not_stored(c);
+            c->write_and_go = CONN_SWALLOW;
+        }
+
+        /* a stale value must not outlive the set */
+        item_delete(key, nkey, hv);
+        return;
+    }
+
+    it = item_alloc(id, key, nkey, hv, flags, time_reltime(exptime), vlen);
     if (it == NULL) {
         log_warn("server error on c %d for req of type %d because of oom in "
                  "storing item", c->sd, c->req_type);
@@ -1151,7 +1275,7 @@ asc_process_update(struct conn *c, struct token *token, int ntoken)
         c->write_and_go = CONN_SWALLOW;
         c->sbytes = vlen + CRLF_LEN;
 
-        item_delete(key, nkey);
+        item_delete(key, nkey, hv);
         return;
     }
 
@@ -1159,8 +1283,9 @@ asc_process_update(struct conn *c, struct token *token, int ntoken)
         item_set_cas(it, req_cas_id);
     }
     c->item = it;
-    c->ritem = item_data(it);
-    c->rlbytes = it->nbyte + CRLF_LEN;
+    c->rspan = 0;
+    c->ritem = item_data_span(it, 0, &nbyte);
+    c->rlbytes = (int)nbyte;
     conn_set_state(c, CONN_NREAD);
 }
 
@@ -1169,7 +1294,7 @@ asc_process_annex(struct conn *c, struct token *token, int ntoken)
 {
     char *key;
     uint8_t nkey;
-    uint32_t vlen;
+    uint32_t vlen, hv, nbyte;
     struct item *it;
     uint8_t id;
 
@@ -1192,7 +1317,8 @@ asc_process_annex(struct conn *c, struct token *token, int ntoken)
     }
 
     /* flags and exptime are both set to 0 as they have no effect later */
-    it = item_alloc(id, key, nkey, 0, 0, vlen);
+    hv = hash(key, nkey, 0);
+    it = item_alloc(id, key, nkey, hv, 0, 0, vlen);
     if (it == NULL) {
         log_warn("server error on c %d for req of type %d because of oom in "
                  "allocing item", c->sd, c->req_type);
@@ -1203,13 +1329,14 @@ asc_process_annex(struct conn *c, struct token *token, int ntoken)
         c->write_and_go = CONN_SWALLOW;
         c->sbytes = vlen + CRLF_LEN;
 
-        item_delete(key, nkey);
+        item_delete(key, nkey, hv);
         return;
     }
 
     c->item = it;
-    c->ritem = item_data(it);
-    c->rlbytes = it->nbyte + CRLF_LEN;
+    c->rspan = 0;
+    c->ritem = item_data_span(it, 0, &nbyte);
+    c->rlbytes = (int)nbyte;
     conn_set_state(c, CONN_NREAD);
 }
 
@@ -1221,6 +1348,7 @@ asc_process_delta(struct conn *c, struct token *token, int ntoken)
     uint64_t delta;
     char *key;
     uint8_t nkey;
+    uint32_t hv;
     bool incr;
     uint64_t value;
     size_t rsplen;
@@ -1240,7 +1368,8 @@ asc_process_delta(struct conn *c, struct token *token, int ntoken)
     }
 
     incr = (c->req_type == REQ_INCR) ? true : false;
-    res = item_delta(&value, key, nkey, incr, delta);
+    hv = hash(key, nkey, 0);
+    res = item_delta(&value, key, nkey, hv, incr, delta);
     switch (res) {
     case DELTA_OK:
         if (incr) {
@@ -1294,6 +1423,7 @@ asc_process_delete(struct conn *c, struct token *token, int ntoken)
     item_delete_result_t res;
     char *key;       /* key to be deleted */
     uint8_t nkey;     /* # key bytes */
+    uint32_t hv;      /* key hash */
     size_t rsplen;
 
     asc_set_noreply_maybe(c, token, ntoken);
@@ -1306,7 +1436,8 @@ asc_process_delete(struct conn *c, struct token *token, int ntoken)
         return;
     }
 
-    res  = item_delete(key, nkey);
+    hv = hash(key, nkey, 0);
+    res  = item_delete(key, nkey, hv);
     switch (res) {
     case DELETE_OK:
         stats_thread_incr(delete_hit);
@@ -1398,6 +1529,10 @@ asc_process_stats(struct conn *c, struct token *token, int ntoken)
             stats_slabs(c);
         } else if (strncmp(t->val, "sizes", t->len) == 0) {
             stats_sizes(c);
+        } else if (strncmp(t->val, "profile", t->len) == 0) {
+            stats_profile(c);
+        } else if (strncmp(t->val, "mrc", t->len) == 0) {
+            stats_mrc(c);
         } else {
             log_debug(LOG_NOTICE, "client error on c %d for req of type %d with "
                       "invalid stats subcommand '%.*s", c->sd, c->req_type,
@@ -1630,6 +1765,42 @@ asc_process_evict(struct conn *c, struct token *token, int ntoken)
     asc_rsp_client_error(c);
 }
 
+static void
+asc_process_automove(struct conn *c, struct token *token, int ntoken)
+{
+    int32_t option;
+
+    if (ntoken != 4) {
+        log_hexdump(LOG_NOTICE, c->req, c->req_len, "client error on c %d for "
+                    "req of type %d with %d invalid tokens", c->sd,
+                    c->req_type, ntoken);
+
+        asc_rsp_client_error(c);
+        return;
+    }
+
+    if (!mc_strtol(token[TOKEN_AUTOMOVE_COMMAND].val, &option)) {
+        log_debug(LOG_NOTICE, "client error on c %d for req of type %d with "
+                  "invalid option '%.*s'", c->sd, c->req_type,
+                  token[TOKEN_AUTOMOVE_COMMAND].len,
+                  token[TOKEN_AUTOMOVE_COMMAND].val);
+
+        asc_rsp_client_error(c);
+        return;
+    }
+
+    if (option >= SLAB_AUTOMOVE_OFF && option <= SLAB_AUTOMOVE_AGGRESSIVE) {
+        settings.slab_automove = option;
+        asc_rsp_ok(c);
+        return;
+    }
+
+    log_debug(LOG_NOTICE, "client error on c %d for req of type %d with "
+              "invalid option %"PRId32"", c->sd, c->req_type, option);
+
+    asc_rsp_client_error(c);
+}
+
 static void
 asc_process_maxbytes(struct conn *c, struct token *token, int ntoken)
 {
@@ -1852,6 +2023,53 @@ asc_process_hotkey(struct conn *c, struct token *token, int ntoken)
     }
 }
 
+static void
+asc_process_snapshot(struct conn *c, struct token *token, int ntoken)
+{
+    struct token *t;
+    rstatus_t status;
+
+    if (ntoken != 4) {
+        log_hexdump(LOG_NOTICE, c->req, c->req_len, "client error on c %d for "
+                    "req of type %d with %d invalid tokens", c->sd,
+                    c->req_type, ntoken);
+
+        asc_rsp_client_error(c);
+        return;
+    }
+
+    t = &token[TOKEN_SNAPSHOT_COMMAND];
+
+    if (strncmp(t->val, "dump", t->len) != 0) {
+        log_debug(LOG_NOTICE, "client error on c %d for req of type %d with "
+                  "invalid snapshot subcommand '%.*s'", c->sd, c->req_type,
+                  t->len, t->val);
+
+        asc_rsp_client_error(c);
+        return;
+    }
+
+    if (settings.snapshot_file == NULL) {
+        log_debug(LOG_NOTICE, "client error on c %d for req of type %d "
+                  "with no snapshot file to dump to", c->sd, c->req_type);
+
+        asc_rsp_client_error(c);
+        return;
+    }
+
+    status = snapshot_dump();
+    if (status != MC_OK) {
+        log_debug(LOG_NOTICE, "server error on c %d for req of type %d "
+                  "with snapshot dump %s", c->sd, c->req_type,
+                  status == MC_EAGAIN ? "already in progress" : "failed");
+
+        asc_rsp_server_error(c);
+        return;
+    }
+
+    asc_rsp_ok(c);
+}
+
 static void
 asc_process_config(struct conn *c, struct token *token, int ntoken)
 {
@@ -1863,10 +2081,14 @@ asc_process_config(struct conn *c, struct token *token, int ntoken)
         asc_process_klog(c, token, ntoken);
     } else if (strncmp(t->val, "evict", t->len) == 0) {
         asc_process_evict(c, token, ntoken);
+    } else if (strncmp(t->val, "automove", t->len) == 0) {
+        asc_process_automove(c, token, ntoken);
     } else if (strncmp(t->val, "maxbytes", t->len) == 0) {
         asc_process_maxbytes(c, token, ntoken);
     } else if (strncmp(t->val, "hotkey", t->len) == 0) {
         asc_process_hotkey(c, token, ntoken);
+    } else if (strncmp(t->val, "snapshot", t->len) == 0) {
+        asc_process_snapshot(c, token, ntoken);
     } else {
         log_debug(LOG_NOTICE, "client error on c %d for req of type %d with "
                   "invalid config subcommand '%.*s'", c->sd, c->req_type,
@@ -29,76 +29,527 @@
 
 #include <mc_core.h>
 
-#define HASHSIZE(_n) (1UL << (_n))
-#define HASHMASK(_n) (HASHSIZE(_n) - 1)
-
-#define HASH_DEFAULT_MOVE_SIZE  1
-#define HASH_DEFAULT_POWER      16
+#define HASH_MIGRATE_NBUCKET    2       /* # hash buckets a write moves during migration */
+#define HASH_MIGRATE_BG_NBUCKET 64      /* # hash buckets moved per background step */
+#define HASH_MIGRATE_INTERVAL   1000    /* usec between background steps */
 
 extern struct settings settings;
-extern pthread_mutex_t cache_lock;
+
+size_t nbyte_primary;                       /* bytes used by primary hash table */
+size_t nbyte_old;                           /* bytes used by old hash table */
+uint32_t nbucket_old;                       /* # buckets in old hash table */
+uint32_t nbucket_moved;                     /* # buckets moved out of old hash table */
 
 /*
- * We always look for items in the primary_hashtable expect when we are
- * expanding. During expansion (expanding = 1), we migrate key-values at
- * bucket granularity - nhash_move_size from old_hashtable to primary_hashtable.
- * The expand_bucket tells us how far we have gotton and it takes
- * values in the range [0, HASHSIZE(hash_power - 1) - 1]
+ * The hash table is one of two kinds, picked at startup:
+ *
+ * 1. HASH_TABLE_CHAINED: an array of buckets, each being the head of a
+ *    chain of items linked through their h_next. Every probe of a chain
+ *    touches the header of another item, which is likely a cache miss.
+ *
+ * 2. HASH_TABLE_BUCKETIZED: an array of cache line sized buckets, each
+ *    with ASSOC_BUCKET_NSLOT slots holding an item and an 8-bit tag of
+ *    its key hash. A lookup compares its tag against all the tags of a
+ *    bucket at once, with the tags packed into a single word (simd within
+ *    a register), and only dereferences items whose tag matches. So a
+ *    miss mostly costs a single cache miss on the bucket. Items that do
+ *    not fit into the slots of their bucket are chained off the overflow
+ *    list of the bucket, through their h_next.
  */
-static struct item_slh *primary_hashtable;  /* primary (main) hash table */
-static struct item_slh *old_hashtable;      /* secondary (old) hash table */
-static uint32_t nhash_item;                 /* # items in hash table */
-static uint32_t hash_power;                 /* # buckets = 2^hash_power */
+#define ASSOC_BUCKET_NSLOT  6
+#define ASSOC_BUCKET_ALIGN  64
+#define ASSOC_TAG(_hv)      ((uint8_t)((_hv) >> 24))
+#define ASSOC_TAG_ONES      0x0101010101010101ULL
+#define ASSOC_TAG_HIGHS     0x8080808080808080ULL
+
+#define ASSOC_LOCKLESS_MAX_NPROBE   64  /* max # items a lockless lookup walks */
 
-static int expanding;                       /* expanding? */
-static uint32_t nhash_move_size;            /* # hash buckets to move during expansion */
-static uint32_t expand_bucket;              /* last expanded bucket */
+struct assoc_bucket {
+    uint8_t         tag[sizeof(uint64_t)];     /* tags of slots, excess ones unused */
+    struct item     *slot[ASSOC_BUCKET_NSLOT]; /* items, NULL if slot is free */
+    struct item_slh overflow;                  /* items in excess of slots */
+} __attribute__((aligned(ASSOC_BUCKET_ALIGN)));
 
-static pthread_cond_t maintenance_cond;     /* maintenance thread condvar */
-static pthread_t maintenance_tid;           /* maintenance thread id */
-static volatile int run_maintenance_thread; /* run maintenance thread? */
+/*
+ * A hash table of 2^power buckets. The old hash table also tracks which
+ * of its buckets were moved to the primary hash table, one bit each.
+ */
+struct assoc_table {
+    void     *bucket; /* buckets */
+    uint32_t power;   /* # buckets = 2^power */
+    uint64_t *moved;  /* bitmap of moved buckets, for the old hash table */
+};
+
+/*
+ * We always look for items in the primary_hashtable except when we are
+ * migrating to a hash table of another size, grown as items are added or
+ * shrunk as they are removed. During migration, items are moved at bucket
+ * granularity from old_hashtable to primary_hashtable, and a key is looked
+ * up in the old hash table unless its bucket there was moved already.
+ *
+ * Buckets are moved in no particular order and a few at a time. A write
+ * first moves the old bucket of its own key, and then the next
+ * HASH_MIGRATE_NBUCKET buckets from migrate_bucket on, unless their stripe
+ * is busy. The maintenance thread moves HASH_MIGRATE_BG_NBUCKET buckets
+ * every HASH_MIGRATE_INTERVAL in the background, one stripe at a time, so
+ * that migration completes even without writes. Other than that, it only
+ * starts a migration and releases the old hash table once all of its
+ * buckets are moved, which are the only steps that take all the stripes,
+ * and merely swap tables.
+ *
+ * A bucket and its chain is protected by the item lock stripe it maps onto.
+ * As there are never more stripes than buckets in either hash table, hash
+ * tables never shrinking below their initial size, all the items of a
+ * bucket of the old hash table and of the buckets it moves into are
+ * covered by the same stripe.
+ *
+ * Lockless lookups (assoc_find_lockless) hold no stripe at all, and may
+ * see tables being swapped or a bucket being moved. They never index a
+ * table out of its bounds though, as a table carries its own size, and
+ * it is up to their callers to validate the outcome. Tables are only
+ * released once lockless readers are done with them (see
+ * thread_epoch_synchronize).
+ */
+static bool bucketized;                        /* bucketized hash table? */
+static size_t bucket_size;                     /* size of a hash bucket */
+static struct assoc_table *primary_hashtable;  /* primary (main) hash table */
+static struct assoc_table *old_hashtable;      /* secondary (old) hash table, while migrating */
+static uint32_t nhash_item;                    /* # items in hash table */
+static uint32_t min_hash_power;                /* # buckets never shrinks below 2^min_hash_power */
+static uint32_t migrate_bucket;                /* next old bucket to move */
+
+static pthread_mutex_t maintenance_lock;       /* maintenance thread lock */
+static pthread_cond_t maintenance_cond;        /* maintenance thread condvar */
+static pthread_t maintenance_tid;              /* maintenance thread id */
+static volatile int run_maintenance_thread;    /* run maintenance thread? */
+static int resize_requested;                   /* resize requested? */
+
+static uint32_t assoc_resize_power(void);
 
 static void *
-assoc_maintenance_thread(void *arg)
+assoc_table_bucket(struct assoc_table *table, uint32_t idx)
+{
+    return (uint8_t *)table->bucket + (size_t)idx * bucket_size;
+}
+
+static bool
+assoc_bucket_moved(struct assoc_table *table, uint32_t idx)
+{
+    uint64_t moved;
+
+    moved = __atomic_load_n(&table->moved[idx / 64], __ATOMIC_ACQUIRE);
+
+    return ((moved >> (idx % 64)) & 1) != 0;
+}
+
+static struct item *
+assoc_chain_find(struct item_slh *chain, const char *key, size_t nkey)
+{
+    struct item *it;
+
+    for (it = chain->first; it != NULL; it = item_h_next(it)) {
+        if ((nkey == it->nkey) && (memcmp(key, item_key(it), nkey) == 0)) {
+            break;
+        }
+    }
+
+    return it;
+}
+
+/*
+ * Same as assoc_chain_find(), for lockless readers. A chain modified under
+ * the reader can lead it astray, onto another chain and maybe in circles,
+ * so the walk is bounded, and MC_EAGAIN returned if it gives up.
+ */
+static rstatus_t
+assoc_chain_find_lockless(struct item_slh *chain, const char *key,
+                          size_t nkey, struct item **result)
+{
+    struct item *it;
+    uint32_t nprobe;
+
+    it = __atomic_load_n(&chain->first, __ATOMIC_ACQUIRE);
+    for (nprobe = 0; it != NULL; nprobe++) {
+        if (nprobe == ASSOC_LOCKLESS_MAX_NPROBE) {
+            return MC_EAGAIN;
+        }
+
+        if ((nkey == it->nkey) && (memcmp(key, item_key(it), nkey) == 0)) {
+            break;
+        }
+
+        it = item_h_next_lockless(it);
+    }
+
+    *result = it;
+
+    return MC_OK;
+}
+
+static void
+assoc_chain_delete(struct item_slh *chain, struct item *it)
+{
+    struct item *curr, *prev;
+
+    for (prev = NULL, curr = chain->first; curr != it;
+         prev = curr, curr = item_h_next(curr)) {
+        ASSERT(curr != NULL);
+    }
+
+    if (prev == NULL) {
+        item_h_remove_head(chain);
+    } else {
+        item_h_remove_after(prev);
+    }
+}
+
+/*
+ * Return true if any tag in bucket b may be equal to tag. Excess tags and
+ * tags of free slots can yield false positives, but never false negatives.
+ */
+static bool
+assoc_bucket_match(struct assoc_bucket *b, uint8_t tag)
+{
+    uint64_t tags, x;
+
+    memcpy(&tags, b->tag, sizeof(tags));
+    x = tags ^ (ASSOC_TAG_ONES * tag);
+
+    /* some byte of x is zero iff the expression is non-zero */
+    return ((x - ASSOC_TAG_ONES) & ~x & ASSOC_TAG_HIGHS) != 0;
+}
+
+static struct item *
+assoc_bucket_find_slot(struct assoc_bucket *b, const char *key, size_t nkey,
+                       uint32_t hv)
+{
+    struct item *it;
+    uint8_t tag;
+    uint32_t i;
+
+    tag = ASSOC_TAG(hv);
+
+    if (assoc_bucket_match(b, tag)) {
+        for (i = 0; i < ASSOC_BUCKET_NSLOT; i++) {
+            it = __atomic_load_n(&b->slot[i], __ATOMIC_ACQUIRE);
+            if (it != NULL && b->tag[i] == tag && it->hv == hv &&
+                nkey == it->nkey && memcmp(key, item_key(it), nkey) == 0) {
+                return it;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static struct item *
+assoc_bucket_find(struct assoc_bucket *b, const char *key, size_t nkey,
+                  uint32_t hv)
+{
+    struct item *it;
+
+    it = assoc_bucket_find_slot(b, key, nkey, hv);
+    if (it != NULL) {
+        return it;
+    }
+
+    return assoc_chain_find(&b->overflow, key, nkey);
+}
+
+static void
+assoc_bucket_insert(struct assoc_bucket *b, struct item *it)
+{
+    uint32_t i;
+
+    for (i = 0; i < ASSOC_BUCKET_NSLOT; i++) {
+        if (b->slot[i] == NULL) {
+            b->slot[i] = it;
+            b->tag[i] = ASSOC_TAG(it->hv);
+            return;
+        }
+    }
+
+    item_h_insert_head(&b->overflow, it);
+}
+
+static void
+assoc_bucket_delete(struct assoc_bucket *b, struct item *it)
 {
-    uint32_t i, hv;
-    struct item_slh *old_bucket, *new_bucket;
+    struct item *oit;
+    uint32_t i;
+
+    for (i = 0; i < ASSOC_BUCKET_NSLOT; i++) {
+        if (b->slot[i] == it) {
+            /* refill the slot from the overflow list, if any */
+            oit = b->overflow.first;
+            if (oit != NULL) {
+                item_h_remove_head(&b->overflow);
+                b->tag[i] = ASSOC_TAG(oit->hv);
+            }
+            b->slot[i] = oit;
+            return;
+        }
+    }
+
+    assoc_chain_delete(&b->overflow, it);
+}
+
+static void
+assoc_bucket_insert_any(void *bucket, struct item *it)
+{
+    if (bucketized) {
+        assoc_bucket_insert(bucket, it);
+    } else {
+        item_h_insert_head(bucket, it);
+    }
+}
+
+/*
+ * Move one bucket from the old hash table to the primary hash table, unless
+ * it was moved already. Caller holds the stripe of the bucket.
+ */
+static void
+assoc_move_bucket(uint32_t idx)
+{
+    struct item_slh *chain;
+    struct assoc_bucket *b;
     struct item *it, *next;
+    uint32_t i, mask;
+
+    ASSERT(old_hashtable != NULL);
+
+    if (assoc_bucket_moved(old_hashtable, idx)) {
+        return;
+    }
+
+    mask = HASHMASK(primary_hashtable->power);
+
+    if (bucketized) {
+        b = assoc_table_bucket(old_hashtable, idx);
+        for (i = 0; i < ASSOC_BUCKET_NSLOT; i++) {
+            it = b->slot[i];
+            if (it != NULL) {
+                b->slot[i] = NULL;
+                assoc_bucket_insert(
+                    assoc_table_bucket(primary_hashtable, it->hv & mask), it);
+            }
+        }
+        chain = &b->overflow;
+    } else {
+        chain = assoc_table_bucket(old_hashtable, idx);
+    }
+
+    for (it = chain->first; it != NULL; it = next) {
+        next = item_h_next(it);
+        item_h_remove_head(chain);
+        assoc_bucket_insert_any(
+            assoc_table_bucket(primary_hashtable, it->hv & mask), it);
+    }
+
+    __atomic_or_fetch(&old_hashtable->moved[idx / 64], 1ULL << (idx % 64),
+                      __ATOMIC_RELEASE);
+    __atomic_add_fetch(&nbucket_moved, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Move up to nbucket buckets of the old hash table from migrate_bucket on.
+ * Workers already hold a stripe, and so must not wait for another one; with
+ * trylock set, we give up on the first busy stripe instead.
+ */
+static void
+assoc_migrate(uint32_t nbucket, bool trylock)
+{
+    uint32_t i, idx, next;
+
+    for (i = 0; i < nbucket; i++) {
+        idx = __atomic_load_n(&migrate_bucket, __ATOMIC_RELAXED);
+
+        if (!trylock) {
+            item_lock(idx);
+        } else if (!item_trylock(idx)) {
+            return;
+        }
 
-    while (run_maintenance_thread) {
         /*
-         * Lock the cache, and bulk move multiple buckets to the new
-         * hash table
+         * Tables are only swapped with all stripes held, so the old hash
+         * table is stable now, but idx could have been read during the
+         * previous migration, or be claimed by someone else by now
          */
-        pthread_mutex_lock(&cache_lock);
+        if (old_hashtable == NULL || idx >= HASHSIZE(old_hashtable->power)) {
+            item_unlock(idx);
+            return;
+        }
 
-        for (i = 0; i < nhash_move_size && expanding == 1; i++) {
+        next = idx;
+        if (__atomic_compare_exchange_n(&migrate_bucket, &next, idx + 1, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            assoc_move_bucket(idx);
+        }
 
-            old_bucket = &old_hashtable[expand_bucket];
+        item_unlock(idx);
+    }
+}
 
-            SLIST_FOREACH_SAFE(it, old_bucket, h_sle, next) {
-                hv = hash(item_key(it), it->nkey, 0);
-                new_bucket = &primary_hashtable[hv & HASHMASK(hash_power)];
-                SLIST_REMOVE(old_bucket, it, item, h_sle);
-                SLIST_INSERT_HEAD(new_bucket, it, h_sle);
-            }
+/*
+ * Bounded migration work done on every write; caller holds the stripe of
+ * the key being written. The old bucket of the key is moved first, so that
+ * writes always land in the primary hash table.
+ */
+static void
+assoc_migrate_on_write(uint32_t hv)
+{
+    if (old_hashtable == NULL) {
+        return;
+    }
 
-            expand_bucket++;
-            if (expand_bucket == HASHSIZE(hash_power - 1)) {
-                expanding = 0;
-                mc_free(old_hashtable);
-                nbyte_old = 0;
-            }
+    assoc_move_bucket(hv & HASHMASK(old_hashtable->power));
+    assoc_migrate(HASH_MIGRATE_NBUCKET, true);
+}
+
+static struct assoc_table *
+assoc_create_table(uint32_t power)
+{
+    struct assoc_table *table;
+    size_t size;
+
+    table = mc_alloc(sizeof(*table));
+    if (table == NULL) {
+        return NULL;
+    }
+
+    size = bucket_size * HASHSIZE(power);
+    if (bucketized) {
+        table->bucket = mc_memalign(ASSOC_BUCKET_ALIGN, size);
+    } else {
+        table->bucket = mc_alloc(size);
+    }
+    if (table->bucket == NULL) {
+        mc_free(table);
+        return NULL;
+    }
+
+    /* empty chains, slots and overflow lists are all zeroes */
+    memset(table->bucket, 0, size);
+    table->power = power;
+    table->moved = NULL;
+
+    return table;
+}
+
+static void
+assoc_destroy_table(struct assoc_table *table)
+{
+    mc_free(table->bucket);
+    if (table->moved != NULL) {
+        mc_free(table->moved);
+    }
+    mc_free(table);
+}
+
+/*
+ * Start migrating to a hash table of 2^power buckets. On failure, continue
+ * using the current hash table. Caller holds all the item lock stripes.
+ */
+static void
+assoc_migrate_start(uint32_t power)
+{
+    struct assoc_table *table, *old;
+    uint32_t nbucket;
+
+    old = primary_hashtable;
+    nbucket = HASHSIZE(old->power);
+
+    old->moved = mc_zalloc(sizeof(*old->moved) * ((nbucket + 63) / 64));
+    if (old->moved == NULL) {
+        return;
+    }
+
+    table = assoc_create_table(power);
+    if (table == NULL) {
+        mc_free(old->moved);
+        return;
+    }
+
+    log_debug(LOG_INFO, "%s hash table with %"PRIu32" items to %"PRIu32" "
+              "buckets of size %zu bytes",
+              power > old->power ? "expanding" : "shrinking", nhash_item,
+              (uint32_t)HASHSIZE(power), bucket_size * HASHSIZE(power));
+
+    migrate_bucket = 0;
+    nbucket_moved = 0;
+    nbucket_old = nbucket;
+    nbyte_old = nbyte_primary;
+    nbyte_primary = bucket_size * HASHSIZE(power);
+
+    /* a lookup finding the new table before the old one sees a moved bucket */
+    __atomic_store_n(&old_hashtable, old, __ATOMIC_RELEASE);
+    __atomic_store_n(&primary_hashtable, table, __ATOMIC_RELEASE);
+}
+
+/*
+ * Release the old hash table, once all its buckets have been moved.
+ */
+static void
+assoc_migrate_finish(void)
+{
+    struct assoc_table *table;
+
+    item_lock_all();
+    table = old_hashtable;
+    __atomic_store_n(&old_hashtable, NULL, __ATOMIC_RELEASE);
+    nbucket_old = 0;
+    nbucket_moved = 0;
+    nbyte_old = 0;
+    item_unlock_all();
+
+    log_debug(LOG_INFO, "migrated hash table with %"PRIu32" items to %"PRIu32
+              " buckets", nhash_item,
+              (uint32_t)HASHSIZE(primary_hashtable->power));
+
+    /* lockless readers may still be walking the old table */
+    thread_epoch_synchronize();
+    assoc_destroy_table(table);
+}
+
+static void *
+assoc_maintenance_thread(void *arg)
+{
+    uint32_t power;
+
+    pthread_mutex_lock(&maintenance_lock);
+
+    while (run_maintenance_thread) {
+        if (!resize_requested) {
+            /* we are done migrating, just wait for the next invocation */
+            pthread_cond_wait(&maintenance_cond, &maintenance_lock);
+            continue;
         }
+        resize_requested = 0;
+        pthread_mutex_unlock(&maintenance_lock);
 
-        if (expanding == 0) {
-            /* we are done expanding, just wait for the next invocation */
-            pthread_cond_wait(&maintenance_cond, &cache_lock);
+        item_lock_all();
+        power = assoc_resize_power();
+        if (power != 0) {
+            assoc_migrate_start(power);
         }
+        item_unlock_all();
+
+        while (old_hashtable != NULL && run_maintenance_thread) {
+            if (__atomic_load_n(&nbucket_moved, __ATOMIC_RELAXED) ==
+                nbucket_old) {
+                assoc_migrate_finish();
+                break;
+            }
 
-        pthread_mutex_unlock(&cache_lock);
+            assoc_migrate(HASH_MIGRATE_BG_NBUCKET, false);
+            usleep(HASH_MIGRATE_INTERVAL);
+        }
+
+        pthread_mutex_lock(&maintenance_lock);
     }
 
+    pthread_mutex_unlock(&maintenance_lock);
+
     return NULL;
 }
 
@@ -120,50 +571,37 @@ assoc_start_maintenance_thread(void)
 static void
 assoc_stop_maintenance_thread(void)
 {
-    pthread_mutex_lock(&cache_lock);
+    pthread_mutex_lock(&maintenance_lock);
     run_maintenance_thread = 0;
     pthread_cond_signal(&maintenance_cond);
-    pthread_mutex_unlock(&cache_lock);
+    pthread_mutex_unlock(&maintenance_lock);
 
     /* wait for the maintenance thread to stop */
     pthread_join(maintenance_tid, NULL);
 }
 
-static struct item_slh *
-assoc_create_table(uint32_t table_sz)
+/*
+ * The old hash table is checked first: a lookup that finds no old hash
+ * table and then the primary hash table of a migration that just started
+ * sees all buckets as moved, but then its stripe was held all along.
+ */
+static void *
+assoc_get_bucket(uint32_t hv)
 {
-    struct item_slh *table;
-    uint32_t i;
-
-    table = mc_alloc(sizeof(*table) * table_sz);
-    if (table == NULL) {
-        return NULL;
-    }
-
-    for (i = 0; i < table_sz; i++) {
-        SLIST_INIT(&table[i]);
+    struct assoc_table *table;
+    uint32_t idx;
+
+    table = __atomic_load_n(&old_hashtable, __ATOMIC_ACQUIRE);
+    if (table != NULL) {
+        idx = hv & HASHMASK(table->power);
+        if (!assoc_bucket_moved(table, idx)) {
+            return assoc_table_bucket(table, idx);
+        }
     }
 
-    return table;
-}
-
-static struct item_slh *
-assoc_get_bucket(const char *key, size_t nkey)
-{
-    struct item_slh *bucket;
-    uint32_t hv, oldbucket, curbucket;
-
-    hv = hash(key, nkey, 0);
-    oldbucket = hv & HASHMASK(hash_power - 1);
-    curbucket = hv & HASHMASK(hash_power);
-
-    if ((expanding == 1) && oldbucket >= expand_bucket) {
-        bucket = &old_hashtable[oldbucket];
-    } else {
-        bucket = &primary_hashtable[curbucket];
-    }
+    table = __atomic_load_n(&primary_hashtable, __ATOMIC_ACQUIRE);
 
-    return bucket;
+    return assoc_table_bucket(table, hv & HASHMASK(table->power));
 }
 
 rstatus_t
@@ -172,25 +610,36 @@ assoc_init(void)
     rstatus_t status;
     uint32_t hashtable_sz;
 
-    primary_hashtable = NULL;
-    hash_power = settings.hash_power > 0 ? settings.hash_power : HASH_DEFAULT_POWER;
+    bucketized = (settings.hash_table == HASH_TABLE_BUCKETIZED);
+    bucket_size = bucketized ? sizeof(struct assoc_bucket) :
+                  sizeof(struct item_slh);
+
+    min_hash_power = settings.hash_power > 0 ? settings.hash_power :
+                     HASH_DEFAULT_POWER;
 
     old_hashtable = NULL;
-    nhash_move_size = HASH_DEFAULT_MOVE_SIZE;
     nhash_item = 0;
-    expanding = 0;
-    expand_bucket = 0;
+    migrate_bucket = 0;
+    nbucket_old = 0;
+    nbucket_moved = 0;
+    nbyte_old = 0;
 
-    hashtable_sz = HASHSIZE(hash_power);
+    hashtable_sz = HASHSIZE(min_hash_power);
 
-    primary_hashtable = assoc_create_table(hashtable_sz);
+    primary_hashtable = assoc_create_table(min_hash_power);
     if (primary_hashtable == NULL) {
         return MC_ENOMEM;
     }
-    nbyte_primary = hashtable_sz * sizeof(struct item_slh);
+    nbyte_primary = hashtable_sz * bucket_size;
 
+    log_debug(LOG_INFO, "created %s hash table of %"PRIu32" buckets of size "
+              "%zu", bucketized ? "bucketized" : "chained", hashtable_sz,
+              bucket_size);
+
+    pthread_mutex_init(&maintenance_lock, NULL);
     pthread_cond_init(&maintenance_cond, NULL);
     run_maintenance_thread = 1;
+    resize_requested = 0;
 
     status = assoc_start_maintenance_thread();
     if (status != MC_OK) {
@@ -207,105 +656,215 @@ assoc_deinit(void)
 }
 
 struct item *
-assoc_find(const char *key, size_t nkey)
+assoc_find(const char *key, size_t nkey, uint32_t hv)
 {
-    struct item_slh *bucket;
-    struct item *it;
-    uint32_t depth;
+    void *bucket;
 
-    ASSERT(pthread_mutex_trylock(&cache_lock) != 0);
     ASSERT(key != NULL && nkey != 0);
 
-    bucket = assoc_get_bucket(key, nkey);
+    bucket = assoc_get_bucket(hv);
 
-    for (depth = 0, it = SLIST_FIRST(bucket); it != NULL;
-         depth++, it = SLIST_NEXT(it, h_sle)) {
-        if ((nkey == it->nkey) && (memcmp(key, item_key(it), nkey) == 0)) {
-            break;
+    if (bucketized) {
+        return assoc_bucket_find(bucket, key, nkey, hv);
+    }
+
+    return assoc_chain_find(bucket, key, nkey);
+}
+
+/*
+ * Lookup an item without holding the stripe of its key. The caller must be
+ * within an epoch (see thread_epoch_enter), and must validate the outcome,
+ * which is MC_EAGAIN if the lookup gave up.
+ */
+rstatus_t
+assoc_find_lockless(const char *key, size_t nkey, uint32_t hv,
+                    struct item **it)
+{
+    void *bucket;
+
+    ASSERT(key != NULL && nkey != 0);
+
+    bucket = assoc_get_bucket(hv);
+
+    if (bucketized) {
+        *it = assoc_bucket_find_slot(bucket, key, nkey, hv);
+        if (*it != NULL) {
+            return MC_OK;
         }
+        bucket = &((struct assoc_bucket *)bucket)->overflow;
     }
 
-    return it;
+    return assoc_chain_find_lockless(bucket, key, nkey, it);
 }
 
-static bool
-assoc_expand_needed(void)
+/*
+ * Prefetch the hash bucket of a key ahead of its lookup. Like lockless
+ * lookups, prefetches must be issued within an epoch.
+ */
+void
+assoc_prefetch(uint32_t hv)
 {
-    return ((settings.hash_power == 0) && (expanding == 0) &&
-            (nhash_item > (HASHSIZE(hash_power) * 3 / 2)));
+    mc_prefetch(assoc_get_bucket(hv));
 }
 
 /*
- * Expand the hashtable to the next power of 2. On failure, continue using
- * the old hashtable
+ * Prefetch the items a lookup of the key compares against first, which
+ * are the items of matching tags in a bucketized hash table, and the head
+ * of the chain otherwise. Best issued once the bucket itself was
+ * prefetched, as this reads it.
  */
-static void
-assoc_expand(void)
+void
+assoc_prefetch_items(uint32_t hv)
 {
-    uint32_t hashtable_sz = HASHSIZE(hash_power + 1);
+    struct assoc_bucket *b;
+    void *bucket;
+    uint8_t tag;
+    uint32_t i;
 
-    old_hashtable = primary_hashtable;
-    nbyte_old = nbyte_primary;
-    primary_hashtable = assoc_create_table(hashtable_sz);
-    if (primary_hashtable == NULL) {
-        primary_hashtable = old_hashtable;
-        old_hashtable = NULL;
-        nbyte_old = 0;
+    bucket = assoc_get_bucket(hv);
+
+    if (!bucketized) {
+        mc_prefetch(__atomic_load_n(&((struct item_slh *)bucket)->first,
+                                    __ATOMIC_RELAXED));
         return;
     }
-    nbyte_primary = hashtable_sz * sizeof(struct item_slh);
 
-    log_debug(LOG_INFO, "expanding hash table with %"PRIu32" items to "
-              "%"PRIu32" buckets of size %"PRIu32" bytes", nhash_item,
-              hashtable_sz, sizeof(struct item_slh) * hashtable_sz);
+    b = bucket;
+    tag = ASSOC_TAG(hv);
 
-    hash_power++;
-    expanding = 1;
-    expand_bucket = 0;
+    if (!assoc_bucket_match(b, tag)) {
+        return;
+    }
 
+    for (i = 0; i < ASSOC_BUCKET_NSLOT; i++) {
+        if (b->tag[i] == tag) {
+            mc_prefetch(__atomic_load_n(&b->slot[i], __ATOMIC_RELAXED));
+        }
+    }
+}
+
+/*
+ * Return the power of 2 to resize the hash table to, or 0 if it is fine as
+ * is. Expand once the load factor exceeds 1.5 items per chain, or 3/4 of
+ * the slots of a bucketized hash table, and shrink once it drops below a
+ * quarter of that, but never below the initial size. Hash tables of fixed
+ * size are never resized.
+ */
+static uint32_t
+assoc_resize_power(void)
+{
+    uint64_t nitem, nitem_max;
+    uint32_t power;
+
+    if (settings.hash_power != 0 || old_hashtable != NULL) {
+        return 0;
+    }
+
+    power = primary_hashtable->power;
+    nitem = __atomic_load_n(&nhash_item, __ATOMIC_RELAXED);
+
+    nitem_max = HASHSIZE(power);
+    nitem_max = bucketized ? nitem_max * ASSOC_BUCKET_NSLOT * 3 / 4 :
+                nitem_max * 3 / 2;
+
+    if (nitem > nitem_max && power < HASH_MAX_POWER - 1) {
+        return power + 1;
+    }
+
+    if (nitem < nitem_max / 4 && power > min_hash_power) {
+        return power - 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Wake up the maintenance thread to resize the hash table. We cannot
+ * start resizing in place as that requires all the stripes, while the
+ * caller already holds one.
+ */
+static void
+assoc_request_resize(void)
+{
+    pthread_mutex_lock(&maintenance_lock);
+    resize_requested = 1;
     pthread_cond_signal(&maintenance_cond);
+    pthread_mutex_unlock(&maintenance_lock);
 }
 
 void
 assoc_insert(struct item *it)
 {
-    struct item_slh *bucket;
+    ASSERT(assoc_find(item_key(it), it->nkey, it->hv) == NULL);
 
-    ASSERT(pthread_mutex_trylock(&cache_lock) != 0);
-    ASSERT(assoc_find(item_key(it), it->nkey) == NULL);
+    assoc_migrate_on_write(it->hv);
 
-    bucket = assoc_get_bucket(item_key(it), it->nkey);
-    SLIST_INSERT_HEAD(bucket, it, h_sle);
-    nhash_item++;
+    assoc_bucket_insert_any(assoc_get_bucket(it->hv), it);
+    __atomic_add_fetch(&nhash_item, 1, __ATOMIC_RELAXED);
 
-    if (assoc_expand_needed()) {
-        assoc_expand();
+    if (assoc_resize_power() != 0) {
+        assoc_request_resize();
     }
 }
 
-void
-assoc_delete(const char *key, size_t nkey)
+/*
+ * Return true if the item is in the hash table under the hash value hv.
+ * The item is compared against, but never dereferenced, so that a
+ * reference kept aside, to an item that may have been freed and its
+ * memory reused since, can be checked. Caller holds the stripe of hv.
+ */
+bool
+assoc_contains(struct item *it, uint32_t hv)
 {
-    struct item_slh *bucket;
-    struct item *it, *prev;
+    struct assoc_bucket *b;
+    struct item_slh *chain;
+    struct item *iter;
+    void *bucket;
+    uint32_t i;
 
-    ASSERT(pthread_mutex_trylock(&cache_lock) != 0);
-    ASSERT(assoc_find(key, nkey) != NULL);
+    bucket = assoc_get_bucket(hv);
 
-    bucket = assoc_get_bucket(key, nkey);
+    if (bucketized) {
+        b = bucket;
+        for (i = 0; i < ASSOC_BUCKET_NSLOT; i++) {
+            if (b->slot[i] == it) {
+                return true;
+            }
+        }
+        chain = &b->overflow;
+    } else {
+        chain = bucket;
+    }
 
-    for (prev = NULL, it = SLIST_FIRST(bucket); it != NULL;
-         prev = it, it = SLIST_NEXT(it, h_sle)) {
-        if ((nkey == it->nkey) && (memcmp(key, item_key(it), nkey) == 0)) {
-            break;
+    for (iter = chain->first; iter != NULL; iter = item_h_next(iter)) {
+        if (iter == it) {
+            return true;
         }
     }
 
-    if (prev == NULL) {
-        SLIST_REMOVE_HEAD(bucket, h_sle);
+    return false;
+}
+
+void
+assoc_delete(struct item *it)
+{
+    void *bucket;
+
+    ASSERT(assoc_find(item_key(it), it->nkey, it->hv) == it);
+
+    assoc_migrate_on_write(it->hv);
+
+    bucket = assoc_get_bucket(it->hv);
+
+    if (bucketized) {
+        assoc_bucket_delete(bucket, it);
     } else {
-        SLIST_REMOVE_AFTER(prev, h_sle);
+        assoc_chain_delete(bucket, it);
     }
 
-    nhash_item--;
+    __atomic_sub_fetch(&nhash_item, 1, __ATOMIC_RELAXED);
+
+    if (assoc_resize_power() != 0) {
+        assoc_request_resize();
+    }
 }
@@ -30,16 +30,31 @@
 #ifndef _MC_ASSOC_H_
 #define _MC_ASSOC_H_
 
-#define HASH_MAX_POWER  32
+#define HASHSIZE(_n)        (1UL << (_n))
+#define HASHMASK(_n)        (HASHSIZE(_n) - 1)
 
-size_t nbyte_primary;
-size_t nbyte_old;
+#define HASH_DEFAULT_POWER  16
+#define HASH_MAX_POWER      32
+
+typedef enum hash_table_type {
+    HASH_TABLE_CHAINED,     /* buckets are chains of items */
+    HASH_TABLE_BUCKETIZED,  /* buckets are cache lines of tagged items */
+} hash_table_type_t;
+
+extern size_t nbyte_primary;
+extern size_t nbyte_old;
+extern uint32_t nbucket_old;
+extern uint32_t nbucket_moved;
 
 rstatus_t assoc_init(void);
 void assoc_deinit(void);
 
-struct item *assoc_find(const char *key, size_t nkey);
+struct item *assoc_find(const char *key, size_t nkey, uint32_t hv);
+rstatus_t assoc_find_lockless(const char *key, size_t nkey, uint32_t hv, struct item **it);
+void assoc_prefetch(uint32_t hv);
+void assoc_prefetch_items(uint32_t hv);
 void assoc_insert(struct item *item);
-void assoc_delete(const char *key, size_t nkey);
+void assoc_delete(struct item *item);
+bool assoc_contains(struct item *it, uint32_t hv);
 
 #endif
@@ -243,6 +243,7 @@ conn_get(int sd, conn_state_t state, int ev_flags, int rsize, int udp)
 
     c->ritem = NULL;
     c->rlbytes = 0;
+    c->rspan = 0;
 
     c->item = NULL;
     c->sbytes = 0;
@@ -278,6 +279,9 @@ conn_get(int sd, conn_state_t state, int ev_flags, int rsize, int udp)
 
     c->noreply = 0;
 
+    c->ext_nread = 0;
+    c->ext_error = false;
+
     stats_thread_incr(conn_total);
     stats_thread_incr(conn_curr);
 
@@ -63,6 +63,7 @@ typedef enum conn_state {
     CONN_WRITE,         /* writing out a simple response */
     CONN_MWRITE,        /* writing out many items sequentially */
     CONN_SWALLOW,       /* swallowing unnecessary bytes w/o storing */
+    CONN_EXT_READ,      /* waiting for items to be read from the extstore */
     CONN_CLOSE,         /* closing this connection */
     CONN_SENTINEL       /* max state value (used for assertion) */
 } conn_state_t;
@@ -92,6 +93,7 @@ struct conn {
 
     char                 *ritem;           /* when we read in an item's value, it goes here */
     int                  rlbytes;
+    uint32_t             rspan;            /* span of item data being read, see item_data_span() */
 
     void                 *item;            /* for commands set / add / replace */
     int                  sbytes;           /* how many bytes to swallow in CONN_SWALLOW state*/
@@ -128,6 +130,10 @@ struct conn {
 
     char                 peer[32];         /* printable host:port, possibly truncated */
 
+    uint32_t             ext_nread;        /* # extstore reads in flight, see ext_read() */
+    bool                 ext_error;        /* extstore read failed? */
+    conn_state_t         ext_state;        /* which state to go into once reads are done */
+
     int                  udp_rid;          /* udp request id */
     struct sockaddr      udp_raddr;        /* udp request address */
     socklen_t            udp_raddr_size;   /* udp request address size */
@@ -29,6 +29,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
 
 #include <mc_core.h>
 
@@ -526,6 +527,7 @@ core_drive_machine(struct conn *c)
 {
     rstatus_t status;
     ssize_t n;
+    uint32_t nbyte;
     bool stop = false;
     int nreqs = settings.reqs_per_event;
 
@@ -589,6 +591,13 @@ core_drive_machine(struct conn *c)
 
         case CONN_NREAD:
             if (c->rlbytes == 0) {
+                /* data of a chunked item is read one chunk at a time */
+                c->ritem = item_data_span(c->item, ++c->rspan, &nbyte);
+                if (c->ritem != NULL) {
+                    c->rlbytes = (int)nbyte;
+                    break;
+                }
+
                 core_complete_nread(c);
                 break;
             }
@@ -772,6 +781,26 @@ core_drive_machine(struct conn *c)
             }
             break;
 
+        case CONN_EXT_READ:
+            /* drop the hold of the get on its extstore reads */
+            if (__atomic_sub_fetch(&c->ext_nread, 1, __ATOMIC_ACQ_REL) == 0) {
+                conn_set_state(c, c->ext_error ? CONN_CLOSE : c->ext_state);
+                break;
+            }
+
+            /*
+             * Reads are still in flight, and the conn is resumed by
+             * core_ext_done() once they are done. Until then no more
+             * requests are read in, and the conn must not be closed.
+             */
+            status = core_update(c, 0);
+            if (status != MC_OK) {
+                log_warn("update on c %d failed, ignored: %s", c->sd,
+                         strerror(errno));
+            }
+            stop = true;
+            break;
+
         case CONN_CLOSE:
             core_close(c);
             stop = true;
@@ -786,6 +815,21 @@ core_drive_machine(struct conn *c)
     time_update();
 }
 
+/*
+ * Resume connection c, left in CONN_EXT_READ, once the last extstore read
+ * of its get is done. A get whose reads failed has its response cut short,
+ * so the conn is closed.
+ */
+void
+core_ext_done(struct conn *c)
+{
+    ASSERT(c->state == CONN_EXT_READ);
+    ASSERT(c->ext_nread == 0);
+
+    conn_set_state(c, c->ext_error ? CONN_CLOSE : c->ext_state);
+    core_drive_machine(c);
+}
+
 void
 core_event_handler(int sd, short which, void *arg)
 {
@@ -1035,6 +1079,40 @@ core_create_socket(void)
     return MC_OK;
 }
 
+/*
+ * Shut down on SIGINT or SIGTERM, saving the slab heap to the heap file
+ * first. Signals are handled in the main thread event loop, rather than
+ * in signal_handler(), as saving takes locks.
+ */
+static void
+core_shutdown(int signo, short which, void *arg)
+{
+    log_debug(LOG_NOTICE, "signal %d received, saving slab heap and exiting",
+              signo);
+
+    slab_heap_save();
+
+    exit(1);
+}
+
+static void
+core_shutdown_init(void)
+{
+    static struct event shutdown_ev[2];
+    static int signo[] = { SIGINT, SIGTERM };
+    uint32_t i;
+
+    if (settings.heap_file == NULL) {
+        return;
+    }
+
+    for (i = 0; i < NELEMS(signo); i++) {
+        signal_set(&shutdown_ev[i], signo[i], core_shutdown, NULL);
+        event_base_set(main_base, &shutdown_ev[i]);
+        signal_add(&shutdown_ev[i], NULL);
+    }
+}
+
 rstatus_t
 core_init(void)
 {
@@ -1059,6 +1137,16 @@ core_init(void)
         return MC_ERROR;
     }
 
+    status = hash_init(settings.hash_type);
+    if (status != MC_OK) {
+        return status;
+    }
+
+    status = item_init();
+    if (status != MC_OK) {
+        return status;
+    }
+
     status = assoc_init();
     if (status != MC_OK) {
         return status;
@@ -1066,13 +1154,41 @@ core_init(void)
 
     conn_init();
 
-    item_init();
-
     status = slab_init();
     if (status != MC_OK) {
         return status;
     }
 
+    status = seg_init();
+    if (status != MC_OK) {
+        return status;
+    }
+
+    status = expiry_init();
+    if (status != MC_OK) {
+        return status;
+    }
+
+    status = ext_init();
+    if (status != MC_OK) {
+        return status;
+    }
+
+    status = admit_init();
+    if (status != MC_OK) {
+        return status;
+    }
+
+    status = policy_init();
+    if (status != MC_OK) {
+        return status;
+    }
+
+    status = mrc_init();
+    if (status != MC_OK) {
+        return status;
+    }
+
     stats_init();
 
     status = klog_init();
@@ -1093,6 +1209,8 @@ core_init(void)
         return status;
     }
 
+    core_shutdown_init();
+
     return MC_OK;
 }
 
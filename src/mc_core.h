@@ -69,6 +69,12 @@
 # define MC_DISABLE_KLOG 0
 #endif
 
+#ifdef HAVE_COMPACT_ITEMS
+# define MC_COMPACT_ITEMS 1
+#else
+# define MC_COMPACT_ITEMS 0
+#endif
+
 #ifdef HAVE_LITTLE_ENDIAN
 # define MC_LITTLE_ENDIAN 1
 #endif
@@ -85,6 +91,14 @@
 #define MC_LARGE_PAGES 1
 #endif
 
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_MADVISE)
+#define MC_MMAP_HEAP 1
+#endif
+
+#ifdef HAVE_LINUX_MEMPOLICY_H
+#define MC_NUMA 1
+#endif
+
 #define MC_OK        0
 #define MC_ERROR    -1
 #define MC_EAGAIN   -2
@@ -101,6 +115,7 @@ struct thread_aggregator;
 struct item;
 struct slab;
 struct slabclass;
+struct seg;
 
 #include <stddef.h>
 #include <stdint.h>
@@ -198,7 +213,8 @@ struct slabclass;
 #define EVICT_RS      0x02 /* random slab eviction */
 #define EVICT_AS      0x04 /* lra (least recently accessed) slab eviction */
 #define EVICT_CS      0x08 /* lrc (least recently created) slab eviction */
-#define EVICT_INVALID 0x10 /* go no further! */
+#define EVICT_HD      0x10 /* lowest hit density slab eviction */
+#define EVICT_INVALID 0x20 /* go no further! */
 
 #define DEFINE_ACTION(_type, _min, _max, _nmin, _nmax) REQ_##_type,
 typedef enum req_type {
@@ -216,10 +232,17 @@ typedef enum rsp_type {
 
 #include <mc_thread.h>
 #include <mc_slabs.h>
+#include <mc_segs.h>
 #include <mc_stats.h>
 #include <mc_klog.h>
 #include <mc_assoc.h>
 #include <mc_items.h>
+#include <mc_expiry.h>
+#include <mc_snapshot.h>
+#include <mc_extstore.h>
+#include <mc_admit.h>
+#include <mc_policy.h>
+#include <mc_mrc.h>
 #include <mc_signal.h>
 #include <mc_ascii.h>
 #include <mc_connection.h>
@@ -233,6 +256,7 @@ struct settings {
 
     bool            prealloc;                     /* memory  : whether we preallocate for slabs */
     bool            lock_page;                    /* memory  : whether to lock allcoated pages */
+    bool            large_pages;                  /* memory  : whether to back slab heap with huge pages */
     bool            daemonize;                    /* process : daemonized or not */
     bool            max_corefile;                 /* process : maximize core core file limit */
     bool            use_cas;                      /* protocol: whether cas is supported */
@@ -262,15 +286,29 @@ struct settings {
     char            *socketpath;                  /* network : path to unix socket if used */
     int             access;                       /* network : access mask for unix socket */
 
+    numa_policy_t   numa_policy;                  /* memory  : numa placement of slab heap */
+    char            *heap_file;                   /* memory  : file backing slab heap across restarts */
+    char            *snapshot_file;               /* memory  : file to dump items to and load them from */
+    char            *ext_file;                    /* memory  : file of second tier for evicted items */
+    size_t          ext_size;                     /* memory  : size of second tier file */
+    storage_type_t  storage;                      /* memory  : storage engine for items */
+    admission_type_t admission;                   /* memory  : admission filter of sets that evict */
+    policy_type_t   policy;                       /* memory  : eviction policy of lru q */
     int             evict_opt;                    /* memory  : eviction */
+    int             slab_automove;                /* memory  : slab rebalancing aggressiveness */
     bool            use_freeq;                    /* memory  : whether use items in freeq or not */
     bool            use_lruq;                     /* memory  : whether use items in freeq or not */
+    bool            expiry_wheel;                 /* memory  : reclaim expired items through expiry wheels? */
     double          factor;                       /* memory  : chunk size growth factor */
     size_t          maxbytes;                     /* memory  : maximum bytes allowed for slabs */
     size_t          chunk_size;                   /* memory  : minimum item chunk size */
     size_t          max_chunk_size;               /* memory  : maximum item chunk size */
+    size_t          max_item_size;                /* memory  : maximum item size, chunked beyond max_chunk_size */
     size_t          slab_size;                    /* memory  : slab size */
     int             hash_power;                   /* memory  : hash table size, 0 for autotune */
+    hash_table_type_t hash_table;                 /* memory  : hash table type */
+    hash_type_t     hash_type;                    /* memory  : hash function for keys */
+    int             lock_power;                   /* memory  : # item lock stripes, as power of 2 */
 
                                                   /* global state */
 
@@ -293,6 +331,7 @@ struct settings {
 
 void core_write_and_free(struct conn *c, char *buf, int bytes);
 void core_event_handler(int fd, short which, void *arg);
+void core_ext_done(struct conn *c);
 void core_accept_conns(bool do_accept);
 
 rstatus_t core_init(void);
@@ -0,0 +1,406 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+
+#include <mc_core.h>
+
+extern struct settings settings;
+extern struct thread_worker *threads;
+extern struct thread_key keys;
+
+#define EXPIRY_ROOT_NSLOT   (1U << EXPIRY_ROOT_BITS)
+#define EXPIRY_LEVEL_NSLOT  (1U << EXPIRY_LEVEL_BITS)
+#define EXPIRY_NSLOT        (EXPIRY_ROOT_NSLOT + \
+                             (EXPIRY_NLEVEL - 1) * EXPIRY_LEVEL_NSLOT)
+#define EXPIRY_MAX_DELTA    ((rel_time_t)1 << (EXPIRY_ROOT_BITS + \
+                             (EXPIRY_NLEVEL - 1) * EXPIRY_LEVEL_BITS))
+
+struct expiry_entry {
+    item_link_t         it;         /* item, which may be gone since */
+    uint32_t            hv;         /* hash value of item key */
+    rel_time_t          exptime;    /* expiry time of item */
+};
+
+struct expiry_block {
+    struct expiry_block *next;      /* next block of the slot */
+    uint32_t            nentry;     /* # entries in use */
+    struct expiry_entry entry[EXPIRY_BLOCK_NENTRY];
+};
+
+/*
+ * A wheel is updated mostly by its worker, and advanced by the rebalancer,
+ * under its lock, which sits below the item stripes in the lock hierarchy.
+ * Slots are fired and cascaded by detaching their blocks under the lock,
+ * and the items they refer to are reclaimed once it is dropped.
+ */
+struct expiry_wheel {
+    pthread_mutex_t     lock;                   /* wheel lock */
+    rel_time_t          now;                    /* time of the next slot to fire */
+    struct expiry_block *slot[EXPIRY_NSLOT];    /* slots, a list of blocks each */
+};
+
+static uint32_t expiry_nblock;      /* # blocks allocated across all wheels */
+static uint32_t expiry_max_nblock;  /* max # blocks allowed */
+
+rstatus_t
+expiry_init(void)
+{
+    expiry_nblock = 0;
+    expiry_max_nblock = 0;
+
+    if (!settings.expiry_wheel) {
+        return MC_OK;
+    }
+
+    if (settings.storage == STORAGE_SEG) {
+        log_error("segment storage engine expires segments as a whole, "
+                  "without expiry wheel");
+        return MC_ERROR;
+    }
+
+    expiry_max_nblock = (settings.maxbytes >> EXPIRY_NBYTE_SHIFT) /
+                        sizeof(struct expiry_block);
+
+    log_debug(LOG_INFO, "expiry wheel capped at %"PRIu32" blocks of %zu "
+              "bytes", expiry_max_nblock, sizeof(struct expiry_block));
+
+    return MC_OK;
+}
+
+void
+expiry_deinit(void)
+{
+}
+
+/*
+ * Create the wheel of a worker thread, starting at the current time.
+ */
+struct expiry_wheel *
+expiry_wheel_create(void)
+{
+    struct expiry_wheel *w;
+    err_t err;
+
+    w = mc_zalloc(sizeof(*w));
+    if (w == NULL) {
+        return NULL;
+    }
+
+    err = pthread_mutex_init(&w->lock, NULL);
+    if (err != 0) {
+        log_error("pthread mutex init failed: %s", strerror(err));
+        mc_free(w);
+        return NULL;
+    }
+
+    w->now = time_now();
+
+    return w;
+}
+
+static struct expiry_block *
+expiry_block_get(void)
+{
+    struct expiry_block *blk;
+
+    if (__atomic_add_fetch(&expiry_nblock, 1, __ATOMIC_RELAXED) >
+        expiry_max_nblock) {
+        __atomic_sub_fetch(&expiry_nblock, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    blk = mc_alloc(sizeof(*blk));
+    if (blk == NULL) {
+        __atomic_sub_fetch(&expiry_nblock, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    blk->next = NULL;
+    blk->nentry = 0;
+
+    return blk;
+}
+
+static void
+expiry_block_put(struct expiry_block *blk)
+{
+    mc_free(blk);
+    __atomic_sub_fetch(&expiry_nblock, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Return the slot an entry expiring at exptime goes into, the entries of
+ * the first level being due within EXPIRY_ROOT_NSLOT secs of now.
+ */
+static uint32_t
+expiry_slot(struct expiry_wheel *w, rel_time_t exptime)
+{
+    rel_time_t delta;
+    uint32_t level, shift;
+
+    if (exptime < w->now) {
+        exptime = w->now;
+    }
+
+    delta = exptime - w->now;
+    if (delta < EXPIRY_ROOT_NSLOT) {
+        return exptime & (EXPIRY_ROOT_NSLOT - 1);
+    }
+
+    if (delta >= EXPIRY_MAX_DELTA) {
+        /* too far ahead, so to be cascaded again */
+        exptime = w->now + EXPIRY_MAX_DELTA - 1;
+        delta = EXPIRY_MAX_DELTA - 1;
+    }
+
+    for (level = 1, shift = EXPIRY_ROOT_BITS;
+         delta >= ((rel_time_t)1 << (shift + EXPIRY_LEVEL_BITS));
+         level++, shift += EXPIRY_LEVEL_BITS) {
+    }
+
+    return EXPIRY_ROOT_NSLOT + (level - 1) * EXPIRY_LEVEL_NSLOT +
+           ((exptime >> shift) & (EXPIRY_LEVEL_NSLOT - 1));
+}
+
+/*
+ * Add an entry to its slot. Caller holds the wheel lock.
+ */
+static bool
+_expiry_wheel_add(struct expiry_wheel *w, struct expiry_entry *e)
+{
+    struct expiry_block *blk;
+    uint32_t idx;
+
+    idx = expiry_slot(w, e->exptime);
+
+    blk = w->slot[idx];
+    if (blk == NULL || blk->nentry == EXPIRY_BLOCK_NENTRY) {
+        blk = expiry_block_get();
+        if (blk == NULL) {
+            return false;
+        }
+        blk->next = w->slot[idx];
+        w->slot[idx] = blk;
+    }
+
+    blk->entry[blk->nentry++] = *e;
+
+    return true;
+}
+
+/*
+ * Index a linked item by its expiry time in the wheel of the calling
+ * thread, if it expires. A thread with no wheel of its own, like the
+ * extstore io threads standing in for the dispatcher, indexes it in the
+ * wheel of the worker picked by the key hash. Caller holds the stripe of
+ * the item key.
+ */
+void
+expiry_insert(struct item *it)
+{
+    struct expiry_wheel *w;
+    struct expiry_entry e;
+    bool added;
+
+    ASSERT(item_is_linked(it));
+
+    if (it->exptime == 0) {
+        return;
+    }
+
+    w = pthread_getspecific(keys.expiry);
+    if (w == NULL) {
+        w = threads[it->hv % settings.num_workers].expiry;
+        if (w == NULL) {
+            return;
+        }
+    }
+
+    e.it = item_2_link(it);
+    e.hv = it->hv;
+    e.exptime = it->exptime;
+
+    pthread_mutex_lock(&w->lock);
+    added = _expiry_wheel_add(w, &e);
+    pthread_mutex_unlock(&w->lock);
+
+    if (added) {
+        stats_thread_incr(expiry_curr);
+    } else {
+        stats_thread_incr(expiry_full);
+    }
+}
+
+static struct expiry_block *
+expiry_wheel_detach(struct expiry_wheel *w, uint32_t idx)
+{
+    struct expiry_block *blk;
+
+    pthread_mutex_lock(&w->lock);
+    blk = w->slot[idx];
+    w->slot[idx] = NULL;
+    pthread_mutex_unlock(&w->lock);
+
+    return blk;
+}
+
+/*
+ * Cascade the slot of a level that came up into the levels below, a block
+ * at a time. Entries of a block are set aside, and the block released,
+ * before they are added back, so that a full wheel can take them.
+ */
+static void
+expiry_wheel_cascade(struct expiry_wheel *w, uint32_t idx)
+{
+    struct expiry_block *blk, *next;
+    struct expiry_entry entry[EXPIRY_BLOCK_NENTRY];
+    uint32_t i, n, ndrop;
+
+    for (ndrop = 0, blk = expiry_wheel_detach(w, idx); blk != NULL;
+         blk = next) {
+        next = blk->next;
+        n = blk->nentry;
+        memcpy(entry, blk->entry, n * sizeof(entry[0]));
+        expiry_block_put(blk);
+
+        pthread_mutex_lock(&w->lock);
+        for (i = 0; i < n; i++) {
+            if (!_expiry_wheel_add(w, &entry[i])) {
+                ndrop++;
+            }
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    if (ndrop > 0) {
+        stats_thread_decr_by(expiry_curr, ndrop);
+        stats_thread_incr_by(expiry_full, ndrop);
+    }
+}
+
+/*
+ * Fire the entries of a slot of the first level, detached from the wheel,
+ * reclaiming the items they refer to, as long as these are still around
+ * and expired.
+ */
+static void
+expiry_wheel_fire(struct expiry_block *blk)
+{
+    struct expiry_block *next;
+    struct expiry_entry *e;
+    uint32_t i, nreap, nstale;
+
+    for (nreap = 0, nstale = 0; blk != NULL; blk = next) {
+        next = blk->next;
+        for (i = 0; i < blk->nentry; i++) {
+            e = &blk->entry[i];
+            if (item_reap(item_link_2_item(e->it), e->hv)) {
+                nreap++;
+            } else {
+                nstale++;
+            }
+        }
+        expiry_block_put(blk);
+    }
+
+    if (nreap + nstale > 0) {
+        stats_thread_decr_by(expiry_curr, nreap + nstale);
+        stats_thread_incr_by(expiry_reap, nreap);
+        stats_thread_incr_by(expiry_stale, nstale);
+
+        log_debug(LOG_VERB, "expiry wheel fired %"PRIu32" entries, %"PRIu32
+                  " items reclaimed", nreap + nstale, nreap);
+    }
+}
+
+/*
+ * Advance a wheel up to now, one sec at a time, cascading the slots of the
+ * upper levels whenever the levels below wrap around.
+ */
+static void
+expiry_wheel_advance(struct expiry_wheel *w, rel_time_t now)
+{
+    struct expiry_block *blk;
+    rel_time_t tick;
+    uint32_t level, shift, idx;
+
+    while ((tick = w->now) <= now) {
+        for (level = 1, shift = EXPIRY_ROOT_BITS;
+             level < EXPIRY_NLEVEL &&
+             (tick & (((rel_time_t)1 << shift) - 1)) == 0;
+             level++, shift += EXPIRY_LEVEL_BITS) {
+            idx = (tick >> shift) & (EXPIRY_LEVEL_NSLOT - 1);
+            expiry_wheel_cascade(w, EXPIRY_ROOT_NSLOT +
+                                 (level - 1) * EXPIRY_LEVEL_NSLOT + idx);
+        }
+
+        /*
+         * The slot is detached as the wheel moves past it, or else it
+         * would take entries due a whole level later
+         */
+        idx = tick & (EXPIRY_ROOT_NSLOT - 1);
+        pthread_mutex_lock(&w->lock);
+        blk = w->slot[idx];
+        w->slot[idx] = NULL;
+        w->now = tick + 1;
+        pthread_mutex_unlock(&w->lock);
+
+        expiry_wheel_fire(blk);
+    }
+}
+
+/*
+ * Reclaim the items that expired since the last call, across the wheels
+ * of all workers. Called by the rebalancer thread every sec.
+ */
+void
+expiry_reap(void)
+{
+    rel_time_t now;
+    int i;
+
+    if (!settings.expiry_wheel) {
+        return;
+    }
+
+    now = time_now();
+    for (i = 0; i < settings.num_workers; i++) {
+        if (threads[i].expiry != NULL) {
+            expiry_wheel_advance(threads[i].expiry, now);
+        }
+    }
+}
+
+size_t
+expiry_nbyte(void)
+{
+    return (size_t)__atomic_load_n(&expiry_nblock, __ATOMIC_RELAXED) *
+           sizeof(struct expiry_block);
+}
@@ -0,0 +1,74 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MC_EXPIRY_H_
+#define _MC_EXPIRY_H_
+
+/*
+ * With --expiry-wheel, items of the slab engine that expire are indexed by
+ * their expiry time in a hierarchical timer wheel, so that they can be
+ * reclaimed once expired, instead of only when they are looked up or
+ * happen to be at the head of their lru q.
+ *
+ * Every worker thread indexes the items it links in its own wheel, and the
+ * rebalancer thread advances all wheels every second. The first level of
+ * a wheel has a slot per second for the next 256 secs, and every other
+ * level has 64 slots, each as wide as the whole level before it. Entries
+ * of a slot of the upper levels are cascaded down, as their slot comes
+ * up, until they land in a slot of the first level, which fires them.
+ * This covers exptimes of up to ~2 years; later ones are cascaded again
+ * until they are in range.
+ *
+ * An entry is the item reference, its hash value and its expiry time,
+ * kept in blocks apart from the item, which is left as it is. Entries are
+ * never removed as items are overwritten or deleted, so when an entry
+ * fires, the item it refers to may be gone, its memory being reused for
+ * another item even. The item is only reclaimed if it is found in the
+ * hash table, under the stripe of its hash value, and has expired.
+ *
+ * Memory taken up by entries is capped to 1 / 2^EXPIRY_NBYTE_SHIFT of the
+ * slab memory; items that do not fit are left to lazy expiry.
+ */
+#define EXPIRY_NLEVEL       4
+#define EXPIRY_ROOT_BITS    8       /* # slots of the first level, as power of 2 */
+#define EXPIRY_LEVEL_BITS   6       /* # slots of other levels, as power of 2 */
+#define EXPIRY_BLOCK_NENTRY 63      /* # entries per block */
+#define EXPIRY_NBYTE_SHIFT  4       /* wheels take up at most maxbytes >> 4 */
+
+struct expiry_wheel;
+
+rstatus_t expiry_init(void);
+void expiry_deinit(void);
+
+struct expiry_wheel *expiry_wheel_create(void);
+void expiry_insert(struct item *it);
+void expiry_reap(void);
+size_t expiry_nbyte(void);
+
+#endif
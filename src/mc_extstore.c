@@ -0,0 +1,639 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+
+#include <mc_core.h>
+
+extern struct settings settings;
+
+/*
+ * Item evicted to a write buffer, whose data is at offset in the buffer.
+ */
+struct ext_record {
+    uint64_t   cas;                 /* cas, or 0 */
+    uint32_t   hv;                  /* key hash value */
+    uint32_t   dataflags;           /* data flags opaque to the server */
+    rel_time_t atime;               /* last access time */
+    rel_time_t exptime;             /* expiry time */
+    uint32_t   offset;              /* offset of data in buffer */
+    uint32_t   nbyte;               /* data size */
+    uint8_t    nkey;                /* key length */
+    char       key[KEY_MAX_LEN];    /* key */
+};
+
+struct ext_wbuf {
+    char              *data;                          /* item data */
+    struct ext_record *rec;                           /* records */
+    uint32_t          nbyte;                          /* # bytes of data */
+    uint32_t          nrecord;                        /* # records */
+    uint32_t          cancel[EXT_CANCEL_NBIT / 32];   /* hashes deleted */
+};
+
+struct ext_page {
+    uint32_t gen;           /* generation, bumped on reuse */
+    uint32_t nread;         /* # reads in flight */
+};
+
+struct ext_io {
+    STAILQ_ENTRY(ext_io) next;      /* link in io q */
+    struct conn          *c;        /* conn of the get */
+    struct item          *it;       /* stub read for */
+    struct item          *nit;      /* item read into */
+    struct ext_loc       loc;       /* location of item data */
+    struct timespec      start;     /* time read was queued */
+};
+
+STAILQ_HEAD(ext_ioq, ext_io);
+
+static struct {
+    int             fd;         /* extstore file */
+    uint32_t        npage;      /* # pages in file */
+    struct ext_page *page;      /* pages */
+    uint32_t        wpage;      /* page being written, by the writer */
+    uint32_t        woff;       /* offset in page being written */
+
+    pthread_mutex_t lock;       /* lock on buffers and pages */
+    pthread_cond_t  wcond;      /* buffer to write, for the writer */
+    pthread_cond_t  ucond;      /* page unpinned, for the writer */
+    struct ext_wbuf wbuf[2];    /* write buffers */
+    struct ext_wbuf *fill;      /* buffer being filled */
+    struct ext_wbuf *flush;     /* buffer being written, or NULL */
+
+    pthread_mutex_t io_lock;    /* lock on io q */
+    pthread_cond_t  io_cond;    /* read to do, for the io threads */
+    struct ext_ioq  ioq;        /* reads to do */
+} ext;
+
+static uint64_t
+ext_usec_since(struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (uint64_t)(end.tv_sec - start->tv_sec) * 1000000 +
+           (end.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*
+ * Hand the buffer being filled to the writer, and fill the other one,
+ * which the writer is done with. Must be called with ext.lock held.
+ */
+static void
+ext_swap(void)
+{
+    ASSERT(ext.flush == NULL);
+
+    ext.flush = ext.fill;
+    ext.fill = ext.fill == &ext.wbuf[0] ? &ext.wbuf[1] : &ext.wbuf[0];
+
+    ASSERT(ext.fill->nrecord == 0);
+
+    pthread_cond_signal(&ext.wcond);
+}
+
+/*
+ * Copy an item evicted while still live to the buffer being filled, to
+ * be written out to the extstore. The caller holds the stripe of the item
+ * key, which keeps its data from changing. The item is dropped if it is
+ * too small to be worth it, or larger than a page, or if both buffers are
+ * taken.
+ */
+void
+ext_evict(struct item *it)
+{
+    struct ext_wbuf *w;
+    struct ext_record *rec;
+    char *data;
+    uint32_t idx, len, nbyte;
+
+    if (settings.ext_file == NULL || it->nbyte < EXT_MIN_NBYTE ||
+        it->nbyte > EXT_PAGE_SIZE) {
+        return;
+    }
+
+    pthread_mutex_lock(&ext.lock);
+
+    w = ext.fill;
+    if (w->nrecord == EXT_MAX_NRECORD ||
+        w->nbyte + it->nbyte > EXT_PAGE_SIZE) {
+        if (ext.flush != NULL) {
+            pthread_mutex_unlock(&ext.lock);
+            stats_thread_incr(ext_drop);
+            return;
+        }
+        ext_swap();
+        w = ext.fill;
+    }
+
+    rec = &w->rec[w->nrecord++];
+    rec->cas = item_get_cas(it);
+    rec->hv = it->hv;
+    rec->dataflags = it->dataflags;
+    rec->atime = it->atime;
+    rec->exptime = it->exptime;
+    rec->offset = w->nbyte;
+    rec->nbyte = it->nbyte;
+    rec->nkey = it->nkey;
+    memcpy(rec->key, item_key(it), it->nkey);
+
+    for (idx = 0, nbyte = it->nbyte; nbyte > 0; idx++, nbyte -= len) {
+        data = item_data_span(it, idx, &len);
+        len = MIN(len, nbyte);
+        memcpy(w->data + w->nbyte, data, len);
+        w->nbyte += len;
+    }
+
+    pthread_mutex_unlock(&ext.lock);
+}
+
+/*
+ * Keep items of hash value hv evicted before now from being linked back
+ * as stubs, once their key is deleted. Hashes are tracked in a bitmap per
+ * buffer, so that a few more items than those of the key may be dropped.
+ */
+void
+ext_cancel(uint32_t hv)
+{
+    uint32_t bit;
+
+    if (settings.ext_file == NULL) {
+        return;
+    }
+
+    bit = hv % EXT_CANCEL_NBIT;
+
+    __atomic_fetch_or(&ext.wbuf[0].cancel[bit / 32], 1U << (bit % 32),
+                      __ATOMIC_RELAXED);
+    __atomic_fetch_or(&ext.wbuf[1].cancel[bit / 32], 1U << (bit % 32),
+                      __ATOMIC_RELAXED);
+}
+
+/*
+ * Return true if items of hash value hv in the buffer being written were
+ * cancelled by ext_cancel(). Only called by the writer.
+ */
+bool
+ext_cancelled(uint32_t hv)
+{
+    uint32_t bit;
+
+    ASSERT(ext.flush != NULL);
+
+    bit = hv % EXT_CANCEL_NBIT;
+
+    return (__atomic_load_n(&ext.flush->cancel[bit / 32], __ATOMIC_RELAXED) &
+            (1U << (bit % 32))) != 0;
+}
+
+/*
+ * Move the writer on to the next page, which it takes over once the
+ * reads in flight on it are done.
+ */
+static void
+ext_next_page(void)
+{
+    struct ext_page *p;
+
+    pthread_mutex_lock(&ext.lock);
+
+    ext.wpage = (ext.wpage + 1) % ext.npage;
+    p = &ext.page[ext.wpage];
+    p->gen++;
+    while (p->nread != 0) {
+        pthread_cond_wait(&ext.ucond, &ext.lock);
+    }
+
+    pthread_mutex_unlock(&ext.lock);
+
+    ext.woff = 0;
+}
+
+/*
+ * Pin the page of loc for a read, if it still holds the data of loc.
+ */
+static bool
+ext_pin(struct ext_loc *loc)
+{
+    struct ext_page *p;
+    bool pinned;
+
+    if (loc->page >= ext.npage) {
+        return false;
+    }
+
+    p = &ext.page[loc->page];
+
+    pthread_mutex_lock(&ext.lock);
+    pinned = (p->gen == loc->gen);
+    if (pinned) {
+        p->nread++;
+    }
+    pthread_mutex_unlock(&ext.lock);
+
+    return pinned;
+}
+
+static void
+ext_unpin(struct ext_loc *loc)
+{
+    struct ext_page *p;
+
+    p = &ext.page[loc->page];
+
+    pthread_mutex_lock(&ext.lock);
+    ASSERT(p->nread > 0);
+    if (--p->nread == 0) {
+        pthread_cond_signal(&ext.ucond);
+    }
+    pthread_mutex_unlock(&ext.lock);
+}
+
+/*
+ * Write out the data of a buffer, and link a stub for each of its items.
+ */
+static void
+ext_write(struct ext_wbuf *w)
+{
+    struct ext_record *rec;
+    struct ext_loc loc;
+    struct item *it;
+    uint32_t i;
+    uint8_t id;
+
+    if (ext.woff + w->nbyte > EXT_PAGE_SIZE) {
+        ext_next_page();
+    }
+
+    if (pwrite(ext.fd, w->data, w->nbyte, (off_t)ext.wpage * EXT_PAGE_SIZE +
+               ext.woff) != (ssize_t)w->nbyte) {
+        log_warn("write of %"PRIu32" items to ext file '%s' failed: %s",
+                 w->nrecord, settings.ext_file, strerror(errno));
+        stats_thread_incr(ext_write_error);
+        return;
+    }
+    stats_thread_incr_by(ext_write_byte, w->nbyte);
+
+    loc.page = ext.wpage;
+    loc.gen = ext.page[ext.wpage].gen;
+
+    for (i = 0; i < w->nrecord; i++) {
+        rec = &w->rec[i];
+
+        id = item_slabid(rec->nkey, sizeof(loc));
+        if (id == SLABCLASS_INVALID_ID) {
+            continue;
+        }
+
+        it = item_alloc(id, rec->key, rec->nkey, rec->hv, rec->dataflags,
+                        rec->exptime, sizeof(loc));
+        if (it == NULL) {
+            stats_thread_incr(ext_drop);
+            continue;
+        }
+
+        loc.offset = ext.woff + rec->offset;
+        loc.nbyte = rec->nbyte;
+        memcpy(item_data(it), &loc, sizeof(loc));
+
+        /* for item_link_stub() to tell whether a flush came in between */
+        it->atime = rec->atime;
+
+        if (item_link_stub(it, rec->cas)) {
+            stats_thread_incr(ext_write);
+        }
+        item_remove(it);
+    }
+
+    ext.woff += w->nbyte;
+}
+
+static void *
+ext_write_thread(void *arg)
+{
+    struct ext_wbuf *w;
+    struct timespec ts;
+
+    /* items are allocated and linked on behalf of the dispatcher */
+    if (thread_stand_in(settings.num_workers) != MC_OK) {
+        exit(1);
+    }
+
+    pthread_mutex_lock(&ext.lock);
+
+    for (;;) {
+        if (ext.flush == NULL) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec++;
+            pthread_cond_timedwait(&ext.wcond, &ext.lock, &ts);
+
+            /* write out a buffer left pending for a while */
+            if (ext.flush == NULL) {
+                if (ext.fill->nrecord == 0) {
+                    continue;
+                }
+                ext_swap();
+            }
+        }
+
+        w = ext.flush;
+        pthread_mutex_unlock(&ext.lock);
+
+        ext_write(w);
+
+        pthread_mutex_lock(&ext.lock);
+        w->nbyte = 0;
+        w->nrecord = 0;
+        memset(w->cancel, 0, sizeof(w->cancel));
+        ext.flush = NULL;
+    }
+
+    return NULL;
+}
+
+/*
+ * Queue the read of the item a stub stands for, which the caller holds
+ * a reference on, and pass it on to the read. The item read into is
+ * returned refcounted for the caller, who may build a response out of it
+ * right away, as long as it is not sent before the read is done; the conn
+ * keeps count of its reads in flight in c->ext_nread.
+ *
+ * Returns NULL, as on a miss, if the data of the stub is gone, or if the
+ * read could not be queued.
+ */
+struct item *
+ext_read(struct conn *c, struct item *it)
+{
+    struct ext_io *io;
+    struct item *nit;
+    uint8_t id;
+
+    ASSERT(item_is_ext(it));
+
+    io = mc_alloc(sizeof(*io));
+    if (io == NULL) {
+        item_remove(it);
+        return NULL;
+    }
+
+    memcpy(&io->loc, item_data(it), sizeof(io->loc));
+
+    if (!ext_pin(&io->loc)) {
+        stats_thread_incr(ext_miss);
+        item_unlink_stub(it);
+        item_remove(it);
+        mc_free(io);
+        return NULL;
+    }
+
+    id = item_slabid(it->nkey, io->loc.nbyte);
+    nit = (id == SLABCLASS_INVALID_ID) ? NULL :
+          item_alloc(id, item_key(it), it->nkey, it->hv, it->dataflags,
+                     it->exptime, io->loc.nbyte);
+    if (nit == NULL) {
+        ext_unpin(&io->loc);
+        item_remove(it);
+        mc_free(io);
+        return NULL;
+    }
+
+    item_set_cas(nit, item_get_cas(it));
+
+    /* the read holds a reference of its own on the item read into */
+    item_acquire_refcount(nit);
+
+    io->c = c;
+    io->it = it;
+    io->nit = nit;
+    clock_gettime(CLOCK_MONOTONIC, &io->start);
+
+    /* the get holds one more until its response is built, see CONN_EXT_READ */
+    __atomic_add_fetch(&c->ext_nread, c->ext_nread == 0 ? 2 : 1,
+                       __ATOMIC_ACQ_REL);
+
+    pthread_mutex_lock(&ext.io_lock);
+    STAILQ_INSERT_TAIL(&ext.ioq, io, next);
+    pthread_cond_signal(&ext.io_cond);
+    pthread_mutex_unlock(&ext.io_lock);
+
+    return nit;
+}
+
+/*
+ * Read the data of an item from the extstore into the item read into.
+ */
+static bool
+ext_pread(struct item *it, struct ext_loc *loc)
+{
+    char *data;
+    off_t off;
+    uint32_t idx, len, nbyte;
+
+    off = (off_t)loc->page * EXT_PAGE_SIZE + loc->offset;
+
+    for (idx = 0, nbyte = loc->nbyte; nbyte > 0; idx++, nbyte -= len) {
+        data = item_data_span(it, idx, &len);
+        len = MIN(len, nbyte);
+        if (pread(ext.fd, data, len, off) != (ssize_t)len) {
+            return false;
+        }
+        off += len;
+    }
+
+    return true;
+}
+
+/*
+ * Do a read queued by ext_read(). The item read takes the place of its
+ * stub, and the conn of the get is resumed once its last read is done.
+ */
+static void
+ext_io(struct ext_io *io)
+{
+    struct conn *c = io->c;
+    bool ok;
+
+    ok = ext_pread(io->nit, &io->loc);
+    ext_unpin(&io->loc);
+
+    if (ok) {
+        item_relink_stub(io->it, io->nit);
+        stats_thread_incr(ext_hit);
+    } else {
+        log_warn("read of %"PRIu32" bytes from ext file '%s' failed: %s",
+                 io->loc.nbyte, settings.ext_file, strerror(errno));
+        item_unlink_stub(io->it);
+        stats_thread_incr(ext_read_error);
+        c->ext_error = true;
+    }
+    stats_thread_incr_by(ext_read_usec, ext_usec_since(&io->start));
+
+    item_remove(io->it);
+    item_remove(io->nit);
+    mc_free(io);
+
+    if (__atomic_sub_fetch(&c->ext_nread, 1, __ATOMIC_ACQ_REL) == 0) {
+        thread_ext_done(c);
+    }
+}
+
+static void *
+ext_io_thread(void *arg)
+{
+    struct ext_io *io;
+
+    /* items are linked and put back on behalf of the dispatcher */
+    if (thread_stand_in(settings.num_workers) != MC_OK) {
+        exit(1);
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&ext.io_lock);
+        while ((io = STAILQ_FIRST(&ext.ioq)) == NULL) {
+            pthread_cond_wait(&ext.io_cond, &ext.io_lock);
+        }
+        STAILQ_REMOVE_HEAD(&ext.ioq, next);
+        pthread_mutex_unlock(&ext.io_lock);
+
+        ext_io(io);
+    }
+
+    return NULL;
+}
+
+static rstatus_t
+ext_wbuf_init(struct ext_wbuf *w)
+{
+    w->data = mc_alloc(EXT_PAGE_SIZE);
+    w->rec = mc_alloc(EXT_MAX_NRECORD * sizeof(*w->rec));
+    if (w->data == NULL || w->rec == NULL) {
+        return MC_ENOMEM;
+    }
+
+    w->nbyte = 0;
+    w->nrecord = 0;
+    memset(w->cancel, 0, sizeof(w->cancel));
+
+    return MC_OK;
+}
+
+/*
+ * Set up the extstore, starting over with an empty file, if one is set.
+ */
+rstatus_t
+ext_init(void)
+{
+    rstatus_t status;
+
+    if (settings.ext_file == NULL) {
+        return MC_OK;
+    }
+
+    ext.npage = (uint32_t)(settings.ext_size / EXT_PAGE_SIZE);
+    ASSERT(ext.npage >= EXT_MIN_NPAGE);
+
+    ext.fd = open(settings.ext_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (ext.fd < 0) {
+        log_error("open of ext file '%s' failed: %s", settings.ext_file,
+                  strerror(errno));
+        return MC_ERROR;
+    }
+
+    ext.page = mc_zalloc(ext.npage * sizeof(*ext.page));
+    if (ext.page == NULL) {
+        return MC_ENOMEM;
+    }
+
+    /* the first write moves on to the first page */
+    ext.wpage = ext.npage - 1;
+    ext.woff = EXT_PAGE_SIZE;
+
+    pthread_mutex_init(&ext.lock, NULL);
+    pthread_cond_init(&ext.wcond, NULL);
+    pthread_cond_init(&ext.ucond, NULL);
+
+    status = ext_wbuf_init(&ext.wbuf[0]);
+    if (status != MC_OK) {
+        return status;
+    }
+
+    status = ext_wbuf_init(&ext.wbuf[1]);
+    if (status != MC_OK) {
+        return status;
+    }
+
+    ext.fill = &ext.wbuf[0];
+    ext.flush = NULL;
+
+    pthread_mutex_init(&ext.io_lock, NULL);
+    pthread_cond_init(&ext.io_cond, NULL);
+    STAILQ_INIT(&ext.ioq);
+
+    log_debug(LOG_NOTICE, "ext file '%s' of %"PRIu32" pages of %d bytes",
+              settings.ext_file, ext.npage, EXT_PAGE_SIZE);
+
+    return MC_OK;
+}
+
+/*
+ * Start the writer and io threads of the extstore. Must be called once
+ * workers are set up.
+ */
+rstatus_t
+ext_start(void)
+{
+    pthread_t tid;
+    uint32_t i;
+    err_t err;
+
+    if (settings.ext_file == NULL) {
+        return MC_OK;
+    }
+
+    err = pthread_create(&tid, NULL, ext_write_thread, NULL);
+    if (err != 0) {
+        log_error("pthread create failed: %s", strerror(err));
+        return MC_ERROR;
+    }
+    pthread_detach(tid);
+
+    for (i = 0; i < EXT_IO_NTHREAD; i++) {
+        err = pthread_create(&tid, NULL, ext_io_thread, NULL);
+        if (err != 0) {
+            log_error("pthread create failed: %s", strerror(err));
+            return MC_ERROR;
+        }
+        pthread_detach(tid);
+    }
+
+    return MC_OK;
+}
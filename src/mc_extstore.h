@@ -0,0 +1,80 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MC_EXTSTORE_H_
+#define _MC_EXTSTORE_H_
+
+/*
+ * The extstore is a second tier of storage for items evicted from memory,
+ * in the file set with --ext-file, which is laid out as a ring of pages of
+ * EXT_PAGE_SIZE bytes each.
+ *
+ * An item evicted while still live has its data copied into a write buffer
+ * by ext_evict(). A writer thread appends the data of a full buffer, or of
+ * one left pending for a second, to the current page of the file, or to
+ * the next one if it does not fit, and then links for each item a stub of
+ * it under its key. A stub is an item with ITEM_EXT set, whose data is the
+ * location of the item data in the file. The write buffers are two, one
+ * being filled while the other is written; items evicted while both are
+ * taken are dropped.
+ *
+ * A get that hits a stub allocates an item of the size of the item data,
+ * and queues its read to a pool of io threads, which pread it from the
+ * file. The response is built as for any other item, and is sent once all
+ * reads of the get are done, without blocking the worker in the meantime.
+ * An item read back takes the place of its stub in memory.
+ *
+ * Reusing a page bumps its generation, and stubs to the data of a former
+ * generation are taken as misses. Pages are pinned by the reads in flight,
+ * which the writer waits out before writing over a page.
+ */
+#define EXT_PAGE_SIZE       (4 * MB)
+#define EXT_MIN_NPAGE       2
+#define EXT_MIN_NBYTE       256     /* smallest item data written out */
+#define EXT_MAX_NRECORD     (EXT_PAGE_SIZE / EXT_MIN_NBYTE)
+#define EXT_IO_NTHREAD      4
+#define EXT_CANCEL_NBIT     (1 << 16)
+
+/* data of a stub */
+struct ext_loc {
+    uint32_t page;          /* page of item data */
+    uint32_t gen;           /* generation of page when written */
+    uint32_t offset;        /* offset of item data in page */
+    uint32_t nbyte;         /* item data size */
+};
+
+rstatus_t ext_init(void);
+rstatus_t ext_start(void);
+
+void ext_evict(struct item *it);
+void ext_cancel(uint32_t hv);
+bool ext_cancelled(uint32_t hv);
+struct item *ext_read(struct conn *c, struct item *it);
+
+#endif
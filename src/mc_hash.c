@@ -28,9 +28,10 @@
  */
 
 /*
- * Hash table
+ * Hash functions
  *
- * The hash function used here is by Bob Jenkins, 1996:
+ * The hash function used for keys is picked at startup among lookup3,
+ * crc32c and xxh32. The default, lookup3, is by Bob Jenkins, 1996:
  *   <http://burtleburtle.net/bob/hash/doobs.html>
  *   "By Bob Jenkins, 1996.  bob_jenkins@burtleburtle.net.
  *   You may use this code any way you wish, private, educational,
@@ -148,7 +149,7 @@ and these came close:
 }
 
 #if HASH_LITTLE_ENDIAN == 1
-uint32_t hash(
+uint32_t hash_lookup3(
   const void *key,       /* the key to hash */
   size_t      length,    /* length of the key */
   const uint32_t    initval)   /* initval */
@@ -329,7 +330,7 @@ uint32_t hash(
  * from hashlittle() on all machines.  hashbig() takes advantage of
  * big-endian byte ordering.
  */
-uint32_t hash( const void *key, size_t length, const uint32_t initval)
+uint32_t hash_lookup3( const void *key, size_t length, const uint32_t initval)
 {
   uint32_t a,b,c;
   union { const void *ptr; size_t i; } u; /* to cast key to (size_t) happily */
@@ -455,3 +456,316 @@ uint32_t hash( const void *key, size_t length, const uint32_t initval)
 #else /* HASH_XXX_ENDIAN == 1 */
 #error Must define HASH_BIG_ENDIAN or HASH_LITTLE_ENDIAN
 #endif /* HASH_XXX_ENDIAN == 1 */
+
+/*
+ * crc32c using the sse4.2 crc32 instruction, 8 bytes at a time. The
+ * instruction is only used when the cpu advertises sse4.2, so the rest
+ * of twemcache can still be built for older x86-64 targets.
+ */
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+
+#define HASH_HAVE_CRC32C 1
+
+__attribute__((target("sse4.2")))
+uint32_t
+hash_crc32c(const void *key, size_t length, const uint32_t initval)
+{
+    const uint8_t *p = key;
+    uint64_t crc = ~initval, v;
+    uint32_t w;
+
+    for (; length >= 8; length -= 8, p += 8) {
+        memcpy(&v, p, sizeof(v));
+        crc = _mm_crc32_u64(crc, v);
+    }
+
+    if (length >= 4) {
+        memcpy(&w, p, sizeof(w));
+        crc = _mm_crc32_u32((uint32_t)crc, w);
+        length -= 4;
+        p += 4;
+    }
+
+    for (; length > 0; length--, p++) {
+        crc = _mm_crc32_u8((uint32_t)crc, *p);
+    }
+
+    return ~(uint32_t)crc;
+}
+#else
+# define HASH_HAVE_CRC32C 0
+#endif
+
+/*
+ * xxHash, 32-bit variant, by Yann Collet:
+ *   <https://github.com/Cyan4973/xxHash>
+ */
+#define XXH32_P1    2654435761U
+#define XXH32_P2    2246822519U
+#define XXH32_P3    3266489917U
+#define XXH32_P4    668265263U
+#define XXH32_P5    374761393U
+
+static inline uint32_t
+xxh32_read(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+#if HASH_BIG_ENDIAN == 1
+    v = __builtin_bswap32(v);
+#endif
+
+    return v;
+}
+
+static inline uint32_t
+xxh32_round(uint32_t acc, uint32_t v)
+{
+    acc += v * XXH32_P2;
+    acc = rot(acc, 13);
+    acc *= XXH32_P1;
+
+    return acc;
+}
+
+uint32_t
+hash_xxh32(const void *key, size_t length, const uint32_t initval)
+{
+    const uint8_t *p = key, *end = p + length;
+    uint32_t h;
+
+    if (length >= 16) {
+        uint32_t v1 = initval + XXH32_P1 + XXH32_P2;
+        uint32_t v2 = initval + XXH32_P2;
+        uint32_t v3 = initval;
+        uint32_t v4 = initval - XXH32_P1;
+
+        do {
+            v1 = xxh32_round(v1, xxh32_read(p));
+            v2 = xxh32_round(v2, xxh32_read(p + 4));
+            v3 = xxh32_round(v3, xxh32_read(p + 8));
+            v4 = xxh32_round(v4, xxh32_read(p + 12));
+            p += 16;
+        } while (p <= end - 16);
+
+        h = rot(v1, 1) + rot(v2, 7) + rot(v3, 12) + rot(v4, 18);
+    } else {
+        h = initval + XXH32_P5;
+    }
+
+    h += (uint32_t)length;
+
+    for (; p + 4 <= end; p += 4) {
+        h += xxh32_read(p) * XXH32_P3;
+        h = rot(h, 17) * XXH32_P4;
+    }
+
+    for (; p < end; p++) {
+        h += (*p) * XXH32_P5;
+        h = rot(h, 11) * XXH32_P1;
+    }
+
+    h ^= h >> 15;
+    h *= XXH32_P2;
+    h ^= h >> 13;
+    h *= XXH32_P3;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static struct {
+    const char *name;
+    hash_t     func;
+} hash_funcs[] = {
+    { "lookup3", hash_lookup3 },
+#if HASH_HAVE_CRC32C == 1
+    { "crc32c",  hash_crc32c },
+#else
+    { "crc32c",  NULL },
+#endif
+    { "xxh32",   hash_xxh32 },
+};
+
+hash_t hash = hash_lookup3;
+
+const char *
+hash_name(hash_type_t type)
+{
+    ASSERT(type < HASH_SENTINEL);
+
+    return hash_funcs[type].name;
+}
+
+rstatus_t
+hash_parse(const char *name, hash_type_t *type)
+{
+    uint32_t i;
+
+    for (i = 0; i < NELEMS(hash_funcs); i++) {
+        if (strcmp(name, hash_funcs[i].name) == 0) {
+            *type = (hash_type_t)i;
+            return MC_OK;
+        }
+    }
+
+    return MC_ERROR;
+}
+
+static bool
+hash_supported(hash_type_t type)
+{
+    if (type >= HASH_SENTINEL || hash_funcs[type].func == NULL) {
+        return false;
+    }
+
+#if HASH_HAVE_CRC32C == 1
+    if (type == HASH_CRC32C && !__builtin_cpu_supports("sse4.2")) {
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+/*
+ * Pick the hash function used for every key. This must happen before
+ * any key is hashed, as items hashed with different functions can not
+ * find each other.
+ */
+rstatus_t
+hash_init(hash_type_t type)
+{
+    ASSERT(type < HASH_SENTINEL);
+
+    if (!hash_supported(type)) {
+        log_error("hash function '%s' is not supported on this cpu",
+                  hash_name(type));
+        return MC_ERROR;
+    }
+
+    hash = hash_funcs[type].func;
+
+    log_debug(LOG_INFO, "using hash function '%s'", hash_name(type));
+
+    return MC_OK;
+}
+
+/*
+ * Key lengths seen in deployments: short counter and id keys, namespaced
+ * object keys that make up most of the traffic, long composite keys and
+ * keys close to the protocol limit of 250 bytes.
+ */
+#define HASH_BENCH_NKEY     4096
+#define HASH_BENCH_NHASH    (1 << 22)
+
+static struct {
+    const char *name;
+    uint32_t   min;        /* min key length */
+    uint32_t   max;        /* max key length */
+} hash_bench_dists[] = {
+    { "short",  4,   16  },
+    { "medium", 16,  48  },
+    { "long",   48,  128 },
+    { "max",    200, 250 },
+};
+
+static uint32_t
+hash_bench_rand(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+
+    return x;
+}
+
+static double
+hash_bench_run(hash_t func, const char *buf, const uint32_t *offset,
+               const uint8_t *len)
+{
+    struct timespec start, end;
+    volatile uint32_t sink;
+    uint32_t i, h;
+
+    h = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < HASH_BENCH_NHASH; i++) {
+        uint32_t k = i % HASH_BENCH_NKEY;
+
+        h ^= func(buf + offset[k], len[k], 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    sink = h;
+    (void)sink;
+
+    return ((end.tv_sec - start.tv_sec) * 1e9 +
+            (end.tv_nsec - start.tv_nsec)) / HASH_BENCH_NHASH;
+}
+
+/*
+ * Time every hash function over keys drawn from each key length
+ * distribution, and print the average cost of hashing one key.
+ */
+void
+hash_benchmark(void)
+{
+    static const char *prefix[] = { "user:", "tweet:", "tl:home:", "sess_" };
+    static const char alnum[] =
+        "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    uint32_t offset[HASH_BENCH_NKEY];
+    uint8_t len[HASH_BENCH_NKEY];
+    char *buf;
+    uint32_t d, i, j, state;
+
+    buf = mc_alloc(HASH_BENCH_NKEY * KEY_MAX_LEN);
+    if (buf == NULL) {
+        log_stderr("hash benchmark failed: %s", strerror(errno));
+        return;
+    }
+
+    log_stderr("%-14s %12s %12s %12s", "key length", hash_funcs[HASH_LOOKUP3].name,
+               hash_funcs[HASH_CRC32C].name, hash_funcs[HASH_XXH32].name);
+
+    for (d = 0; d < NELEMS(hash_bench_dists); d++) {
+        char line[LOG_MAX_LEN];
+        int n;
+
+        state = 2463534242U;
+        for (i = 0; i < HASH_BENCH_NKEY; i++) {
+            const char *p = prefix[hash_bench_rand(&state) % NELEMS(prefix)];
+            uint32_t plen = strlen(p);
+
+            offset[i] = i * KEY_MAX_LEN;
+            len[i] = hash_bench_dists[d].min + hash_bench_rand(&state) %
+                     (hash_bench_dists[d].max - hash_bench_dists[d].min + 1);
+            plen = MIN(plen, len[i]);
+            memcpy(buf + offset[i], p, plen);
+            for (j = plen; j < len[i]; j++) {
+                buf[offset[i] + j] = alnum[hash_bench_rand(&state) %
+                                           (sizeof(alnum) - 1)];
+            }
+        }
+
+        n = mc_scnprintf(line, sizeof(line), "%-7s%3"PRIu32"-%-3"PRIu32,
+                         hash_bench_dists[d].name, hash_bench_dists[d].min,
+                         hash_bench_dists[d].max);
+        for (i = 0; i < NELEMS(hash_funcs); i++) {
+            if (!hash_supported((hash_type_t)i)) {
+                n += mc_scnprintf(line + n, sizeof(line) - n, " %12s", "-");
+                continue;
+            }
+            n += mc_scnprintf(line + n, sizeof(line) - n, " %9.2f ns",
+                              hash_bench_run(hash_funcs[i].func, buf, offset,
+                                             len));
+        }
+        log_stderr("%s", line);
+    }
+
+    mc_free(buf);
+}
@@ -30,6 +30,25 @@
 #ifndef _MC_HASH_H_
 #define _MC_HASH_H_
 
-uint32_t hash(const void *key, size_t length, const uint32_t initval);
+typedef enum hash_type {
+    HASH_LOOKUP3,           /* Bob Jenkins' lookup3 */
+    HASH_CRC32C,            /* crc32c using the sse4.2 instruction */
+    HASH_XXH32,             /* Yann Collet's xxHash, 32-bit variant */
+    HASH_SENTINEL
+} hash_type_t;
+
+typedef uint32_t (*hash_t)(const void *key, size_t length, const uint32_t initval);
+
+/* hash function picked at startup, and used for every key */
+extern hash_t hash;
+
+uint32_t hash_lookup3(const void *key, size_t length, const uint32_t initval);
+uint32_t hash_crc32c(const void *key, size_t length, const uint32_t initval);
+uint32_t hash_xxh32(const void *key, size_t length, const uint32_t initval);
+
+const char *hash_name(hash_type_t type);
+rstatus_t hash_parse(const char *name, hash_type_t *type);
+rstatus_t hash_init(hash_type_t type);
+void hash_benchmark(void);
 
 #endif
@@ -6,6 +6,7 @@ extern struct settings settings;
 
 bool hotkey_realloc = false;
 static uint64_t hotkey_counter;
+static pthread_mutex_t hotkey_lock = PTHREAD_MUTEX_INITIALIZER; /* lock protecting key window and map */
 
 #define HOTKEY_WINDOW_SIZE HOTKEY_REDLINE_QPS * HOTKEY_TIMEFRAME / 1000 / HOTKEY_SAMPLE_RATE
 
@@ -63,73 +64,95 @@ _get_bandwidth(size_t count, size_t size, size_t usec)
     return count * size * hotkey_sample_rate * 1000000 / usec;
 }
 
-item_control_flags_t
-hotkey_sample(const char *key, size_t klen, size_t vlen)
+static item_control_flags_t
+_hotkey_sample(const char *key, size_t klen, size_t vlen)
 {
-    if (++hotkey_counter % hotkey_sample_rate == 0) {
-        /* sample this key */
-        size_t count;
-        uint64_t qps, bw;
-        uint64_t oldest_time, cur_time, time_diff; /* timestamps in usec */
-
-        /* get current time, push key into window with timestamp, then obtain
-           the count of that key */
-        ASSERT(!key_window_full());
-        cur_time = (time_now() * 1000000) + time_now_usec();
-        count = key_window_push(key, klen, cur_time);
-        stats_thread_incr(hotkey_sampled);
-
-        if (key_window_full()) {
-            /* calculate qps using window size, and the amount of time it took to
-               fill the window. */
-            oldest_time = key_window_pop();
-            /* the ternary conditional statement is here to prevent any divide by 0 errs */
-            time_diff = (cur_time - oldest_time > 0) ? cur_time - oldest_time : 1;
-            qps = hotkey_qps_numerator / time_diff;
-            bw = _get_bandwidth(count, klen + vlen, time_diff);
-
-            log_debug(LOG_DEBUG, "count of key %.*s: %d qps: %d bandwidth: %d",
-                    klen, key, count, qps, bw);
-
-            /* signal QPS hotkey if qps >= redline and key count >= threshold */
-            if (qps >= hotkey_redline_qps && count >= __atomic_load_n(&hotkey_threshold,
-                            __ATOMIC_RELAXED)) {
-                log_debug(LOG_INFO, "frequency hotkey detected: %.*s", klen, key);
-                stats_thread_incr(hotkey_qps);
-                return ITEM_HOT_QPS;
-            }
-
-            /* signal bandwidth hotkey if bw consumption >= threshold */
-            if (bw >= __atomic_load_n(&hotkey_bw_threshold, __ATOMIC_RELAXED)) {
-                log_debug(LOG_INFO, "bandwidth hotkey detected: %.*s", klen, key);
-                stats_thread_incr(hotkey_bw);
-                return ITEM_HOT_BW;
-            }
+    /* sample this key */
+    size_t count;
+    uint64_t qps, bw;
+    uint64_t oldest_time, cur_time, time_diff; /* timestamps in usec */
+
+    /* get current time, push key into window with timestamp, then obtain
+       the count of that key */
+    ASSERT(!key_window_full());
+    cur_time = (time_now() * 1000000) + time_now_usec();
+    count = key_window_push(key, klen, cur_time);
+    stats_thread_incr(hotkey_sampled);
+
+    if (key_window_full()) {
+        /* calculate qps using window size, and the amount of time it took to
+           fill the window. */
+        oldest_time = key_window_pop();
+        /* the ternary conditional statement is here to prevent any divide by 0 errs */
+        time_diff = (cur_time - oldest_time > 0) ? cur_time - oldest_time : 1;
+        qps = hotkey_qps_numerator / time_diff;
+        bw = _get_bandwidth(count, klen + vlen, time_diff);
+
+        log_debug(LOG_DEBUG, "count of key %.*s: %d qps: %d bandwidth: %d",
+                klen, key, count, qps, bw);
+
+        /* signal QPS hotkey if qps >= redline and key count >= threshold */
+        if (qps >= hotkey_redline_qps && count >= __atomic_load_n(&hotkey_threshold,
+                        __ATOMIC_RELAXED)) {
+            log_debug(LOG_INFO, "frequency hotkey detected: %.*s", klen, key);
+            stats_thread_incr(hotkey_qps);
+            return ITEM_HOT_QPS;
+        }
+
+        /* signal bandwidth hotkey if bw consumption >= threshold */
+        if (bw >= __atomic_load_n(&hotkey_bw_threshold, __ATOMIC_RELAXED)) {
+            log_debug(LOG_INFO, "bandwidth hotkey detected: %.*s", klen, key);
+            stats_thread_incr(hotkey_bw);
+            return ITEM_HOT_BW;
         }
     }
 
     return 0;
 }
 
+/*
+ * Samples are taken from all workers, and the key window and the key count
+ * map are shared, so sampling is serialized by hotkey_lock
+ */
+item_control_flags_t
+hotkey_sample(const char *key, size_t klen, size_t vlen)
+{
+    item_control_flags_t ret;
+
+    if (__atomic_add_fetch(&hotkey_counter, 1, __ATOMIC_RELAXED) %
+        hotkey_sample_rate != 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&hotkey_lock);
+    ret = _hotkey_sample(key, klen, vlen);
+    pthread_mutex_unlock(&hotkey_lock);
+
+    return ret;
+}
+
 static inline rstatus_t
 _hotkey_realloc(void)
 {
     rstatus_t status;
 
+    pthread_mutex_lock(&hotkey_lock);
+
     hotkey_window_size = hotkey_redline_qps * hotkey_timeframe / 1000 / hotkey_sample_rate;
     hotkey_qps_numerator = hotkey_window_size * hotkey_sample_rate * 1000000;
 
     key_window_deinit();
     if ((status = key_window_init(hotkey_window_size)) != MC_OK) {
-        return status;
+        goto done;
     }
 
     kc_map_deinit();
-    if ((status = kc_map_init(hotkey_window_size)) != MC_OK) {
-        return status;
-    }
+    status = kc_map_init(hotkey_window_size);
 
-    return MC_OK;
+done:
+    pthread_mutex_unlock(&hotkey_lock);
+
+    return status;
 }
 
 rstatus_t
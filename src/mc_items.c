@@ -33,6 +33,8 @@
 #include <mc_core.h>
 
 extern struct settings settings;
+extern struct thread_worker *threads;
+extern struct thread_key keys;
 
 /*
  * We only reposition items in the lru q if they haven't been
@@ -43,12 +45,93 @@ extern struct settings settings;
 
 #define ITEM_LRUQ_MAX_TRIES     50
 
+#define ITEM_ACCESS_NENTRY      4096 /* # accesses an access log holds */
+#define ITEM_ACCESS_NEVICT      64   /* # accesses an eviction applies */
+
 /* 2MB is the maximum response size for 'cachedump' command */
 #define ITEM_CACHEDUMP_MEMLIMIT (2 * MB)
 
-pthread_mutex_t cache_lock;                     /* lock protecting lru q and hash */
-struct item_tqh item_lruq[SLABCLASS_MAX_IDS];   /* lru q of items */
-static uint64_t cas_id;                         /* unique cas id */
+/*
+ * Locking in the item layer is striped to let workers operating on
+ * different keys proceed in parallel. Locks, from outermost to innermost,
+ * are always acquired in the following order:
+ *
+ *  1. item_stripes[], one of 2^item_lock_power stripes selected by the key
+ *     hash. A stripe protects the hash chains of all keys that map onto
+ *     it, as well as the linked status and refcount of their items;
+ *  2. slab_lock, protecting slabclass and heapinfo (see mc_slabs.c), or
+ *     seg_lock with the segment engine (see mc_segs.c);
+ *  3. item_lruq_locks[], one per slab class, protecting that class's lru q.
+ *
+ * A thread never blocks on a stripe while it holds a lock further down the
+ * hierarchy. Paths that walk the lru q or a slab and need to lock the stripe
+ * of an arbitrary item (eviction, flush) only ever trylock it and skip the
+ * item on contention. Stripes are recursive, so a thread that already holds
+ * a stripe can still reclaim an item that happens to map onto that stripe.
+ *
+ * The number of stripes never exceeds the number of hash buckets, so all
+ * items in a hash bucket are covered by the same stripe (see mc_assoc.c)
+ *
+ * The lock of an access log (see item_touch) sits above the stripes, and is
+ * only ever trylocked.
+ *
+ * Gets don't take the stripe unless they have to (see item_get_lockless).
+ * Every stripe carries a sequence number that is odd while the stripe is
+ * held and changes whenever it is released, so a lockless reader can tell
+ * whether the hash chains of a stripe could have changed under it.
+ */
+struct item_stripe {
+    pthread_mutex_t lock;  /* recursive lock */
+    uint32_t        depth; /* # times the lock is held by its owner */
+    uint32_t        seq;   /* sequence number, odd while the lock is held */
+};
+
+static struct item_stripe *item_stripes;                /* striped locks protecting hash and items */
+static uint32_t item_lock_power;                        /* # item lock stripes = 2^item_lock_power */
+static pthread_mutex_t item_lruq_locks[SLABCLASS_MAX_IDS];/* locks protecting lru q */
+struct item_tqh item_lruq[SLABCLASS_MAX_IDS];           /* lru q of items */
+static uint64_t cas_id;                                 /* unique cas id */
+#if MC_COMPACT_ITEMS == 1
+uint32_t item_link_shift;                               /* # bits of item offset in a link */
+#endif
+
+#define ITEM_LOCK_IDX(_hv)  ((_hv) & HASHMASK(item_lock_power))
+
+#define ITEM_GET_MULTI_BATCH    16  /* # keys looked up at once by item_get_multi */
+
+/*
+ * The refcount, flags and slab class id of an item share a word, which
+ * is updated with compare-and-swap. This lets a lockless reader take a
+ * reference on an item only for as long as the item is linked, while
+ * whoever unlinks the item under its stripe learns atomically whether a
+ * reader got there first.
+ */
+union item_state {
+    uint32_t word;
+    struct {
+        uint16_t refcount;
+        uint8_t  flags;
+        uint8_t  id;
+    } f;
+};
+
+/*
+ * State of a thread relinking the items of a slab heap left by a previous
+ * run (see slab_restore). The heap may be mapped elsewhere than it was,
+ * so links held by its items are translated by delta, and only trusted
+ * once checked. Relinked items are queued and accounted for by the thread,
+ * and handed over once it is done.
+ */
+struct item_restore {
+    intptr_t        delta;                         /* heap address now - then */
+    uint32_t        nslab;                         /* # slab restored */
+    uint64_t        nitem;                         /* # item relinked */
+    uint64_t        cas;                           /* largest cas relinked */
+    struct item_tqh lruq[SLABCLASS_MAX_IDS];       /* items relinked, by class */
+    uint64_t        nitem_id[SLABCLASS_MAX_IDS];   /* # items relinked, by class */
+    uint64_t        nbyte[SLABCLASS_MAX_IDS];      /* their bytes, by class */
+    uint64_t        nbyte_value[SLABCLASS_MAX_IDS];/* their value bytes, by class */
+};
 
 /*
  * Returns the next cas id for a new item. Minimum cas value
@@ -58,12 +141,106 @@ static uint64_t
 item_next_cas(void)
 {
     if (settings.use_cas) {
-        return ++cas_id;
+        return __atomic_add_fetch(&cas_id, 1, __ATOMIC_RELAXED);
     }
 
     return 0ULL;
 }
 
+/*
+ * Bump the sequence number of a stripe that was just acquired by a thread
+ * not already holding it. The release fence keeps the writes made under
+ * the stripe from becoming visible before the sequence number turns odd.
+ */
+static void
+item_stripe_acquired(struct item_stripe *stripe)
+{
+    if (stripe->depth++ == 0) {
+        __atomic_store_n(&stripe->seq, stripe->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+}
+
+void
+item_lock(uint32_t hv)
+{
+    struct item_stripe *stripe = &item_stripes[ITEM_LOCK_IDX(hv)];
+
+    pthread_mutex_lock(&stripe->lock);
+    item_stripe_acquired(stripe);
+}
+
+void
+item_unlock(uint32_t hv)
+{
+    struct item_stripe *stripe = &item_stripes[ITEM_LOCK_IDX(hv)];
+
+    ASSERT(stripe->depth > 0);
+
+    if (--stripe->depth == 0) {
+        __atomic_store_n(&stripe->seq, stripe->seq + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+bool
+item_trylock(uint32_t hv)
+{
+    struct item_stripe *stripe = &item_stripes[ITEM_LOCK_IDX(hv)];
+
+    if (pthread_mutex_trylock(&stripe->lock) != 0) {
+        return false;
+    }
+    item_stripe_acquired(stripe);
+
+    return true;
+}
+
+/*
+ * Sample the sequence number of a stripe before a lockless read, which
+ * can only proceed if it is even, and validate the read against it.
+ */
+static uint32_t
+item_stripe_seq(uint32_t hv)
+{
+    return __atomic_load_n(&item_stripes[ITEM_LOCK_IDX(hv)].seq,
+                           __ATOMIC_ACQUIRE);
+}
+
+static bool
+item_stripe_unchanged(uint32_t hv, uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return (__atomic_load_n(&item_stripes[ITEM_LOCK_IDX(hv)].seq,
+                            __ATOMIC_RELAXED) == seq);
+}
+
+/*
+ * Acquire all item lock stripes in ascending order. This is only needed
+ * to change the layout of the hash table and must be called without any
+ * other lock from the item or slab layer held
+ */
+void
+item_lock_all(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < HASHSIZE(item_lock_power); i++) {
+        item_lock(i);
+    }
+}
+
+void
+item_unlock_all(void)
+{
+    uint32_t i;
+
+    for (i = HASHSIZE(item_lock_power); i > 0; i--) {
+        item_unlock(i - 1);
+    }
+}
+
 static bool
 item_expired(struct item *it)
 {
@@ -72,20 +249,81 @@ item_expired(struct item *it)
     return (it->exptime > 0 && it->exptime < time_now()) ? true : false;
 }
 
-void
+static bool
+item_get_expired(struct item *it)
+{
+    return (it->exptime != 0 && it->exptime <= time_now());
+}
+
+static bool
+item_get_flushed(struct item *it)
+{
+    return (settings.oldest_live != 0 && settings.oldest_live <= time_now() &&
+            it->atime <= settings.oldest_live);
+}
+
+/*
+ * Return true if a get would not find an item, as it either expired or
+ * was flushed.
+ */
+bool
+item_stale(struct item *it)
+{
+    return item_get_expired(it) || item_get_flushed(it);
+}
+
+rstatus_t
 item_init(void)
 {
-    uint8_t i;
+    pthread_mutexattr_t attr;
+    uint32_t i, nlock, hash_power;
 
     log_debug(LOG_DEBUG, "item hdr size %d", ITEM_HDR_SIZE);
 
-    pthread_mutex_init(&cache_lock, NULL);
+#if MC_COMPACT_ITEMS == 1
+    /* a link holds the offset of an item, and the index of its slab */
+    for (item_link_shift = 0;
+         ((size_t)1 << item_link_shift) * MC_ALIGNMENT < settings.slab_size;
+         item_link_shift++) {
+    }
+    if (settings.maxbytes / settings.slab_size >
+        ((size_t)1 << (32 - item_link_shift))) {
+        log_error("compact items cannot address more than %zu slabs of %zu "
+                  "bytes", (size_t)1 << (32 - item_link_shift),
+                  settings.slab_size);
+        return MC_ERROR;
+    }
+#endif
+
+    /* stripes must not outnumber the buckets of the initial hash table */
+    hash_power = settings.hash_power > 0 ? settings.hash_power : HASH_DEFAULT_POWER;
+    item_lock_power = MIN(settings.lock_power, hash_power);
+    nlock = HASHSIZE(item_lock_power);
+
+    item_stripes = mc_zalloc(sizeof(*item_stripes) * nlock);
+    if (item_stripes == NULL) {
+        log_error("create of %"PRIu32" item locks failed: %s", nlock,
+                  strerror(errno));
+        return MC_ENOMEM;
+    }
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    for (i = 0; i < nlock; i++) {
+        pthread_mutex_init(&item_stripes[i].lock, &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+
+    log_debug(LOG_INFO, "created %"PRIu32" item lock stripes", nlock);
 
     for (i = SLABCLASS_MIN_ID; i <= SLABCLASS_MAX_ID; i++) {
-        TAILQ_INIT(&item_lruq[i]);
+        pthread_mutex_init(&item_lruq_locks[i], NULL);
+        item_q_init(&item_lruq[i]);
     }
 
     cas_id = 0ULL;
+
+    return MC_OK;
 }
 
 void
@@ -93,6 +331,18 @@ item_deinit(void)
 {
 }
 
+void
+item_lruq_lock(uint8_t id)
+{
+    pthread_mutex_lock(&item_lruq_locks[id]);
+}
+
+void
+item_lruq_unlock(uint8_t id)
+{
+    pthread_mutex_unlock(&item_lruq_locks[id]);
+}
+
 /*
  * Get start location of item payload
  */
@@ -115,6 +365,191 @@ item_data(struct item *it)
     return data;
 }
 
+/*
+ * Room for data in a chunk of the largest slab class
+ */
+static size_t
+item_chunk_nbyte(void)
+{
+    return settings.max_chunk_size - ITEM_HDR_SIZE - 1;
+}
+
+/*
+ * Whether an item with a given key and data size is too large for the
+ * largest item chunk, and is chunked.
+ */
+static bool
+item_needs_chunks(uint8_t nkey, uint32_t nbyte)
+{
+    return item_ntotal(nkey, nbyte, settings.use_cas) > settings.max_chunk_size;
+}
+
+/*
+ * Number of chunks to spread nbyte bytes of data and the trailing CRLF over
+ */
+static uint32_t
+item_nbyte_2_nchunk(uint32_t nbyte)
+{
+    size_t nchunk_byte = item_chunk_nbyte();
+
+    return (uint32_t)((nbyte + CRLF_LEN + nchunk_byte - 1) / nchunk_byte);
+}
+
+uint32_t
+item_nchunk(struct item *it)
+{
+    ASSERT(item_is_chunked(it));
+
+    return item_nbyte_2_nchunk(it->nbyte);
+}
+
+/*
+ * Get the idx^th chunk of a chunked item, or of one being allocated. Links
+ * to chunks are not aligned within the item, so they are copied in and out.
+ */
+struct item *
+item_chunk(struct item *it, uint32_t idx)
+{
+    item_link_t link;
+
+    memcpy(&link, item_data(it) + idx * sizeof(link), sizeof(link));
+
+    return item_link_2_item(link);
+}
+
+static void
+item_set_chunk(struct item *it, uint32_t idx, struct item *chunk)
+{
+    item_link_t link = item_2_link(chunk);
+
+    memcpy(item_data(it) + idx * sizeof(link), &link, sizeof(link));
+}
+
+/*
+ * Get the idx^th span of contiguous memory holding item data, along with
+ * its size in nbyte, or NULL and 0 past the last span. Data of an
+ * unchunked item is a single span, that of a chunked item is a span per
+ * chunk. Spans include the trailing CRLF, except for right-aligned items
+ * which have none.
+ */
+char *
+item_data_span(struct item *it, uint32_t idx, uint32_t *nbyte)
+{
+    struct item *chunk;
+
+    *nbyte = 0;
+
+    if (!item_is_chunked(it)) {
+        if (idx > 0) {
+            return NULL;
+        }
+
+        *nbyte = item_is_raligned(it) ? it->nbyte : it->nbyte + CRLF_LEN;
+
+        return item_data(it);
+    }
+
+    if (idx >= item_nchunk(it)) {
+        return NULL;
+    }
+
+    chunk = item_chunk(it, idx);
+    *nbyte = chunk->nbyte;
+
+    return item_data(chunk);
+}
+
+/*
+ * Copy nbyte bytes of item data starting at offset into buf, across spans.
+ */
+void
+item_data_read(struct item *it, uint32_t offset, char *buf, uint32_t nbyte)
+{
+    uint32_t idx, len, n;
+    char *data;
+
+    for (idx = 0; nbyte > 0; idx++) {
+        data = item_data_span(it, idx, &len);
+        ASSERT(data != NULL);
+
+        if (offset >= len) {
+            offset -= len;
+            continue;
+        }
+
+        n = MIN(len - offset, nbyte);
+        memcpy(buf, data + offset, n);
+        buf += n;
+        nbyte -= n;
+        offset = 0;
+    }
+}
+
+/*
+ * Copy nbyte bytes from buf into item data starting at offset, across spans.
+ */
+static void
+item_data_write(struct item *it, uint32_t offset, const char *buf,
+                uint32_t nbyte)
+{
+    uint32_t idx, len, n;
+    char *data;
+
+    for (idx = 0; nbyte > 0; idx++) {
+        data = item_data_span(it, idx, &len);
+        ASSERT(data != NULL);
+
+        if (offset >= len) {
+            offset -= len;
+            continue;
+        }
+
+        n = MIN(len - offset, nbyte);
+        memcpy(data + offset, buf, n);
+        buf += n;
+        nbyte -= n;
+        offset = 0;
+    }
+}
+
+/*
+ * Copy all data of item it into item nit, starting at offset.
+ */
+static void
+item_data_copy(struct item *nit, uint32_t offset, struct item *it)
+{
+    uint32_t idx, len, nbyte;
+    char *data;
+
+    for (idx = 0, nbyte = it->nbyte; nbyte > 0; idx++) {
+        data = item_data_span(it, idx, &len);
+        ASSERT(data != NULL);
+
+        len = MIN(len, nbyte);
+        item_data_write(nit, offset, data, len);
+        offset += len;
+        nbyte -= len;
+    }
+}
+
+#if MC_COMPACT_ITEMS == 1
+/*
+ * Get the link to this item, see struct item.
+ */
+item_link_t
+item_2_link(struct item *it)
+{
+    if (it == NULL) {
+        return 0;
+    }
+
+    ASSERT(it->offset % MC_ALIGNMENT == 0);
+
+    return (item_2_slab(it)->sid << item_link_shift) |
+           (it->offset / MC_ALIGNMENT);
+}
+#endif
+
 /*
  * Get the slab that contains this item.
  */
@@ -133,27 +568,117 @@ item_2_slab(struct item *it)
     return slab;
 }
 
+/*
+ * Item refcount is protected by the stripe of the item key, or by the
+ * slab_lock for items that are handed out by the slab allocator and are
+ * not yet visible to anyone else. The only exception are lockless readers,
+ * who may raise the refcount of a linked item at any time, which is why
+ * the refcount is always updated atomically (see item_acquire_linked).
+ * The parent slab refcount is shared by items across all stripes and is
+ * updated atomically.
+ */
 static void
+item_add_refcount(struct item *it, int delta)
+{
+    union item_state old, new;
+
+    old.word = __atomic_load_n(&it->state, __ATOMIC_SEQ_CST);
+    do {
+        new = old;
+        new.f.refcount += delta;
+    } while (!__atomic_compare_exchange_n(&it->state, &old.word, new.word,
+                                          false, __ATOMIC_SEQ_CST,
+                                          __ATOMIC_SEQ_CST));
+}
+
+void
 item_acquire_refcount(struct item *it)
 {
-    ASSERT(pthread_mutex_trylock(&cache_lock) != 0);
     ASSERT(it->magic == ITEM_MAGIC);
 
-    it->refcount++;
+    item_add_refcount(it, 1);
     slab_acquire_refcount(item_2_slab(it));
 }
 
 static void
 item_release_refcount(struct item *it)
 {
-    ASSERT(pthread_mutex_trylock(&cache_lock) != 0);
     ASSERT(it->magic == ITEM_MAGIC);
     ASSERT(it->refcount > 0);
 
-    it->refcount--;
+    item_add_refcount(it, -1);
     slab_release_refcount(item_2_slab(it));
 }
 
+/*
+ * Take a reference on an item, as long as it is linked. This is how a
+ * lockless reader pins an item it found in the hash table.
+ */
+static bool
+item_acquire_linked(struct item *it)
+{
+    union item_state old, new;
+
+    old.word = __atomic_load_n(&it->state, __ATOMIC_SEQ_CST);
+    do {
+        if (!(old.f.flags & ITEM_LINKED)) {
+            return false;
+        }
+        new = old;
+        new.f.refcount++;
+    } while (!__atomic_compare_exchange_n(&it->state, &old.word, new.word,
+                                          false, __ATOMIC_SEQ_CST,
+                                          __ATOMIC_SEQ_CST));
+
+    slab_acquire_refcount(item_2_slab(it));
+
+    return true;
+}
+
+/*
+ * Clear the linked flag of an item and return its refcount at that very
+ * moment. Once unlinked, the refcount can only be raised by the holder of
+ * the stripe, so the returned value is stable for the caller.
+ */
+static uint16_t
+item_clear_linked(struct item *it)
+{
+    union item_state old, linked;
+
+    ASSERT(item_is_linked(it));
+
+    linked.word = 0;
+    linked.f.flags = ITEM_LINKED;
+    old.word = __atomic_fetch_and(&it->state, ~linked.word, __ATOMIC_SEQ_CST);
+
+    return old.f.refcount;
+}
+
+/*
+ * Clear the linked flag of an item, but only if nobody holds a reference
+ * on it.
+ */
+static bool
+item_clear_linked_unused(struct item *it)
+{
+    union item_state old, new;
+
+    ASSERT(item_is_linked(it));
+
+    old.word = __atomic_load_n(&it->state, __ATOMIC_SEQ_CST);
+    do {
+        if (old.f.refcount != 0) {
+            return false;
+        }
+        new = old;
+        new.f.flags &= ~ITEM_LINKED;
+    } while (!__atomic_compare_exchange_n(&it->state, &old.word, new.word,
+                                          false, __ATOMIC_SEQ_CST,
+                                          __ATOMIC_SEQ_CST));
+
+    return true;
+}
+
 void
 item_hdr_init(struct item *it, uint32_t offset, uint8_t id)
 {
@@ -166,22 +691,20 @@ item_hdr_init(struct item *it, uint32_t offset, uint8_t id)
     it->id = id;
     it->refcount = 0;
     it->flags = 0;
+    __atomic_store_n(&it->qflags, 0, __ATOMIC_RELAXED);
 }
 
 /*
- * Add an item to the tail of the lru q.
+ * Add an item to the lru q, where the eviction policy has it go.
  *
- * Lru q is sorted in ascending time order - oldest to most recent. So
- * enqueuing at item to the tail of the lru q requires us to update its
- * last access time atime.
+ * Lru q is sorted in ascending time order - oldest to most recent, or
+ * each of its segments is (see mc_policy.h). So enqueuing an item
+ * requires us to update its last access time atime.
  *
- * The allocated flag indicates whether the item being re-linked is a newly
- * allocated or not. This is useful for updating the slab lruq, which can
- * choose to update only when a new item has been allocated (write-only) or
- * the opposite (read-only), or on both occasions (access-based).
+ * The segment engine keeps no lru q, and only the stats are updated.
  */
 static void
-item_link_q(struct item *it, bool allocated)
+_item_link_q(struct item *it)
 {
     uint8_t id = it->id;
 
@@ -194,9 +717,9 @@ item_link_q(struct item *it, bool allocated)
               it->flags, it->id);
 
     it->atime = time_now();
-    TAILQ_INSERT_TAIL(&item_lruq[id], it, i_tqe);
-
-    slab_lruq_touch(item_2_slab(it), allocated);
+    if (settings.storage == STORAGE_SLAB) {
+        policy_link(it);
+    }
 
     stats_slab_incr(id, item_curr);
     stats_slab_incr_by(id, data_curr, item_size(it));
@@ -207,7 +730,7 @@ item_link_q(struct item *it, bool allocated)
  * Remove the item from the lru q
  */
 static void
-item_unlink_q(struct item *it)
+_item_unlink_q(struct item *it)
 {
     uint8_t id = it->id;
 
@@ -218,7 +741,9 @@ item_unlink_q(struct item *it)
               "%02x id %"PRId8"", it->nkey, item_key(it), it->offset,
               it->flags, it->id);
 
-    TAILQ_REMOVE(&item_lruq[id], it, i_tqe);
+    if (settings.storage == STORAGE_SLAB) {
+        policy_unlink(it);
+    }
 
     stats_slab_decr(id, item_curr);
     stats_slab_decr_by(id, data_curr, item_size(it));
@@ -226,56 +751,172 @@ item_unlink_q(struct item *it)
 }
 
 /*
- * Make an item with zero refcount available for reuse by unlinking
- * it from the lru q and hash.
+ * Lock the lru q and add the item to its tail.
  *
- * Don't free the item yet because that would make it unavailable
- * for reuse.
+ * The allocated flag indicates whether the item being re-linked is a newly
+ * allocated or not. This is useful for updating the slab lruq, which can
+ * choose to update only when a new item has been allocated (write-only) or
+ * the opposite (read-only), or on both occasions (access-based). The slab
+ * lruq is touched after the lru q lock is dropped, as the slab_lock sits
+ * above it in the lock hierarchy.
  */
-void
-item_reuse(struct item *it)
+static void
+item_link_q(struct item *it, bool allocated)
 {
-    ASSERT(pthread_mutex_trylock(&cache_lock) != 0);
-    ASSERT(it->magic == ITEM_MAGIC);
-    ASSERT(!item_is_slabbed(it));
-    ASSERT(item_is_linked(it));
-    ASSERT(it->refcount == 0);
+    item_lruq_lock(it->id);
+    _item_link_q(it);
+    item_lruq_unlock(it->id);
 
-    it->flags &= ~ITEM_LINKED;
+    if (settings.storage == STORAGE_SLAB) {
+        slab_lruq_touch(item_2_slab(it), allocated);
+    }
+}
 
-    assoc_delete(item_key(it), it->nkey);
-    item_unlink_q(it);
+static void
+item_unlink_q(struct item *it)
+{
+    item_lruq_lock(it->id);
+    _item_unlink_q(it);
+    item_lruq_unlock(it->id);
+}
+
+/*
+ * Make an item with zero refcount available for reuse by unlinking
+ * it from the lru q and hash. The caller must hold the stripe of the
+ * item key and the lru q lock of its slab class. Fails if a lockless
+ * reader got hold of the item.
+ *
+ * An item reused while still live is evicted, and handed to the second
+ * tier, if any, to keep a copy of. Stubs are not, as their data is there
+ * already.
+ *
+ * Don't free the item yet because that would make it unavailable
+ * for reuse.
+ */
+static bool
+_item_reuse(struct item *it)
+{
+    ASSERT(it->magic == ITEM_MAGIC);
+    ASSERT(!item_is_slabbed(it));
+    ASSERT(item_is_linked(it));
+
+    if (!item_clear_linked_unused(it)) {
+        return false;
+    }
+
+    if (!item_is_ext(it) && !item_get_expired(it) && !item_get_flushed(it)) {
+        policy_evict(it);
+        ext_evict(it);
+    }
+
+    assoc_delete(it);
+    _item_unlink_q(it);
 
     log_debug(LOG_VERB, "reuse %s it '%.*s' at offset %"PRIu32" with id "
               "%"PRIu8"", item_expired(it) ? "expired" : "evicted",
               it->nkey, item_key(it), it->offset, it->id);
+
+    return true;
+}
+
+/*
+ * Same as _item_reuse(), but only requires the caller to hold the stripe
+ * of the item key.
+ */
+bool
+item_reuse(struct item *it)
+{
+    bool reused;
+
+    item_lruq_lock(it->id);
+    reused = _item_reuse(it);
+    item_lruq_unlock(it->id);
+
+    return reused;
+}
+
+/*
+ * Move a linked item with zero refcount into the chunk nit of the same
+ * class, which the segment engine carved out for it. The caller must hold
+ * the stripe of the item key. The copy takes the place of the item in the
+ * hash table, and the item is left unlinked for the caller to free. Fails
+ * if a lockless reader got hold of the item.
+ */
+bool
+item_move(struct item *it, struct item *nit)
+{
+    uint32_t offset;
+
+    ASSERT(it->magic == ITEM_MAGIC);
+    ASSERT(item_is_linked(it));
+    ASSERT(nit->id == it->id);
+    ASSERT(nit->refcount == 0);
+
+    if (!item_clear_linked_unused(it)) {
+        return false;
+    }
+
+    assoc_delete(it);
+
+    offset = nit->offset;
+    memcpy(nit, it, slab_item_size(it->id));
+    nit->offset = offset;
+    nit->refcount = 0;
+    nit->flags = (it->flags & (ITEM_CAS | ITEM_RALIGN)) | ITEM_LINKED;
+
+    /* lockless readers must not find the item before it is complete */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    assoc_insert(nit);
+
+    log_debug(LOG_VERB, "move it '%.*s' at offset %"PRIu32" to offset "
+              "%"PRIu32" with id %"PRIu8"", it->nkey, item_key(it),
+              it->offset, nit->offset, it->id);
+
+    return true;
 }
 
 /*
- * Find an unused (unreferenced) item from lru q.
+ * Find an unused (unreferenced) item from lru q and reclaim it.
  *
- * First try to find an expired item from the lru Q of item's slab
- * class; if all items are unexpired, return the one that is the
- * least recently used.
+ * Unless evict is set, we only reclaim an item from the lru q of the
+ * given slab class if it has expired; otherwise we reclaim the item the
+ * eviction policy picks, the least recently used one with lru, whether it
+ * has expired or not.
  *
- * We bound the search for an expired item in lru q, by only
- * traversing the oldest ITEM_LRUQ_MAX_TRIES items.
+ * We bound the search in lru q, by only traversing the oldest
+ * ITEM_LRUQ_MAX_TRIES items. As the lru q lock sits below the stripes
+ * in the lock hierarchy, we only trylock the stripe of a candidate and
+ * move on to the next one if it is busy. The reclaimed item is returned
+ * refcounted, so that a slab eviction cannot claim it once its stripe
+ * is unlocked.
  */
 static struct item *
-item_get_from_lruq(uint8_t id)
+item_get_from_lruq(uint8_t id, bool evict)
 {
-    struct item *it;  /* expired item */
-    struct item *uit; /* unexpired item */
-    uint32_t tries;
+    struct item *it;  /* candidate item */
+    struct item *rit; /* reclaimed item */
+    uint32_t tries, hv;
 
     if (!settings.use_lruq) {
         return NULL;
     }
 
-    for (tries = ITEM_LRUQ_MAX_TRIES, it = TAILQ_FIRST(&item_lruq[id]),
-         uit = NULL;
-         it != NULL && tries > 0;
-         tries--, it = TAILQ_NEXT(it, i_tqe)) {
+    if (evict) {
+        /*
+         * recent accesses have their say in which item goes, but only a
+         * few, so as to keep evicting allocs cheap; the rebalancer applies
+         * the rest
+         */
+        item_access_drain(ITEM_ACCESS_NEVICT);
+    }
+
+    item_lruq_lock(id);
+
+    for (tries = ITEM_LRUQ_MAX_TRIES,
+         it = evict ? policy_victim(id, NULL) : item_q_first(&item_lruq[id]),
+         rit = NULL;
+         it != NULL && tries > 0 && rit == NULL;
+         tries--, it = evict ? policy_victim(id, it) : item_q_next(it)) {
 
         if (it->refcount != 0) {
             log_debug(LOG_VVERB, "skip it '%.*s' at offset %"PRIu32" with "
@@ -285,16 +926,38 @@ item_get_from_lruq(uint8_t id)
             continue;
         }
 
-        if (item_expired(it)) {
-            /* first expired item wins */
-            return it;
-        } else if (uit == NULL) {
-            /* otherwise, get the lru unexpired item */
-            uit = it;
+        if (!evict && !item_expired(it)) {
+            continue;
+        }
+
+        hv = it->hv;
+        if (!item_trylock(hv)) {
+            continue;
+        }
+
+        /* a lockless reader may have grabbed the item in the meantime */
+        if (_item_reuse(it)) {
+            if (item_expired(it)) {
+                stats_slab_incr(id, item_expire);
+            } else {
+                stats_slab_incr(id, item_evict);
+            }
+
+            item_acquire_refcount(it);
+            rit = it;
         }
+
+        item_unlock(hv);
+    }
+
+    item_lruq_unlock(id);
+
+    if (rit != NULL) {
+        /* chunks of a reclaimed item go back to their slabs right away */
+        slab_put_chunks(rit);
     }
 
-    return uit;
+    return rit;
 }
 
 uint8_t item_slabid(uint8_t nkey, uint32_t nbyte)
@@ -304,7 +967,15 @@ uint8_t item_slabid(uint8_t nkey, uint32_t nbyte)
 
     ntotal = item_ntotal(nkey, nbyte, settings.use_cas);
 
-    id = slab_id(ntotal);
+    if (ntotal > settings.max_item_size) {
+        id = SLABCLASS_INVALID_ID;
+    } else if (ntotal > settings.max_chunk_size) {
+        /* a chunked item only holds links to its chunks */
+        id = slab_id(item_ntotal(nkey, item_nbyte_2_nchunk(nbyte) *
+                                 sizeof(item_link_t), settings.use_cas));
+    } else {
+        id = slab_id(ntotal);
+    }
     if (id == SLABCLASS_INVALID_ID) {
         log_debug(LOG_NOTICE, "slab class id out of range with %"PRIu8" bytes "
                   "key, %"PRIu32" bytes value and %zu item chunk size", nkey,
@@ -323,16 +994,33 @@ uint8_t item_slabid(uint8_t nkey, uint32_t nbyte)
  * is refcounted so that it is not deleted under callers nose. It is the
  * callers responsibilty to release this refcount when the item is inserted
  * into the hash + lru q or freed.
+ *
+ * Allocation does not require the caller to hold any stripe, but it is
+ * safe to allocate while holding one.
  */
 static struct item *
-_item_alloc(uint8_t id, char *key, uint8_t nkey, uint32_t dataflags, rel_time_t
-            exptime, uint32_t nbyte)
+_item_alloc_single(uint8_t id, char *key, uint8_t nkey, uint32_t hv,
+                   uint32_t dataflags, rel_time_t exptime, uint32_t nbyte)
 {
     struct item *it;  /* item */
-    struct item *uit; /* unexpired lru item */
 
     ASSERT(id >= SLABCLASS_MIN_ID && id <= SLABCLASS_MAX_ID);
 
+    if (settings.storage == STORAGE_SEG) {
+        /* the segment engine reclaims and evicts on its own */
+        it = seg_get_item(id, exptime);
+        if (it != NULL) {
+            goto alloc_done;
+        }
+
+        log_warn("server error on allocating item of class %"PRIu8" in a "
+                 "segment", id);
+
+        stats_thread_incr(server_error);
+
+        return NULL;
+    }
+
     /*
      * We try to obtain an item in the following order:
      *  1)  by acquiring an expired item;
@@ -340,31 +1028,24 @@ _item_alloc(uint8_t id, char *key, uint8_t nkey, uint32_t dataflags, rel_time_t
      *  3)  by evicting a slab, if slab eviction(s) are enabled;
      *  4)  by evicting an item, if item lru eviction is enabled.
      */
-    it = item_get_from_lruq(id); /* expired / unexpired lru item */
-
-    if (it != NULL && item_expired(it)) {
+    it = item_get_from_lruq(id, false); /* expired lru item */
+    if (it != NULL) {
         /* 1) this is an expired item, always use it */
-        stats_slab_incr(id, item_expire);
-
-        item_reuse(it);
         goto alloc_done;
     }
 
-    uit = (settings.evict_opt & EVICT_LRU)? it : NULL; /* keep if can be used */
-
     it = slab_get_item(id);
     if (it != NULL) {
         /* 2) or 3) either we allow random eviction a free item is found */
         goto alloc_done;
     }
 
-    if (uit != NULL) {
-        /* 4) this is an lru item and we can reuse it */
-        it = uit;
-        stats_slab_incr(id, item_evict);
-
-        item_reuse(it);
-        goto alloc_done;
+    if (settings.evict_opt & EVICT_LRU) {
+        /* 4) reuse an lru item */
+        it = item_get_from_lruq(id, true);
+        if (it != NULL) {
+            goto alloc_done;
+        }
     }
 
     log_warn("server error on allocating item in slab %"PRIu8, id);
@@ -379,15 +1060,14 @@ alloc_done:
     ASSERT(!item_is_linked(it));
     ASSERT(!item_is_slabbed(it));
     ASSERT(it->offset != 0);
-    ASSERT(it->refcount == 0);
-
-    item_acquire_refcount(it);
+    ASSERT(it->refcount == 1);
 
     it->flags = settings.use_cas ? ITEM_CAS : 0;
     it->dataflags = dataflags;
     it->nbyte = nbyte;
     it->exptime = exptime;
     it->nkey = nkey;
+    it->hv = hv;
 #if defined MC_MEM_SCRUB && MC_MEM_SCRUB == 1
     memset(it->end, 0xff, slab_item_size(it->id) - ITEM_HDR_SIZE);
 #endif
@@ -403,295 +1083,1346 @@ alloc_done:
     return it;
 }
 
+static void
+item_free(struct item *it)
+{
+    ASSERT(it->magic == ITEM_MAGIC);
+
+    if (settings.storage == STORAGE_SEG) {
+        seg_put_item(it);
+    } else {
+        slab_put_item(it);
+    }
+}
+
+/*
+ * Allocate a chunk of class cid for a chunked item of class id. Chunks
+ * only ever come out of their slabs and never make it into an lru q, so
+ * with lru eviction, room for them is made by evicting items of the class
+ * of the chunked item instead, whose chunks go back to their slabs.
+ */
+static struct item *
+item_alloc_chunk(uint8_t id, uint8_t cid, char *key, uint32_t hv,
+                 rel_time_t exptime, uint32_t nbyte)
+{
+    struct item *chunk, *it;
+    uint32_t tries;
+
+    for (tries = ITEM_LRUQ_MAX_TRIES; tries > 0; tries--) {
+        chunk = _item_alloc_single(cid, key, 0, hv, 0, exptime, nbyte);
+        if (chunk != NULL || !(settings.evict_opt & EVICT_LRU)) {
+            return chunk;
+        }
+
+        it = item_get_from_lruq(id, true);
+        if (it == NULL) {
+            return NULL;
+        }
+        item_release_refcount(it);
+        item_free(it);
+    }
+
+    return NULL;
+}
+
+/*
+ * Allocate a chunked item of class id along with all its chunks. Chunks
+ * are held by a refcount until they are all allocated, so that no slab
+ * eviction gets to see them half way through.
+ */
+static struct item *
+_item_alloc_chunked(uint8_t id, char *key, uint8_t nkey, uint32_t hv,
+                    uint32_t dataflags, rel_time_t exptime, uint32_t nbyte)
+{
+    struct item *it, *chunk;
+    uint32_t i, nchunk, n, nleft;
+    uint8_t cid;
+
+    nchunk = item_nbyte_2_nchunk(nbyte);
+
+    it = _item_alloc_single(id, key, nkey, hv, dataflags, exptime,
+                            nchunk * sizeof(item_link_t));
+    if (it == NULL) {
+        return NULL;
+    }
+
+    for (i = 0, nleft = nbyte + CRLF_LEN; i < nchunk; i++, nleft -= n) {
+        n = MIN(nleft, item_chunk_nbyte());
+        cid = slab_id(ITEM_HDR_SIZE + 1 + n);
+        ASSERT(cid != SLABCLASS_INVALID_ID);
+
+        chunk = item_alloc_chunk(id, cid, key, hv, exptime, n);
+        if (chunk == NULL) {
+            goto error;
+        }
+
+        chunk->flags = ITEM_CHUNK;
+        chunk->h_next = item_2_link(it);
+        item_set_chunk(it, i, chunk);
+    }
+
+    it->nbyte = nbyte;
+    it->flags |= ITEM_CHUNKED;
+
+    for (i = 0; i < nchunk; i++) {
+        item_release_refcount(item_chunk(it, i));
+    }
+
+    log_debug(LOG_VERB, "alloc it '%.*s' at offset %"PRIu32" with id %"PRIu8
+              " in %"PRIu32" chunks", it->nkey, item_key(it), it->offset,
+              it->id, nchunk);
+
+    return it;
+
+error:
+    while (i-- > 0) {
+        chunk = item_chunk(it, i);
+        item_release_refcount(chunk);
+        item_free(chunk);
+    }
+    item_release_refcount(it);
+    item_free(it);
+
+    return NULL;
+}
+
+/*
+ * Allocate an item, chunked if it is too large for the largest item chunk.
+ * Whichever it is, the returned item is refcounted, see _item_alloc_single.
+ */
+static struct item *
+_item_alloc(uint8_t id, char *key, uint8_t nkey, uint32_t hv,
+            uint32_t dataflags, rel_time_t exptime, uint32_t nbyte)
+{
+    if (item_needs_chunks(nkey, nbyte)) {
+        return _item_alloc_chunked(id, key, nkey, hv, dataflags, exptime,
+                                   nbyte);
+    }
+
+    return _item_alloc_single(id, key, nkey, hv, dataflags, exptime, nbyte);
+}
+
 struct item *
-item_alloc(uint8_t id, char *key, uint8_t nkey, uint32_t dataflags,
-           rel_time_t exptime, uint32_t nbyte)
+item_alloc(uint8_t id, char *key, uint8_t nkey, uint32_t hv,
+           uint32_t dataflags, rel_time_t exptime, uint32_t nbyte)
+{
+    return _item_alloc(id, key, nkey, hv, dataflags, exptime, nbyte);
+}
+
+/*
+ * Return true if a set of an item of class id, whose key hashes to hv,
+ * should be stored. The admission filter only has a say once the item can
+ * only be allocated by evicting another one, in which case it is admitted
+ * if its key is more frequent than that of the next eviction victim: the
+ * first item the eviction policy looks at that is not in use. With slab
+ * eviction, the filter only gets a say when a slab is about to be evicted,
+ * and the least recently used item stands in for the items of that slab.
+ *
+ * Sets are always admitted when there is no eviction, or no victim in
+ * sight, and so are they when the victim has expired.
+ */
+bool
+item_admit(uint8_t id, uint32_t hv)
 {
     struct item *it;
+    uint32_t tries, vhv;
+    bool admit, found;
 
-    pthread_mutex_lock(&cache_lock);
-    it = _item_alloc(id, key, nkey, dataflags, exptime, nbyte);
-    pthread_mutex_unlock(&cache_lock);
+    if (settings.admission == ADMIT_NONE) {
+        return true;
+    }
 
-    return it;
+    admit_record(hv);
+
+    if (settings.evict_opt == EVICT_NONE || !settings.use_lruq ||
+        !slab_full(id)) {
+        return true;
+    }
+
+    found = false;
+    vhv = 0;
+    admit = true;
+
+    item_lruq_lock(id);
+
+    for (tries = ITEM_LRUQ_MAX_TRIES, it = policy_peek(id);
+         it != NULL && tries > 0 && !found;
+         tries--, it = item_q_next(it)) {
+
+        if (it->refcount != 0) {
+            continue;
+        }
+
+        found = true;
+        if (!item_expired(it)) {
+            vhv = it->hv;
+            admit = false;
+        }
+    }
+
+    item_lruq_unlock(id);
+
+    if (!admit) {
+        admit = admit_estimate(hv) > admit_estimate(vhv);
+    }
+
+    if (admit) {
+        stats_thread_incr(admit_accept);
+    } else {
+        stats_thread_incr(admit_reject);
+    }
+
+    log_debug(LOG_VERB, "%s set of class %"PRIu8" with hv %"PRIu32" over "
+              "victim with hv %"PRIu32"", admit ? "admit" : "reject", id, hv,
+              vhv);
+
+    return admit;
 }
 
+/*
+ * Link an item into the hash table and lru q, with a given cas
+ */
 static void
-item_free(struct item *it)
+_item_link_cas(struct item *it, uint64_t cas)
+{
+    ASSERT(it->magic == ITEM_MAGIC);
+    ASSERT(!item_is_linked(it));
+    ASSERT(!item_is_slabbed(it));
+
+    log_debug(LOG_DEBUG, "link it '%.*s' at offset %"PRIu32" with flags "
+              "%02x id %"PRId8"", it->nkey, item_key(it), it->offset,
+              it->flags, it->id);
+
+    it->flags |= ITEM_LINKED;
+    item_set_cas(it, cas);
+
+    /* lockless readers must not find the item before it is complete */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    assoc_insert(it);
+    item_link_q(it, true);
+    expiry_insert(it);
+
+    stats_slab_incr(it->id, item_link);
+}
+
+/*
+ * Link an item into the hash table and lru q
+ */
+static void
+_item_link(struct item *it)
+{
+    _item_link_cas(it, item_next_cas());
+}
+
+/*
+ * Unlinks an item from the lru q and hash table. Free an unlinked
+ * item if it's refcount is zero.
+ */
+static void
+_item_unlink(struct item *it)
+{
+    uint16_t refcount;
+
+    ASSERT(it->magic == ITEM_MAGIC);
+
+    log_debug(LOG_DEBUG, "unlink it '%.*s' at offset %"PRIu32" with flags "
+              "%02x id %"PRId8"", it->nkey, item_key(it), it->offset,
+              it->flags, it->id);
+
+    if (item_is_linked(it)) {
+        refcount = item_clear_linked(it);
+
+        stats_slab_incr(it->id, item_unlink);
+        assoc_delete(it);
+
+        item_unlink_q(it);
+
+        if (refcount == 0) {
+            item_free(it);
+        }
+    }
+}
+
+/*
+ * Same as _item_unlink(), for the segment engine, which holds the stripe
+ * of the item key.
+ */
+void
+item_unlink(struct item *it)
+{
+    _item_unlink(it);
+}
+
+/*
+ * Decrement the refcount on an item. Free an unliked item if its refcount
+ * drops to zero.
+ */
+static void
+_item_remove(struct item *it)
 {
     ASSERT(it->magic == ITEM_MAGIC);
-    slab_put_item(it);
+    ASSERT(!item_is_slabbed(it));
+
+    log_debug(LOG_DEBUG, "remove it '%.*s' at offset %"PRIu32" with flags "
+              "%02x id %"PRId8" refcount %"PRIu16"", it->nkey, item_key(it),
+              it->offset, it->flags, it->id, it->refcount);
+
+    if (it->refcount != 0) {
+        item_release_refcount(it);
+    }
+
+    if (it->refcount == 0 && !item_is_linked(it)) {
+        item_free(it);
+    }
+}
+
+void
+item_remove(struct item *it)
+{
+    uint32_t hv;
+
+    hv = it->hv;
+    item_lock(hv);
+    _item_remove(it);
+    item_unlock(hv);
+}
+
+/*
+ * Return true if the item was touched within the last ITEM_UPDATE_INTERVAL
+ * secs. Time starts at a few secs, so the interval is added to the access
+ * time rather than taken off the current time, which would wrap.
+ */
+static bool
+item_touched_recently(struct item *it)
+{
+    return it->atime + ITEM_UPDATE_INTERVAL > time_now();
+}
+
+/*
+ * Touch the item by moving it to the tail of lru q, and its slab to the
+ * tail of the slab lruq. Gets only get here for items not touched in the
+ * last ITEM_UPDATE_INTERVAL secs (see item_touch).
+ */
+static void
+_item_touch(struct item *it)
+{
+    ASSERT(it->magic == ITEM_MAGIC);
+    ASSERT(!item_is_slabbed(it));
+
+    log_debug(LOG_VERB, "update it '%.*s' at offset %"PRIu32" with flags "
+              "%02x id %"PRId8"", it->nkey, item_key(it), it->offset,
+              it->flags, it->id);
+
+    if (item_is_linked(it)) {
+        item_lruq_lock(it->id);
+        _item_unlink_q(it);
+        _item_link_q(it);
+        item_lruq_unlock(it->id);
+
+        slab_lruq_touch(item_2_slab(it), false);
+    }
+}
+
+/*
+ * The segment engine has no lru q, and only needs to know whether an item
+ * was accessed since it was written, when segments are merged. The flag
+ * shares a word with the refcount, which lockless readers update without
+ * the stripe, so it is set atomically.
+ */
+static void
+item_mark_accessed(struct item *it)
+{
+    union item_state accessed;
+
+    ASSERT(it->magic == ITEM_MAGIC);
+    ASSERT(it->refcount > 0);
+
+    if (it->flags & ITEM_ACCESSED) {
+        return;
+    }
+
+    accessed.word = 0;
+    accessed.f.flags = ITEM_ACCESSED;
+    __atomic_fetch_or(&it->state, accessed.word, __ATOMIC_RELAXED);
+}
+
+/*
+ * An item access logged by a worker, along with the hash value the item
+ * was found by, as the item may be gone by the time the access is applied
+ */
+struct item_access {
+    item_link_t it; /* item, which may be gone since */
+    uint32_t    hv; /* hash value of item key */
+};
+
+/*
+ * Apply an access to the lru q of the item and to the slab lruq, with the
+ * stripe of the item held. Other policies than lru leave the lru q for
+ * eviction to reorder.
+ */
+static void
+_item_access_apply(struct item *it)
+{
+    if (settings.policy == POLICY_LRU) {
+        _item_touch(it);
+    } else {
+        slab_lruq_touch(item_2_slab(it), false);
+    }
+}
+
+/*
+ * Apply up to max accesses of a log held by the caller, but no more than
+ * the log holds, in case its worker keeps adding to it, and return the
+ * number of accesses taken off the log. As with the entries
+ * of an expiry wheel, the item of an access is only trusted once found in
+ * the hash table under the stripe of hv. Accesses whose stripe is busy
+ * are dropped, as with an lru q update skipped by ITEM_UPDATE_INTERVAL.
+ */
+static uint32_t
+item_access_apply(struct item_access_log *log, uint32_t max)
+{
+    struct item_access a;
+    struct item *it;
+    uint32_t n;
+
+    max = MIN(max, ITEM_ACCESS_NENTRY);
+
+    for (n = 0; n < max; n++) {
+        if (ring_array_pop(&a, log->ring) != MC_OK) {
+            break;
+        }
+
+        if (!item_trylock(a.hv)) {
+            continue;
+        }
+
+        it = item_link_2_item(a.it);
+        if (assoc_contains(it, a.hv)) {
+            _item_access_apply(it);
+        }
+
+        item_unlock(a.hv);
+    }
+
+    return n;
+}
+
+/*
+ * Apply up to max accesses from the access logs of the workers, skipping
+ * logs that are being applied already. Each call starts from the log after
+ * the one the previous call started from, so that a small max still gets
+ * around to every worker. The rebalancer thread drains all logs every sec,
+ * which bounds how far behind the lru q and slab lruq get, while item lru
+ * eviction applies a few accesses before it picks an item.
+ */
+void
+item_access_drain(uint32_t max)
+{
+    static uint32_t next; /* log the next drain starts from */
+    struct item_access_log *log;
+    uint32_t i, start, nworker;
+
+    nworker = (uint32_t)settings.num_workers;
+    start = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED);
+
+    for (i = 0; i < nworker && max > 0; i++) {
+        log = threads[(start + i) % nworker].access;
+        if (log == NULL || pthread_mutex_trylock(&log->lock) != 0) {
+            continue;
+        }
+
+        max -= item_access_apply(log, max);
+        pthread_mutex_unlock(&log->lock);
+    }
+}
+
+struct item_access_log *
+item_access_create(void)
+{
+    struct item_access_log *log;
+    err_t err;
+
+    log = mc_zalloc(sizeof(*log));
+    if (log == NULL) {
+        return NULL;
+    }
+
+    err = pthread_mutex_init(&log->lock, NULL);
+    if (err != 0) {
+        log_error("pthread mutex init failed: %s", strerror(err));
+        mc_free(log);
+        return NULL;
+    }
+
+    log->ring = ring_array_create(sizeof(struct item_access),
+                                  ITEM_ACCESS_NENTRY);
+    if (log->ring == NULL) {
+        pthread_mutex_destroy(&log->lock);
+        mc_free(log);
+        return NULL;
+    }
+
+    return log;
+}
+
+/*
+ * Touch an item found by a get. Gets don't reorder the lru q and slab
+ * lruq, which are shared by all workers, but only log their accesses, to
+ * be applied later and in batches (see item_access_drain), so that reads
+ * stay lookups. A worker applies its log itself when the log is full.
+ * Threads other than workers have no log, and apply their access at once.
+ */
+void
+item_touch(struct item *it)
+{
+    struct item_access_log *log;
+    struct item_access a;
+    uint32_t hv;
+
+    if (settings.storage == STORAGE_SEG) {
+        item_mark_accessed(it);
+        return;
+    }
+
+    slab_hit(item_2_slab(it));
+
+    if (settings.policy != POLICY_LRU) {
+        policy_touch(it);
+        if (!(settings.evict_opt & EVICT_AS)) {
+            return;
+        }
+    } else if (item_touched_recently(it)) {
+        return;
+    } else {
+        /*
+         * Gets of the item before its access is applied are not logged
+         * again; the access time is reset when it is applied anyway
+         */
+        it->atime = time_now();
+    }
+
+    hv = it->hv;
+
+    log = pthread_getspecific(keys.access);
+    if (log == NULL) {
+        item_lock(hv);
+        _item_access_apply(it);
+        item_unlock(hv);
+        return;
+    }
+
+    a.it = item_2_link(it);
+    a.hv = hv;
+    if (ring_array_push(&a, log->ring) == MC_OK) {
+        return;
+    }
+
+    /* the access is dropped if the log is being applied already */
+    if (pthread_mutex_trylock(&log->lock) == 0) {
+        item_access_apply(log, ITEM_ACCESS_NENTRY);
+        pthread_mutex_unlock(&log->lock);
+        ring_array_push(&a, log->ring);
+    }
+}
+
+/*
+ * Replace one item with another in the hash table and lru q.
+ */
+static void
+_item_relink(struct item *it, struct item *nit)
+{
+    ASSERT(it->magic == ITEM_MAGIC);
+    ASSERT(!item_is_slabbed(it));
+
+    ASSERT(nit->magic == ITEM_MAGIC);
+    ASSERT(!item_is_slabbed(nit));
+
+    log_debug(LOG_VERB, "relink it '%.*s' at offset %"PRIu32" id %"PRIu8" "
+              "with one at offset %"PRIu32" id %"PRIu8"", it->nkey,
+              item_key(it), it->offset, it->id, nit->offset, nit->id);
+
+    _item_unlink(it);
+    _item_link(nit);
+}
+
+static char *
+_item_cache_dump(uint8_t id, uint32_t limit, uint32_t *bytes)
+{
+    const size_t memlimit = ITEM_CACHEDUMP_MEMLIMIT;
+    char *buffer;
+    uint32_t bufcurr;
+    struct item *it;
+    uint32_t len;
+    uint32_t shown = 0;
+    char key_temp[KEY_MAX_LEN + 1];
+    char temp[KEY_MAX_LEN * 2];
+
+    buffer = mc_alloc(memlimit);
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    for (bufcurr = 0, it = item_q_first(&item_lruq[id]);
+         it != NULL && (limit == 0 || shown < limit);
+         it = item_q_next(it)) {
+
+        ASSERT(it->nkey <= KEY_MAX_LEN);
+        /* copy the key since it may not be null-terminated in the struct */
+        strncpy(key_temp, item_key(it), it->nkey);
+        key_temp[it->nkey] = '\0'; /* terminate */
+        len = snprintf(temp, sizeof(temp), "ITEM %s [%d b; %lu s]\r\n",
+                       key_temp, it->nbyte,
+                       (unsigned long)it->exptime + time_started());
+        if (len >= sizeof(temp)) {
+            log_debug(LOG_WARN, "item log was truncated during cache dump");
+        }
+        if (bufcurr + len + (sizeof("END\r\n") - 1) > memlimit) {
+            break;
+        }
+        memcpy(buffer + bufcurr, temp, len);
+        bufcurr += len;
+        shown++;
+    }
+
+    memcpy(buffer + bufcurr, "END\r\n", sizeof("END\r\n") - 1);
+    bufcurr += sizeof("END\r\n") - 1;
+
+    *bytes = bufcurr;
+
+    return buffer;
+}
+
+char *
+item_cache_dump(uint8_t id, uint32_t limit, uint32_t *bytes)
+{
+    char *ret;
+
+    item_lruq_lock(id);
+    ret = _item_cache_dump(id, limit, bytes);
+    item_lruq_unlock(id);
+
+    return ret;
+}
+
+/*
+ * Unlink an item an expiry wheel found due. The wheel keeps references to
+ * items aside, which may have been freed since, and their memory reused
+ * for another item, of another class even. So the item is only trusted
+ * once found in the hash table under the stripe of hv.
+ *
+ * Return true if the item had expired and was unlinked.
+ */
+bool
+item_reap(struct item *it, uint32_t hv)
+{
+    bool reaped;
+
+    item_lock(hv);
+
+    reaped = assoc_contains(it, hv) && item_get_expired(it);
+    if (reaped) {
+        log_debug(LOG_VERB, "reap it '%.*s' at offset %"PRIu32" with id "
+                  "%"PRIu8"", it->nkey, item_key(it), it->offset, it->id);
+        stats_slab_incr(it->id, item_expire);
+        _item_unlink(it);
+    }
+
+    item_unlock(hv);
+
+    return reaped;
+}
+
+struct item_restore *
+item_restore_create(intptr_t delta, uint32_t nslab)
+{
+    struct item_restore *r;
+    uint32_t id;
+
+    r = mc_zalloc(sizeof(*r));
+    if (r == NULL) {
+        return NULL;
+    }
+
+    r->delta = delta;
+    r->nslab = nslab;
+    for (id = SLABCLASS_MIN_ID; id <= SLABCLASS_MAX_ID; id++) {
+        item_q_init(&r->lruq[id]);
+    }
+
+    return r;
+}
+
+/*
+ * Translate a link held by a restored item into the item it links to now,
+ * or NULL if it does not link to an item of a restored slab.
+ */
+static struct item *
+item_restore_link(struct item_restore *r, item_link_t link)
+{
+    struct item *it;
+
+#if MC_COMPACT_ITEMS == 1
+    if (link == 0 || (link >> item_link_shift) >= r->nslab) {
+        return NULL;
+    }
+    it = item_link_2_item(link);
+#else
+    if (link == NULL) {
+        return NULL;
+    }
+    it = (struct item *)((uintptr_t)link + r->delta);
+#endif
+
+    return slab_item_valid(it) ? it : NULL;
+}
+
+/*
+ * Check that the chunks of a restored chunked item link back to it and
+ * hold its data and trailing CRLF between them, and translate the links
+ * to them.
+ */
+static bool
+item_restore_chunks(struct item_restore *r, struct item *it)
+{
+    struct item *chunk;
+    item_link_t link;
+    uint32_t i, nchunk;
+    uint64_t nbyte;
+
+    nchunk = item_nchunk(it);
+    if (item_ntotal(it->nkey, nchunk * sizeof(link), item_has_cas(it)) >
+        slab_item_size(it->id)) {
+        return false;
+    }
+
+    for (i = 0, nbyte = 0; i < nchunk; i++) {
+        memcpy(&link, item_data(it) + i * sizeof(link), sizeof(link));
+
+        chunk = item_restore_link(r, link);
+        if (chunk == NULL || !item_is_chunk(chunk) || item_is_slabbed(chunk) ||
+            item_restore_link(r, chunk->h_next) != it ||
+            item_data(chunk) + chunk->nbyte >
+            (char *)chunk + slab_item_size(chunk->id)) {
+            return false;
+        }
+
+        item_set_chunk(it, i, chunk);
+        nbyte += chunk->nbyte;
+    }
+
+    return (nbyte == (uint64_t)it->nbyte + CRLF_LEN);
+}
+
+/*
+ * Return true if a restored item is intact, and neither expired nor
+ * flushed since, under the clock of the run that left it.
+ */
+static bool
+item_restore_check(struct item_restore *r, struct item *it)
+{
+    size_t ntotal;
+
+    if (!slab_item_valid(it) || item_is_slabbed(it) || it->nkey == 0 ||
+        it->nkey > KEY_MAX_LEN) {
+        return false;
+    }
+
+    /* the second tier is started over on every run */
+    if (item_is_ext(it)) {
+        return false;
+    }
+
+    if (item_get_expired(it) || item_get_flushed(it)) {
+        return false;
+    }
+
+    if (item_is_chunked(it)) {
+        return item_restore_chunks(r, it);
+    }
+
+    ntotal = item_size(it);
+    if (item_is_raligned(it)) {
+        ntotal -= CRLF_LEN;
+    }
+
+    return (ntotal <= slab_item_size(it->id));
+}
+
+/*
+ * Relink an item of a restored slab heap into the hash table and the lru
+ * q of its class, if it was linked when the heap was left and still holds.
+ * Items not relinked are left unlinked, for item_restored() to tell apart
+ * from chunks once all items went through here.
+ */
+void
+item_restore(struct item_restore *r, struct item *it)
+{
+    uint8_t id;
+
+    if (!item_is_linked(it)) {
+        return;
+    }
+
+    if (item_is_chunk(it) || !item_restore_check(r, it)) {
+        it->flags = 0;
+        return;
+    }
+
+    /* the key may have been hashed by another hash function then */
+    it->hv = hash(item_key(it), it->nkey, 0);
+
+    item_lock(it->hv);
+
+    if (assoc_find(item_key(it), it->nkey, it->hv) != NULL) {
+        item_unlock(it->hv);
+        it->flags = 0;
+        return;
+    }
+
+    it->refcount = 0;
+    __atomic_store_n(&it->qflags, 0, __ATOMIC_RELAXED);
+    it->flags &= (ITEM_LINKED | ITEM_CAS | ITEM_RALIGN | ITEM_ACCESSED |
+                  ITEM_CHUNKED);
+    assoc_insert(it);
+
+    item_unlock(it->hv);
+
+    id = it->id;
+    item_q_insert_tail(&r->lruq[id], it);
+    r->nitem_id[id]++;
+    r->nbyte[id] += item_size(it);
+    r->nbyte_value[id] += it->nbyte;
+    r->nitem++;
+    r->cas = MAX(r->cas, item_get_cas(it));
+
+    expiry_insert(it);
+}
+
+/*
+ * Return true if an item of a restored slab heap is in use: relinked items
+ * are, and so are the chunks of relinked chunked items, whose links back
+ * to them are translated here. Any other item is to be freed.
+ */
+bool
+item_restored(struct item_restore *r, struct item *it)
+{
+    struct item *parent;
+    uint32_t i, nchunk;
+
+    if (item_is_linked(it)) {
+        return true;
+    }
+
+    if (!item_is_chunk(it) || item_is_slabbed(it)) {
+        return false;
+    }
+
+    parent = item_restore_link(r, it->h_next);
+    if (parent == NULL || !item_is_linked(parent) ||
+        !item_is_chunked(parent)) {
+        return false;
+    }
+
+    nchunk = item_nchunk(parent);
+    for (i = 0; i < nchunk; i++) {
+        if (item_chunk(parent, i) == it) {
+            it->h_next = item_2_link(parent);
+            it->refcount = 0;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Make sure cas ids handed out from now on are larger than a given one.
+ */
+static void
+item_raise_cas(uint64_t cas)
+{
+    uint64_t curr;
+
+    curr = __atomic_load_n(&cas_id, __ATOMIC_RELAXED);
+    while (curr < cas &&
+           !__atomic_compare_exchange_n(&cas_id, &curr, cas, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/*
+ * Hand the items relinked by a thread over to the lru q of their class,
+ * behind those of the threads done before, and account for them. Cas ids
+ * handed out from then on are larger than those of the relinked items.
+ *
+ * Return the # items relinked.
+ */
+uint64_t
+item_restore_done(struct item_restore *r)
+{
+    uint64_t nitem;
+    uint32_t id;
+
+    for (id = SLABCLASS_MIN_ID; id <= SLABCLASS_MAX_ID; id++) {
+        if (r->nitem_id[id] == 0) {
+            continue;
+        }
+
+        item_lruq_lock(id);
+        policy_concat(id, &r->lruq[id], r->nitem_id[id]);
+        item_lruq_unlock(id);
+
+        stats_slab_incr_by(id, item_curr, r->nitem_id[id]);
+        stats_slab_incr_by(id, data_curr, r->nbyte[id]);
+        stats_slab_incr_by(id, data_value_curr, r->nbyte_value[id]);
+    }
+
+    item_raise_cas(r->cas);
+
+    nitem = r->nitem;
+    mc_free(r);
+
+    return nitem;
+}
+
+/*
+ * Return an item if it hasn't been marked as expired, lazily expiring
+ * item as-and-when needed
+ *
+ * When a non-null item is returned, it's the callers responsibily to
+ * release refcount on the item
+ */
+static struct item *
+_item_get(const char *key, size_t nkey, uint32_t hv)
+{
+    struct item *it;
+
+    it = assoc_find(key, nkey, hv);
+    if (it == NULL) {
+        log_debug(LOG_VERB, "get it '%.*s' not found", nkey, key);
+        return NULL;
+    }
+
+    if (item_get_expired(it)) {
+        _item_unlink(it);
+        stats_slab_incr(it->id, item_expire);
+        log_debug(LOG_VERB, "get it '%.*s' expired and nuked", nkey, key);
+        return NULL;
+    }
+
+    if (item_get_flushed(it)) {
+        _item_unlink(it);
+        stats_slab_incr(it->id, item_expire);
+        log_debug(LOG_VERB, "it '%.*s' nuked", nkey, key);
+        return NULL;
+    }
+
+    item_acquire_refcount(it);
+
+    log_debug(LOG_VERB, "get it '%.*s' found at offset %"PRIu32" with flags "
+              "%02x id %"PRIu8" refcount %"PRIu32"", it->nkey, item_key(it),
+              it->offset, it->flags, it->id);
+
+
+    return it;
+}
+
+/*
+ * Same as _item_get(), for a caller that goes on to read or change the data
+ * of the item in place. A stub has none of its own, and the data it stands
+ * for is only read back asynchronously, so the stub is dropped and the key
+ * taken as a miss.
+ */
+static struct item *
+_item_get_data(const char *key, size_t nkey, uint32_t hv)
+{
+    struct item *it;
+
+    it = _item_get(key, nkey, hv);
+    if (it != NULL && item_is_ext(it)) {
+        _item_unlink(it);
+        _item_remove(it);
+        stats_thread_incr(ext_miss);
+        return NULL;
+    }
+
+    return it;
 }
 
 /*
- * Link an item into the hash table and lru q
+ * Optimistically get an item without taking the stripe of its key.
+ *
+ * The lookup runs within an epoch, which keeps the hash table and item
+ * memory it walks from being reclaimed, but not from being modified. So
+ * a miss only stands if the stripe was not held at any point during it,
+ * and a hit has to be pinned by a reference taken while the item is still
+ * linked, and then checked to be the item for this key, since items can
+ * be reused for another key in place (see item_get_lockless_check).
+ *
+ * Returns true with the refcounted candidate item or NULL in it, if the
+ * lookup is conclusive. Returns false if the get has to be retried under
+ * the stripe. The caller must be within an epoch.
  */
-static void
-_item_link(struct item *it)
+static bool
+_item_get_lockless(const char *key, size_t nkey, uint32_t hv,
+                   struct item **it)
 {
-    ASSERT(it->magic == ITEM_MAGIC);
-    ASSERT(!item_is_linked(it));
-    ASSERT(!item_is_slabbed(it));
+    struct item *fit; /* found item */
+    uint32_t seq;
+    rstatus_t status;
 
-    log_debug(LOG_DEBUG, "link it '%.*s' at offset %"PRIu32" with flags "
-              "%02x id %"PRId8"", it->nkey, item_key(it), it->offset,
-              it->flags, it->id);
+    seq = item_stripe_seq(hv);
 
-    it->flags |= ITEM_LINKED;
-    item_set_cas(it, item_next_cas());
+    status = assoc_find_lockless(key, nkey, hv, &fit);
+    if (status != MC_OK) {
+        return false;
+    }
 
-    assoc_insert(it);
-    item_link_q(it, true);
+    if (fit == NULL) {
+        if ((seq & 1) != 0 || !item_stripe_unchanged(hv, seq)) {
+            return false;
+        }
+        *it = NULL;
+        return true;
+    }
 
-    stats_slab_incr(it->id, item_link);
+    if (!item_acquire_linked(fit)) {
+        return false;
+    }
+
+    *it = fit;
+
+    return true;
 }
 
 /*
- * Unlinks an item from the lru q and hash table. Free an unlinked
- * item if it's refcount is zero.
+ * Check the outcome of a conclusive lockless lookup, once out of the epoch,
+ * since it may have to release the candidate item. Returns false if the
+ * get has to be retried under the stripe, as is the case for items that
+ * are not for this key anymore, or are to be expired.
  */
-static void
-_item_unlink(struct item *it)
+static bool
+item_get_lockless_check(const char *key, size_t nkey, uint32_t hv,
+                        struct item *it)
 {
-    ASSERT(it->magic == ITEM_MAGIC);
+    if (it == NULL) {
+        log_debug(LOG_VERB, "get it '%.*s' not found", nkey, key);
+        return true;
+    }
 
-    log_debug(LOG_DEBUG, "unlink it '%.*s' at offset %"PRIu32" with flags "
-              "%02x id %"PRId8"", it->nkey, item_key(it), it->offset,
-              it->flags, it->id);
+    if (it->hv != hv || it->nkey != nkey ||
+        memcmp(key, item_key(it), nkey) != 0 ||
+        item_get_expired(it) || item_get_flushed(it)) {
+        item_remove(it);
+        return false;
+    }
 
-    if (item_is_linked(it)) {
-        it->flags &= ~ITEM_LINKED;
+    log_debug(LOG_VERB, "get it '%.*s' found at offset %"PRIu32" with flags "
+              "%02x id %"PRIu8" without lock", it->nkey, item_key(it),
+              it->offset, it->flags, it->id);
 
-        stats_slab_incr(it->id, item_unlink);
-        assoc_delete(item_key(it), it->nkey);
+    return true;
+}
 
-        item_unlink_q(it);
+static void
+item_get_sample(const char *key, size_t nkey, struct item *it)
+{
+    item_control_flags_t hot;
 
-        if (it->refcount == 0) {
-            item_free(it);
-        }
+    if (!__atomic_load_n(&settings.hotkey_enable, __ATOMIC_RELAXED)) {
+        return;
     }
+
+    hot = hotkey_sample(key, nkey, it->nbyte);
+    __atomic_and_fetch(&it->dataflags, ~(ITEM_HOT_QPS | ITEM_HOT_BW),
+                       __ATOMIC_RELAXED);
+    __atomic_or_fetch(&it->dataflags, hot, __ATOMIC_RELAXED);
 }
 
-/*
- * Decrement the refcount on an item. Free an unliked item if its refcount
- * drops to zero.
- */
-static void
-_item_remove(struct item *it)
+struct item *
+item_get(const char *key, size_t nkey, uint32_t hv)
 {
-    ASSERT(it->magic == ITEM_MAGIC);
-    ASSERT(!item_is_slabbed(it));
+    struct item *it;
+    bool done;
 
-    log_debug(LOG_DEBUG, "remove it '%.*s' at offset %"PRIu32" with flags "
-              "%02x id %"PRId8" refcount %"PRIu16"", it->nkey, item_key(it),
-              it->offset, it->flags, it->id, it->refcount);
+    admit_record(hv);
+    mrc_get(key, nkey, hv);
 
-    if (it->refcount != 0) {
-        item_release_refcount(it);
+    done = false;
+    if (thread_epoch_enter()) {
+        done = _item_get_lockless(key, nkey, hv, &it);
+        thread_epoch_exit();
+        done = done && item_get_lockless_check(key, nkey, hv, it);
     }
 
-    if (it->refcount == 0 && !item_is_linked(it)) {
-        item_free(it);
+    if (!done) {
+        item_lock(hv);
+        it = _item_get(key, nkey, hv);
+        item_unlock(hv);
     }
-}
 
-void
-item_remove(struct item *it)
-{
-    pthread_mutex_lock(&cache_lock);
-    _item_remove(it);
-    pthread_mutex_unlock(&cache_lock);
+    if (it != NULL) {
+        item_get_sample(key, nkey, it);
+    }
+
+    return it;
 }
 
 /*
- * Touch the item by moving it to the tail of lru q only if it wasn't
- * touched ITEM_UPDATE_INTERVAL secs back.
+ * Take a snapshot of an item come across while walking the slabs, if it is
+ * linked, and neither expired nor flushed. The walk holds no locks, so the
+ * item is only trusted once found in the hash table under the stripe of
+ * its hash value, as in item_reap(). Its key, and its data if unchunked,
+ * are copied into buf under the stripe, as data is annexed and incremented
+ * in place; buf must hold KEY_MAX_LEN + settings.max_chunk_size bytes.
+ * Data of a chunked item is never changed in place, and is left to be
+ * read from the item, which is refcounted in s->it.
+ *
+ * Return true if the item was taken.
  */
-static void
-_item_touch(struct item *it)
+bool
+item_snapshot(struct item *it, struct item_snapshot *s, char *buf)
 {
-    ASSERT(it->magic == ITEM_MAGIC);
-    ASSERT(!item_is_slabbed(it));
+    uint32_t hv;
 
-    if (it->atime >= (time_now() - ITEM_UPDATE_INTERVAL)) {
-        return;
+    hv = it->hv;
+    item_lock(hv);
+
+    if (!assoc_contains(it, hv) || item_is_ext(it) || item_get_expired(it) ||
+        item_get_flushed(it)) {
+        item_unlock(hv);
+        return false;
     }
 
-    log_debug(LOG_VERB, "update it '%.*s' at offset %"PRIu32" with flags "
-              "%02x id %"PRId8"", it->nkey, item_key(it), it->offset,
-              it->flags, it->id);
+    s->cas = item_get_cas(it);
+    s->exptime = it->exptime;
+    s->dataflags = it->dataflags;
+    s->nbyte = it->nbyte;
+    s->nkey = it->nkey;
+    memcpy(buf, item_key(it), it->nkey);
 
-    if (item_is_linked(it)) {
-        item_unlink_q(it);
-        item_link_q(it, false);
+    if (item_is_chunked(it)) {
+        item_acquire_refcount(it);
+        s->it = it;
+    } else {
+        memcpy(buf + it->nkey, item_data(it), it->nbyte);
+        s->it = NULL;
     }
-}
 
-void
-item_touch(struct item *it)
-{
-    if (it->atime >= (time_now() - ITEM_UPDATE_INTERVAL)) {
-        return;
-    }
+    item_unlock(hv);
 
-    pthread_mutex_lock(&cache_lock);
-    _item_touch(it);
-    pthread_mutex_unlock(&cache_lock);
+    return true;
 }
 
 /*
- * Replace one item with another in the hash table and lru q.
+ * Link a new item loaded from a snapshot, with the given cas if not 0,
+ * unless its key is already linked. Loading is done before any request is
+ * served, so the cas can be set once the item is linked.
+ *
+ * Return true if the item was linked.
  */
-static void
-_item_relink(struct item *it, struct item *nit)
+bool
+item_load(char *key, uint8_t nkey, uint32_t dataflags, rel_time_t exptime,
+          uint64_t cas, const char *data, uint32_t nbyte)
 {
-    ASSERT(it->magic == ITEM_MAGIC);
-    ASSERT(!item_is_slabbed(it));
-
-    ASSERT(nit->magic == ITEM_MAGIC);
-    ASSERT(!item_is_slabbed(nit));
-
-    log_debug(LOG_VERB, "relink it '%.*s' at offset %"PRIu32" id %"PRIu8" "
-              "with one at offset %"PRIu32" id %"PRIu8"", it->nkey,
-              item_key(it), it->offset, it->id, nit->offset, nit->id);
+    struct item *it, *oit;
+    uint32_t hv;
+    uint8_t id;
+    bool linked;
 
-    _item_unlink(it);
-    _item_link(nit);
-}
+    id = item_slabid(nkey, nbyte);
+    if (id == SLABCLASS_INVALID_ID) {
+        return false;
+    }
 
-static char *
-_item_cache_dump(uint8_t id, uint32_t limit, uint32_t *bytes)
-{
-    const size_t memlimit = ITEM_CACHEDUMP_MEMLIMIT;
-    char *buffer;
-    uint32_t bufcurr;
-    struct item *it;
-    uint32_t len;
-    uint32_t shown = 0;
-    char key_temp[KEY_MAX_LEN + 1];
-    char temp[KEY_MAX_LEN * 2];
+    hv = hash(key, nkey, 0);
 
-    buffer = mc_alloc(memlimit);
-    if (buffer == NULL) {
-        return NULL;
+    it = item_alloc(id, key, nkey, hv, dataflags, exptime, nbyte);
+    if (it == NULL) {
+        return false;
     }
 
-    for (bufcurr = 0, it = TAILQ_FIRST(&item_lruq[id]);
-         it != NULL && (limit == 0 || shown < limit);
-         it = TAILQ_NEXT(it, i_tqe)) {
+    item_data_write(it, 0, data, nbyte);
 
-        ASSERT(it->nkey <= KEY_MAX_LEN);
-        /* copy the key since it may not be null-terminated in the struct */
-        strncpy(key_temp, item_key(it), it->nkey);
-        key_temp[it->nkey] = '\0'; /* terminate */
-        len = snprintf(temp, sizeof(temp), "ITEM %s [%d b; %lu s]\r\n",
-                       key_temp, it->nbyte,
-                       (unsigned long)it->exptime + time_started());
-        if (len >= sizeof(temp)) {
-            log_debug(LOG_WARN, "item log was truncated during cache dump");
-        }
-        if (bufcurr + len + (sizeof("END\r\n") - 1) > memlimit) {
-            break;
+    item_lock(hv);
+
+    oit = _item_get(key, nkey, hv);
+    if (oit == NULL) {
+        _item_link(it);
+        if (cas != 0) {
+            item_set_cas(it, cas);
         }
-        memcpy(buffer + bufcurr, temp, len);
-        bufcurr += len;
-        shown++;
+        linked = true;
+    } else {
+        _item_remove(oit);
+        linked = false;
     }
+    _item_remove(it);
 
-    memcpy(buffer + bufcurr, "END\r\n", sizeof("END\r\n") - 1);
-    bufcurr += sizeof("END\r\n") - 1;
+    item_unlock(hv);
 
-    *bytes = bufcurr;
+    item_raise_cas(cas);
 
-    return buffer;
+    return linked;
 }
 
-char *
-item_cache_dump(uint8_t id, uint32_t limit, uint32_t *bytes)
+/*
+ * Link a stub for an item written out to the second tier, with the cas of
+ * the item, unless the key was linked, deleted, flushed or expired in the
+ * meantime.
+ * A stub already linked for the key is replaced, as stubs are linked in
+ * the order their items were written out, oldest first.
+ *
+ * Return true if the stub was linked.
+ */
+bool
+item_link_stub(struct item *it, uint64_t cas)
 {
-    char *ret;
+    struct item *oit;
+    uint32_t hv;
+    bool linked;
+
+    hv = it->hv;
+    linked = false;
+
+    item_lock(hv);
+
+    if (!item_get_expired(it) && !item_get_flushed(it)) {
+        oit = _item_get(item_key(it), it->nkey, hv);
+        if (oit == NULL) {
+            if (!ext_cancelled(hv)) {
+                it->flags |= ITEM_EXT;
+                _item_link_cas(it, cas);
+                linked = true;
+            }
+        } else {
+            if (item_is_ext(oit)) {
+                _item_unlink(oit);
+                it->flags |= ITEM_EXT;
+                _item_link_cas(it, cas);
+                linked = true;
+            }
+            _item_remove(oit);
+        }
+    }
 
-    pthread_mutex_lock(&cache_lock);
-    ret = _item_cache_dump(id, limit, bytes);
-    pthread_mutex_unlock(&cache_lock);
+    item_unlock(hv);
 
-    return ret;
+    return linked;
 }
 
 /*
- * Return an item if it hasn't been marked as expired, lazily expiring
- * item as-and-when needed
- *
- * When a non-null item is returned, it's the callers responsibily to
- * release refcount on the item
+ * Unlink a stub whose data is gone from the second tier, if still linked.
  */
-static struct item *
-_item_get(const char *key, size_t nkey)
+void
+item_unlink_stub(struct item *it)
 {
-    struct item *it;
-
-    it = assoc_find(key, nkey);
-    if (it == NULL) {
-        log_debug(LOG_VERB, "get it '%.*s' not found", nkey, key);
-        return NULL;
-    }
-
-    if (it->exptime != 0 && it->exptime <= time_now()) {
+    item_lock(it->hv);
+    if (item_is_linked(it)) {
         _item_unlink(it);
-        stats_slab_incr(it->id, item_expire);
-        log_debug(LOG_VERB, "get it '%.*s' expired and nuked", nkey, key);
-        return NULL;
     }
+    item_unlock(it->hv);
+}
+
+/*
+ * Replace a stub with the item read back from the second tier, keeping its
+ * cas, unless the stub was unlinked or replaced while being read.
+ */
+void
+item_relink_stub(struct item *it, struct item *nit)
+{
+    ASSERT(it->hv == nit->hv);
 
-    if (settings.oldest_live != 0 && settings.oldest_live <= time_now() &&
-        it->atime <= settings.oldest_live) {
+    item_lock(it->hv);
+    if (item_is_linked(it)) {
         _item_unlink(it);
-        stats_slab_incr(it->id, item_expire);
-        log_debug(LOG_VERB, "it '%.*s' nuked", nkey, key);
-        return NULL;
+        _item_link_cas(nit, item_get_cas(it));
     }
+    item_unlock(it->hv);
+}
 
-    item_acquire_refcount(it);
+/*
+ * Get the items of n keys at once, as for a multiget, with their hashes
+ * already computed. A lookup mostly stalls on cache misses, first on the
+ * hash bucket and then on the item header it leads to. So instead of
+ * looking up keys one after the other, the buckets of all keys are
+ * prefetched, then the items in these buckets, and only then are the keys
+ * looked up, by which time their cache lines are hopefully in flight or
+ * in cache. Keys are taken ITEM_GET_MULTI_BATCH at a time, which keeps
+ * the prefetched lines from being evicted before use, and bounds how long
+ * a worker stays within an epoch.
+ *
+ * On return, it[i] is the refcounted item of key[i], or NULL on a miss.
+ */
+void
+item_get_multi(char **key, uint8_t *nkey, uint32_t *hv, struct item **it,
+               uint32_t n)
+{
+    bool done[ITEM_GET_MULTI_BATCH];
+    uint32_t i, j, nbatch;
 
-    log_debug(LOG_VERB, "get it '%.*s' found at offset %"PRIu32" with flags "
-              "%02x id %"PRIu8" refcount %"PRIu32"", it->nkey, item_key(it),
-              it->offset, it->flags, it->id);
+    for (i = 0; i < n; i += nbatch) {
+        nbatch = MIN(n - i, ITEM_GET_MULTI_BATCH);
+
+        if (!thread_epoch_enter()) {
+            for (j = i; j < i + nbatch; j++) {
+                it[j] = item_get(key[j], nkey[j], hv[j]);
+            }
+            continue;
+        }
 
+        for (j = i; j < i + nbatch; j++) {
+            assoc_prefetch(hv[j]);
+        }
 
-    return it;
-}
+        for (j = i; j < i + nbatch; j++) {
+            assoc_prefetch_items(hv[j]);
+        }
 
-struct item *
-item_get(const char *key, size_t nkey)
-{
-    struct item *it;
+        for (j = i; j < i + nbatch; j++) {
+            done[j - i] = _item_get_lockless(key[j], nkey[j], hv[j], &it[j]);
+        }
 
-    pthread_mutex_lock(&cache_lock);
-    it = _item_get(key, nkey);
-    if (__atomic_load_n(&settings.hotkey_enable, __ATOMIC_RELAXED) && it != NULL) {
-        it->dataflags &= ~(ITEM_HOT_QPS | ITEM_HOT_BW);
-        it->dataflags |= hotkey_sample(key, nkey, it->nbyte);
-    }
-    pthread_mutex_unlock(&cache_lock);
+        thread_epoch_exit();
 
-    return it;
+        for (j = i; j < i + nbatch; j++) {
+            if (!done[j - i] ||
+                !item_get_lockless_check(key[j], nkey[j], hv[j], it[j])) {
+                item_lock(hv[j]);
+                it[j] = _item_get(key[j], nkey[j], hv[j]);
+                item_unlock(hv[j]);
+            }
+
+            admit_record(hv[j]);
+            mrc_get(key[j], nkey[j], hv[j]);
+
+            if (it[j] != NULL) {
+                item_get_sample(key[j], nkey[j], it[j]);
+            }
+        }
+    }
 }
 
 /*
  * Flushes expired items after a "flush_all" call. Expires items that
  * are more recent than the oldest_live setting
  */
-static void
-_item_flush_expired(void)
+void
+item_flush_expired(void)
 {
     uint8_t i;
-    struct item *it, *next;
+    struct item *it;
+    uint32_t hv;
 
     if (settings.oldest_live == 0) {
         return;
     }
 
+    if (settings.storage == STORAGE_SEG) {
+        seg_flush();
+        return;
+    }
+
     for (i = SLABCLASS_MIN_ID; i <= SLABCLASS_MAX_ID; i++) {
         /*
          * Lru q is sorted in ascending time order -- oldest to most recent.
@@ -700,29 +2431,43 @@ _item_flush_expired(void)
          * proactively flush most recent ones in a given queue until we hit
          * an item older than oldest_live. Older items in this queue are then
          * lazily expired by oldest_live check in item_get.
+         *
+         * With a segmented lru q, each segment is walked in turn.
+         *
+         * An item is unlinked with its stripe held but without the lru q
+         * lock, which sits below the stripes in the lock hierarchy. Items
+         * whose stripe is busy are skipped and left for the lazy check.
          */
-        TAILQ_FOREACH_REVERSE_SAFE(it, &item_lruq[i], item_tqh, i_tqe, next) {
-            ASSERT(!item_is_slabbed(it));
+        for (;;) {
+            item_lruq_lock(i);
+            for (it = item_q_last(&item_lruq[i]); it != NULL;) {
+                ASSERT(!item_is_slabbed(it));
+
+                if (it->atime < settings.oldest_live) {
+                    it = policy_segment_prev(i, it);
+                    continue;
+                }
+
+                hv = it->hv;
+                if (item_trylock(hv)) {
+                    break;
+                }
+                it = item_q_prev(it);
+            }
+            item_lruq_unlock(i);
 
-            if (it->atime < settings.oldest_live) {
+            if (it == NULL) {
                 break;
             }
 
             _item_unlink(it);
+            item_unlock(hv);
 
-            stats_slab_incr(it->id, item_evict);
+            stats_slab_incr(i, item_evict);
         }
     }
 }
 
-void
-item_flush_expired(void)
-{
-    pthread_mutex_lock(&cache_lock);
-    _item_flush_expired();
-    pthread_mutex_unlock(&cache_lock);
-}
-
 static void
 _item_set(struct conn *c)
 {
@@ -731,7 +2476,7 @@ _item_set(struct conn *c)
 
     it = c->item;
     key = item_key(it);
-    oit = _item_get(key, it->nkey);
+    oit = _item_get(key, it->nkey, it->hv);
     if (oit == NULL) {
         _item_link(it);
     } else {
@@ -747,9 +2492,14 @@ _item_set(struct conn *c)
 void
 item_set(struct conn *c)
 {
-    pthread_mutex_lock(&cache_lock);
+    uint32_t hv;
+
+    hv = ((struct item *)c->item)->hv;
+    item_lock(hv);
     _item_set(c);
-    pthread_mutex_unlock(&cache_lock);
+    item_unlock(hv);
+
+    mrc_set(c->item);
 }
 
 static item_cas_result_t
@@ -761,7 +2511,7 @@ _item_cas(struct conn *c)
 
     it = c->item;
     key = item_key(it);
-    oit = _item_get(key, it->nkey);
+    oit = _item_get(key, it->nkey, it->hv);
     if (oit == NULL) {
         ret = CAS_NOT_FOUND;
 
@@ -797,10 +2547,16 @@ item_cas_result_t
 item_cas(struct conn *c)
 {
     item_cas_result_t ret;
+    uint32_t hv;
 
-    pthread_mutex_lock(&cache_lock);
+    hv = ((struct item *)c->item)->hv;
+    item_lock(hv);
     ret = _item_cas(c);
-    pthread_mutex_unlock(&cache_lock);
+    item_unlock(hv);
+
+    if (ret == CAS_OK) {
+        mrc_set(c->item);
+    }
 
     return ret;
 }
@@ -814,7 +2570,7 @@ _item_add(struct conn *c)
 
     it = c->item;
     key = item_key(it);
-    oit = _item_get(key, it->nkey);
+    oit = _item_get(key, it->nkey, it->hv);
     if (oit != NULL) {
         _item_remove(oit);
 
@@ -836,10 +2592,16 @@ item_add_result_t
 item_add(struct conn *c)
 {
     item_add_result_t ret;
+    uint32_t hv;
 
-    pthread_mutex_lock(&cache_lock);
+    hv = ((struct item *)c->item)->hv;
+    item_lock(hv);
     ret = _item_add(c);
-    pthread_mutex_unlock(&cache_lock);
+    item_unlock(hv);
+
+    if (ret == ADD_OK) {
+        mrc_set(c->item);
+    }
 
     return ret;
 }
@@ -853,7 +2615,7 @@ _item_replace(struct conn *c)
 
     it = c->item;
     key = item_key(it);
-    oit = _item_get(key, it->nkey);
+    oit = _item_get(key, it->nkey, it->hv);
     if (oit == NULL) {
         ret = REPLACE_NOT_FOUND;
     } else {
@@ -874,10 +2636,16 @@ item_replace_result_t
 item_replace(struct conn *c)
 {
     item_replace_result_t ret;
+    uint32_t hv;
 
-    pthread_mutex_lock(&cache_lock);
+    hv = ((struct item *)c->item)->hv;
+    item_lock(hv);
     ret = _item_replace(c);
-    pthread_mutex_unlock(&cache_lock);
+    item_unlock(hv);
+
+    if (ret == REPLACE_OK) {
+        mrc_set(c->item);
+    }
 
     return ret;
 }
@@ -891,12 +2659,13 @@ _item_annex(uint32_t *nbyte, uint8_t *oid, uint8_t *nid, struct conn *c)
     struct item *it, *oit, *nit;
     uint8_t id;
     uint32_t total_nbyte;
+    bool append;
 
     ret = ANNEX_OK;
 
     it = c->item;
     key = item_key(it);
-    oit = _item_get(key, it->nkey);
+    oit = _item_get_data(key, it->nkey, it->hv);
     nit = NULL;
     if (oit == NULL) {
         ret = ANNEX_NOT_FOUND;
@@ -921,7 +2690,27 @@ _item_annex(uint32_t *nbyte, uint8_t *oid, uint8_t *nid, struct conn *c)
               " id %"PRId8"", oit->nkey, item_key(oit), oit->offset, oit->flags,
               oit->id);
 
-    if (c->req_type == REQ_APPEND || c->req_type == REQ_APPENDRL) {
+    append = (c->req_type == REQ_APPEND || c->req_type == REQ_APPENDRL);
+
+    if (item_is_chunked(oit) || item_is_chunked(it) ||
+        item_needs_chunks(oit->nkey, total_nbyte)) {
+        /*
+         * Chunked data is never annexed in place, but copied over into a
+         * new item, one span at a time.
+         */
+        nit = _item_alloc(id, key, oit->nkey, oit->hv, oit->dataflags,
+                          oit->exptime, total_nbyte);
+        if (nit == NULL) {
+            ret = ANNEX_EOM;
+
+            goto annex_done;
+        }
+
+        item_data_copy(nit, 0, append ? oit : it);
+        item_data_copy(nit, append ? oit->nbyte : it->nbyte,
+                       append ? it : oit);
+        _item_relink(oit, nit);
+    } else if (append) {
         /* if oit is large enough to hold the extra data and left-aligned,
          * which is the default behavior, we copy the delta to the end of
          * the existing data. Otherwise, allocate a new item and store the
@@ -932,7 +2721,7 @@ _item_annex(uint32_t *nbyte, uint8_t *oid, uint8_t *nid, struct conn *c)
             oit->nbyte = total_nbyte;
             item_set_cas(oit, item_next_cas());
         } else {
-            nit = _item_alloc(id, key, oit->nkey, oit->dataflags,
+            nit = _item_alloc(id, key, oit->nkey, oit->hv, oit->dataflags,
                               oit->exptime, total_nbyte);
             if (nit == NULL) {
                 ret = ANNEX_EOM;
@@ -955,7 +2744,7 @@ _item_annex(uint32_t *nbyte, uint8_t *oid, uint8_t *nid, struct conn *c)
             oit->nbyte = total_nbyte;
             item_set_cas(oit, item_next_cas());
         } else {
-            nit = _item_alloc(id, key, oit->nkey, oit->dataflags,
+            nit = _item_alloc(id, key, oit->nkey, oit->hv, oit->dataflags,
                               oit->exptime, total_nbyte);
             if (nit == NULL) {
                 ret = ANNEX_EOM;
@@ -991,9 +2780,12 @@ item_annex_result_t
 item_annex(uint32_t *nbyte, uint8_t *oid, uint8_t *nid, struct conn *c)
 {
     item_annex_result_t ret;
-    pthread_mutex_lock(&cache_lock);
+    uint32_t hv;
+
+    hv = ((struct item *)c->item)->hv;
+    item_lock(hv);
     ret = _item_annex(nbyte, oid, nid, c);
-    pthread_mutex_unlock(&cache_lock);
+    item_unlock(hv);
 
     return ret;
 }
@@ -1002,7 +2794,8 @@ item_annex(uint32_t *nbyte, uint8_t *oid, uint8_t *nid, struct conn *c)
  * Apply a delta value (positive or negative) to an item.
  */
 static item_delta_result_t
-_item_delta(uint64_t *value, char *key, size_t nkey, bool incr, uint64_t delta)
+_item_delta(uint64_t *value, char *key, size_t nkey, uint32_t hv, bool incr,
+            uint64_t delta)
 {
     item_delta_result_t ret = DELTA_OK;
     int res;
@@ -1010,7 +2803,7 @@ _item_delta(uint64_t *value, char *key, size_t nkey, bool incr, uint64_t delta)
     struct item *it;
     char buf[INCR_MAX_STORAGE_LEN];
 
-    it = _item_get(key, nkey);
+    it = _item_get_data(key, nkey, hv);
     if (it == NULL) {
         return DELTA_NOT_FOUND;
 
@@ -1019,7 +2812,7 @@ _item_delta(uint64_t *value, char *key, size_t nkey, bool incr, uint64_t delta)
 
     ptr = item_data(it);
 
-    if (!mc_strtoull_len(ptr, value, it->nbyte)) {
+    if (item_is_chunked(it) || !mc_strtoull_len(ptr, value, it->nbyte)) {
         ret = DELTA_NON_NUMERIC;
 
         goto delta_done;
@@ -1042,8 +2835,8 @@ _item_delta(uint64_t *value, char *key, size_t nkey, bool incr, uint64_t delta)
         id = item_slabid(it->nkey, res);
         ASSERT(id != SLABCLASS_INVALID_ID);
 
-        new_it = _item_alloc(id, item_key(it), it->nkey, it->dataflags,
-                             it->exptime, res);
+        new_it = _item_alloc(id, item_key(it), it->nkey, it->hv,
+                             it->dataflags, it->exptime, res);
         if (new_it == NULL) {
             ret = DELTA_EOM;
             goto delta_done;
@@ -1071,13 +2864,14 @@ delta_done:
 }
 
 item_delta_result_t
-item_delta(uint64_t *value, char *key, size_t nkey, bool incr, uint64_t delta)
+item_delta(uint64_t *value, char *key, size_t nkey, uint32_t hv, bool incr,
+           uint64_t delta)
 {
     item_delta_result_t ret;
 
-    pthread_mutex_lock(&cache_lock);
-    ret = _item_delta(value, key, nkey, incr, delta);
-    pthread_mutex_unlock(&cache_lock);
+    item_lock(hv);
+    ret = _item_delta(value, key, nkey, hv, incr, delta);
+    item_unlock(hv);
 
     return ret;
 }
@@ -1086,20 +2880,24 @@ item_delta(uint64_t *value, char *key, size_t nkey, bool incr, uint64_t delta)
  * Unlink an item and remove it (if its recount drops to zero).
  */
 item_delete_result_t
-item_delete(char *key, size_t nkey)
+item_delete(char *key, size_t nkey, uint32_t hv)
 {
     item_delete_result_t ret = DELETE_OK;
     struct item *it;
 
-    pthread_mutex_lock(&cache_lock);
-    it = _item_get(key, nkey);
+    item_lock(hv);
+    it = _item_get(key, nkey, hv);
     if (it != NULL) {
         _item_unlink(it);
         _item_remove(it);
     } else {
         ret = DELETE_NOT_FOUND;
     }
-    pthread_mutex_unlock(&cache_lock);
+    /* nor may a copy on its way to the second tier come back */
+    ext_cancel(hv);
+    item_unlock(hv);
+
+    mrc_delete(key, nkey, hv);
 
     return ret;
 }
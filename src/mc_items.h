@@ -31,10 +31,14 @@
 #define _MC_ITEMS_H_
 
 typedef enum item_flags {
-    ITEM_LINKED  = 1,  /* item in lru q and hash */
-    ITEM_CAS     = 2,  /* item has cas */
-    ITEM_SLABBED = 4,  /* item in free q */
-    ITEM_RALIGN  = 8,  /* item data (payload) is right-aligned */
+    ITEM_LINKED   = 1,  /* item in lru q and hash */
+    ITEM_CAS      = 2,  /* item has cas */
+    ITEM_SLABBED  = 4,  /* item in free q, or freed within its segment */
+    ITEM_RALIGN   = 8,  /* item data (payload) is right-aligned */
+    ITEM_ACCESSED = 16, /* item read since it was written or merged */
+    ITEM_CHUNKED  = 32, /* item data (payload) is spread over chunk items */
+    ITEM_CHUNK    = 64, /* item holds a piece of the data of a chunked item */
+    ITEM_EXT      = 128,/* item is a stub of an item kept in the second tier */
 
 } item_flags_t;
 
@@ -115,32 +119,79 @@ typedef enum item_delta_result {
  * - 8-byte cas, if ITEM_CAS flag is set
  * - key with terminating '\0', length = item->nkey + 1
  * - data with no terminating '\0'
+ *
+ * Items link to each other in an lru q or free q (i_next, i_prev) and in
+ * a hash chain (h_next). A link is an item pointer, unless twemcache is
+ * configured with --enable-compact-items, in which case it is a 32-bit
+ * reference made of the index of the slab of the item in the slab table
+ * (slab->sid) followed by the offset of the item in its slab, in units of
+ * MC_ALIGNMENT. This saves 12 bytes per item, but limits the slab heap to
+ * 2^32 * MC_ALIGNMENT bytes (32GB). Offset 0 of a slab is its header, so a
+ * null link is 0 either way.
+ *
+ * An item too large for the largest item chunk (see --max-item-size) is
+ * chunked (ITEM_CHUNKED): in place of its data, it holds an array of links
+ * to the chunk items (ITEM_CHUNK) its data and trailing CRLF are spread
+ * over. All but the last chunk are items of the largest slab class, filled
+ * to the brim; the last one is of the smallest class that fits what is
+ * left. A chunk has no key and is neither linked nor refcounted, it links
+ * back to its chunked item through h_next, shares its hash value and is
+ * freed along with it.
+ *
+ * An item evicted while still live can be kept in the second tier (see
+ * mc_extstore.h), in which case a stub of it (ITEM_EXT) is linked in its
+ * place, which holds the key, flags, expiry time and cas of the item, but
+ * only the location of its data in the second tier as data.
  */
+#if MC_COMPACT_ITEMS == 1
+typedef uint32_t item_link_t;
+#else
+typedef struct item *item_link_t;
+#endif
+
 struct item {
 #if MC_ASSERT_PANIC == 1 || MC_ASSERT_LOG == 1
     uint32_t          magic;      /* item magic (const) */
 #endif
-    TAILQ_ENTRY(item) i_tqe;      /* link in lru q or free q */
-    SLIST_ENTRY(item) h_sle;      /* link in hash */
+    item_link_t       i_next;     /* next in lru q or free q */
+    item_link_t       i_prev;     /* prev in lru q or free q */
+    item_link_t       h_next;     /* next in hash */
     rel_time_t        atime;      /* last access time in secs */
     rel_time_t        exptime;    /* expiry time in secs */
     uint32_t          nbyte;      /* date size */
     uint32_t          offset;     /* offset of item in slab */
     uint32_t          dataflags;  /* data flags opaque to the server */
-    uint16_t          refcount;   /* # concurrent users of item */
-    uint8_t           flags;      /* item flags */
-    uint8_t           id;         /* slab class id */
+    uint32_t          hv;         /* hash value of key */
+    union {
+        struct {
+            uint16_t  refcount;   /* # concurrent users of item */
+            uint8_t   flags;      /* item flags */
+            uint8_t   id;         /* slab class id */
+        };
+        uint32_t      state;      /* refcount, flags and id as one word */
+    };
     uint8_t           nkey;       /* key length */
+    uint8_t           qflags;     /* lru q state of eviction policy */
     char              end[1];     /* item data */
 };
 
-SLIST_HEAD(item_slh, item);
+/* head of a hash chain */
+struct item_slh {
+    struct item *first;
+};
 
-TAILQ_HEAD(item_tqh, item);
+/* head of an lru q or free q */
+struct item_tqh {
+    struct item *first;
+    struct item *last;
+};
 
 #define ITEM_MAGIC      0xfeedface
 #define ITEM_HDR_SIZE   offsetof(struct item, end)
 
+#define ITEM_LOCK_POWER     10  /* default # item lock stripes, as power of 2 */
+#define ITEM_LOCK_MAX_POWER 16
+
 /*
  * An item chunk is the portion of the memory carved out from the slab
  * for an item. An item chunk contains the item header followed by item
@@ -161,6 +212,12 @@ TAILQ_HEAD(item_tqh, item);
 #define ITEM_CHUNK_SIZE     \
     MC_ALIGN(ITEM_HDR_SIZE + ITEM_PAYLOAD_SIZE, MC_ALIGNMENT)
 
+/*
+ * Items larger than the largest item chunk are chunked (see struct item),
+ * up to this size
+ */
+#define ITEM_MAX_SIZE       ((size_t)(1024 * MB))
+
 
 #if __GNUC__ >= 4 && __GNUC_MINOR__ >= 2
 #pragma GCC diagnostic ignored "-Wstrict-aliasing"
@@ -186,6 +243,21 @@ item_is_raligned(struct item *it) {
     return (it->flags & ITEM_RALIGN);
 }
 
+static inline bool
+item_is_chunked(struct item *it) {
+    return (it->flags & ITEM_CHUNKED);
+}
+
+static inline bool
+item_is_chunk(struct item *it) {
+    return (it->flags & ITEM_CHUNK);
+}
+
+static inline bool
+item_is_ext(struct item *it) {
+    return (it->flags & ITEM_EXT);
+}
+
 static inline uint64_t
 item_get_cas(struct item *it)
 {
@@ -211,6 +283,209 @@ item_set_cas(struct item *it, uint64_t cas)
 #pragma GCC diagnostic pop
 #endif
 
+#if MC_COMPACT_ITEMS == 1
+extern struct slab **slab_table;
+extern uint32_t item_link_shift;
+
+item_link_t item_2_link(struct item *it);
+
+static inline struct item *
+item_link_2_item(item_link_t link)
+{
+    uint32_t mask;
+
+    if (link == 0) {
+        return NULL;
+    }
+
+    mask = (1U << item_link_shift) - 1;
+
+    return (struct item *)((uint8_t *)slab_table[link >> item_link_shift] +
+                           (size_t)(link & mask) * MC_ALIGNMENT);
+}
+#else
+static inline item_link_t
+item_2_link(struct item *it)
+{
+    return it;
+}
+
+static inline struct item *
+item_link_2_item(item_link_t link)
+{
+    return link;
+}
+#endif
+
+/*
+ * Lru q and free q primitives, along the lines of TAILQ in mc_queue.h
+ */
+static inline void
+item_q_init(struct item_tqh *q)
+{
+    q->first = NULL;
+    q->last = NULL;
+}
+
+static inline bool
+item_q_empty(struct item_tqh *q)
+{
+    return (q->first == NULL);
+}
+
+static inline struct item *
+item_q_first(struct item_tqh *q)
+{
+    return q->first;
+}
+
+static inline struct item *
+item_q_last(struct item_tqh *q)
+{
+    return q->last;
+}
+
+static inline struct item *
+item_q_next(struct item *it)
+{
+    return item_link_2_item(it->i_next);
+}
+
+static inline struct item *
+item_q_prev(struct item *it)
+{
+    return item_link_2_item(it->i_prev);
+}
+
+static inline void
+item_q_insert_head(struct item_tqh *q, struct item *it)
+{
+    item_link_t link = item_2_link(it);
+
+    it->i_prev = item_2_link(NULL);
+    it->i_next = item_2_link(q->first);
+    if (q->first != NULL) {
+        q->first->i_prev = link;
+    } else {
+        q->last = it;
+    }
+    q->first = it;
+}
+
+static inline void
+item_q_insert_tail(struct item_tqh *q, struct item *it)
+{
+    item_link_t link = item_2_link(it);
+
+    it->i_next = item_2_link(NULL);
+    it->i_prev = item_2_link(q->last);
+    if (q->last != NULL) {
+        q->last->i_next = link;
+    } else {
+        q->first = it;
+    }
+    q->last = it;
+}
+
+static inline void
+item_q_remove(struct item_tqh *q, struct item *it)
+{
+    struct item *next, *prev;
+
+    next = item_q_next(it);
+    prev = item_q_prev(it);
+
+    if (next != NULL) {
+        next->i_prev = it->i_prev;
+    } else {
+        q->last = prev;
+    }
+
+    if (prev != NULL) {
+        prev->i_next = it->i_next;
+    } else {
+        q->first = next;
+    }
+
+    it->i_next = item_2_link(NULL);
+    it->i_prev = item_2_link(NULL);
+}
+
+static inline void
+item_q_insert_before(struct item_tqh *q, struct item *pos, struct item *it)
+{
+    struct item *prev = item_q_prev(pos);
+    item_link_t link = item_2_link(it);
+
+    it->i_next = item_2_link(pos);
+    it->i_prev = pos->i_prev;
+    if (prev != NULL) {
+        prev->i_next = link;
+    } else {
+        q->first = it;
+    }
+    pos->i_prev = link;
+}
+
+/*
+ * Move all items of q2 to the tail of q, leaving q2 empty
+ */
+static inline void
+item_q_concat(struct item_tqh *q, struct item_tqh *q2)
+{
+    if (q2->first == NULL) {
+        return;
+    }
+
+    if (q->last != NULL) {
+        q->last->i_next = item_2_link(q2->first);
+        q2->first->i_prev = item_2_link(q->last);
+    } else {
+        q->first = q2->first;
+    }
+    q->last = q2->last;
+
+    item_q_init(q2);
+}
+
+/*
+ * Hash chain primitives, along the lines of SLIST in mc_queue.h. Lockless
+ * readers walk chains as they are being modified, which is why links are
+ * published with release semantics, and read by them with acquire.
+ */
+static inline struct item *
+item_h_next(struct item *it)
+{
+    return item_link_2_item(it->h_next);
+}
+
+static inline struct item *
+item_h_next_lockless(struct item *it)
+{
+    return item_link_2_item(__atomic_load_n(&it->h_next, __ATOMIC_ACQUIRE));
+}
+
+static inline void
+item_h_insert_head(struct item_slh *chain, struct item *it)
+{
+    it->h_next = item_2_link(chain->first);
+    __atomic_store_n(&chain->first, it, __ATOMIC_RELEASE);
+}
+
+static inline void
+item_h_remove_head(struct item_slh *chain)
+{
+    __atomic_store_n(&chain->first, item_h_next(chain->first),
+                     __ATOMIC_RELEASE);
+}
+
+static inline void
+item_h_remove_after(struct item *prev)
+{
+    __atomic_store_n(&prev->h_next, item_h_next(prev)->h_next,
+                     __ATOMIC_RELEASE);
+}
+
 static inline char *
 item_key(struct item *it)
 {
@@ -246,32 +521,85 @@ item_size(struct item *it)
     return item_ntotal(it->nkey, it->nbyte, item_has_cas(it));
 }
 
-void item_init(void);
+struct item_restore;
+
+/*
+ * Snapshot of an item, taken by item_snapshot()
+ */
+struct item_snapshot {
+    struct item *it;        /* chunked item, refcounted, or NULL */
+    uint64_t    cas;        /* cas */
+    rel_time_t  exptime;    /* expiry time */
+    uint32_t    dataflags;  /* data flags opaque to the server */
+    uint32_t    nbyte;      /* data size */
+    uint8_t     nkey;       /* key length */
+};
+
+/*
+ * Accesses a worker thread made to items, which are applied to the lru q
+ * later, in batches (see item_touch)
+ */
+struct item_access_log {
+    pthread_mutex_t   lock; /* held by whoever applies the log */
+    struct ring_array *ring; /* accesses not applied yet */
+};
+
+rstatus_t item_init(void);
 void item_deinit(void);
 
+void item_lock(uint32_t hv);
+void item_unlock(uint32_t hv);
+bool item_trylock(uint32_t hv);
+void item_lock_all(void);
+void item_unlock_all(void);
+void item_lruq_lock(uint8_t id);
+void item_lruq_unlock(uint8_t id);
+
 char * item_data(struct item *it);
+char *item_data_span(struct item *it, uint32_t idx, uint32_t *nbyte);
+void item_data_read(struct item *it, uint32_t offset, char *buf, uint32_t nbyte);
+uint32_t item_nchunk(struct item *it);
+struct item *item_chunk(struct item *it, uint32_t idx);
 struct slab *item_2_slab(struct item *it);
 
 void item_hdr_init(struct item *it, uint32_t offset, uint8_t id);
+void item_acquire_refcount(struct item *it);
 
 uint8_t item_slabid(uint8_t nkey, uint32_t nbyte);
-struct item *item_alloc(uint8_t id, char *key, uint8_t nkey, uint32_t dataflags, rel_time_t exptime, uint32_t nbyte);
+struct item *item_alloc(uint8_t id, char *key, uint8_t nkey, uint32_t hv, uint32_t dataflags, rel_time_t exptime, uint32_t nbyte);
+bool item_admit(uint8_t id, uint32_t hv);
+bool item_stale(struct item *it);
 
-void item_reuse(struct item *it);
+bool item_reuse(struct item *it);
+bool item_move(struct item *it, struct item *nit);
+void item_unlink(struct item *it);
 
 void item_remove(struct item *it);
 void item_touch(struct item *it);
+struct item_access_log *item_access_create(void);
+void item_access_drain(uint32_t max);
 char *item_cache_dump(uint8_t id, uint32_t limit, uint32_t *bytes);
 
-struct item *item_get(const char *key, size_t nkey);
+struct item *item_get(const char *key, size_t nkey, uint32_t hv);
+void item_get_multi(char **key, uint8_t *nkey, uint32_t *hv, struct item **it, uint32_t n);
 void item_flush_expired(void);
+bool item_reap(struct item *it, uint32_t hv);
+struct item_restore *item_restore_create(intptr_t delta, uint32_t nslab);
+void item_restore(struct item_restore *r, struct item *it);
+bool item_restored(struct item_restore *r, struct item *it);
+uint64_t item_restore_done(struct item_restore *r);
+bool item_snapshot(struct item *it, struct item_snapshot *s, char *buf);
+bool item_load(char *key, uint8_t nkey, uint32_t dataflags, rel_time_t exptime, uint64_t cas, const char *data, uint32_t nbyte);
+bool item_link_stub(struct item *it, uint64_t cas);
+void item_unlink_stub(struct item *it);
+void item_relink_stub(struct item *it, struct item *nit);
 
 void item_set(struct conn *c);
 item_cas_result_t item_cas(struct conn *c);
 item_add_result_t item_add(struct conn *c);
 item_replace_result_t item_replace(struct conn *c);
 item_annex_result_t item_annex(uint32_t *nbyte, uint8_t *oid, uint8_t *nid, struct conn *c);
-item_delta_result_t item_delta(uint64_t *value, char *key, size_t nkey, bool incr, uint64_t delta);
-item_delete_result_t item_delete(char *key, size_t nkey);
+item_delta_result_t item_delta(uint64_t *value, char *key, size_t nkey, uint32_t hv, bool incr, uint64_t delta);
+item_delete_result_t item_delete(char *key, size_t nkey, uint32_t hv);
 
 #endif
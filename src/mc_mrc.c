@@ -0,0 +1,390 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <mc_core.h>
+
+extern struct settings settings;
+
+#define MRC_SAMPLE_MUL  0x9e3779b1  /* spreads a key hash before sampling */
+#define MRC_FP_SEED     0x6d7263    /* seed of the key fingerprint hash */
+
+struct mrc_entry {
+    TAILQ_ENTRY(mrc_entry) s_tqe;   /* link in lru stack or free q */
+    struct mrc_entry       *h_next; /* next entry in hash bucket */
+    uint32_t               hv;      /* key hash */
+    uint32_t               fp;      /* key fingerprint */
+    uint32_t               nbyte;   /* memory taken up by the item */
+    uint8_t                level;   /* smallest shadow cache holding it */
+};
+
+TAILQ_HEAD(mrc_tqh, mrc_entry);
+
+/* shadow cache sizes, in halves of the cache size */
+static const uint32_t mrc_nhalf[MRC_NSIZE] = { 1, 2, 4, 8 };
+
+static struct {
+    pthread_mutex_t  lock;                /* lock protecting all of below */
+    struct mrc_entry *entry;              /* all entries */
+    struct mrc_entry **bucket;            /* hash table of entries in stack */
+    uint32_t         mask;                /* # buckets - 1 */
+    uint32_t         shift;               /* log2 of 1 / sample rate */
+    uint32_t         nentry;              /* # entries in stack */
+    struct mrc_tqh   stack;               /* lru stack, most recent first */
+    struct mrc_tqh   freeq;               /* free entries */
+    struct mrc_entry *tail[MRC_NSIZE];    /* last entry of each segment */
+    uint64_t         nbyte[MRC_NSIZE];    /* # bytes of each segment */
+    uint64_t         max_nbyte[MRC_NSIZE];/* max # bytes of each segment */
+    uint64_t         nget;                /* # sampled gets */
+    uint64_t         nhit[MRC_NSIZE];     /* # sampled gets hit by each cache */
+    uint64_t         nsec;                /* nsec spent on sampled keys */
+} mrc;
+
+/*
+ * Sampled keys take a few hundred nsec each, so time is kept in nsec
+ */
+static uint64_t
+mrc_nsec_since(struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (uint64_t)(end.tv_sec - start->tv_sec) * 1000000000 +
+           (end.tv_nsec - start->tv_nsec);
+}
+
+static bool
+mrc_sampled(uint32_t hv)
+{
+    return mrc.shift == 0 || (hv * MRC_SAMPLE_MUL) >> (32 - mrc.shift) == 0;
+}
+
+/*
+ * Return the slab memory taken up by an item and its chunks.
+ */
+static uint32_t
+mrc_item_nbyte(struct item *it)
+{
+    uint32_t i, nchunk;
+    size_t nbyte;
+
+    nbyte = slab_item_footprint(slab_item_size(it->id));
+    if (item_is_chunked(it)) {
+        nchunk = item_nchunk(it);
+        for (i = 0; i < nchunk; i++) {
+            nbyte += slab_item_footprint(slab_item_size(item_chunk(it, i)->id));
+        }
+    }
+
+    return (uint32_t)nbyte;
+}
+
+static struct mrc_entry **
+mrc_bucket(uint32_t fp)
+{
+    return &mrc.bucket[fp & mrc.mask];
+}
+
+static struct mrc_entry *
+mrc_lookup(uint32_t hv, uint32_t fp)
+{
+    struct mrc_entry *e;
+
+    for (e = *mrc_bucket(fp); e != NULL; e = e->h_next) {
+        if (e->hv == hv && e->fp == fp) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Take an entry off the lru stack.
+ */
+static void
+mrc_unlink(struct mrc_entry *e)
+{
+    struct mrc_entry *prev = TAILQ_PREV(e, mrc_tqh, s_tqe);
+
+    if (mrc.tail[e->level] == e) {
+        mrc.tail[e->level] = (prev != NULL && prev->level == e->level) ?
+                             prev : NULL;
+    }
+    mrc.nbyte[e->level] -= e->nbyte;
+    TAILQ_REMOVE(&mrc.stack, e, s_tqe);
+}
+
+/*
+ * Take an entry off the lru stack and out of the hash table, and free it.
+ */
+static void
+mrc_free(struct mrc_entry *e)
+{
+    struct mrc_entry **pe;
+
+    mrc_unlink(e);
+
+    for (pe = mrc_bucket(e->fp); *pe != e; pe = &(*pe)->h_next) {
+        /* void */
+    }
+    *pe = e->h_next;
+
+    TAILQ_INSERT_HEAD(&mrc.freeq, e, s_tqe);
+    mrc.nentry--;
+}
+
+static struct mrc_entry *
+mrc_alloc(uint32_t hv, uint32_t fp)
+{
+    struct mrc_entry *e, **pe;
+
+    if (TAILQ_EMPTY(&mrc.freeq)) {
+        /* the largest shadow cache is short of entries */
+        mrc_free(TAILQ_LAST(&mrc.stack, mrc_tqh));
+    }
+
+    e = TAILQ_FIRST(&mrc.freeq);
+    TAILQ_REMOVE(&mrc.freeq, e, s_tqe);
+    mrc.nentry++;
+
+    e->hv = hv;
+    e->fp = fp;
+    pe = mrc_bucket(fp);
+    e->h_next = *pe;
+    *pe = e;
+
+    return e;
+}
+
+/*
+ * Put an entry on top of the lru stack, and push the last entries of every
+ * segment that outgrew its shadow cache down into the next one, or out of
+ * the stack from the last one.
+ */
+static void
+mrc_push(struct mrc_entry *e)
+{
+    struct mrc_entry *last, *prev;
+    uint32_t i;
+
+    e->level = 0;
+    TAILQ_INSERT_HEAD(&mrc.stack, e, s_tqe);
+    if (mrc.tail[0] == NULL) {
+        mrc.tail[0] = e;
+    }
+    mrc.nbyte[0] += e->nbyte;
+
+    for (i = 0; i < MRC_NSIZE; i++) {
+        while (mrc.nbyte[i] > mrc.max_nbyte[i]) {
+            last = mrc.tail[i];
+            if (i == MRC_NSIZE - 1) {
+                mrc_free(last);
+                continue;
+            }
+
+            prev = TAILQ_PREV(last, mrc_tqh, s_tqe);
+            mrc.tail[i] = (prev != NULL && prev->level == i) ? prev : NULL;
+            mrc.nbyte[i] -= last->nbyte;
+
+            last->level = i + 1;
+            if (mrc.tail[i + 1] == NULL) {
+                mrc.tail[i + 1] = last;
+            }
+            mrc.nbyte[i + 1] += last->nbyte;
+        }
+    }
+}
+
+/*
+ * Record a get of a key, whether or not the cache has it.
+ */
+void
+mrc_get(const char *key, size_t nkey, uint32_t hv)
+{
+    struct mrc_entry *e;
+    struct timespec start;
+    uint32_t fp, i;
+
+    if (!mrc_sampled(hv)) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fp = hash(key, nkey, MRC_FP_SEED);
+
+    pthread_mutex_lock(&mrc.lock);
+
+    mrc.nget++;
+    e = mrc_lookup(hv, fp);
+    if (e != NULL) {
+        for (i = e->level; i < MRC_NSIZE; i++) {
+            mrc.nhit[i]++;
+        }
+        mrc_unlink(e);
+        mrc_push(e);
+    }
+
+    mrc.nsec += mrc_nsec_since(&start);
+    pthread_mutex_unlock(&mrc.lock);
+}
+
+/*
+ * Record the store of an item, which every shadow cache takes in.
+ */
+void
+mrc_set(struct item *it)
+{
+    struct mrc_entry *e;
+    struct timespec start;
+    uint32_t fp;
+
+    if (!mrc_sampled(it->hv)) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fp = hash(item_key(it), it->nkey, MRC_FP_SEED);
+
+    pthread_mutex_lock(&mrc.lock);
+
+    e = mrc_lookup(it->hv, fp);
+    if (e != NULL) {
+        mrc_unlink(e);
+    } else {
+        e = mrc_alloc(it->hv, fp);
+    }
+    e->nbyte = mrc_item_nbyte(it);
+    mrc_push(e);
+
+    mrc.nsec += mrc_nsec_since(&start);
+    pthread_mutex_unlock(&mrc.lock);
+}
+
+/*
+ * Record the delete of a key, which every shadow cache forgets.
+ */
+void
+mrc_delete(const char *key, size_t nkey, uint32_t hv)
+{
+    struct mrc_entry *e;
+    struct timespec start;
+    uint32_t fp;
+
+    if (!mrc_sampled(hv)) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fp = hash(key, nkey, MRC_FP_SEED);
+
+    pthread_mutex_lock(&mrc.lock);
+
+    e = mrc_lookup(hv, fp);
+    if (e != NULL) {
+        mrc_free(e);
+    }
+
+    mrc.nsec += mrc_nsec_since(&start);
+    pthread_mutex_unlock(&mrc.lock);
+}
+
+void
+mrc_curve(struct mrc_curve *curve)
+{
+    uint32_t i;
+
+    pthread_mutex_lock(&mrc.lock);
+
+    curve->rate = 1U << mrc.shift;
+    curve->nentry = mrc.nentry;
+    curve->nget = mrc.nget;
+    curve->usec = mrc.nsec / 1000;
+    for (i = 0; i < MRC_NSIZE; i++) {
+        curve->nhit[i] = mrc.nhit[i];
+        curve->size[i] = settings.maxbytes / 2 * mrc_nhalf[i];
+    }
+
+    pthread_mutex_unlock(&mrc.lock);
+}
+
+/*
+ * Pick the sample rate, 1 in 2^MRC_MIN_SHIFT at most, so that the shadow of
+ * a cache as large as this one holds no more than MRC_SAMPLE_SIZE bytes,
+ * and allocate as many entries as there can be items in the largest shadow
+ * cache, up to MRC_MAX_NENTRY.
+ */
+rstatus_t
+mrc_init(void)
+{
+    uint32_t i, nentry, power;
+    uint64_t size;
+
+    for (mrc.shift = MRC_MIN_SHIFT;
+         (settings.maxbytes >> mrc.shift) > MRC_SAMPLE_SIZE;
+         mrc.shift++) {
+        /* void */
+    }
+
+    for (size = 0, i = 0; i < MRC_NSIZE; i++) {
+        mrc.max_nbyte[i] = (settings.maxbytes / 2 * mrc_nhalf[i] >>
+                            mrc.shift) - size;
+        size += mrc.max_nbyte[i];
+    }
+
+    nentry = MIN(size / slab_item_footprint(slab_item_size(SLABCLASS_MIN_ID)),
+                 MRC_MAX_NENTRY);
+    nentry = MAX(nentry, 1);
+    for (power = 0; (1U << power) < nentry; power++) {
+        /* void */
+    }
+
+    mrc.entry = mc_zalloc(sizeof(*mrc.entry) * nentry);
+    mrc.bucket = mc_zalloc(sizeof(*mrc.bucket) << power);
+    if (mrc.entry == NULL || mrc.bucket == NULL) {
+        return MC_ENOMEM;
+    }
+    mrc.mask = (1U << power) - 1;
+
+    TAILQ_INIT(&mrc.stack);
+    TAILQ_INIT(&mrc.freeq);
+    for (i = 0; i < nentry; i++) {
+        TAILQ_INSERT_TAIL(&mrc.freeq, &mrc.entry[i], s_tqe);
+    }
+
+    pthread_mutex_init(&mrc.lock, NULL);
+
+    log_debug(LOG_INFO, "mrc sampling 1 in %"PRIu32" keys into %"PRIu32" "
+              "entries", 1U << mrc.shift, nentry);
+
+    return MC_OK;
+}
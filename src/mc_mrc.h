@@ -0,0 +1,75 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MC_MRC_H_
+#define _MC_MRC_H_
+
+/*
+ * The miss ratio curve tells what the hit ratio of gets would be, had the
+ * cache been given half, as much, twice or four times as much memory as it
+ * has. It is estimated the SHARDS way: keys are sampled spatially, by their
+ * hash, at a rate of 1 in 2^k, and the sampled accesses replayed against
+ * shadow lru caches of 1/2^k of those sizes, which only remember keys and
+ * how much memory their items take up. With k such that the shadow of the
+ * cache as large as the real one holds no more than MRC_SAMPLE_SIZE bytes,
+ * the shadow caches stay small, and keys that are not sampled cost a
+ * multiply and a compare. A sampled key costs a few cache misses, so no
+ * more than 1 in 2^MRC_MIN_SHIFT keys is sampled, which keeps the time
+ * spent on them under 1% of the cpu time of a small cache as well.
+ *
+ * The shadow caches are nested, as a smaller lru cache holds the most
+ * recently used part of a larger one, so they share a single lru stack that
+ * is cut into MRC_NSIZE segments, one more for every size. The hit ratios
+ * are corrected for the skew of the sample when they are reported, as in
+ * SHARDS_adj, see stats_mrc(). The time taken by sampled keys is kept
+ * track of, to tell what the estimate costs.
+ */
+#define MRC_NSIZE           4
+#define MRC_SAMPLE_SIZE     MB
+#define MRC_MIN_SHIFT       5
+#define MRC_MAX_NENTRY      (1 << 16)
+
+struct mrc_curve {
+    uint32_t rate;              /* 1 in rate keys is sampled */
+    uint32_t nentry;            /* # keys in the shadow caches */
+    uint64_t nget;              /* # sampled gets */
+    uint64_t usec;              /* usec spent on sampled keys */
+    uint64_t nhit[MRC_NSIZE];   /* # sampled gets hit by each shadow cache */
+    size_t   size[MRC_NSIZE];   /* memory of the cache of each shadow cache */
+};
+
+rstatus_t mrc_init(void);
+
+void mrc_get(const char *key, size_t nkey, uint32_t hv);
+void mrc_set(struct item *it);
+void mrc_delete(const char *key, size_t nkey, uint32_t hv);
+
+void mrc_curve(struct mrc_curve *curve);
+
+#endif
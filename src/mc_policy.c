@@ -0,0 +1,471 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <mc_core.h>
+
+extern struct settings settings;
+extern struct item_tqh item_lruq[];
+
+#define POLICY_GHOST_MIN_POWER  10
+#define POLICY_GHOST_MAX_POWER  22
+
+/*
+ * Segments of the lru q of a slab class, which are protected by the lru
+ * q lock of the class
+ */
+struct policy_class {
+    struct item *split;     /* first item of the tail segment, or NULL */
+    uint32_t    nitem;      /* # items in lru q */
+    uint32_t    ntail;      /* # items in tail segment */
+};
+
+static struct policy_class pclass[SLABCLASS_MAX_IDS];
+static uint32_t *ghost;                 /* hashes of keys evicted from small */
+static uint32_t ghost_mask;
+
+static uint8_t
+policy_qflags(struct item *it)
+{
+    return __atomic_load_n(&it->qflags, __ATOMIC_RELAXED);
+}
+
+static uint8_t
+policy_freq(struct item *it)
+{
+    return policy_qflags(it) & POLICY_FREQ_MASK;
+}
+
+static bool
+policy_in_tail(struct item *it)
+{
+    return (policy_qflags(it) & POLICY_SEG_TAIL) != 0;
+}
+
+/*
+ * Hits race with the lru q lock holder, so qflags are only ever updated
+ * atomically.
+ */
+static void
+policy_set_tail(struct item *it, bool tail)
+{
+    if (tail) {
+        __atomic_fetch_or(&it->qflags, POLICY_SEG_TAIL, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&it->qflags, (uint8_t)~POLICY_SEG_TAIL,
+                           __ATOMIC_RELAXED);
+    }
+}
+
+static void
+policy_clear_freq(struct item *it)
+{
+    __atomic_fetch_and(&it->qflags, (uint8_t)~POLICY_FREQ_MASK,
+                       __ATOMIC_RELAXED);
+}
+
+static void
+policy_add_freq(struct item *it, uint8_t n, uint8_t max)
+{
+    uint8_t old, new;
+
+    old = __atomic_load_n(&it->qflags, __ATOMIC_RELAXED);
+    do {
+        if ((old & POLICY_FREQ_MASK) >= max) {
+            return;
+        }
+        new = (old & ~POLICY_FREQ_MASK) |
+              MIN((old & POLICY_FREQ_MASK) + n, max);
+    } while (!__atomic_compare_exchange_n(&it->qflags, &old, new, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static uint8_t
+policy_max_freq(void)
+{
+    return (settings.policy == POLICY_S3FIFO) ? POLICY_FREQ_MASK : 1;
+}
+
+static bool
+ghost_hit(uint32_t hv)
+{
+    uint32_t *slot = &ghost[hv & ghost_mask];
+
+    if (__atomic_load_n(slot, __ATOMIC_RELAXED) != hv) {
+        return false;
+    }
+    __atomic_store_n(slot, 0, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+static void
+ghost_insert(uint32_t hv)
+{
+    __atomic_store_n(&ghost[hv & ghost_mask], hv, __ATOMIC_RELAXED);
+}
+
+/*
+ * Remove an item from the lru q of its class, keeping track of where its
+ * tail segment starts.
+ */
+static void
+policy_remove(struct item *it)
+{
+    struct policy_class *p = &pclass[it->id];
+
+    if (p->split == it) {
+        p->split = item_q_next(it);
+    }
+    item_q_remove(&item_lruq[it->id], it);
+}
+
+/*
+ * Insert an item at the tail of the head segment of its lru q, which is
+ * the tail of the lru q itself if there is no tail segment.
+ */
+static void
+policy_insert_head_seg(struct item *it)
+{
+    struct policy_class *p = &pclass[it->id];
+
+    if (p->split == NULL) {
+        item_q_insert_tail(&item_lruq[it->id], it);
+    } else {
+        item_q_insert_before(&item_lruq[it->id], p->split, it);
+    }
+}
+
+/*
+ * Insert an item at the tail of the tail segment of its lru q.
+ */
+static void
+policy_insert_tail_seg(struct item *it)
+{
+    struct policy_class *p = &pclass[it->id];
+
+    item_q_insert_tail(&item_lruq[it->id], it);
+    if (p->split == NULL) {
+        p->split = it;
+    }
+}
+
+/*
+ * Move an item to the tail of the tail segment, or of the head one, of
+ * its lru q, which queues it anew.
+ */
+static void
+policy_requeue(struct item *it, bool tail)
+{
+    struct policy_class *p = &pclass[it->id];
+    bool was_tail = policy_in_tail(it);
+
+    policy_remove(it);
+    policy_clear_freq(it);
+    policy_set_tail(it, tail);
+    if (tail) {
+        policy_insert_tail_seg(it);
+    } else {
+        policy_insert_head_seg(it);
+    }
+
+    if (was_tail && !tail) {
+        p->ntail--;
+    } else if (!was_tail && tail) {
+        p->ntail++;
+    }
+
+    it->atime = time_now();
+
+    stats_slab_incr(it->id, item_requeue);
+}
+
+/*
+ * Link an item to the lru q of its class, the lru q lock of which is held.
+ */
+void
+policy_link(struct item *it)
+{
+    struct policy_class *p = &pclass[it->id];
+
+    __atomic_store_n(&it->qflags, 0, __ATOMIC_RELAXED);
+
+    switch (settings.policy) {
+    case POLICY_LRU:
+    case POLICY_CLOCK:
+        item_q_insert_tail(&item_lruq[it->id], it);
+        break;
+
+    case POLICY_SLRU:
+        policy_insert_head_seg(it);
+        break;
+
+    case POLICY_S3FIFO:
+        if (ghost_hit(it->hv)) {
+            policy_insert_head_seg(it);
+        } else {
+            __atomic_store_n(&it->qflags, POLICY_SEG_TAIL,
+                             __ATOMIC_RELAXED);
+            policy_insert_tail_seg(it);
+            p->ntail++;
+        }
+        break;
+    }
+
+    p->nitem++;
+}
+
+/*
+ * Unlink an item from the lru q of its class, the lru q lock of which is
+ * held.
+ */
+void
+policy_unlink(struct item *it)
+{
+    struct policy_class *p = &pclass[it->id];
+
+    if (policy_in_tail(it)) {
+        ASSERT(p->ntail > 0);
+        p->ntail--;
+    }
+    ASSERT(p->nitem > 0);
+    p->nitem--;
+
+    policy_remove(it);
+}
+
+/*
+ * Note that an item about to be unlinked is evicted while still live. An
+ * item evicted from the small segment has its key hash remembered by the
+ * ghost.
+ */
+void
+policy_evict(struct item *it)
+{
+    if (settings.policy == POLICY_S3FIFO && policy_in_tail(it)) {
+        ghost_insert(it->hv);
+    }
+}
+
+/*
+ * Move n items of q, whose qflags are clear, to the tail of the head
+ * segment of the lru q of class id, leaving q empty.
+ */
+void
+policy_concat(uint8_t id, struct item_tqh *q, uint32_t n)
+{
+    struct policy_class *p = &pclass[id];
+    struct item *it;
+
+    if (p->split == NULL) {
+        item_q_concat(&item_lruq[id], q);
+    } else {
+        while ((it = item_q_first(q)) != NULL) {
+            item_q_remove(q, it);
+            item_q_insert_before(&item_lruq[id], p->split, it);
+        }
+    }
+
+    p->nitem += n;
+}
+
+/*
+ * Count a hit on an item, without the lru q lock.
+ */
+void
+policy_touch(struct item *it)
+{
+    policy_add_freq(it, 1, policy_max_freq());
+}
+
+/*
+ * Push items out of the protected segment of an slru q, onto the tail of
+ * its probation segment, for as long as it has more than its share.
+ */
+static void
+policy_slru_demote(uint8_t id)
+{
+    struct policy_class *p = &pclass[id];
+    struct item *it;
+
+    while (p->ntail * 100 > p->nitem * POLICY_SLRU_SHARE) {
+        it = p->split;
+        if (it == NULL || item_stale(it)) {
+            break;
+        }
+
+        /* the head of the tail segment is the tail of the head one too */
+        policy_set_tail(it, false);
+        p->split = item_q_next(it);
+        p->ntail--;
+        it->atime = time_now();
+    }
+}
+
+static bool
+policy_s3fifo_small(uint8_t id)
+{
+    struct policy_class *p = &pclass[id];
+
+    return p->split != NULL &&
+           (p->ntail * 100 > p->nitem * POLICY_S3FIFO_SHARE ||
+            p->split == item_q_first(&item_lruq[id]));
+}
+
+/*
+ * Return the next candidate for eviction from the lru q of class id after
+ * prev, or the first one if prev is NULL. The lru q lock of the class is
+ * held. On the way, items hit since they were queued are given another
+ * round, up to POLICY_MAX_REQUEUE of them, and the candidate returned is
+ * an item that was not hit, or is stale, or the last one looked at.
+ */
+struct item *
+policy_victim(uint8_t id, struct item *prev)
+{
+    struct item_tqh *q = &item_lruq[id];
+    struct item *it, *next;
+    uint32_t n;
+    uint8_t freq;
+
+    if (prev != NULL) {
+        it = item_q_next(prev);
+    } else if (settings.policy == POLICY_S3FIFO && policy_s3fifo_small(id)) {
+        it = pclass[id].split;
+    } else {
+        it = item_q_first(q);
+    }
+
+    if (settings.policy == POLICY_LRU) {
+        return it;
+    }
+
+    for (n = 0; it != NULL && n < POLICY_MAX_REQUEUE; n++, it = next) {
+        if (policy_freq(it) == 0 || item_stale(it)) {
+            return it;
+        }
+
+        next = item_q_next(it);
+
+        switch (settings.policy) {
+        case POLICY_CLOCK:
+            policy_requeue(it, false);
+            break;
+
+        case POLICY_SLRU:
+            /* a hit on probation earns protection */
+            policy_requeue(it, true);
+            policy_slru_demote(id);
+            break;
+
+        case POLICY_S3FIFO:
+            /* a hit in small earns main, one in main another round of it */
+            freq = policy_in_tail(it) ? 0 : policy_freq(it) - 1;
+            policy_requeue(it, false);
+            if (freq > 0) {
+                policy_add_freq(it, freq, POLICY_FREQ_MASK);
+            }
+            break;
+
+        default:
+            NOT_REACHED();
+        }
+
+        /* items requeued at the tail come round again */
+        if (next == NULL) {
+            next = item_q_first(q);
+        }
+    }
+
+    return it;
+}
+
+/*
+ * Return the first candidate for eviction from the lru q of class id, as
+ * policy_victim() would, but without requeueing any item.
+ */
+struct item *
+policy_peek(uint8_t id)
+{
+    if (settings.policy == POLICY_S3FIFO && policy_s3fifo_small(id)) {
+        return pclass[id].split;
+    }
+
+    return item_q_first(&item_lruq[id]);
+}
+
+/*
+ * Return the last item of the segment ahead of that of item it in the lru
+ * q of class id, or NULL if there is none. Segments are each in atime
+ * order, but not the lru q as a whole.
+ */
+struct item *
+policy_segment_prev(uint8_t id, struct item *it)
+{
+    struct item *split = pclass[id].split;
+
+    if (split == NULL || !policy_in_tail(it)) {
+        return NULL;
+    }
+
+    return item_q_prev(split);
+}
+
+rstatus_t
+policy_init(void)
+{
+    size_t nitem;
+    uint32_t power;
+
+    memset(pclass, 0, sizeof(pclass));
+
+    if (settings.policy != POLICY_S3FIFO) {
+        return MC_OK;
+    }
+
+    /* remember about as many keys as there can be items */
+    nitem = settings.maxbytes / settings.chunk_size;
+    for (power = POLICY_GHOST_MIN_POWER;
+         power < POLICY_GHOST_MAX_POWER && ((size_t)1 << power) < nitem;
+         power++) {
+        /* void */
+    }
+
+    ghost = mc_zalloc(sizeof(*ghost) << power);
+    if (ghost == NULL) {
+        return MC_ENOMEM;
+    }
+    ghost_mask = (1U << power) - 1;
+
+    log_debug(LOG_INFO, "s3fifo ghost of %"PRIu32" key hashes",
+              ghost_mask + 1);
+
+    return MC_OK;
+}
@@ -0,0 +1,86 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MC_POLICY_H_
+#define _MC_POLICY_H_
+
+/*
+ * The eviction policy, set with --eviction-policy, decides in which order
+ * the items of a slab class are evicted from its lru q by item eviction
+ * (-M 1). With lru, the lru q is kept in order of last access, and a hit
+ * moves its item to the tail of the lru q, at most once a minute. The
+ * other policies leave the lru q alone on a hit, and only count it in the
+ * qflags of the item, which eviction then looks at from the head of the
+ * lru q:
+ *
+ *  - clock gives an item that was hit another round, by moving it to the
+ *    tail of the lru q, and evicts the first one that was not;
+ *  - slru splits the lru q into a probation segment at its head, where
+ *    items are linked, and a protected segment at its tail, where items
+ *    hit while on probation go, and which holds up to POLICY_SLRU_SHARE
+ *    percent of the items. Items are evicted from probation, and only go
+ *    back to it once they are pushed out of the protected segment;
+ *  - s3fifo links items to a small segment at the tail of the lru q, and
+ *    evicts from it while it holds more than POLICY_S3FIFO_SHARE percent
+ *    of the items. Items that were hit move on to the main segment at the
+ *    head, and the others are evicted and remembered in a ghost table of
+ *    key hashes, which links a key seen again right into main. Main is a
+ *    clock of its own, which counts up to 3 hits.
+ *
+ * Each segment is kept in order of the time its items were queued in it,
+ * which is their atime, and items past their expiry time or flushed are
+ * never moved, which is what flushes rely on.
+ */
+#define POLICY_FREQ_MASK        0x03    /* # hits since last queued, saturating */
+#define POLICY_SEG_TAIL         0x04    /* item in the segment at the tail of its lru q */
+
+#define POLICY_MAX_REQUEUE      1024    /* # items requeued per eviction candidate */
+#define POLICY_SLRU_SHARE       80      /* % items in protected segment */
+#define POLICY_S3FIFO_SHARE     10      /* % items in small segment */
+
+typedef enum policy_type {
+    POLICY_LRU,     /* lru q in order of last access */
+    POLICY_CLOCK,   /* lru q in order of queueing, another round on a hit */
+    POLICY_SLRU,    /* lru q in probation and protected segments */
+    POLICY_S3FIFO,  /* lru q in main and small segments, with a ghost */
+} policy_type_t;
+
+rstatus_t policy_init(void);
+
+void policy_link(struct item *it);
+void policy_unlink(struct item *it);
+void policy_evict(struct item *it);
+void policy_concat(uint8_t id, struct item_tqh *q, uint32_t n);
+void policy_touch(struct item *it);
+
+struct item *policy_victim(uint8_t id, struct item *prev);
+struct item *policy_peek(uint8_t id);
+struct item *policy_segment_prev(uint8_t id, struct item *it);
+
+#endif
@@ -21,7 +21,10 @@ struct ring_array {
  *
  * Each ring array should have exactly one reader and exactly one writer, as
  * far as threads are concerned (which can be the same). This allows the use of
- * atomic instructions to replace locks.
+ * atomic instructions to replace locks: each side publishes its offset with a
+ * release store, and reads the offset of the other side with an acquire load,
+ * so that an element is fully written before it is read, and fully read before
+ * it is overwritten.
  *
  * We use an extra slot to differentiate full from empty.
  *
@@ -93,7 +96,7 @@ ring_array_push(const void *elem, struct ring_array *arr)
      * either rpos or wpos.
      */
     uint32_t new_wpos;
-    uint32_t rpos = __atomic_load_n(&(arr->rpos), __ATOMIC_RELAXED);
+    uint32_t rpos = __atomic_load_n(&(arr->rpos), __ATOMIC_ACQUIRE);
 
     if (ring_array_full(rpos, arr->wpos, arr->cap)) {
         log_debug(LOG_DEBUG, "Could not push to ring array %p; array is full", arr);
@@ -104,7 +107,7 @@ ring_array_push(const void *elem, struct ring_array *arr)
 
     /* update wpos atomically */
     new_wpos = (arr->wpos + 1) % (arr->cap + 1);
-    __atomic_store_n(&(arr->wpos), new_wpos, __ATOMIC_RELAXED);
+    __atomic_store_n(&(arr->wpos), new_wpos, __ATOMIC_RELEASE);
 
     return MC_OK;
 }
@@ -114,7 +117,7 @@ ring_array_pop(void *elem, struct ring_array *arr)
 {
     /* take snapshot of wpos, since another thread might be pushing */
     uint32_t new_rpos;
-    uint32_t wpos = __atomic_load_n(&(arr->wpos), __ATOMIC_RELAXED);
+    uint32_t wpos = __atomic_load_n(&(arr->wpos), __ATOMIC_ACQUIRE);
 
     if (ring_array_empty(arr->rpos, wpos)) {
         log_debug(LOG_DEBUG, "Could not pop from ring array %p; array is empty", arr);
@@ -127,7 +130,7 @@ ring_array_pop(void *elem, struct ring_array *arr)
 
     /* update rpos atomically */
     new_rpos = (arr->rpos + 1) % (arr->cap + 1);
-    __atomic_store_n(&(arr->rpos), new_rpos, __ATOMIC_RELAXED);
+    __atomic_store_n(&(arr->rpos), new_rpos, __ATOMIC_RELEASE);
 
     return MC_OK;
 }
@@ -0,0 +1,780 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+
+#include <mc_core.h>
+
+extern struct settings settings;
+
+/*
+ * A ttl bucket holds the segments of items with about the same ttl, in
+ * the order they were created. New items are appended to the active
+ * segment, the last one in the bucket.
+ */
+struct seg_ttl_bucket {
+    struct seg_tqh segq;        /* segments, oldest first */
+    uint32_t       nseg;        /* # segments */
+    struct seg     *active;     /* segment items are appended to */
+};
+
+struct seg_heapinfo {
+    struct seg     *seg_table;  /* table of all segments */
+    uint32_t       nseg;        /* # segment allocated */
+    uint32_t       max_nseg;    /* max # segment allowed */
+    struct seg_tqh free_segq;   /* free segments */
+    uint32_t       nfree_seg;   /* # free segments */
+    struct seg_tqh evict_segq;  /* evicted segments, yet to be reclaimed */
+    uint32_t       nevict_seg;  /* # evicted segments */
+    struct seg     *spare;      /* segment kept to merge into */
+    uint32_t       merge_idx;   /* next ttl bucket to merge */
+};
+
+static struct seg_ttl_bucket seg_bucket[SEG_TTL_NBUCKET];   /* segments bucketed by ttl */
+static struct seg_heapinfo seg_heapinfo;                    /* info of all allocated segments */
+static pthread_mutex_t seg_lock;                            /* lock protecting ttl buckets and heapinfo */
+
+#define SEG_EXPTIME_NEVER   ((rel_time_t)-1)
+
+/*
+ * Locking of the segment engine mirrors the slab allocator: seg_lock sits
+ * where the slab_lock does in the lock hierarchy (see mc_items.c), below
+ * the item stripes and above the lru q locks. Evicting or flushing the
+ * items of a segment thus only ever trylocks their stripes.
+ *
+ * Freeing an item does not take the seg_lock, as it only marks the item
+ * as free and drops the count of live items in its segment.
+ */
+
+rstatus_t
+seg_init(void)
+{
+    uint32_t i;
+
+    if (settings.storage != STORAGE_SEG) {
+        return MC_OK;
+    }
+
+    pthread_mutex_init(&seg_lock, NULL);
+
+    for (i = 0; i < SEG_TTL_NBUCKET; i++) {
+        TAILQ_INIT(&seg_bucket[i].segq);
+        seg_bucket[i].nseg = 0;
+        seg_bucket[i].active = NULL;
+    }
+
+    seg_heapinfo.nseg = 0;
+    seg_heapinfo.max_nseg = settings.maxbytes / settings.slab_size;
+    seg_heapinfo.seg_table = mc_zalloc(sizeof(*seg_heapinfo.seg_table) *
+                                       seg_heapinfo.max_nseg);
+    if (seg_heapinfo.seg_table == NULL) {
+        log_error("create of seg table with %"PRIu32" entries failed: %s",
+                  seg_heapinfo.max_nseg, strerror(errno));
+        return MC_ENOMEM;
+    }
+    TAILQ_INIT(&seg_heapinfo.free_segq);
+    seg_heapinfo.nfree_seg = 0;
+    TAILQ_INIT(&seg_heapinfo.evict_segq);
+    seg_heapinfo.nevict_seg = 0;
+    seg_heapinfo.spare = NULL;
+    seg_heapinfo.merge_idx = 0;
+
+    log_debug(LOG_INFO, "created seg table with %"PRIu32" entries in %d ttl "
+              "buckets", seg_heapinfo.max_nseg, SEG_TTL_NBUCKET);
+
+    return MC_OK;
+}
+
+void
+seg_deinit(void)
+{
+}
+
+/*
+ * Return the ttl bucket of items with a given expiry time.
+ */
+static uint32_t
+seg_ttl_bucket(rel_time_t exptime)
+{
+    rel_time_t now;
+    uint32_t ttl, range, shift;
+
+    if (exptime == 0) {
+        return SEG_TTL_NBUCKET - 1;
+    }
+
+    now = time_now();
+    ttl = exptime > now ? exptime - now : 0;
+
+    for (range = 0; range < SEG_TTL_NRANGE; range++) {
+        shift = SEG_TTL_MIN_SHIFT + range * SEG_TTL_RANGE_SHIFT;
+        if ((ttl >> shift) < SEG_TTL_NBUCKET / SEG_TTL_NRANGE) {
+            return range * (SEG_TTL_NBUCKET / SEG_TTL_NRANGE) + (ttl >> shift);
+        }
+    }
+
+    return SEG_TTL_NBUCKET - 1;
+}
+
+static struct seg *
+item_2_seg(struct item *it)
+{
+    return &seg_heapinfo.seg_table[item_2_slab(it)->sid];
+}
+
+static bool
+seg_empty(struct seg *seg)
+{
+    return (seg->offset == SLAB_HDR_SIZE);
+}
+
+/*
+ * A segment has expired once all of its items have. Segments that nothing
+ * was carved out of yet are left alone.
+ */
+static bool
+seg_expired(struct seg *seg)
+{
+    return (!seg_empty(seg) && seg->exptime != SEG_EXPTIME_NEVER &&
+            seg->exptime <= time_now());
+}
+
+/*
+ * A segment is dead once all of its items have been freed, unless more
+ * items can still be carved out of it.
+ */
+static bool
+seg_dead(struct seg *seg)
+{
+    return (!seg_empty(seg) && seg != seg_bucket[seg->bucket].active &&
+            __atomic_load_n(&seg->nlive, __ATOMIC_ACQUIRE) == 0);
+}
+
+/*
+ * Get a segment whose memory is not reachable by anyone anymore.
+ */
+static struct seg *
+seg_get_free(void)
+{
+    struct seg *seg;
+
+    seg = TAILQ_FIRST(&seg_heapinfo.free_segq);
+    if (seg != NULL) {
+        seg_heapinfo.nfree_seg--;
+        TAILQ_REMOVE(&seg_heapinfo.free_segq, seg, g_tqe);
+    }
+
+    return seg;
+}
+
+static void
+seg_put_free(struct seg *seg)
+{
+    seg_heapinfo.nfree_seg++;
+    TAILQ_INSERT_TAIL(&seg_heapinfo.free_segq, seg, g_tqe);
+}
+
+static void
+seg_put_evicted(struct seg *seg)
+{
+    seg_heapinfo.nevict_seg++;
+    TAILQ_INSERT_TAIL(&seg_heapinfo.evict_segq, seg, g_tqe);
+}
+
+/*
+ * Get a segment from memory never used before, as long as the heap is
+ * not full.
+ */
+static struct seg *
+seg_get_new(void)
+{
+    struct seg *seg;
+    struct slab *slab;
+
+    if (seg_heapinfo.nseg >= seg_heapinfo.max_nseg) {
+        return NULL;
+    }
+
+    slab = slab_get_raw();
+    if (slab == NULL) {
+        return NULL;
+    }
+
+#if MC_ASSERT_PANIC == 1 || MC_ASSERT_LOG == 1
+    slab->magic = SLAB_MAGIC;
+#endif
+    slab->id = SLABCLASS_INVALID_ID;
+    slab->unused = 0;
+    slab->refcount = 0;
+    ASSERT(slab->sid == seg_heapinfo.nseg);
+
+    seg = &seg_heapinfo.seg_table[seg_heapinfo.nseg++];
+    seg->slab = slab;
+
+    log_debug(LOG_VERB, "new seg %p allocated at pos %u", slab, slab->sid);
+
+    return seg;
+}
+
+/*
+ * Prepare a segment for items of the given ttl bucket to be carved out.
+ */
+static void
+seg_hdr_init(struct seg *seg, uint32_t idx)
+{
+    ASSERT(seg->slab->refcount == 0);
+
+    seg->exptime = 0;
+    seg->offset = SLAB_HDR_SIZE;
+    seg->nlive = 0;
+    seg->bucket = idx;
+}
+
+/*
+ * Link a segment into its ttl bucket, either as its new active segment
+ * or, for a segment holding items merged from older ones, at its head.
+ */
+static void
+seg_link(struct seg *seg, bool active)
+{
+    struct seg_ttl_bucket *bucket = &seg_bucket[seg->bucket];
+
+    if (active) {
+        TAILQ_INSERT_TAIL(&bucket->segq, seg, g_tqe);
+        bucket->active = seg;
+    } else {
+        TAILQ_INSERT_HEAD(&bucket->segq, seg, g_tqe);
+    }
+    bucket->nseg++;
+
+    stats_thread_incr(seg_curr);
+}
+
+static void
+seg_unlink(struct seg *seg)
+{
+    struct seg_ttl_bucket *bucket = &seg_bucket[seg->bucket];
+
+    ASSERT(bucket->nseg > 0);
+
+    if (bucket->active == seg) {
+        bucket->active = NULL;
+    }
+    bucket->nseg--;
+    TAILQ_REMOVE(&bucket->segq, seg, g_tqe);
+
+    stats_thread_decr(seg_curr);
+}
+
+/*
+ * Carve the next item of a given class out of a segment, if there is room
+ * left for it. The expiry of the segment is raised to that of the item.
+ */
+static struct item *
+seg_carve(struct seg *seg, uint8_t id, rel_time_t exptime)
+{
+    struct item *it;
+    size_t size;
+
+    size = slab_item_size(id);
+    if (seg->offset + size > settings.slab_size) {
+        return NULL;
+    }
+
+    it = (struct item *)((uint8_t *)seg->slab + seg->offset);
+    item_hdr_init(it, seg->offset, id);
+    seg->offset += size;
+    __atomic_add_fetch(&seg->nlive, 1, __ATOMIC_RELAXED);
+
+    if (exptime == 0) {
+        seg->exptime = SEG_EXPTIME_NEVER;
+    } else if (seg->exptime != SEG_EXPTIME_NEVER) {
+        seg->exptime = MAX(seg->exptime, exptime);
+    }
+
+    return it;
+}
+
+/*
+ * Get the item at a given offset of a segment, and the offset of the
+ * one after it.
+ */
+static struct item *
+seg_2_item(struct seg *seg, uint32_t *offset)
+{
+    struct item *it;
+
+    ASSERT(*offset < seg->offset);
+
+    it = (struct item *)((uint8_t *)seg->slab + *offset);
+
+    ASSERT(it->magic == ITEM_MAGIC);
+    ASSERT(it->offset == *offset);
+
+    *offset += slab_item_size(it->id);
+
+    return it;
+}
+
+/*
+ * Free an item, which has to be unlinked and not in use anymore. The
+ * item is marked free last, as its segment may be reclaimed right then.
+ */
+void
+seg_put_item(struct item *it)
+{
+    struct seg *seg = item_2_seg(it);
+
+    ASSERT(!item_is_linked(it));
+    ASSERT(!item_is_slabbed(it));
+    ASSERT(it->refcount == 0);
+    ASSERT(seg->nlive > 0);
+
+    log_debug(LOG_VERB, "put it '%.*s' at offset %"PRIu32" with id %"PRIu8
+              " into seg %p", it->nkey, item_key(it), it->offset, it->id,
+              seg->slab);
+
+    stats_slab_incr(it->id, item_remove);
+
+    __atomic_sub_fetch(&seg->nlive, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&it->flags, it->flags | ITEM_SLABBED, __ATOMIC_RELEASE);
+}
+
+/*
+ * Evict a segment by unlinking and freeing all items within it that are
+ * still linked, so that it can be reclaimed. A linked item is
+ * moved to the merge destination dst instead, if one is given, the item
+ * was accessed since it was written or last moved, and there is room left
+ * in dst.
+ *
+ * As with slab eviction, the stripe of an item is only trylocked. But
+ * unlike with slabs, an item that is busy or in use does not stop us
+ * from evicting the others, as freed items never come back to life; the
+ * segment just cannot be reclaimed this time around. The same goes for an
+ * item that is neither linked nor free, which is owned by someone else.
+ *
+ * Eviction complexity is O(#items/segment).
+ */
+static rstatus_t
+seg_evict_one(struct seg *seg, struct seg *dst)
+{
+    struct item *it, *nit;
+    uint32_t offset, hv;
+    uint8_t flags;
+    bool busy;
+
+    for (busy = false, offset = SLAB_HDR_SIZE; offset < seg->offset;) {
+        it = seg_2_item(seg, &offset);
+
+        flags = __atomic_load_n(&it->flags, __ATOMIC_ACQUIRE);
+        if (flags & ITEM_SLABBED) {
+            continue;
+        }
+
+        if (!(flags & ITEM_LINKED)) {
+            busy = true;
+            continue;
+        }
+
+        hv = it->hv;
+        if (!item_trylock(hv)) {
+            busy = true;
+            continue;
+        }
+
+        if (!item_is_linked(it) || it->hv != hv) {
+            item_unlock(hv);
+            busy = true;
+            continue;
+        }
+
+        if (dst != NULL && (it->flags & ITEM_ACCESSED) && it->refcount == 0 &&
+            !(it->exptime != 0 && it->exptime <= time_now())) {
+            nit = seg_carve(dst, it->id, it->exptime);
+            if (nit != NULL) {
+                if (item_move(it, nit)) {
+                    seg_put_item(it);
+                    item_unlock(hv);
+                    continue;
+                }
+                seg_put_item(nit);
+            }
+        }
+
+        if (!item_reuse(it)) {
+            item_unlock(hv);
+            busy = true;
+            continue;
+        }
+
+        if (it->exptime != 0 && it->exptime <= time_now()) {
+            stats_slab_incr(it->id, item_expire);
+        } else {
+            stats_slab_incr(it->id, item_evict);
+        }
+
+        seg_put_item(it);
+        item_unlock(hv);
+    }
+
+    if (busy || __atomic_load_n(&seg->slab->refcount, __ATOMIC_SEQ_CST) != 0) {
+        log_debug(LOG_VERB, "abort evicting seg %p in bucket %"PRIu32"",
+                  seg->slab, seg->bucket);
+        return MC_EAGAIN;
+    }
+
+    seg_unlink(seg);
+
+    log_debug(LOG_VERB, "evicted seg %p in bucket %"PRIu32"", seg->slab,
+              seg->bucket);
+
+    return MC_OK;
+}
+
+/*
+ * Make evicted segments available for reuse. Lockless readers that found
+ * an item of these segments before it was unlinked may still be looking
+ * at it, and must be done before the segments are carved anew. The first
+ * segment tops up the merge spare if needed, unless it is the only one.
+ */
+static void
+seg_reclaim(void)
+{
+    struct seg *seg;
+    uint32_t n;
+
+    n = seg_heapinfo.nevict_seg;
+    if (n == 0) {
+        return;
+    }
+
+    thread_epoch_synchronize();
+
+    while (!TAILQ_EMPTY(&seg_heapinfo.evict_segq)) {
+        seg = TAILQ_FIRST(&seg_heapinfo.evict_segq);
+        TAILQ_REMOVE(&seg_heapinfo.evict_segq, seg, g_tqe);
+        seg_heapinfo.nevict_seg--;
+
+        if (seg_heapinfo.spare == NULL && n > 1) {
+            seg_heapinfo.spare = seg;
+        } else {
+            seg_put_free(seg);
+        }
+    }
+}
+
+/*
+ * Evict all segments that have expired or are dead, and reclaim them.
+ * Returns the number of segments reclaimed.
+ */
+static uint32_t
+_seg_expire(void)
+{
+    struct seg *seg, *next;
+    uint32_t i, n;
+
+    for (n = 0, i = 0; i < SEG_TTL_NBUCKET; i++) {
+        TAILQ_FOREACH_SAFE(seg, &seg_bucket[i].segq, g_tqe, next) {
+            if (!seg_expired(seg) && !seg_dead(seg)) {
+                continue;
+            }
+
+            if (seg_evict_one(seg, NULL) == MC_OK) {
+                seg_put_evicted(seg);
+                n++;
+            }
+        }
+    }
+
+    stats_thread_incr_by(seg_expire, n);
+
+    seg_reclaim();
+
+    return n;
+}
+
+/*
+ * Evict segments to make room for new ones when nothing has expired.
+ *
+ * We go through the ttl buckets in a round robin fashion, and merge the
+ * oldest SEG_MERGE_NSEG segments of the next bucket that has any segment
+ * besides its active one: the items of these segments that were accessed
+ * since they were written are moved into a single segment, the spare,
+ * and all others are evicted. Moved items have to be accessed again to
+ * survive the next merge. The merged segment takes their place at the
+ * head of the bucket.
+ *
+ * Without a spare, the oldest segment is evicted as a whole to become
+ * one. When only active segments are left, one of them is evicted as a
+ * whole instead of merging. Should no segment be freed for all that, the
+ * spare is given up.
+ */
+static void
+seg_evict(void)
+{
+    struct seg_ttl_bucket *bucket;
+    struct seg *seg, *next, *dst;
+    uint32_t i, idx, n, nmerge;
+
+    for (bucket = NULL, i = 0; i < SEG_TTL_NBUCKET && bucket == NULL; i++) {
+        idx = (seg_heapinfo.merge_idx + i) % SEG_TTL_NBUCKET;
+        seg = TAILQ_FIRST(&seg_bucket[idx].segq);
+        if (seg != NULL && seg != seg_bucket[idx].active) {
+            bucket = &seg_bucket[idx];
+        }
+    }
+
+    for (i = 0; i < SEG_TTL_NBUCKET && bucket == NULL; i++) {
+        idx = (seg_heapinfo.merge_idx + i) % SEG_TTL_NBUCKET;
+        if (!TAILQ_EMPTY(&seg_bucket[idx].segq)) {
+            bucket = &seg_bucket[idx];
+        }
+    }
+
+    if (bucket == NULL) {
+        return;
+    }
+
+    seg_heapinfo.merge_idx = (idx + 1) % SEG_TTL_NBUCKET;
+
+    seg = TAILQ_FIRST(&bucket->segq);
+    if (seg == bucket->active || seg_heapinfo.spare == NULL) {
+        log_debug(LOG_DEBUG, "evicting seg %p in bucket %"PRIu32"", seg->slab,
+                  idx);
+
+        if (seg_evict_one(seg, NULL) != MC_OK) {
+            return;
+        }
+
+        stats_thread_incr(seg_evict);
+
+        if (seg_heapinfo.spare != NULL) {
+            seg_put_evicted(seg);
+            seg_reclaim();
+            return;
+        }
+
+        thread_epoch_synchronize();
+        seg_heapinfo.spare = seg;
+        seg = TAILQ_FIRST(&bucket->segq);
+    }
+
+    dst = seg_heapinfo.spare;
+    seg_heapinfo.spare = NULL;
+    seg_hdr_init(dst, idx);
+
+    for (n = 0, nmerge = 0;
+         seg != NULL && seg != bucket->active && nmerge < SEG_MERGE_NSEG;
+         nmerge++, seg = next) {
+        next = TAILQ_NEXT(seg, g_tqe);
+
+        if (seg_evict_one(seg, dst) == MC_OK) {
+            seg_put_evicted(seg);
+            n++;
+        }
+    }
+
+    log_debug(LOG_DEBUG, "merged %"PRIu32" segs in bucket %"PRIu32" into seg "
+              "%p, %"PRIu32" evicted", nmerge, idx, dst->slab, n);
+
+    if (seg_empty(dst)) {
+        seg_heapinfo.spare = dst;
+    } else {
+        seg_link(dst, false);
+    }
+
+    if (nmerge > 0) {
+        stats_thread_incr(seg_merge);
+    }
+    stats_thread_incr_by(seg_evict, n);
+
+    seg_reclaim();
+
+    if (seg_heapinfo.nfree_seg == 0 && seg_heapinfo.spare != NULL) {
+        seg_put_free(seg_heapinfo.spare);
+        seg_heapinfo.spare = NULL;
+    }
+}
+
+/*
+ * Get a segment to become the active segment of a ttl bucket. We get a
+ * segment either from:
+ * 1. the free segment q, or
+ * 2. the heap, if not full, or
+ * 3. by reclaiming segments that expired or died, or
+ * 4. by evicting segments, if eviction is enabled.
+ */
+static struct seg *
+seg_get(uint32_t idx)
+{
+    struct seg *seg;
+
+    seg = seg_get_free();
+
+    if (seg == NULL) {
+        seg = seg_get_new();
+    }
+
+    if (seg == NULL && _seg_expire() > 0) {
+        seg = seg_get_free();
+    }
+
+    if (seg == NULL && settings.evict_opt != EVICT_NONE) {
+        seg_evict();
+        seg = seg_get_free();
+    }
+
+    if (seg == NULL) {
+        return NULL;
+    }
+
+    seg_hdr_init(seg, idx);
+    seg_link(seg, true);
+
+    return seg;
+}
+
+static struct item *
+_seg_get_item(uint8_t id, rel_time_t exptime)
+{
+    struct seg *seg;
+    struct item *it;
+    uint32_t idx;
+
+    idx = seg_ttl_bucket(exptime);
+
+    seg = seg_bucket[idx].active;
+    if (seg != NULL) {
+        it = seg_carve(seg, id, exptime);
+        if (it != NULL) {
+            return it;
+        }
+    }
+
+    seg = seg_get(idx);
+    if (seg == NULL) {
+        return NULL;
+    }
+
+    return seg_carve(seg, id, exptime);
+}
+
+/*
+ * Get an item of a given class, to expire at the given time, by appending
+ * it to the active segment of its ttl bucket.
+ *
+ * The returned item is refcounted, so that it cannot be claimed by a
+ * segment eviction before the caller gets to link it.
+ */
+struct item *
+seg_get_item(uint8_t id, rel_time_t exptime)
+{
+    struct item *it;
+
+    ASSERT(id >= SLABCLASS_MIN_ID && id <= SLABCLASS_MAX_ID);
+
+    pthread_mutex_lock(&seg_lock);
+    it = _seg_get_item(id, exptime);
+    if (it != NULL) {
+        item_acquire_refcount(it);
+    }
+    pthread_mutex_unlock(&seg_lock);
+
+    return it;
+}
+
+/*
+ * Reclaim segments that expired or died, so that their memory is
+ * available again before it is needed. This is run periodically by the
+ * rebalancer thread.
+ */
+void
+seg_expire(void)
+{
+    uint32_t n;
+
+    pthread_mutex_lock(&seg_lock);
+    n = _seg_expire();
+    pthread_mutex_unlock(&seg_lock);
+
+    if (n > 0) {
+        log_debug(LOG_VERB, "reclaimed %"PRIu32" expired segs", n);
+    }
+}
+
+/*
+ * Flush all items after a "flush_all" call that takes effect right away.
+ *
+ * Unlike with slabs, we don't only flush the items accessed within the
+ * last second and leave the older ones to the lazy oldest_live check, but
+ * unlink all items, so that their segments can be reclaimed as dead. Items
+ * whose stripe is busy are skipped and left for the lazy check.
+ */
+void
+seg_flush(void)
+{
+    struct seg *seg;
+    struct item *it;
+    uint32_t i, offset, hv;
+    uint8_t id;
+
+    if (settings.oldest_live == 0 || settings.oldest_live > time_now()) {
+        return;
+    }
+
+    pthread_mutex_lock(&seg_lock);
+
+    for (i = 0; i < SEG_TTL_NBUCKET; i++) {
+        TAILQ_FOREACH(seg, &seg_bucket[i].segq, g_tqe) {
+            for (offset = SLAB_HDR_SIZE; offset < seg->offset;) {
+                it = seg_2_item(seg, &offset);
+
+                if (!(__atomic_load_n(&it->flags, __ATOMIC_ACQUIRE) &
+                      ITEM_LINKED)) {
+                    continue;
+                }
+
+                hv = it->hv;
+                if (!item_trylock(hv)) {
+                    continue;
+                }
+
+                if (item_is_linked(it) && it->hv == hv) {
+                    id = it->id;
+                    item_unlink(it);
+                    stats_slab_incr(id, item_evict);
+                }
+
+                item_unlock(hv);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&seg_lock);
+}
@@ -0,0 +1,100 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MC_SEGS_H_
+#define _MC_SEGS_H_
+
+#include <mc_slabs.h>
+
+typedef enum storage_type {
+    STORAGE_SLAB,   /* items are kept in the slabs of their class */
+    STORAGE_SEG,    /* items are appended to segments of their ttl */
+} storage_type_t;
+
+/*
+ * With the segment storage engine, a slab is not carved into items of one
+ * class, but used as a segment, to which items of any class are appended
+ * one after the other, each in a chunk the size of its class. Segments are
+ * grouped by the ttl of their items into ttl buckets, and items are only
+ * ever appended to the active segment of their bucket.
+ *
+ * Items are never reused in place. A freed item is only marked as such
+ * (ITEM_SLABBED), and its memory is reclaimed along with its segment, once
+ * every item in the segment has expired or been freed. So there is neither
+ * an item free q nor an item lru q to maintain.
+ *
+ *   <------------------------ slab_size ------------------------->
+ *   +---------------+---------+-------------+-----+--------------+
+ *   |  slab header  |  item   |    item     | ... |    unused    |
+ *   | (struct slab) | class 1 |   class 3   |     |              |
+ *   +---------------+---------+-------------+-----+--------------+
+ *   ^               ^                             ^
+ *   |               |                             |
+ *   \               |                             \
+ *   seg->slab       \                             seg->offset
+ *                   slab->data
+ *
+ * The segment itself is described by a struct seg kept apart from the
+ * slab. Segments being the only slabs allocated with the segment engine,
+ * the index of the slab in the slab table (slab->sid) is also that of its
+ * descriptor.
+ */
+struct seg {
+    struct slab      *slab;     /* memory of the segment */
+    TAILQ_ENTRY(seg) g_tqe;     /* link in ttl bucket or free q */
+    rel_time_t       exptime;   /* expiry of the longest lived item */
+    uint32_t         offset;    /* offset of the next item to carve out */
+    uint32_t         nlive;     /* # items carved out and not yet freed */
+    uint32_t         bucket;    /* ttl bucket */
+};
+
+TAILQ_HEAD(seg_tqh, seg);
+
+/*
+ * Ttl buckets cover ttls of up to ~97 days in four ranges of 256 buckets
+ * each, where every range has 16x wider buckets than the one before, from
+ * 8 secs to ~9 hours. Items that never expire and those with even longer
+ * ttls go into the last bucket.
+ */
+#define SEG_TTL_NBUCKET     1024
+#define SEG_TTL_NRANGE      4
+#define SEG_TTL_MIN_SHIFT   3       /* bucket width of 1st range, as power of 2 */
+#define SEG_TTL_RANGE_SHIFT 4       /* growth of bucket width per range, as power of 2 */
+
+#define SEG_MERGE_NSEG      4       /* max # segments merged into one */
+
+rstatus_t seg_init(void);
+void seg_deinit(void);
+
+struct item *seg_get_item(uint8_t id, rel_time_t exptime);
+void seg_put_item(struct item *it);
+void seg_expire(void);
+void seg_flush(void);
+
+#endif
@@ -28,29 +28,163 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
 
 #include <mc_core.h>
 
+#ifdef MC_MMAP_HEAP
+#include <sys/mman.h>
+#endif
+
+#ifdef MC_NUMA
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
 extern struct settings settings;
-extern pthread_mutex_t cache_lock;
+extern struct thread_worker *threads;
+extern struct thread_key keys;
 
 struct slab_heapinfo {
     uint8_t         *base;       /* prealloc base */
     uint8_t         *curr;       /* prealloc start */
+    slab_heap_pages_t pages;     /* kind of pages backing prealloc */
+    uint32_t        nprefault;   /* # prefault threads still running */
+    bool            ready;       /* is prealloc prefaulted? */
+    struct timespec prefault_ts; /* when prefault started */
+    uint64_t        prefault_usec;/* time it took to prefault prealloc */
     uint32_t        nslab;       /* # slab allocated */
     uint32_t        max_nslab;   /* max # slab allowed */
-    struct slab     **slab_table;/* table of all slabs */
     struct slab_tqh slab_lruq;   /* lru slab q */
+    struct slab_heap_hdr *hdr;   /* header of heap file, if any */
+    uint32_t        nrestore;    /* # slab of heap file to restore */
+    uint64_t        restore_nitem;/* # item restored from heap file */
+    uint64_t        restore_usec;/* time it took to restore heap file */
+};
+
+/*
+ * Layout of a slab heap, which has to be the same for a slab heap left by
+ * a previous run to be restored.
+ */
+struct slab_heap_layout {
+    uint64_t item_hdr_size;           /* item header size of the build */
+    uint64_t slab_hdr_size;           /* slab header size of the build */
+    uint64_t compact_items;           /* items linked by compact links? */
+    uint64_t slab_size;               /* slab size */
+    uint64_t max_nslab;               /* max # slab */
+    uint64_t nclass;                  /* # slab class */
+    uint64_t size[SLABCLASS_MAX_IDS]; /* item chunk size, by class */
+};
+
+/*
+ * Header of a slab heap backed by a heap file, which follows the last slab
+ * in the file (see slab_heap_map_file). Besides the layout, it keeps what
+ * the next run needs to make sense of the slabs: where the heap was mapped,
+ * as links between items are addresses, and the clock that times of items
+ * are relative to.
+ */
+struct slab_heap_hdr {
+    uint64_t                magic;       /* SLAB_HEAP_MAGIC */
+    uint64_t                version;     /* SLAB_HEAP_VERSION */
+    struct slab_heap_layout layout;      /* layout of the heap */
+    uint64_t                clean;       /* left by a clean shutdown? */
+    uint64_t                base;        /* address the heap was mapped at */
+    int64_t                 started;     /* start time of the run */
+    uint64_t                oldest_live; /* flush_all cutoff of the run */
+    uint64_t                nslab;       /* # slab allocated */
 };
 
 struct slabclass slabclass[SLABCLASS_MAX_IDS];  /* collection of slabs bucketed by slabclass */
 uint8_t slabclass_max_id;                       /* maximum slabclass id */
 static struct slab_heapinfo heapinfo;           /* info of all allocated slabs */
+struct slab **slab_table;                       /* table of all allocated slabs */
 pthread_mutex_t slab_lock;                      /* lock protecting slabclass and heapinfo */
 
+static void slab_put_item_into_freeq(struct item *it);
+static void slab_move_item_into_freeq(struct item *it);
+static void slab_mag_drain(uint8_t id);
+static void _slab_put_item(struct item *it);
+static void _slab_put_chunks(struct item *it);
+
 #define SLAB_RAND_MAX_TRIES         50
 #define SLAB_LRU_MAX_TRIES          50
+#define SLAB_HD_NSAMPLE             8
 #define SLAB_LRU_UPDATE_INTERVAL    1
+#define SLAB_MOVE_MAX_TRIES         50
+#define SLAB_PREFAULT_MAX_NTHREAD   64
+#define SLAB_PROFILE_MAX_NSIZE      512
+#define SLAB_RESTORE_MAX_NTHREAD    64
+#define SLAB_NUMA_MAX_NODE          1024
+
+#define SLAB_HEAP_MAGIC             0x70616568776d6574ULL /* "twemheap" */
+#define SLAB_HEAP_VERSION           1
+
+/*
+ * Part of the preallocated slab heap that a prefault thread faults in.
+ */
+struct slab_prefault {
+    uint8_t *start;     /* start of the part */
+    size_t  size;       /* size of the part */
+};
+
+/*
+ * Share of the slabs of a restored slab heap that a restore thread goes
+ * over, standing in for a worker (see slab_restore). Items it frees are
+ * queued by the thread, and handed over to their class once it is done.
+ */
+struct slab_restore {
+    uint32_t            idx;                            /* worker stood in for */
+    uint32_t            start;                          /* first slab */
+    uint32_t            end;                            /* one past the last slab */
+    bool                relink;                         /* relink or free items? */
+    struct item_restore *r;                             /* item restore state */
+    uint64_t            nitem;                          /* # item relinked */
+    uint32_t            nfree_itemq[SLABCLASS_MAX_IDS]; /* # items freed, by class */
+    struct item_tqh     free_itemq[SLABCLASS_MAX_IDS];  /* items freed, by class */
+};
+
+/*
+ * Scratch space of slab_profile_tune(), too large for a worker stack. The
+ * histogram it tunes to is coarsened into at most SLAB_PROFILE_MAX_NSIZE
+ * sizes, which bounds the search to a few tens of millions of steps.
+ */
+struct slab_profile_scratch {
+    size_t   size[SLAB_PROFILE_MAX_NSIZE + 1];  /* candidate chunk sizes */
+    uint64_t nitem[SLAB_PROFILE_MAX_NSIZE + 1]; /* prefix sum of # items */
+    uint64_t f[2][SLAB_PROFILE_MAX_NSIZE + 1];  /* last two rows of f */
+    uint16_t from[SLABCLASS_MAX_IDS][SLAB_PROFILE_MAX_NSIZE + 1]; /* argmin j */
+};
+
+/*
+ * Automove observes the slab classes over windows of a few checks, and
+ * a class has to lead the eviction pressure for nwindow consecutive windows
+ * before it gets a slab. The conservative setting follows mainline
+ * memcached: 10 sec windows, 3 in a row.
+ */
+struct slab_automove_policy {
+    uint32_t window;  /* # checks per window */
+    uint32_t nwindow; /* # consecutive windows to act upon */
+};
+
+static struct slab_automove_policy slab_automove_policy[] = {
+    [SLAB_AUTOMOVE_OFF]          = { 0,  0 },
+    [SLAB_AUTOMOVE_CONSERVATIVE] = { 10, 3 },
+    [SLAB_AUTOMOVE_AGGRESSIVE]   = { 1,  1 },
+};
+
+/*
+ * Automove state, only touched by the rebalancer thread
+ */
+static struct {
+    bool     init;                          /* baseline taken? */
+    uint32_t ncheck;                        /* # checks into current window */
+    int64_t  oom[SLABCLASS_MAX_IDS];        /* slab_error at window start */
+    int64_t  hit[SLABCLASS_MAX_IDS];        /* key hits at window start */
+    uint32_t quiet[SLABCLASS_MAX_IDS];      /* # consecutive windows w/o pressure */
+    uint8_t  receiver;                      /* class under most pressure */
+    uint32_t nreceiver;                     /* # consecutive windows it led */
+} automove;
 
 /*
  * Return the usable space for item sized chunks that would be carved out
@@ -82,21 +216,29 @@ slab_print(void)
     }
 }
 
+/*
+ * Slab refcount is the sum of refcounts of all items in the slab. Items in
+ * a slab are protected by different stripes, so we update it atomically
+ */
 void
 slab_acquire_refcount(struct slab *slab)
 {
-    ASSERT(pthread_mutex_trylock(&cache_lock) != 0);
     ASSERT(slab->magic == SLAB_MAGIC);
-    slab->refcount++;
+    __atomic_add_fetch(&slab->refcount, 1, __ATOMIC_SEQ_CST);
 }
 
 void
 slab_release_refcount(struct slab *slab)
 {
-    ASSERT(pthread_mutex_trylock(&cache_lock) != 0);
     ASSERT(slab->magic == SLAB_MAGIC);
     ASSERT(slab->refcount > 0);
-    slab->refcount--;
+    __atomic_sub_fetch(&slab->refcount, 1, __ATOMIC_SEQ_CST);
+}
+
+static bool
+slab_in_use(struct slab *slab)
+{
+    return (__atomic_load_n(&slab->refcount, __ATOMIC_SEQ_CST) != 0);
 }
 
 /*
@@ -161,6 +303,159 @@ slab_id(size_t size)
     return id;
 }
 
+/*
+ * Return the slab memory taken up by an item stored in chunks of the given
+ * size, including its share of the slack at the end of the slab
+ */
+size_t
+slab_item_footprint(size_t size)
+{
+    ASSERT(size != 0 && size <= slab_size());
+
+    return slab_size() / (slab_size() / size);
+}
+
+/*
+ * Tune the slab profile to a histogram of item sizes, where bucket b holds
+ * nitem[b] items, each of them at most (b + 1) * bucket_size bytes large.
+ *
+ * Chunk sizes are picked among the bucket bounds so that the slab memory
+ * taken up by all these items is the least, with as many slab classes as
+ * there are in the current profile. Items of a size fall in the smallest
+ * class that fits them, so with f[k][i] the least memory the first i sizes
+ * take up in k classes, and the last of these classes of the i-th size:
+ *
+ *   f[k][i] = min over j < i of f[k - 1][j] + cost(j, i)
+ *
+ * where cost(j, i) is the memory of the items of sizes j + 1 to i in
+ * chunks of the i-th size. The largest chunk size of the current profile is
+ * always kept, so that no item stored today is turned away tomorrow.
+ *
+ * Return the last id of the tuned profile, and in footprint the memory it
+ * takes up for the histogram.
+ */
+uint8_t
+slab_profile_tune(const uint64_t *nitem, uint32_t nbucket, size_t bucket_size,
+                  size_t *profile, uint64_t *footprint)
+{
+    struct slab_profile_scratch *sp; /* scratch space */
+    size_t *size;                    /* candidate chunk sizes */
+    uint64_t *n;                     /* prefix sum of # items */
+    uint64_t *prev, *cur, *tmp;      /* last two rows of f */
+    uint32_t nsize, nnonzero, stride, b, i, j, k, kmax;
+    uint8_t id;
+
+    *footprint = 0;
+
+    for (nnonzero = 0, b = 0; b < nbucket; b++) {
+        nnonzero += nitem[b] != 0 ? 1 : 0;
+    }
+
+    if (nnonzero == 0) {
+        /* nothing to tune to */
+        for (id = SLABCLASS_MIN_ID; id <= settings.profile_last_id; id++) {
+            profile[id] = settings.profile[id];
+        }
+        return settings.profile_last_id;
+    }
+
+    sp = mc_zalloc(sizeof(*sp));
+    if (sp == NULL) {
+        return SLABCLASS_INVALID_ID;
+    }
+    size = sp->size;
+    n = sp->nitem;
+    prev = sp->f[0];
+    cur = sp->f[1];
+
+    /* coarsen the histogram into at most SLAB_PROFILE_MAX_NSIZE sizes */
+    stride = (nnonzero + SLAB_PROFILE_MAX_NSIZE - 1) / SLAB_PROFILE_MAX_NSIZE;
+
+    for (nsize = 0, nnonzero = 0, b = 0; b < nbucket; b++) {
+        size_t sz;
+
+        if (nitem[b] == 0) {
+            continue;
+        }
+
+        sz = MC_ALIGN((b + 1) * bucket_size, MC_ALIGNMENT);
+        sz = MAX(sz, ITEM_MIN_CHUNK_SIZE);
+        sz = MIN(sz, settings.max_chunk_size);
+
+        if (nnonzero++ % stride == 0 && sz > size[nsize]) {
+            nsize++;
+            n[nsize] = n[nsize - 1];
+        }
+        size[nsize] = MAX(size[nsize], sz);
+        n[nsize] += nitem[b];
+    }
+
+    /* leave room for the largest chunk size unless it is among the sizes */
+    kmax = settings.profile_last_id;
+    if (size[nsize] < settings.max_chunk_size) {
+        kmax--;
+    }
+    kmax = MIN(kmax, nsize);
+
+    if (kmax == 0) {
+        /* only the largest chunk size, which is what every item gets */
+        *footprint = slab_item_footprint(settings.max_chunk_size) * n[nsize];
+        profile[SLABCLASS_MIN_ID] = settings.max_chunk_size;
+        id = SLABCLASS_MIN_ID;
+        goto done;
+    }
+
+    prev[0] = 0;
+    for (i = 1; i <= nsize; i++) {
+        prev[i] = UINT64_MAX;
+    }
+
+    for (k = 1; k <= kmax; k++) {
+        for (i = 0; i < k; i++) {
+            cur[i] = UINT64_MAX;
+        }
+        for (i = k; i <= nsize; i++) {
+            uint64_t fp = slab_item_footprint(size[i]);
+
+            cur[i] = UINT64_MAX;
+            for (j = k - 1; j < i; j++) {
+                uint64_t f;
+
+                if (prev[j] == UINT64_MAX) {
+                    continue;
+                }
+                f = prev[j] + fp * (n[i] - n[j]);
+                if (f < cur[i]) {
+                    cur[i] = f;
+                    sp->from[k][i] = (uint16_t)j;
+                }
+            }
+        }
+        tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+
+    *footprint = prev[nsize];
+
+    for (i = nsize, k = kmax; k > 0; k--) {
+        profile[SLABCLASS_MIN_ID + k - 1] = size[i];
+        i = sp->from[k][i];
+    }
+    ASSERT(i == 0);
+
+    id = SLABCLASS_MIN_ID + kmax - 1;
+    if (profile[id] < settings.max_chunk_size) {
+        id++;
+        profile[id] = settings.max_chunk_size;
+    }
+
+done:
+    mc_free(sp);
+
+    return id;
+}
+
 /*
  * Initialize all slabclasses.
  *
@@ -192,7 +487,7 @@ slab_slabclass_init(void)
         p->size = item_sz;
 
         p->nfree_itemq = 0;
-        TAILQ_INIT(&p->free_itemq);
+        item_q_init(&p->free_itemq);
 
         p->nfree_item = 0;
         p->free_item = NULL;
@@ -204,6 +499,383 @@ slab_slabclass_deinit(void)
 {
 }
 
+#ifdef MC_NUMA
+/*
+ * Set the bits of the online numa nodes in nodemask, and return the
+ * highest node online, or -1 if that cannot be told.
+ */
+static int
+slab_numa_nodemask(unsigned long *nodemask)
+{
+    size_t nbit = sizeof(unsigned long) * CHAR_BIT;
+    char buf[BUFSIZ], *p, *end;
+    long first, last, node;
+    int max_node;
+    FILE *fp;
+
+    fp = fopen("/sys/devices/system/node/online", "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    p = fgets(buf, sizeof(buf), fp);
+    fclose(fp);
+    if (p == NULL) {
+        return -1;
+    }
+
+    /* a list of node ranges, such as "0-1,3" */
+    max_node = -1;
+    while (*p >= '0' && *p <= '9') {
+        first = strtol(p, &end, 10);
+        last = first;
+        if (*end == '-') {
+            last = strtol(end + 1, &end, 10);
+        }
+        if (last >= SLAB_NUMA_MAX_NODE) {
+            return -1;
+        }
+        for (node = first; node <= last; node++) {
+            nodemask[node / nbit] |= 1UL << (node % nbit);
+        }
+        max_node = MAX(max_node, (int)last);
+        p = (*end == ',') ? end + 1 : end;
+    }
+
+    return max_node;
+}
+#endif
+
+/*
+ * Spread the pages of the slab heap over the numa nodes online. This has
+ * to happen before anyone touches them.
+ */
+static void
+slab_heap_interleave(void *addr, size_t size)
+{
+#ifdef MC_NUMA
+    unsigned long nodemask[SLAB_NUMA_MAX_NODE / (sizeof(unsigned long) *
+                                                 CHAR_BIT)];
+    long status;
+    int max_node;
+
+    if (settings.numa_policy != NUMA_POLICY_INTERLEAVE) {
+        return;
+    }
+
+    memset(nodemask, 0, sizeof(nodemask));
+    max_node = slab_numa_nodemask(nodemask);
+    if (max_node < 0) {
+        log_warn("interleaving %zu bytes of slab heap across numa nodes "
+                 "failed: cannot tell which nodes are online", size);
+        return;
+    }
+
+    /* the kernel takes maxnode as one past the # bits it reads */
+    status = syscall(SYS_mbind, addr, size, MPOL_INTERLEAVE, nodemask,
+                     (unsigned long)max_node + 2, 0);
+    if (status < 0) {
+        log_warn("interleaving %zu bytes of slab heap across numa nodes "
+                 "failed: %s", size, strerror(errno));
+        return;
+    }
+
+    log_debug(LOG_INFO, "interleaved %zu bytes of slab heap across numa nodes",
+              size);
+#endif
+}
+
+#ifdef MC_MMAP_HEAP
+/*
+ * Return the offset of the header of a heap file past a slab heap of a
+ * given size, on a page boundary so that it can be synced on its own.
+ */
+static size_t
+slab_heap_hdr_offset(size_t size)
+{
+    size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+
+    return (size + pagesize - 1) / pagesize * pagesize;
+}
+
+/*
+ * Map the slab heap from the heap file, followed by its header. The file
+ * is mapped shared, so that the slabs are still in the file when the next
+ * run comes to restore them. On a tmpfs like /dev/shm, the file is memory
+ * shared with the next run rather than disk. Reserved huge pages only
+ * back a file on a hugetlbfs, so we can only ask for transparent ones.
+ */
+static uint8_t *
+slab_heap_map_file(size_t size)
+{
+    size_t nbyte;
+    void *p;
+    int fd;
+
+    nbyte = slab_heap_hdr_offset(size) + sizeof(struct slab_heap_hdr);
+
+    fd = open(settings.heap_file, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        log_error("open of heap file '%s' failed: %s", settings.heap_file,
+                  strerror(errno));
+        return NULL;
+    }
+
+    if (ftruncate(fd, (off_t)nbyte) < 0) {
+        log_error("truncate of heap file '%s' to %zu bytes failed: %s",
+                  settings.heap_file, nbyte, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    p = mmap(NULL, nbyte, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        log_error("mmap of %zu bytes of heap file '%s' failed: %s", nbyte,
+                  settings.heap_file, strerror(errno));
+        return NULL;
+    }
+
+    heapinfo.pages = SLAB_HEAP_PAGES_NORMAL;
+#ifdef MADV_HUGEPAGE
+    if (settings.large_pages) {
+        if (madvise(p, size, MADV_HUGEPAGE) == 0) {
+            heapinfo.pages = SLAB_HEAP_PAGES_THP;
+        } else {
+            log_warn("madvise of %zu bytes of heap file for transparent huge "
+                     "pages failed: %s, using default page size", size,
+                     strerror(errno));
+        }
+    }
+#endif
+
+    slab_heap_interleave(p, size);
+
+    heapinfo.hdr = (struct slab_heap_hdr *)((uint8_t *)p +
+                                            slab_heap_hdr_offset(size));
+
+    return p;
+}
+#endif
+
+/*
+ * Map memory for the preallocated slab heap.
+ *
+ * With large pages, we first ask for reserved huge pages. Should there
+ * not be enough of them, we fall back to base pages that the kernel can
+ * back with transparent huge pages as they are faulted in, and failing
+ * that, to plain base pages. Without mmap, the heap is simply malloc-ed.
+ */
+static uint8_t *
+slab_heap_map(size_t size)
+{
+#ifdef MC_MMAP_HEAP
+    void *p = MAP_FAILED;
+
+    if (settings.heap_file != NULL) {
+        return slab_heap_map_file(size);
+    }
+
+    heapinfo.pages = SLAB_HEAP_PAGES_NORMAL;
+
+#ifdef MAP_HUGETLB
+    if (settings.large_pages) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            heapinfo.pages = SLAB_HEAP_PAGES_HUGETLB;
+        } else {
+            log_warn("mmap of %zu bytes with huge pages failed: %s, trying "
+                     "transparent huge pages", size, strerror(errno));
+        }
+    }
+#endif
+
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            log_error("mmap of %zu bytes failed: %s", size, strerror(errno));
+            return NULL;
+        }
+
+#ifdef MADV_HUGEPAGE
+        if (settings.large_pages) {
+            if (madvise(p, size, MADV_HUGEPAGE) == 0) {
+                heapinfo.pages = SLAB_HEAP_PAGES_THP;
+            } else {
+                log_warn("madvise of %zu bytes for transparent huge pages "
+                         "failed: %s, using default page size", size,
+                         strerror(errno));
+            }
+        }
+#endif
+    }
+
+    slab_heap_interleave(p, size);
+
+    return p;
+#else
+    if (settings.heap_file != NULL) {
+        log_error("heap files are not supported on this platform");
+        return NULL;
+    }
+
+    heapinfo.pages = SLAB_HEAP_PAGES_NORMAL;
+
+    return mc_alloc(size);
+#endif
+}
+
+static void
+slab_heap_layout_init(struct slab_heap_layout *layout)
+{
+    uint8_t id;
+
+    memset(layout, 0, sizeof(*layout));
+    layout->item_hdr_size = ITEM_HDR_SIZE;
+    layout->slab_hdr_size = SLAB_HDR_SIZE;
+    layout->compact_items = MC_COMPACT_ITEMS;
+    layout->slab_size = settings.slab_size;
+    layout->max_nslab = heapinfo.max_nslab;
+    layout->nclass = slabclass_max_id;
+    for (id = SLABCLASS_MIN_ID; id <= slabclass_max_id; id++) {
+        layout->size[id] = slabclass[id].size;
+    }
+}
+
+/*
+ * Open the header of the heap file. The slabs in the file are restored
+ * (see slab_restore) only if the run that left them shut down cleanly,
+ * with the same layout. Either way, the heap is marked in use, so that
+ * the next run does not trust it unless this one shuts down cleanly too.
+ */
+static void
+slab_heap_open(void)
+{
+    struct slab_heap_hdr *hdr = heapinfo.hdr;
+    struct slab_heap_layout layout;
+
+    heapinfo.nrestore = 0;
+    slab_heap_layout_init(&layout);
+
+    if (hdr->magic != SLAB_HEAP_MAGIC || hdr->version != SLAB_HEAP_VERSION) {
+        log_debug(LOG_NOTICE, "heap file '%s' holds no slab heap",
+                  settings.heap_file);
+    } else if (memcmp(&hdr->layout, &layout, sizeof(layout)) != 0) {
+        log_warn("heap file '%s' holds a slab heap of another layout, "
+                 "ignored", settings.heap_file);
+    } else if (!hdr->clean) {
+        log_warn("heap file '%s' holds a slab heap that was not shut down "
+                 "cleanly, ignored", settings.heap_file);
+    } else if (hdr->nslab > heapinfo.max_nslab) {
+        log_warn("heap file '%s' holds a slab heap of %"PRIu64" slabs, "
+                 "ignored", settings.heap_file, hdr->nslab);
+    } else {
+        heapinfo.nrestore = (uint32_t)hdr->nslab;
+    }
+
+    if (heapinfo.nrestore == 0) {
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->magic = SLAB_HEAP_MAGIC;
+        hdr->version = SLAB_HEAP_VERSION;
+        hdr->layout = layout;
+    }
+
+    hdr->clean = 0;
+}
+
+static void *
+slab_prefault_thread(void *arg)
+{
+    struct slab_prefault *pf = arg;
+    struct timespec now;
+    size_t pagesize;
+    uint8_t *slab, *p;
+
+    pagesize = (size_t)sysconf(_SC_PAGESIZE);
+
+    /*
+     * We go one slab at a time, so that others mapping memory in the
+     * meantime, like the main thread starting up, do not have to wait
+     * for the whole part to be faulted in.
+     */
+    for (slab = pf->start; slab < pf->start + pf->size;
+         slab += settings.slab_size) {
+#ifdef MADV_POPULATE_WRITE
+        if (madvise(slab, settings.slab_size, MADV_POPULATE_WRITE) == 0) {
+            continue;
+        }
+#endif
+
+        /*
+         * Fault the pages in by writing to them, without changing what is
+         * there, as workers may already be carving items out of them.
+         */
+        for (p = slab; p < slab + settings.slab_size; p += pagesize) {
+            __atomic_fetch_or(p, 0, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (__atomic_sub_fetch(&heapinfo.nprefault, 1, __ATOMIC_ACQ_REL) == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        heapinfo.prefault_usec =
+            (uint64_t)(now.tv_sec - heapinfo.prefault_ts.tv_sec) * 1000000 +
+            (now.tv_nsec - heapinfo.prefault_ts.tv_nsec) / 1000;
+        __atomic_store_n(&heapinfo.ready, true, __ATOMIC_RELEASE);
+
+        log_debug(LOG_NOTICE, "prefaulted %zu bytes of slab heap in %"PRIu64
+                  " usec", slab_heap_nbyte(), heapinfo.prefault_usec);
+    }
+
+    return NULL;
+}
+
+/*
+ * Fault in the preallocated slab heap in the background, with as many
+ * threads as there are workers, each taking its own share of the slabs.
+ * Serving requests need not wait for it, but until the heap is ready,
+ * workers may take page faults on slabs they get.
+ *
+ * With locked pages, the pages are locked as they are faulted in (see
+ * mc_lock_page), rather than by the kernel in the thread mapping them.
+ */
+static rstatus_t
+slab_heap_prefault(void)
+{
+    static struct slab_prefault prefault[SLAB_PREFAULT_MAX_NTHREAD];
+    uint32_t i, nthread, nslab;
+    pthread_t tid;
+    err_t err;
+
+    nthread = MIN(MAX(settings.num_workers, 1), SLAB_PREFAULT_MAX_NTHREAD);
+    nthread = MIN(nthread, MAX(heapinfo.max_nslab, 1));
+    nslab = (heapinfo.max_nslab + nthread - 1) / nthread;
+
+    clock_gettime(CLOCK_MONOTONIC, &heapinfo.prefault_ts);
+    heapinfo.nprefault = nthread;
+
+    for (i = 0; i < nthread; i++) {
+        prefault[i].start = heapinfo.base +
+                            (size_t)MIN(i * nslab, heapinfo.max_nslab) *
+                            settings.slab_size;
+        prefault[i].size = (size_t)(MIN((i + 1) * nslab, heapinfo.max_nslab) -
+                                    MIN(i * nslab, heapinfo.max_nslab)) *
+                           settings.slab_size;
+
+        err = pthread_create(&tid, NULL, slab_prefault_thread, &prefault[i]);
+        if (err != 0) {
+            log_error("pthread create failed: %s", strerror(err));
+            return MC_ERROR;
+        }
+        pthread_detach(tid);
+    }
+
+    log_debug(LOG_INFO, "prefaulting %zu bytes of slab heap with %"PRIu32
+              " threads", slab_heap_nbyte(), nthread);
+
+    return MC_OK;
+}
+
 /*
  * Initialize slab heap related info
  *
@@ -219,8 +891,9 @@ slab_heapinfo_init(void)
     heapinfo.max_nslab = settings.maxbytes / settings.slab_size;
 
     heapinfo.base = NULL;
+    heapinfo.pages = SLAB_HEAP_PAGES_NORMAL;
     if (settings.prealloc) {
-        heapinfo.base = mc_alloc(heapinfo.max_nslab * settings.slab_size);
+        heapinfo.base = slab_heap_map(heapinfo.max_nslab * settings.slab_size);
         if (heapinfo.base == NULL) {
             log_error("pre-alloc %zu bytes for %"PRIu32" slabs failed: %s",
                       heapinfo.max_nslab * settings.slab_size,
@@ -233,8 +906,21 @@ slab_heapinfo_init(void)
     }
     heapinfo.curr = heapinfo.base;
 
-    heapinfo.slab_table = mc_alloc(sizeof(*heapinfo.slab_table) * heapinfo.max_nslab);
-    if (heapinfo.slab_table == NULL) {
+    heapinfo.nrestore = 0;
+    heapinfo.restore_nitem = 0;
+    heapinfo.restore_usec = 0;
+    if (heapinfo.hdr != NULL) {
+        slab_heap_open();
+    }
+
+    heapinfo.ready = !settings.prealloc;
+    heapinfo.prefault_usec = 0;
+    if (settings.prealloc && slab_heap_prefault() != MC_OK) {
+        return MC_ERROR;
+    }
+
+    slab_table = mc_alloc(sizeof(*slab_table) * heapinfo.max_nslab);
+    if (slab_table == NULL) {
         log_error("create of slab table with %"PRIu32" entries failed: %s",
                   heapinfo.max_nslab, strerror(errno));
         return MC_ENOMEM;
@@ -285,6 +971,8 @@ slab_hdr_init(struct slab *slab, uint8_t id)
     slab->id = id;
     slab->unused = 0;
     slab->refcount = 0;
+    slab->nhit = 0;
+    slab->nbyte = 0;
 }
 
 static bool
@@ -313,8 +1001,9 @@ slab_table_update(struct slab *slab)
 {
     ASSERT(heapinfo.nslab < heapinfo.max_nslab);
 
-    heapinfo.slab_table[heapinfo.nslab] = slab;
-    heapinfo.nslab++;
+    slab->sid = heapinfo.nslab;
+    slab_table[heapinfo.nslab] = slab;
+    __atomic_store_n(&heapinfo.nslab, heapinfo.nslab + 1, __ATOMIC_RELAXED);
 
     log_debug(LOG_VERB, "new slab %p allocated at pos %u", slab,
               heapinfo.nslab - 1);
@@ -326,7 +1015,7 @@ slab_table_rand(void)
     uint32_t rand_idx;
 
     rand_idx = (uint32_t)rand() % heapinfo.nslab;
-    return heapinfo.slab_table[rand_idx];
+    return slab_table[rand_idx];
 }
 
 static struct slab *
@@ -371,6 +1060,23 @@ slab_get_new(void)
     return slab;
 }
 
+/*
+ * Get a raw slab from the slab pool, for the segment engine to use as a
+ * segment (see mc_segs.c). The slab is never handed back, and it is up to
+ * the caller to initialize its header.
+ */
+struct slab *
+slab_get_raw(void)
+{
+    struct slab *slab;
+
+    pthread_mutex_lock(&slab_lock);
+    slab = slab_get_new();
+    pthread_mutex_unlock(&slab_lock);
+
+    return slab;
+}
+
 /*
  * Primitives handling slab lruq activities
  */
@@ -388,47 +1094,157 @@ _slab_unlink_lruq(struct slab *slab)
 }
 
 /*
- * Evict a slab by evicting all the items within it. This means that the
- * items that are carved out of the slab must either be deleted from their
- * a) hash + lru Q, or b) free Q. The candidate slab itself must also be
- * delinked from its respective slab pool so that it is available for reuse.
- *
- * Eviction complexity is O(#items/slab).
+ * Evict the chunked item a chunk belongs to, along with all its chunks, so
+ * that the slab of the chunk can be evicted. A chunk still held by its
+ * allocation, or whose chunked item is unlinked or in use, cannot be
+ * evicted.
  */
- static void
-slab_evict_one(struct slab *slab)
+static rstatus_t
+slab_evict_chunk(struct item *chunk)
 {
-    struct slabclass *p;
     struct item *it;
-    uint32_t i;
+    uint32_t hv;
 
-    p = &slabclass[slab->id];
+    if (__atomic_load_n(&chunk->refcount, __ATOMIC_SEQ_CST) != 0) {
+        return MC_EAGAIN;
+    }
+
+    it = item_link_2_item(chunk->h_next);
+    hv = chunk->hv;
+    if (!item_trylock(hv)) {
+        return MC_EAGAIN;
+    }
+
+    /*
+     * The chunk could have been freed along with its chunked item, and
+     * the item reallocated under the same key, before we got hold of the
+     * stripe. A freed chunk has no flags by then (see slab_mag_put)
+     */
+    if (!item_is_chunk(chunk) || item_link_2_item(chunk->h_next) != it ||
+        !item_is_linked(it) || it->hv != hv || !item_reuse(it)) {
+        item_unlock(hv);
+        return MC_EAGAIN;
+    }
+
+    item_unlock(hv);
+
+    _slab_put_item(it);
+
+    return MC_OK;
+}
+
+/*
+ * Evict a slab by evicting all the items within it. This means that the
+ * items that are carved out of the slab must either be deleted from their
+ * a) hash + lru Q, or b) free Q. The candidate slab itself must also be
+ * delinked from its respective slab pool so that it is available for reuse.
+ *
+ * Linked items are protected by the stripes of their keys, which sit above
+ * the slab_lock in the lock hierarchy. So we only trylock the stripe of
+ * every linked item, and give up on the slab if a stripe is busy or an
+ * item turns out to be in use. Items that were already unlinked by then
+ * are put into the free q of their class, which leaves the slab in a
+ * consistent state for the next attempt.
+ *
+ * An item that is neither linked, slabbed nor yet to be carved out of
+ * the current slab is owned by someone else: it is either being filled
+ * in by an allocation, held in the magazine of a worker, or on its way
+ * back into the free q, waiting for the slab_lock we hold. Either way the
+ * slab cannot be evicted.
+ *
+ * A chunk is evicted by evicting its chunked item (see slab_evict_chunk),
+ * and the chunks of an evicted chunked item are freed right away.
+ *
+ * Eviction complexity is O(#items/slab).
+ */
+static rstatus_t
+slab_evict_one(struct slab *slab)
+{
+    struct slabclass *p;
+    struct item *it;
+    struct item_tqh reuseq;
+    uint32_t i, hv;
+    bool current;
+
+    p = &slabclass[slab->id];
 
     /* candidate slab is also the current slab */
-    if (p->free_item != NULL && slab == item_2_slab(p->free_item)) {
+    current = p->free_item != NULL && slab == item_2_slab(p->free_item);
+
+    item_q_init(&reuseq);
+
+    /* delete slab items from hash + lru Q */
+    for (i = 0; i < p->nitem; i++) {
+        it = slab_2_item(slab, i, p->size);
+
+        ASSERT(it->magic == ITEM_MAGIC);
+        ASSERT(it->offset != 0);
+
+        if (item_is_slabbed(it)) {
+            continue;
+        }
+
+        if (current && it >= p->free_item) {
+            /* not carved out yet */
+            continue;
+        }
+
+        if (item_is_chunk(it)) {
+            if (slab_evict_chunk(it) != MC_OK) {
+                goto evict_abort;
+            }
+            continue;
+        }
+
+        if (!item_is_linked(it)) {
+            goto evict_abort;
+        }
+
+        hv = it->hv;
+        if (!item_trylock(hv)) {
+            goto evict_abort;
+        }
+
+        /*
+         * The item could have been reallocated under a different key
+         * before we got hold of the stripe, or be in use
+         */
+        if (!item_is_linked(it) || it->hv != hv || !item_reuse(it)) {
+            item_unlock(hv);
+            goto evict_abort;
+        }
+
+        item_unlock(hv);
+
+        _slab_put_chunks(it);
+        item_q_insert_tail(&reuseq, it);
+    }
+
+    if (slab_in_use(slab)) {
+        goto evict_abort;
+    }
+
+    if (current) {
         p->nfree_item = 0;
-        p->free_item = NULL;
+        __atomic_store_n(&p->free_item, NULL, __ATOMIC_RELAXED);
     }
 
-    /* delete slab items either from hash + lru Q or free Q */
+    /* delete slab items from free Q */
     for (i = 0; i < p->nitem; i++) {
         it = slab_2_item(slab, i, p->size);
 
-        ASSERT(it->magic == ITEM_MAGIC);
         ASSERT(it->refcount == 0);
-        ASSERT(it->offset != 0);
 
-        if (item_is_linked(it)) {
-            item_reuse(it);
-        } else if (item_is_slabbed(it)) {
+        if (item_is_slabbed(it)) {
             ASSERT(slab == item_2_slab(it));
-            ASSERT(!TAILQ_EMPTY(&p->free_itemq));
+            ASSERT(!item_q_empty(&p->free_itemq));
 
             it->flags &= ~ITEM_SLABBED;
 
             ASSERT(p->nfree_itemq > 0);
-            p->nfree_itemq--;
-            TAILQ_REMOVE(&p->free_itemq, it, i_tqe);
+            __atomic_store_n(&p->nfree_itemq, p->nfree_itemq - 1,
+                             __ATOMIC_RELAXED);
+            item_q_remove(&p->free_itemq, it);
             stats_slab_decr(slab->id, item_free);
         }
     }
@@ -438,6 +1254,26 @@ slab_evict_one(struct slab *slab)
 
     stats_slab_incr(slab->id, slab_evict);
     stats_slab_decr(slab->id, slab_curr);
+
+    /*
+     * Lockless readers that found an item of this slab before it was
+     * unlinked may still be looking at it, and must be done before the
+     * slab is carved anew
+     */
+    thread_epoch_synchronize();
+
+    return MC_OK;
+
+evict_abort:
+    log_debug(LOG_VERB, "abort evicting slab %p with id %u", slab, slab->id);
+
+    while (!item_q_empty(&reuseq)) {
+        it = item_q_first(&reuseq);
+        item_q_remove(&reuseq, it);
+        slab_put_item_into_freeq(it);
+    }
+
+    return MC_EAGAIN;
 }
 
 /*
@@ -454,22 +1290,22 @@ slab_evict_rand(void)
     struct slab *slab;
     uint32_t tries;
 
-    tries = SLAB_RAND_MAX_TRIES;
-    do {
+    for (tries = SLAB_RAND_MAX_TRIES; tries > 0; tries--) {
         slab = slab_table_rand();
-        tries--;
-    } while (tries > 0 && slab->refcount != 0);
-
-    if (tries == 0) {
-        /* all randomly chosen slabs are in use */
-        return NULL;
-    }
+        if (slab_in_use(slab)) {
+            continue;
+        }
 
-    log_debug(LOG_DEBUG, "random-evicting slab %p with id %u", slab, slab->id);
+        log_debug(LOG_DEBUG, "random-evicting slab %p with id %u", slab,
+                  slab->id);
 
-    slab_evict_one(slab);
+        if (slab_evict_one(slab) == MC_OK) {
+            return slab;
+        }
+    }
 
-    return slab;
+    /* all randomly chosen slabs are in use */
+    return NULL;
 }
 
 /*
@@ -478,27 +1314,102 @@ slab_evict_rand(void)
 static struct slab *
 slab_evict_lru(int id)
 {
-    struct slab *slab;
+    struct slab *slab, *next;
     uint32_t tries;
 
-
     for (tries = SLAB_LRU_MAX_TRIES, slab = slab_lruq_head();
          tries > 0 && slab != NULL;
-         tries--, slab = TAILQ_NEXT(slab, s_tqe)) {
-        if (slab->refcount == 0) {
-            break;
+         tries--, slab = next) {
+        next = TAILQ_NEXT(slab, s_tqe);
+
+        if (slab_in_use(slab)) {
+            continue;
+        }
+
+        log_debug(LOG_DEBUG, "lru-evicting slab %p with id %u", slab,
+                  slab->id);
+
+        if (slab_evict_one(slab) == MC_OK) {
+            return slab;
         }
     }
 
-    if (tries == 0 || slab == NULL) {
-        return NULL;
+    return NULL;
+}
+
+/*
+ * Return true if slab a has a lower hit density, hits per byte of the
+ * items it holds, than slab b. A slab that holds nothing has none.
+ */
+static bool
+slab_hd_lower(struct slab *a, uint32_t anhit, struct slab *b, uint32_t bnhit)
+{
+    if (a->nbyte == 0 || b->nbyte == 0) {
+        return a->nbyte == 0 && b->nbyte != 0;
     }
 
-    log_debug(LOG_DEBUG, "lru-evicting slab %p with id %u", slab, slab->id);
+    return (uint64_t)anhit * b->nbyte < (uint64_t)bnhit * a->nbyte;
+}
+
+/*
+ * Evict the slab with the lowest hit density out of SLAB_HD_NSAMPLE slabs
+ * sampled from the slab table. Sampled slabs that are spared have their
+ * hits halved, so that the density of a slab follows its recent hits
+ * rather than all those since it was carved out.
+ */
+static struct slab *
+slab_evict_hd(void)
+{
+    struct slab *sample[SLAB_HD_NSAMPLE];
+    uint32_t nhit[SLAB_HD_NSAMPLE];
+    struct slab *slab;
+    uint32_t tries, i, n, victim, nbyte;
+
+    for (tries = SLAB_RAND_MAX_TRIES; tries > 0; tries--) {
+        for (i = 0, n = 0, victim = 0; i < SLAB_HD_NSAMPLE; i++) {
+            slab = slab_table_rand();
+            if (slab_in_use(slab)) {
+                continue;
+            }
+
+            sample[n] = slab;
+            nhit[n] = __atomic_load_n(&slab->nhit, __ATOMIC_RELAXED);
+            if (n > 0 &&
+                slab_hd_lower(slab, nhit[n], sample[victim], nhit[victim])) {
+                victim = n;
+            }
+            n++;
+        }
+
+        if (n == 0) {
+            continue;
+        }
+
+        slab = sample[victim];
+        nbyte = slab->nbyte;
 
-    slab_evict_one(slab);
+        log_debug(LOG_DEBUG, "hd-evicting slab %p with id %u hits %"PRIu32" "
+                  "bytes %"PRIu32"", slab, slab->id, nhit[victim], nbyte);
 
-    return slab;
+        if (slab_evict_one(slab) != MC_OK) {
+            continue;
+        }
+
+        stats_slab_incr_by(slab->id, slab_evict_hit, nhit[victim]);
+        stats_slab_incr_by(slab->id, slab_evict_byte, nbyte);
+
+        for (i = 0; i < n; i++) {
+            if (sample[i] != slab) {
+                __atomic_store_n(&sample[i]->nhit, nhit[i] / 2,
+                                 __ATOMIC_RELAXED);
+            }
+        }
+
+        return slab;
+    }
+
+    /* all sampled slabs are in use */
+    return NULL;
 }
 
 /*
@@ -530,7 +1441,8 @@ slab_add_one(struct slab *slab, uint8_t id)
 
     /* make this slab as the current slab */
     p->nfree_item = p->nitem;
-    p->free_item = (struct item *)&slab->data[0];
+    __atomic_store_n(&p->free_item, (struct item *)&slab->data[0],
+                     __ATOMIC_RELAXED);
 }
 
 /*
@@ -550,10 +1462,22 @@ slab_get(uint8_t id)
     stats_slab_incr(id, slab_req);
 
     ASSERT(slabclass[id].free_item == NULL);
-    ASSERT(TAILQ_EMPTY(&slabclass[id].free_itemq));
+    ASSERT(item_q_empty(&slabclass[id].free_itemq));
 
     slab = slab_get_new();
 
+    if (slab == NULL && (settings.evict_opt & ~EVICT_LRU)) {
+        /*
+         * Items in the magazines of workers would keep their slabs from
+         * being evicted, so they all go back before a slab eviction
+         */
+        slab_mag_drain(SLABCLASS_INVALID_ID);
+    }
+
+    if (slab == NULL && (settings.evict_opt & EVICT_HD)) {
+        slab = slab_evict_hd();
+    }
+
     if (slab == NULL && (settings.evict_opt & (EVICT_CS | EVICT_AS))) {
         slab = slab_evict_lru(id);
     }
@@ -592,19 +1516,22 @@ slab_get_item_from_freeq(uint8_t id)
         return NULL;
     }
 
-    it = TAILQ_FIRST(&p->free_itemq);
+    it = item_q_first(&p->free_itemq);
 
     ASSERT(it->magic == ITEM_MAGIC);
     ASSERT(item_is_slabbed(it));
     ASSERT(!item_is_linked(it));
 
-    it->flags &= ~ITEM_SLABBED;
+    /* stale flags, like those of a chunk, go along with ITEM_SLABBED */
+    it->flags = 0;
 
     ASSERT(p->nfree_itemq > 0);
-    p->nfree_itemq--;
-    TAILQ_REMOVE(&p->free_itemq, it, i_tqe);
+    __atomic_store_n(&p->nfree_itemq, p->nfree_itemq - 1, __ATOMIC_RELAXED);
+    item_q_remove(&p->free_itemq, it);
     stats_slab_decr(id, item_free);
 
+    item_2_slab(it)->nbyte += p->size;
+
     log_debug(LOG_VERB, "get free q it '%.*s' at offset %"PRIu32" with id "
               "%"PRIu8"", it->nkey, item_key(it), it->offset, it->id);
 
@@ -631,16 +1558,29 @@ _slab_get_item(uint8_t id)
         return it;
     }
 
+    if (p->free_item == NULL && slab_heap_full()) {
+        /* free items of this class may be left in the magazines of workers */
+        slab_mag_drain(id);
+        it = slab_get_item_from_freeq(id);
+        if (it != NULL) {
+            return it;
+        }
+    }
+
     if (p->free_item == NULL && (slab_get(id) != MC_OK)) {
-        return NULL;
+        /* an aborted slab eviction may have refilled the item free q */
+        return slab_get_item_from_freeq(id);
     }
 
     /* return item from current slab */
     it = p->free_item;
+    item_2_slab(it)->nbyte += p->size;
     if (--p->nfree_item != 0) {
-        p->free_item = (struct item *)(((uint8_t *)p->free_item) + p->size);
+        __atomic_store_n(&p->free_item,
+                         (struct item *)((uint8_t *)it + p->size),
+                         __ATOMIC_RELAXED);
     } else {
-        p->free_item = NULL;
+        __atomic_store_n(&p->free_item, NULL, __ATOMIC_RELAXED);
     }
 
     log_debug(LOG_VERB, "get new it at offset %"PRIu32" with id %"PRIu8"",
@@ -649,25 +1589,144 @@ _slab_get_item(uint8_t id)
     return it;
 }
 
+/*
+ * Get an item with a given id from the magazine of the calling worker.
+ */
+static struct item *
+slab_mag_get(struct slab_mag *mag, uint8_t id)
+{
+    struct item *it;
+
+    pthread_mutex_lock(&mag->lock);
+    if (mag->nitem[id] == 0) {
+        pthread_mutex_unlock(&mag->lock);
+        return NULL;
+    }
+    __atomic_store_n(&mag->nitem[id], mag->nitem[id] - 1, __ATOMIC_RELAXED);
+    it = mag->item[id][mag->nitem[id]];
+    item_acquire_refcount(it);
+    pthread_mutex_unlock(&mag->lock);
+
+    stats_slab_decr(id, item_free);
+
+    return it;
+}
+
+/*
+ * Get an item with a given id for the caller, and refill the empty magazine
+ * of the calling worker with up to SLAB_MAG_BATCH - 1 more, as long as the
+ * class has them without getting a new slab.
+ */
+static struct item *
+slab_mag_refill(struct slab_mag *mag, uint8_t id)
+{
+    struct slabclass *p = &slabclass[id];
+    struct item *it, *batch[SLAB_MAG_BATCH - 1];
+    uint32_t i, n;
+
+    pthread_mutex_lock(&slab_lock);
+    it = _slab_get_item(id);
+    if (it != NULL) {
+        item_acquire_refcount(it);
+    }
+    for (n = 0; it != NULL && n < SLAB_MAG_BATCH - 1; n++) {
+        if (p->nfree_itemq == 0 && p->free_item == NULL) {
+            break;
+        }
+        batch[n] = _slab_get_item(id);
+        ASSERT(batch[n] != NULL);
+    }
+    pthread_mutex_unlock(&slab_lock);
+
+    if (n == 0) {
+        return it;
+    }
+
+    pthread_mutex_lock(&mag->lock);
+    ASSERT(mag->nitem[id] + n <= SLAB_MAG_SIZE);
+    for (i = 0; i < n; i++) {
+        mag->item[id][mag->nitem[id] + i] = batch[i];
+    }
+    __atomic_store_n(&mag->nitem[id], mag->nitem[id] + n, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&mag->lock);
+
+    stats_slab_incr_by(id, item_free, n);
+    stats_slab_incr(id, item_refill);
+
+    return it;
+}
+
+/*
+ * The returned item is refcounted, so that it cannot be claimed by a slab
+ * eviction before the caller gets to link it.
+ */
 struct item *
 slab_get_item(uint8_t id)
 {
+    struct slab_mag *mag;
     struct item *it;
 
     ASSERT(id >= SLABCLASS_MIN_ID && id <= slabclass_max_id);
 
+    mag = pthread_getspecific(keys.mag);
+    if (mag != NULL) {
+        it = slab_mag_get(mag, id);
+        if (it == NULL) {
+            it = slab_mag_refill(mag, id);
+        }
+        return it;
+    }
+
     pthread_mutex_lock(&slab_lock);
     it = _slab_get_item(id);
+    if (it != NULL) {
+        item_acquire_refcount(it);
+    }
     pthread_mutex_unlock(&slab_lock);
 
     return it;
 }
 
 /*
- * Put an item back into the slab by inserting into the item free Q.
+ * Return true if an item of the slab with a given id can only be had by
+ * evicting, as neither the magazine of the calling worker, the slab nor
+ * the heap have room left for it. This is checked on every set, so it is
+ * only a hint read without locks.
+ */
+bool
+slab_full(uint8_t id)
+{
+    struct slabclass *p;
+    struct slab_mag *mag;
+
+    ASSERT(id >= SLABCLASS_MIN_ID && id <= slabclass_max_id);
+
+    p = &slabclass[id];
+
+    mag = pthread_getspecific(keys.mag);
+    if (mag != NULL &&
+        __atomic_load_n(&mag->nitem[id], __ATOMIC_RELAXED) != 0) {
+        return false;
+    }
+
+    if (settings.use_freeq &&
+        __atomic_load_n(&p->nfree_itemq, __ATOMIC_RELAXED) != 0) {
+        return false;
+    }
+
+    if (__atomic_load_n(&p->free_item, __ATOMIC_RELAXED) != NULL) {
+        return false;
+    }
+
+    return __atomic_load_n(&heapinfo.nslab, __ATOMIC_RELAXED) >=
+           heapinfo.max_nslab;
+}
+
+/*
+ * Move a free item, already counted as such, into the item free Q.
  */
 static void
-slab_put_item_into_freeq(struct item *it)
+slab_move_item_into_freeq(struct item *it)
 {
     uint8_t id = it->id;
     struct slabclass *p = &slabclass[id];
@@ -684,58 +1743,840 @@ slab_put_item_into_freeq(struct item *it)
 
     it->flags |= ITEM_SLABBED;
 
-    p->nfree_itemq++;
-    TAILQ_INSERT_HEAD(&p->free_itemq, it, i_tqe);
+    ASSERT(item_2_slab(it)->nbyte >= p->size);
+    item_2_slab(it)->nbyte -= p->size;
 
-    stats_slab_incr(id, item_free);
-    stats_slab_incr(id, item_remove);
+    __atomic_store_n(&p->nfree_itemq, p->nfree_itemq + 1, __ATOMIC_RELAXED);
+    item_q_insert_head(&p->free_itemq, it);
 }
 
 /*
- * Put an item back into the slab
+ * Put an item back into the slab by inserting into the item free Q.
  */
 static void
-_slab_put_item(struct item *it)
+slab_put_item_into_freeq(struct item *it)
 {
-    slab_put_item_into_freeq(it);
-}
+    slab_move_item_into_freeq(it);
 
-void
-slab_put_item(struct item *it)
-{
-    pthread_mutex_lock(&slab_lock);
-    _slab_put_item(it);
-    pthread_mutex_unlock(&slab_lock);
+    stats_slab_incr(it->id, item_free);
+    stats_slab_incr(it->id, item_remove);
 }
 
 /*
- * Touch slab lruq by moving the given slab to the tail of the slab lruq, but
- * only if it hasn't been moved within the last SLAB_LRU_UPDATE_INTERVAL secs.
+ * Put an item into the magazine of the calling worker. A full magazine
+ * spills its SLAB_MAG_BATCH oldest items into the item free Q, keeping
+ * the most recently freed ones, which are more likely to be in cache.
  */
-void
-slab_lruq_touch(struct slab *slab, bool allocated)
+static void
+slab_mag_put(struct slab_mag *mag, struct item *it)
 {
+    struct item *batch[SLAB_MAG_BATCH];
+    uint8_t id = it->id;
+    uint32_t i, n;
+
+    ASSERT(id >= SLABCLASS_MIN_ID && id <= slabclass_max_id);
+    ASSERT(!item_is_linked(it));
+    ASSERT(!item_is_slabbed(it));
+    ASSERT(it->refcount == 0);
+
     /*
-     * Check eviction option to make sure we adjust the order of slabs only if:
-     * - request comes from allocating an item & lru slab eviction is specified, or
-     * - lra slab eviction is specified
+     * A freed chunk still links back to its chunked item, which a slab
+     * eviction must not follow once the item is reallocated
      */
-    if (!(allocated && (settings.evict_opt & EVICT_CS)) &&
-        !(settings.evict_opt & EVICT_AS)) {
-        return;
+    it->flags = 0;
+
+    n = 0;
+
+    pthread_mutex_lock(&mag->lock);
+    if (mag->nitem[id] == SLAB_MAG_SIZE) {
+        n = SLAB_MAG_BATCH;
+        memcpy(batch, mag->item[id], sizeof(batch));
+        memmove(&mag->item[id][0], &mag->item[id][n],
+                (SLAB_MAG_SIZE - n) * sizeof(mag->item[id][0]));
     }
+    mag->item[id][mag->nitem[id] - n] = it;
+    __atomic_store_n(&mag->nitem[id], mag->nitem[id] - n + 1,
+                     __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&mag->lock);
 
+    stats_slab_incr(id, item_free);
+    stats_slab_incr(id, item_remove);
 
-    /* TODO: find out if we can remove this check w/o impacting performance */
-    if (slab->utime >= (time_now() - SLAB_LRU_UPDATE_INTERVAL)) {
+    if (n == 0) {
         return;
     }
 
-    log_debug(LOG_VERB, "update slab %p with id%"PRIu8" in the slab lruq",
-              slab, slab->id);
-
     pthread_mutex_lock(&slab_lock);
-    _slab_unlink_lruq(slab);
-    _slab_link_lruq(slab);
+    for (i = 0; i < n; i++) {
+        slab_move_item_into_freeq(batch[i]);
+    }
     pthread_mutex_unlock(&slab_lock);
+
+    stats_slab_incr(id, item_spill);
+}
+
+/*
+ * Move the items of class id, or of all classes for SLABCLASS_INVALID_ID,
+ * out of the magazines of all workers into the item free Q. Items taken out
+ * of a magazine and not yet handed out or put back are missed, and keep
+ * their slabs from being evicted for a little while longer.
+ */
+static void
+slab_mag_drain(uint8_t id)
+{
+    struct slab_mag *mag;
+    uint8_t cid, first, last;
+    uint32_t j;
+    int i;
+
+    if (id == SLABCLASS_INVALID_ID) {
+        first = SLABCLASS_MIN_ID;
+        last = slabclass_max_id;
+    } else {
+        first = last = id;
+    }
+
+    for (i = 0; i < settings.num_workers; i++) {
+        mag = threads[i].mag;
+        if (mag == NULL) {
+            continue;
+        }
+
+        pthread_mutex_lock(&mag->lock);
+        for (cid = first; cid <= last; cid++) {
+            if (mag->nitem[cid] == 0) {
+                continue;
+            }
+            for (j = 0; j < mag->nitem[cid]; j++) {
+                slab_move_item_into_freeq(mag->item[cid][j]);
+            }
+            __atomic_store_n(&mag->nitem[cid], 0, __ATOMIC_RELAXED);
+            stats_slab_incr(cid, item_spill);
+        }
+        pthread_mutex_unlock(&mag->lock);
+    }
+}
+
+struct slab_mag *
+slab_mag_create(void)
+{
+    struct slab_mag *mag;
+    err_t err;
+
+    mag = mc_zalloc(sizeof(*mag));
+    if (mag == NULL) {
+        return NULL;
+    }
+
+    err = pthread_mutex_init(&mag->lock, NULL);
+    if (err != 0) {
+        log_error("pthread mutex init failed: %s", strerror(err));
+        mc_free(mag);
+        return NULL;
+    }
+
+    return mag;
+}
+
+/*
+ * Put the chunks of a chunked item back into their slabs, which leaves the
+ * item unchunked.
+ */
+static void
+_slab_put_chunks(struct item *it)
+{
+    uint32_t i, nchunk;
+
+    if (!item_is_chunked(it)) {
+        return;
+    }
+
+    nchunk = item_nchunk(it);
+    for (i = 0; i < nchunk; i++) {
+        slab_put_item_into_freeq(item_chunk(it, i));
+    }
+
+    it->flags &= ~ITEM_CHUNKED;
+}
+
+void
+slab_put_chunks(struct item *it)
+{
+    if (!item_is_chunked(it)) {
+        return;
+    }
+
+    pthread_mutex_lock(&slab_lock);
+    _slab_put_chunks(it);
+    pthread_mutex_unlock(&slab_lock);
+}
+
+/*
+ * Put an item back into the slab, along with its chunks
+ */
+static void
+_slab_put_item(struct item *it)
+{
+    _slab_put_chunks(it);
+    slab_put_item_into_freeq(it);
+}
+
+void
+slab_put_item(struct item *it)
+{
+    struct slab_mag *mag;
+    uint32_t i, nchunk;
+
+    mag = pthread_getspecific(keys.mag);
+    if (mag != NULL) {
+        if (item_is_chunked(it)) {
+            nchunk = item_nchunk(it);
+            for (i = 0; i < nchunk; i++) {
+                slab_mag_put(mag, item_chunk(it, i));
+            }
+            it->flags &= ~ITEM_CHUNKED;
+        }
+        slab_mag_put(mag, it);
+        return;
+    }
+
+    pthread_mutex_lock(&slab_lock);
+    _slab_put_item(it);
+    pthread_mutex_unlock(&slab_lock);
+}
+
+/*
+ * Touch slab lruq by moving the given slab to the tail of the slab lruq, but
+ * only if it hasn't been moved within the last SLAB_LRU_UPDATE_INTERVAL secs.
+ */
+void
+slab_lruq_touch(struct slab *slab, bool allocated)
+{
+    /*
+     * Check eviction option to make sure we adjust the order of slabs only if:
+     * - request comes from allocating an item & lru slab eviction is specified, or
+     * - lra slab eviction is specified
+     */
+    if (!(allocated && (settings.evict_opt & EVICT_CS)) &&
+        !(settings.evict_opt & EVICT_AS)) {
+        return;
+    }
+
+
+    /* TODO: find out if we can remove this check w/o impacting performance */
+    if (slab->utime >= (time_now() - SLAB_LRU_UPDATE_INTERVAL)) {
+        return;
+    }
+
+    log_debug(LOG_VERB, "update slab %p with id%"PRIu8" in the slab lruq",
+              slab, slab->id);
+
+    pthread_mutex_lock(&slab_lock);
+    _slab_unlink_lruq(slab);
+    _slab_link_lruq(slab);
+    pthread_mutex_unlock(&slab_lock);
+}
+
+/*
+ * Count a hit on an item of the given slab, if hit density slab eviction
+ * is specified. Hits are counted without the slab_lock, and a few of them
+ * may be lost to halving by a concurrent eviction.
+ */
+void
+slab_hit(struct slab *slab)
+{
+    if (!(settings.evict_opt & EVICT_HD)) {
+        return;
+    }
+
+    __atomic_fetch_add(&slab->nhit, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Move a slab from class from to class to, by evicting one of its slabs
+ * that is not in use. Candidates are looked up from the head of the slab
+ * lruq, so that the least recently used slabs of a class go first.
+ *
+ * The receiving class only gets the slab when it has no current slab,
+ * which is the case for a class that has run out of memory.
+ */
+static rstatus_t
+slab_move(uint8_t from, uint8_t to)
+{
+    struct slab *slab, *next;
+    uint32_t tries;
+
+    if (slabclass[to].free_item != NULL) {
+        return MC_EAGAIN;
+    }
+
+    slab_mag_drain(from);
+
+    for (tries = SLAB_MOVE_MAX_TRIES, slab = slab_lruq_head();
+         tries > 0 && slab != NULL;
+         slab = next) {
+        next = TAILQ_NEXT(slab, s_tqe);
+
+        if (slab->id != from) {
+            continue;
+        }
+
+        tries--;
+
+        if (slab_in_use(slab)) {
+            continue;
+        }
+
+        if (slab_evict_one(slab) == MC_OK) {
+            log_debug(LOG_INFO, "moved slab %p from class %"PRIu8" to class "
+                      "%"PRIu8"", slab, from, to);
+
+            slab_add_one(slab, to);
+
+            stats_slab_incr(from, slab_move_out);
+            stats_slab_incr(to, slab_move_in);
+
+            return MC_OK;
+        }
+    }
+
+    return MC_EAGAIN;
+}
+
+/*
+ * Rebalance slabs among slab classes to fight slab calcification, which
+ * the item lru eviction (-M 1) suffers from, as it never takes memory
+ * away from a class once given.
+ *
+ * Eviction pressure of a class is measured by its slab_error count, the
+ * number of allocations that found the class out of memory, and had to
+ * either evict an item or fail. Unlike item_evict, this also covers the
+ * classes that never got a slab to evict from.
+ *
+ * At the end of every window, the class under most pressure in the window
+ * is the receiver, and the donor is the class with the fewest key hits
+ * per slab among those that were under no pressure for as many windows as
+ * the receiver has to lead them. A donor always keeps its last slab. At
+ * most one slab is moved per window.
+ *
+ * Decisions are based on the aggregated stats, so nothing is moved when
+ * stats are disabled.
+ */
+void
+slab_automove(void)
+{
+    struct slab_automove_policy *policy;
+    int64_t oom[SLABCLASS_MAX_IDS], hit[SLABCLASS_MAX_IDS];
+    int64_t gets_hit[SLABCLASS_MAX_IDS], nslab[SLABCLASS_MAX_IDS];
+    int64_t max_noom;
+    double temp, min_temp;
+    uint8_t id, receiver, donor;
+
+    if (settings.slab_automove <= SLAB_AUTOMOVE_OFF ||
+        settings.slab_automove > SLAB_AUTOMOVE_AGGRESSIVE || !stats_enabled()) {
+        automove.init = false;
+        return;
+    }
+
+    policy = &slab_automove_policy[settings.slab_automove];
+
+    if (automove.init && ++automove.ncheck < policy->window) {
+        return;
+    }
+    automove.ncheck = 0;
+
+    stats_slab_snapshot(SLAB_slab_error, oom);
+    stats_slab_snapshot(SLAB_get_key_hit, hit);
+    stats_slab_snapshot(SLAB_gets_key_hit, gets_hit);
+    stats_slab_snapshot(SLAB_slab_curr, nslab);
+
+    for (id = SLABCLASS_MIN_ID; id <= slabclass_max_id; id++) {
+        hit[id] += gets_hit[id];
+    }
+
+    if (!automove.init) {
+        memcpy(automove.oom, oom, sizeof(oom));
+        memcpy(automove.hit, hit, sizeof(hit));
+        memset(automove.quiet, 0, sizeof(automove.quiet));
+        automove.receiver = SLABCLASS_INVALID_ID;
+        automove.nreceiver = 0;
+        automove.init = true;
+        return;
+    }
+
+    receiver = SLABCLASS_INVALID_ID;
+    max_noom = 0;
+    for (id = SLABCLASS_MIN_ID; id <= slabclass_max_id; id++) {
+        int64_t noom = oom[id] - automove.oom[id];
+
+        if (noom > max_noom) {
+            max_noom = noom;
+            receiver = id;
+        }
+
+        automove.quiet[id] = noom > 0 ? 0 : automove.quiet[id] + 1;
+    }
+
+    if (receiver != SLABCLASS_INVALID_ID && receiver == automove.receiver) {
+        automove.nreceiver++;
+    } else {
+        automove.receiver = receiver;
+        automove.nreceiver = receiver != SLABCLASS_INVALID_ID ? 1 : 0;
+    }
+
+    donor = SLABCLASS_INVALID_ID;
+    min_temp = 0.0;
+    for (id = SLABCLASS_MIN_ID; id <= slabclass_max_id; id++) {
+        if (id == receiver || nslab[id] < 2 ||
+            automove.quiet[id] < policy->nwindow) {
+            continue;
+        }
+
+        temp = (double)(hit[id] - automove.hit[id]) / nslab[id];
+        if (donor == SLABCLASS_INVALID_ID || temp < min_temp) {
+            min_temp = temp;
+            donor = id;
+        }
+    }
+
+    memcpy(automove.oom, oom, sizeof(oom));
+    memcpy(automove.hit, hit, sizeof(hit));
+
+    if (automove.nreceiver < policy->nwindow || donor == SLABCLASS_INVALID_ID) {
+        return;
+    }
+
+    log_debug(LOG_VERB, "automove slab from class %"PRIu8" with %"PRId64" "
+              "slabs to class %"PRIu8" out of memory %"PRId64" times", donor,
+              nslab[donor], receiver, max_noom);
+
+    pthread_mutex_lock(&slab_lock);
+    if (slab_move(donor, receiver) == MC_OK) {
+        automove.nreceiver = 0;
+    }
+    pthread_mutex_unlock(&slab_lock);
+}
+
+/*
+ * Return the # slabs allocated so far, which are at pos 0 to nslab - 1 of
+ * the slab table for good.
+ */
+uint32_t
+slab_nslab(void)
+{
+    uint32_t nslab;
+
+    pthread_mutex_lock(&slab_lock);
+    nslab = heapinfo.nslab;
+    pthread_mutex_unlock(&slab_lock);
+
+    return nslab;
+}
+
+/*
+ * Return the idx^th item of the slab at a given pos of the slab table, or
+ * NULL past its last item. Slabs are walked without locks, and may move to
+ * another class in the meantime, so the item returned is only where one
+ * may lie, and has to be checked by the caller (see item_snapshot).
+ */
+struct item *
+slab_walk_item(uint32_t sid, uint32_t idx)
+{
+    struct slab *slab;
+    uint8_t id;
+
+    ASSERT(sid < heapinfo.max_nslab);
+
+    slab = slab_table[sid];
+    id = slab->id;
+    if (id < SLABCLASS_MIN_ID || id > slabclass_max_id ||
+        idx >= slabclass[id].nitem) {
+        return NULL;
+    }
+
+    return (struct item *)(slab->data + (size_t)idx * slabclass[id].size);
+}
+
+/*
+ * Return true if an item lies on the item grid of an allocated slab of the
+ * preallocated slab heap, and its header agrees with where it lies.
+ */
+bool
+slab_item_valid(struct item *it)
+{
+    uint8_t *p = (uint8_t *)it;
+    struct slabclass *c;
+    struct slab *slab;
+    size_t offset;
+
+    if (p < heapinfo.base || p >= heapinfo.curr) {
+        return false;
+    }
+
+    offset = (size_t)(p - heapinfo.base) % settings.slab_size;
+    if (offset < SLAB_HDR_SIZE) {
+        return false;
+    }
+
+    slab = (struct slab *)(p - offset);
+    if (slab->id < SLABCLASS_MIN_ID || slab->id > slabclass_max_id) {
+        return false;
+    }
+
+    c = &slabclass[slab->id];
+    if ((offset - SLAB_HDR_SIZE) % c->size != 0 ||
+        (offset - SLAB_HDR_SIZE) / c->size >= c->nitem) {
+        return false;
+    }
+
+#if MC_ASSERT_PANIC == 1 || MC_ASSERT_LOG == 1
+    if (it->magic != ITEM_MAGIC) {
+        return false;
+    }
+#endif
+
+    return (it->offset == offset && it->id == slab->id);
+}
+
+static void *
+slab_restore_thread(void *arg)
+{
+    struct slab_restore *sr = arg;
+    struct slabclass *p;
+    struct slab *slab;
+    struct item *it;
+    uint32_t sid, i, offset;
+
+    if (thread_stand_in(sr->idx) != MC_OK) {
+        exit(1);
+    }
+
+    for (sid = sr->start; sid < sr->end; sid++) {
+        slab = slab_table[sid];
+        p = &slabclass[slab->id];
+
+        if (!sr->relink) {
+            slab->nhit = 0;
+            slab->nbyte = 0;
+        }
+
+        for (i = 0; i < p->nitem; i++) {
+            it = slab_2_item(slab, i, p->size);
+
+            if (sr->relink) {
+                item_restore(sr->r, it);
+                continue;
+            }
+
+            if (item_restored(sr->r, it)) {
+                slab->nbyte += p->size;
+                continue;
+            }
+
+            offset = (uint32_t)((uint8_t *)it - (uint8_t *)slab);
+            item_hdr_init(it, offset, slab->id);
+            it->flags |= ITEM_SLABBED;
+            sr->nfree_itemq[slab->id]++;
+            item_q_insert_head(&sr->free_itemq[slab->id], it);
+        }
+    }
+
+    if (!sr->relink) {
+        sr->nitem = item_restore_done(sr->r);
+    }
+
+    return NULL;
+}
+
+/*
+ * Run a pass of the restore threads over the slabs, and wait for them.
+ */
+static void
+slab_restore_pass(struct slab_restore *restore, uint32_t nthread, bool relink)
+{
+    pthread_t tid[SLAB_RESTORE_MAX_NTHREAD];
+    uint32_t i;
+    err_t err;
+
+    for (i = 0; i < nthread; i++) {
+        restore[i].relink = relink;
+        err = pthread_create(&tid[i], NULL, slab_restore_thread, &restore[i]);
+        if (err != 0) {
+            log_error("pthread create failed: %s", strerror(err));
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < nthread; i++) {
+        pthread_join(tid[i], NULL);
+    }
+}
+
+/*
+ * Restore the slabs left in the heap file by a previous run. The slabs are
+ * taken back as they were, in the order they were allocated in, and their
+ * items are relinked into the hash table and the lru q of their class by
+ * as many threads as there are workers, each standing in for a worker
+ * with its own share of the slabs. Relinking takes two passes, as chunks
+ * can only be told apart from garbage once their chunked item is relinked.
+ * Items that were free, or no longer hold, go to the free q of their class.
+ *
+ * Items keep the times they had, as we carry on with the clock of the run
+ * that left them. The lru q order only holds within the share of a thread.
+ *
+ * Must be called once workers are set up, and before the threads reaping
+ * or moving items in the background are started.
+ */
+void
+slab_restore(void)
+{
+    static struct slab_restore restore[SLAB_RESTORE_MAX_NTHREAD];
+    struct slab_heap_hdr *hdr = heapinfo.hdr;
+    struct timespec start, end;
+    struct slab *slab;
+    uint32_t i, sid, nslab, nthread, nshare;
+    uint8_t id;
+
+    if (heapinfo.nrestore == 0) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    nslab = heapinfo.nrestore;
+
+    for (sid = 0; sid < nslab; sid++) {
+        slab = (struct slab *)(heapinfo.base + (size_t)sid * settings.slab_size);
+        if (slab->id < SLABCLASS_MIN_ID || slab->id > slabclass_max_id ||
+#if MC_ASSERT_PANIC == 1 || MC_ASSERT_LOG == 1
+            slab->magic != SLAB_MAGIC ||
+#endif
+            slab->sid != sid) {
+            log_warn("heap file '%s' holds a corrupt slab at pos %"PRIu32
+                     ", ignored", settings.heap_file, sid);
+            return;
+        }
+    }
+
+    time_restore((time_t)hdr->started);
+    settings.oldest_live = (rel_time_t)hdr->oldest_live;
+
+    pthread_mutex_lock(&slab_lock);
+    for (sid = 0; sid < nslab; sid++) {
+        slab = slab_heap_alloc();
+        slab_table_update(slab);
+        slab->refcount = 0;
+        _slab_link_lruq(slab);
+        stats_slab_incr(slab->id, slab_curr);
+    }
+    pthread_mutex_unlock(&slab_lock);
+
+    nthread = MIN(MAX(settings.num_workers, 1), SLAB_RESTORE_MAX_NTHREAD);
+    nthread = MIN(nthread, nslab);
+    nshare = (nslab + nthread - 1) / nthread;
+
+    for (i = 0; i < nthread; i++) {
+        restore[i].idx = i;
+        restore[i].start = MIN(i * nshare, nslab);
+        restore[i].end = MIN((i + 1) * nshare, nslab);
+        restore[i].r = item_restore_create((intptr_t)heapinfo.base -
+                                           (intptr_t)hdr->base, nslab);
+        if (restore[i].r == NULL) {
+            log_error("restore of heap file '%s' failed: %s",
+                      settings.heap_file, strerror(ENOMEM));
+            exit(1);
+        }
+        restore[i].nitem = 0;
+        for (id = SLABCLASS_MIN_ID; id <= slabclass_max_id; id++) {
+            restore[i].nfree_itemq[id] = 0;
+            item_q_init(&restore[i].free_itemq[id]);
+        }
+    }
+
+    slab_restore_pass(restore, nthread, true);
+    slab_restore_pass(restore, nthread, false);
+
+    pthread_mutex_lock(&slab_lock);
+    for (i = 0; i < nthread; i++) {
+        heapinfo.restore_nitem += restore[i].nitem;
+        for (id = SLABCLASS_MIN_ID; id <= slabclass_max_id; id++) {
+            if (restore[i].nfree_itemq[id] == 0) {
+                continue;
+            }
+            item_q_concat(&slabclass[id].free_itemq,
+                          &restore[i].free_itemq[id]);
+            slabclass[id].nfree_itemq += restore[i].nfree_itemq[id];
+            stats_slab_incr_by(id, item_free, restore[i].nfree_itemq[id]);
+        }
+    }
+    pthread_mutex_unlock(&slab_lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    heapinfo.restore_usec = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000 +
+                            (end.tv_nsec - start.tv_nsec) / 1000;
+
+    log_debug(LOG_NOTICE, "restored %"PRIu64" items in %"PRIu32" slabs of "
+              "heap file '%s' with %"PRIu32" threads in %"PRIu64" usec",
+              heapinfo.restore_nitem, nslab, settings.heap_file, nthread,
+              heapinfo.restore_usec);
+}
+
+/*
+ * Save the slab heap to the heap file on shutdown, for the next run to
+ * restore. Items and slabs are locked for good, so that nothing changes
+ * them from then on, and the heap is only marked clean once it is synced.
+ */
+void
+slab_heap_save(void)
+{
+    struct slab_heap_hdr *hdr = heapinfo.hdr;
+
+    if (hdr == NULL) {
+        return;
+    }
+
+    item_lock_all();
+    pthread_mutex_lock(&slab_lock);
+
+    hdr->base = (uint64_t)(uintptr_t)heapinfo.base;
+    hdr->started = (int64_t)time_started();
+    hdr->oldest_live = settings.oldest_live;
+    hdr->nslab = heapinfo.nslab;
+
+#ifdef MC_MMAP_HEAP
+    if (msync(heapinfo.base, (size_t)heapinfo.nslab * settings.slab_size,
+              MS_SYNC) < 0) {
+        log_error("msync of heap file '%s' failed: %s", settings.heap_file,
+                  strerror(errno));
+        return;
+    }
+
+    hdr->clean = 1;
+
+    if (msync(hdr, sizeof(*hdr), MS_SYNC) < 0) {
+        log_error("msync of heap file '%s' failed: %s", settings.heap_file,
+                  strerror(errno));
+        return;
+    }
+#endif
+
+    log_debug(LOG_NOTICE, "saved %"PRIu32" slabs to heap file '%s'",
+              heapinfo.nslab, settings.heap_file);
+}
+
+/*
+ * Return the kind of pages backing the preallocated slab heap.
+ */
+const char *
+slab_heap_pages(void)
+{
+    switch (heapinfo.pages) {
+    case SLAB_HEAP_PAGES_HUGETLB:
+        return "hugetlb";
+
+    case SLAB_HEAP_PAGES_THP:
+        return "thp";
+
+    default:
+        return "normal";
+    }
+}
+
+/*
+ * Return the # bytes of the slab heap, allocated or preallocated.
+ */
+size_t
+slab_heap_nbyte(void)
+{
+    if (settings.prealloc) {
+        return (size_t)heapinfo.max_nslab * settings.slab_size;
+    }
+
+    return (size_t)heapinfo.nslab * settings.slab_size;
+}
+
+/*
+ * Return the # bytes of the slab heap backed by huge pages. Transparent
+ * huge pages come and go as the kernel sees fit, so we read how many
+ * back the heap right now from its mappings in /proc/self/smaps.
+ */
+size_t
+slab_heap_nbyte_huge(void)
+{
+    FILE *fp;
+    char line[256];
+    uintptr_t start, end, lo, hi;
+    size_t kb, nbyte;
+    bool inheap;
+
+    switch (heapinfo.pages) {
+    case SLAB_HEAP_PAGES_HUGETLB:
+        return slab_heap_nbyte();
+
+    case SLAB_HEAP_PAGES_THP:
+        break;
+
+    default:
+        return 0;
+    }
+
+    fp = fopen("/proc/self/smaps", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    lo = (uintptr_t)heapinfo.base;
+    hi = lo + slab_heap_nbyte();
+    inheap = false;
+    nbyte = 0;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "%"SCNxPTR"-%"SCNxPTR, &start, &end) == 2) {
+            inheap = (start < hi && end > lo);
+        } else if (inheap &&
+                   (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1 ||
+                    sscanf(line, "ShmemPmdMapped: %zu kB", &kb) == 1 ||
+                    sscanf(line, "FilePmdMapped: %zu kB", &kb) == 1)) {
+            nbyte += kb * KB;
+        }
+    }
+
+    fclose(fp);
+
+    return nbyte;
+}
+
+/*
+ * Return true if the slab heap is ready to be used without page faults.
+ */
+bool
+slab_heap_ready(void)
+{
+    return __atomic_load_n(&heapinfo.ready, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Return the time it took to prefault the slab heap, in usec.
+ */
+uint64_t
+slab_heap_prefault_usec(void)
+{
+    return slab_heap_ready() ? heapinfo.prefault_usec : 0;
+}
+
+/*
+ * Return the # items restored from the heap file.
+ */
+uint64_t
+slab_heap_restore_nitem(void)
+{
+    return heapinfo.restore_nitem;
+}
+
+/*
+ * Return the time it took to restore the heap file, in usec.
+ */
+uint64_t
+slab_heap_restore_usec(void)
+{
+    return heapinfo.restore_usec;
 }
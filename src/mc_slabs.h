@@ -62,7 +62,9 @@ struct slab {
     uint16_t          refcount; /* # concurrent users */
     TAILQ_ENTRY(slab) s_tqe;    /* link in slab lruq */
     rel_time_t        utime;    /* last update time in secs */
-    uint32_t          padding;  /* unused */
+    uint32_t          sid;      /* index in slab table and segment table */
+    uint32_t          nhit;     /* # hits, halved whenever eviction spares it */
+    uint32_t          nbyte;    /* # bytes of items carved out and not free */
     uint8_t           data[1];  /* opaque data */
 };
 
@@ -152,18 +154,86 @@ struct slabclass {
 #define SLABCLASS_INVALID_ID    UCHAR_MAX
 #define SLABCLASS_MAX_IDS       UCHAR_MAX
 
+/*
+ * Free items a worker thread keeps to itself, by class, so that most of
+ * its allocations and frees stay off the slab_lock. An empty magazine is
+ * refilled from its class, and a full one spills into it, SLAB_MAG_BATCH
+ * items at a time under a single hold of the slab_lock.
+ *
+ * Items in a magazine have no flags, so that they are neither linked,
+ * slabbed nor chunks, and count towards the bytes held by their slabs, as
+ * if they were in use. The magazine lock only guards against
+ * slab_mag_drain() from other threads, and is taken last, after the
+ * slab_lock. The # items of a class are also read by slab_full() of the
+ * owning worker without it.
+ */
+#define SLAB_MAG_SIZE   16 /* max # item in a magazine */
+#define SLAB_MAG_BATCH  8  /* # item refilled or spilled at once */
+
+struct slab_mag {
+    pthread_mutex_t lock;                                     /* magazine lock */
+    uint32_t        nitem[SLABCLASS_MAX_IDS];                 /* # item, by class */
+    struct item     *item[SLABCLASS_MAX_IDS][SLAB_MAG_SIZE];  /* free items, by class */
+};
+
+/*
+ * Slab automove aggressiveness, see slab_automove()
+ */
+#define SLAB_AUTOMOVE_OFF           0
+#define SLAB_AUTOMOVE_CONSERVATIVE  1
+#define SLAB_AUTOMOVE_AGGRESSIVE    2
+
+#define SLAB_AUTOMOVE_INTERVAL      1 /* secs between two automove checks */
+
+/*
+ * Numa placement of the slab heap, see slab_heap_map()
+ */
+typedef enum numa_policy {
+    NUMA_POLICY_LOCAL,      /* pages are placed on the node touching them first */
+    NUMA_POLICY_INTERLEAVE, /* pages are spread round robin over all nodes */
+} numa_policy_t;
+
+/*
+ * Kind of pages backing the slab heap
+ */
+typedef enum slab_heap_pages {
+    SLAB_HEAP_PAGES_NORMAL,  /* base pages */
+    SLAB_HEAP_PAGES_HUGETLB, /* reserved huge pages */
+    SLAB_HEAP_PAGES_THP,     /* transparent huge pages, when the kernel can */
+} slab_heap_pages_t;
+
 size_t slab_size(void);
 void slab_print(void);
 void slab_acquire_refcount(struct slab *slab);
 void slab_release_refcount(struct slab *slab);
 size_t slab_item_size(uint8_t id);
 uint8_t slab_id(size_t size);
+size_t slab_item_footprint(size_t size);
+uint8_t slab_profile_tune(const uint64_t *nitem, uint32_t nbucket, size_t bucket_size, size_t *profile, uint64_t *footprint);
 
 rstatus_t slab_init(void);
 void slab_deinit(void);
 
+struct slab_mag *slab_mag_create(void);
 struct item *slab_get_item(uint8_t id);
+bool slab_full(uint8_t id);
 void slab_put_item(struct item *it);
+void slab_put_chunks(struct item *it);
+struct slab *slab_get_raw(void);
 void slab_lruq_touch(struct slab *slab, bool allocated);
+void slab_hit(struct slab *slab);
+void slab_automove(void);
+const char *slab_heap_pages(void);
+size_t slab_heap_nbyte(void);
+size_t slab_heap_nbyte_huge(void);
+bool slab_heap_ready(void);
+uint64_t slab_heap_prefault_usec(void);
+uint32_t slab_nslab(void);
+struct item *slab_walk_item(uint32_t sid, uint32_t idx);
+bool slab_item_valid(struct item *it);
+void slab_restore(void);
+void slab_heap_save(void);
+uint64_t slab_heap_restore_nitem(void);
+uint64_t slab_heap_restore_usec(void);
 
 #endif
@@ -0,0 +1,615 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+
+#include <mc_core.h>
+
+extern struct settings settings;
+
+#define SNAPSHOT_MAGIC      0x70616e736d657774ULL /* "twemsnap" */
+#define SNAPSHOT_VERSION    1
+
+struct snapshot_hdr {
+    uint64_t magic;         /* SNAPSHOT_MAGIC */
+    uint32_t version;       /* SNAPSHOT_VERSION */
+    uint32_t unused;        /* unused */
+};
+
+struct snapshot_block {
+    uint32_t nrecord;       /* # records in block */
+    uint32_t nbyte;         /* # bytes of records in block */
+};
+
+struct snapshot_record {
+    uint64_t cas;           /* cas, or 0 */
+    int64_t  exptime;       /* expiry time in unix time, or 0 */
+    uint32_t dataflags;     /* data flags opaque to the server */
+    uint32_t nbyte;         /* data size */
+    uint8_t  nkey;          /* key length */
+    uint8_t  unused[7];     /* unused */
+};
+
+/*
+ * Block being filled by the dump thread. The buffer holds a block of
+ * SNAPSHOT_BLOCK_SIZE bytes, and room for one more record of the largest
+ * unchunked item, whose key and data are copied straight into it.
+ */
+struct snapshot_writer {
+    FILE     *fp;           /* temporary file */
+    char     *buf;          /* block buffer */
+    size_t   nbyte;         /* # bytes of records in block */
+    uint32_t nrecord;       /* # records in block */
+};
+
+/*
+ * Blocks of a snapshot file, handed out to the load threads in turn.
+ */
+struct snapshot_reader {
+    int      fd;            /* snapshot file */
+    off_t    *off;          /* offset of each block */
+    uint32_t nblock;        /* # blocks */
+    uint32_t next;          /* next block to load */
+};
+
+struct snapshot_loader {
+    struct snapshot_reader *r;      /* snapshot file */
+    uint32_t               idx;     /* index of worker stood in for */
+    uint64_t               nitem;   /* # items loaded */
+};
+
+static struct {
+    bool     dumping;       /* dump in progress? */
+    uint64_t dump_nitem;    /* # items in last dump */
+    uint64_t dump_usec;     /* time last dump took */
+    uint64_t load_nitem;    /* # items loaded on startup */
+    uint64_t load_usec;     /* time loading took */
+} snapshot;
+
+static uint64_t
+snapshot_usec_since(struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (uint64_t)(end.tv_sec - start->tv_sec) * 1000000 +
+           (end.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static bool
+snapshot_write(struct snapshot_writer *w, const void *buf, size_t nbyte)
+{
+    return fwrite(buf, 1, nbyte, w->fp) == nbyte;
+}
+
+static bool
+snapshot_write_block(struct snapshot_writer *w, uint32_t nrecord,
+                     size_t nbyte)
+{
+    struct snapshot_block blk;
+
+    blk.nrecord = nrecord;
+    blk.nbyte = (uint32_t)nbyte;
+
+    return snapshot_write(w, &blk, sizeof(blk));
+}
+
+/*
+ * Write out the block being filled, if it has any records.
+ */
+static bool
+snapshot_flush(struct snapshot_writer *w)
+{
+    if (w->nrecord == 0) {
+        return true;
+    }
+
+    if (!snapshot_write_block(w, w->nrecord, w->nbyte) ||
+        !snapshot_write(w, w->buf, w->nbyte)) {
+        return false;
+    }
+
+    w->nbyte = 0;
+    w->nrecord = 0;
+
+    return true;
+}
+
+/*
+ * Add the record of an item to the block being filled, whose key, and
+ * data if unchunked, were copied in by item_snapshot(). A chunked item is
+ * streamed out from its chunks as a block of its own, once the records
+ * before it are written out.
+ */
+static bool
+snapshot_dump_item(struct snapshot_writer *w, struct item_snapshot *s)
+{
+    struct snapshot_record rec;
+    char *p, *data;
+    uint32_t idx, len, nbyte;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.cas = s->cas;
+    rec.exptime = s->exptime == 0 ? 0 :
+                  (int64_t)time_started() + (int64_t)s->exptime;
+    rec.dataflags = s->dataflags;
+    rec.nbyte = s->nbyte;
+    rec.nkey = s->nkey;
+
+    p = w->buf + w->nbyte;
+
+    if (s->it == NULL) {
+        memcpy(p, &rec, sizeof(rec));
+        w->nbyte += sizeof(rec) + s->nkey + s->nbyte;
+        w->nrecord++;
+
+        if (w->nbyte >= SNAPSHOT_BLOCK_SIZE) {
+            return snapshot_flush(w);
+        }
+
+        return true;
+    }
+
+    /* records before it are written from the buffer before its key */
+    if (!snapshot_flush(w) ||
+        !snapshot_write_block(w, 1, sizeof(rec) + s->nkey + s->nbyte) ||
+        !snapshot_write(w, &rec, sizeof(rec)) ||
+        !snapshot_write(w, p + sizeof(rec), s->nkey)) {
+        return false;
+    }
+
+    for (idx = 0, nbyte = s->nbyte; nbyte > 0; idx++, nbyte -= len) {
+        data = item_data_span(s->it, idx, &len);
+        len = MIN(len, nbyte);
+        if (!snapshot_write(w, data, len)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void *
+snapshot_dump_thread(void *arg)
+{
+    struct snapshot_writer w;
+    struct snapshot_hdr hdr;
+    struct item_snapshot s;
+    struct timespec start;
+    struct item *it;
+    char *path;
+    uint64_t nitem;
+    uint32_t sid, idx;
+    bool ok;
+
+    path = arg;
+    nitem = 0;
+    ok = false;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* items are taken and put back on behalf of the dispatcher */
+    if (thread_stand_in(settings.num_workers) != MC_OK) {
+        goto done;
+    }
+
+    w.nbyte = 0;
+    w.nrecord = 0;
+    w.buf = mc_alloc(SNAPSHOT_BLOCK_SIZE + sizeof(struct snapshot_record) +
+                     KEY_MAX_LEN + settings.max_chunk_size);
+    if (w.buf == NULL) {
+        log_error("dump of snapshot file '%s' failed: %s",
+                  settings.snapshot_file, strerror(ENOMEM));
+        goto done;
+    }
+
+    w.fp = fopen(path, "w");
+    if (w.fp == NULL) {
+        log_error("open of snapshot file '%s' failed: %s", path,
+                  strerror(errno));
+        mc_free(w.buf);
+        goto done;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SNAPSHOT_MAGIC;
+    hdr.version = SNAPSHOT_VERSION;
+    if (!snapshot_write(&w, &hdr, sizeof(hdr))) {
+        goto error;
+    }
+
+    /*
+     * Slabs are only ever added to the slab table, so we can walk it
+     * without the slab lock, taking slabs allocated on the way along.
+     */
+    for (sid = 0; sid < slab_nslab(); sid++) {
+        for (idx = 0; (it = slab_walk_item(sid, idx)) != NULL; idx++) {
+            if (!item_snapshot(it, &s, w.buf + w.nbyte +
+                               sizeof(struct snapshot_record))) {
+                continue;
+            }
+
+            ok = snapshot_dump_item(&w, &s);
+            if (s.it != NULL) {
+                item_remove(s.it);
+            }
+            if (!ok) {
+                goto error;
+            }
+            nitem++;
+        }
+    }
+
+    ok = snapshot_flush(&w) && snapshot_write_block(&w, 0, 0) &&
+         fflush(w.fp) == 0 && fsync(fileno(w.fp)) == 0;
+
+error:
+    if (!ok) {
+        log_error("write of snapshot file '%s' failed: %s", path,
+                  strerror(errno));
+    }
+    if (fclose(w.fp) != 0 && ok) {
+        log_error("close of snapshot file '%s' failed: %s", path,
+                  strerror(errno));
+        ok = false;
+    }
+    if (ok && rename(path, settings.snapshot_file) < 0) {
+        log_error("rename of snapshot file '%s' to '%s' failed: %s", path,
+                  settings.snapshot_file, strerror(errno));
+        ok = false;
+    }
+    if (!ok) {
+        unlink(path);
+    }
+    mc_free(w.buf);
+
+done:
+    if (ok) {
+        snapshot.dump_nitem = nitem;
+        snapshot.dump_usec = snapshot_usec_since(&start);
+
+        log_debug(LOG_NOTICE, "dumped %"PRIu64" items to snapshot file '%s' "
+                  "in %"PRIu64" usec", snapshot.dump_nitem,
+                  settings.snapshot_file, snapshot.dump_usec);
+    }
+
+    mc_free(path);
+    __atomic_store_n(&snapshot.dumping, false, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/*
+ * Dump all live items to the snapshot file in the background. Only one
+ * dump runs at a time.
+ *
+ * Return MC_OK if the dump was started, MC_EAGAIN if one is still on.
+ */
+rstatus_t
+snapshot_dump(void)
+{
+    pthread_t tid;
+    char *path;
+    size_t len;
+    err_t err;
+
+    if (settings.snapshot_file == NULL) {
+        return MC_ERROR;
+    }
+
+    if (__atomic_exchange_n(&snapshot.dumping, true, __ATOMIC_ACQ_REL)) {
+        return MC_EAGAIN;
+    }
+
+    len = strlen(settings.snapshot_file) + sizeof(".tmp");
+    path = mc_alloc(len);
+    if (path == NULL) {
+        __atomic_store_n(&snapshot.dumping, false, __ATOMIC_RELEASE);
+        return MC_ENOMEM;
+    }
+    snprintf(path, len, "%s.tmp", settings.snapshot_file);
+
+    err = pthread_create(&tid, NULL, snapshot_dump_thread, path);
+    if (err != 0) {
+        log_error("pthread create failed: %s", strerror(err));
+        mc_free(path);
+        __atomic_store_n(&snapshot.dumping, false, __ATOMIC_RELEASE);
+        return MC_ERROR;
+    }
+    pthread_detach(tid);
+
+    log_debug(LOG_INFO, "dumping snapshot file '%s'", settings.snapshot_file);
+
+    return MC_OK;
+}
+
+/*
+ * Load the records of a block, skipping those expired by now.
+ *
+ * Return false if the block is corrupt.
+ */
+static bool
+snapshot_load_block(struct snapshot_loader *l, struct snapshot_block *blk,
+                    char *buf)
+{
+    struct snapshot_record rec;
+    char *p, *end;
+    rel_time_t exptime;
+    uint32_t i;
+
+    p = buf;
+    end = buf + blk->nbyte;
+
+    for (i = 0; i < blk->nrecord; i++) {
+        if ((size_t)(end - p) < sizeof(rec)) {
+            return false;
+        }
+        memcpy(&rec, p, sizeof(rec));
+        p += sizeof(rec);
+
+        if (rec.nkey == 0 || rec.nkey > KEY_MAX_LEN ||
+            (size_t)(end - p) < (size_t)rec.nkey + rec.nbyte) {
+            return false;
+        }
+
+        exptime = time_reltime((time_t)rec.exptime);
+        if (exptime == 0 || exptime > time_now()) {
+            if (item_load(p, rec.nkey, rec.dataflags, exptime, rec.cas,
+                          p + rec.nkey, rec.nbyte)) {
+                l->nitem++;
+            }
+        }
+        p += rec.nkey + rec.nbyte;
+    }
+
+    return true;
+}
+
+static void *
+snapshot_load_thread(void *arg)
+{
+    struct snapshot_loader *l = arg;
+    struct snapshot_reader *r = l->r;
+    struct snapshot_block blk;
+    char *buf, *nbuf;
+    size_t size;
+    uint32_t i;
+
+    if (thread_stand_in(l->idx) != MC_OK) {
+        exit(1);
+    }
+
+    buf = NULL;
+    size = 0;
+
+    while ((i = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED)) <
+           r->nblock) {
+        if (pread(r->fd, &blk, sizeof(blk), r->off[i]) != sizeof(blk)) {
+            break;
+        }
+
+        if (blk.nbyte > size) {
+            nbuf = mc_realloc(buf, blk.nbyte);
+            if (nbuf == NULL) {
+                log_warn("load of snapshot file '%s' failed: %s",
+                         settings.snapshot_file, strerror(ENOMEM));
+                break;
+            }
+            buf = nbuf;
+            size = blk.nbyte;
+        }
+
+        if (pread(r->fd, buf, blk.nbyte, r->off[i] + sizeof(blk)) !=
+            (ssize_t)blk.nbyte || !snapshot_load_block(l, &blk, buf)) {
+            log_warn("snapshot file '%s' holds a corrupt block at offset "
+                     "%lld, ignored", settings.snapshot_file,
+                     (long long)r->off[i]);
+        }
+    }
+
+    if (buf != NULL) {
+        mc_free(buf);
+    }
+
+    return NULL;
+}
+
+/*
+ * Find the blocks of the snapshot file, up to the end of the file or to
+ * the first block cut short, as left by a dump that did not complete.
+ */
+static rstatus_t
+snapshot_scan(struct snapshot_reader *r)
+{
+    struct snapshot_block blk;
+    struct stat st;
+    off_t off, *noff;
+    uint32_t nalloc;
+    ssize_t n;
+
+    if (fstat(r->fd, &st) < 0) {
+        return MC_ERROR;
+    }
+
+    nalloc = 0;
+    off = sizeof(struct snapshot_hdr);
+
+    for (;;) {
+        n = pread(r->fd, &blk, sizeof(blk), off);
+        if (n < 0) {
+            return MC_ERROR;
+        }
+
+        if (n == sizeof(blk) && blk.nrecord == 0) {
+            return MC_OK;
+        }
+
+        if (n != sizeof(blk) ||
+            off + (off_t)sizeof(blk) + (off_t)blk.nbyte > st.st_size) {
+            log_warn("snapshot file '%s' is cut short, loading its first "
+                     "%"PRIu32" blocks", settings.snapshot_file, r->nblock);
+            return MC_OK;
+        }
+
+        if (r->nblock == nalloc) {
+            nalloc = MAX(2 * nalloc, 64);
+            noff = mc_realloc(r->off, nalloc * sizeof(*r->off));
+            if (noff == NULL) {
+                errno = ENOMEM;
+                return MC_ERROR;
+            }
+            r->off = noff;
+        }
+        r->off[r->nblock++] = off;
+
+        off += sizeof(blk) + blk.nbyte;
+    }
+}
+
+/*
+ * Load the items of the snapshot file, skipping those expired by now,
+ * and those whose keys are already linked. The blocks of the file are
+ * loaded by as many threads as there are workers, each standing in for a
+ * worker, and taking the next block yet to be loaded in turn. Loaded items
+ * keep their cas.
+ *
+ * Must be called once workers are set up, and before connections are
+ * handed to them.
+ */
+void
+snapshot_load(void)
+{
+    static struct snapshot_loader loader[SNAPSHOT_LOAD_MAX_NTHREAD];
+    pthread_t tid[SNAPSHOT_LOAD_MAX_NTHREAD];
+    struct snapshot_reader r;
+    struct snapshot_hdr hdr;
+    struct timespec start;
+    uint32_t i, nthread;
+    err_t err;
+
+    if (settings.snapshot_file == NULL) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    r.fd = open(settings.snapshot_file, O_RDONLY);
+    if (r.fd < 0) {
+        if (errno == ENOENT) {
+            log_debug(LOG_NOTICE, "no snapshot file '%s' to load",
+                      settings.snapshot_file);
+        } else {
+            log_warn("open of snapshot file '%s' failed: %s",
+                     settings.snapshot_file, strerror(errno));
+        }
+        return;
+    }
+
+    r.off = NULL;
+    r.nblock = 0;
+    r.next = 0;
+
+    if (pread(r.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        hdr.magic != SNAPSHOT_MAGIC || hdr.version != SNAPSHOT_VERSION) {
+        log_warn("snapshot file '%s' is not a snapshot of this version, "
+                 "ignored", settings.snapshot_file);
+        goto done;
+    }
+
+    if (snapshot_scan(&r) != MC_OK) {
+        log_warn("read of snapshot file '%s' failed: %s",
+                 settings.snapshot_file, strerror(errno));
+        goto done;
+    }
+
+    nthread = MIN(MAX(settings.num_workers, 1), SNAPSHOT_LOAD_MAX_NTHREAD);
+    nthread = MIN(nthread, MAX(r.nblock, 1));
+
+    for (i = 0; i < nthread; i++) {
+        loader[i].r = &r;
+        loader[i].idx = i;
+        loader[i].nitem = 0;
+
+        err = pthread_create(&tid[i], NULL, snapshot_load_thread, &loader[i]);
+        if (err != 0) {
+            log_error("pthread create failed: %s", strerror(err));
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < nthread; i++) {
+        pthread_join(tid[i], NULL);
+        snapshot.load_nitem += loader[i].nitem;
+    }
+
+    snapshot.load_usec = snapshot_usec_since(&start);
+
+    log_debug(LOG_NOTICE, "loaded %"PRIu64" items in %"PRIu32" blocks of "
+              "snapshot file '%s' with %"PRIu32" threads in %"PRIu64" usec",
+              snapshot.load_nitem, r.nblock, settings.snapshot_file, nthread,
+              snapshot.load_usec);
+
+done:
+    if (r.off != NULL) {
+        mc_free(r.off);
+    }
+    close(r.fd);
+}
+
+bool
+snapshot_dumping(void)
+{
+    return __atomic_load_n(&snapshot.dumping, __ATOMIC_ACQUIRE);
+}
+
+uint64_t
+snapshot_dump_nitem(void)
+{
+    return snapshot.dump_nitem;
+}
+
+uint64_t
+snapshot_dump_usec(void)
+{
+    return snapshot.dump_usec;
+}
+
+uint64_t
+snapshot_load_nitem(void)
+{
+    return snapshot.load_nitem;
+}
+
+uint64_t
+snapshot_load_usec(void)
+{
+    return snapshot.load_usec;
+}
@@ -0,0 +1,69 @@
+/*
+ * twemcache - Twitter memcached.
+ * Copyright (c) 2012, Twitter, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the Twitter nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MC_SNAPSHOT_H_
+#define _MC_SNAPSHOT_H_
+
+/*
+ * A snapshot is a dump of all live items to the file set with
+ * --snapshot-file, taken in the background on "config snapshot dump", and
+ * loaded back on startup, to warm up the cache of a new instance.
+ *
+ * The dump walks the slabs without locks, and copies out each item found
+ * linked under the stripe of its key, one item at a time, so that requests
+ * are never held up for longer than that. Items linked or replaced while
+ * the dump is on may or may not make it into the snapshot, but every item
+ * in it is as it was at some point. The snapshot is written to a temporary
+ * file, which replaces the snapshot file once complete.
+ *
+ * The file is a header followed by blocks of records, each a record header
+ * followed by the item key and data. Blocks are about SNAPSHOT_BLOCK_SIZE
+ * bytes, except for those of chunked items, which are a block each. Blocks
+ * are loaded in parallel by as many threads as there are workers. A block
+ * with no records ends the file.
+ *
+ *   +--------+-------+--------+-----+------+--------+-----+-------+-----+
+ *   | header | block | record | key | data | record | ... | block | ... |
+ *   +--------+-------+--------+-----+------+--------+-----+-------+-----+
+ *
+ * Fields are in the byte order of the host.
+ */
+#define SNAPSHOT_BLOCK_SIZE         MB
+#define SNAPSHOT_LOAD_MAX_NTHREAD   64
+
+rstatus_t snapshot_dump(void);
+void snapshot_load(void);
+
+bool snapshot_dumping(void);
+uint64_t snapshot_dump_nitem(void);
+uint64_t snapshot_dump_usec(void);
+uint64_t snapshot_load_nitem(void);
+uint64_t snapshot_load_usec(void);
+
+#endif
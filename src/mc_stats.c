@@ -40,12 +40,12 @@ extern struct thread_key keys;
 extern struct item_tqh item_lruq[];
 extern uint8_t slabclass_max_id;
 extern struct slabclass slabclass[];
-extern pthread_mutex_t cache_lock;
 
 #define STATS_KEY_LEN       128
 #define STATS_VAL_LEN       128
 
-#define STATS_BUCKET_SIZE   32
+#define STATS_BUCKET_SIZE     32
+#define STATS_PROFILE_NBUCKET 65536
 
 #define MAKEARRAY(_name, _type, _desc)  \
     { .type = _type, .value = { .gauge = {0LL, 0LL } }, .name = #_name },
@@ -71,6 +71,8 @@ static struct stats_metric stats_tmax[] = {
 
 static int num_updaters; /* # threads that update stats */
 
+static struct mrc_curve stats_mrc_curve; /* mrc as of the last aggregation */
+
 struct stats_desc {
     char *name; /* stats name */
     char *desc; /* stats description */
@@ -524,6 +526,9 @@ _stats_aggregate(void)
         pthread_mutex_unlock(threads[i].stats_mutex);
     }
 
+    /* gets sampled by the mrc, to be weighed against the gets counted above */
+    mrc_curve(&stats_mrc_curve);
+
     /* sum slab level stats over all slab classes and store in slab class 0 */
     for (j = 0; j < STATS_SLAB_LEN; ++j) {
         for (cid = SLABCLASS_MIN_ID; cid < SLABCLASS_MAX_ID; ++cid) {
@@ -545,6 +550,26 @@ _stats_aggregate(void)
     /* skipping slab-level max for now */
 }
 
+/*
+ * Copy the last aggregated value of a slab level metric for every slab
+ * class into val, which is indexed by slab class id.
+ */
+void
+stats_slab_snapshot(stats_smetric_t name, int64_t *val)
+{
+    uint8_t cid;
+
+    ASSERT(name < STATS_SLAB_LEN);
+
+    sem_wait(&aggregator.stats_sem);
+
+    for (cid = SLABCLASS_MIN_ID; cid <= slabclass_max_id; ++cid) {
+        val[cid] = stats_metric_val(&aggregator.stats_slabs[cid][name]);
+    }
+
+    sem_post(&aggregator.stats_sem);
+}
+
 /*
  * Process command "stats slabs\r\n"
  */
@@ -598,7 +623,6 @@ stats_sizes(void *c)
     num_buckets = settings.slab_size / STATS_BUCKET_SIZE + 1;
     histogram = mc_zalloc(sizeof(int) * num_buckets);
 
-    pthread_mutex_lock(&cache_lock);
     if (histogram != NULL) {
         uint32_t i;
 
@@ -606,12 +630,17 @@ stats_sizes(void *c)
         for (i = SLABCLASS_MIN_ID; i <= slabclass_max_id; i++) {
             struct item *iter;
 
-            TAILQ_FOREACH(iter, &item_lruq[i], i_tqe) {
+            item_lruq_lock(i);
+            for (iter = item_q_first(&item_lruq[i]); iter != NULL;
+                 iter = item_q_next(iter)) {
                 int ntotal = item_size(iter);
                 int bucket = (ntotal - 1) / STATS_BUCKET_SIZE + 1;
-                ASSERT(bucket < num_buckets);
+
+                /* chunked items all go into the last bucket */
+                bucket = MIN(bucket, num_buckets - 1);
                 histogram[bucket]++;
             }
+            item_lruq_unlock(i);
         }
 
         /* write the buffer */
@@ -625,7 +654,145 @@ stats_sizes(void *c)
         mc_free(histogram);
     }
     stats_append(c, NULL, 0, NULL, 0);
-    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Process command "stats profile\r\n". Tunes the slab profile to the sizes
+ * of the items cached now, and dumps it in the form --slab-profile takes,
+ * along with the slab memory these items take up in the current profile
+ * and would take up in the tuned one. Chunked items are left out, as they
+ * are stored in chunks of the largest size whatever the profile.
+ */
+void
+stats_profile(struct conn *c)
+{
+    uint64_t *histogram;
+    uint32_t num_buckets;
+    size_t bucket_size, profile[SLABCLASS_MAX_IDS];
+    uint64_t nitem, nbyte, footprint_curr, footprint_tuned;
+    uint8_t id, last_id;
+    char *buf;
+    int len;
+
+    bucket_size = MC_ALIGN(settings.max_chunk_size / STATS_PROFILE_NBUCKET,
+                           MC_ALIGNMENT);
+    bucket_size = MAX(bucket_size, MC_ALIGNMENT);
+    num_buckets = settings.max_chunk_size / bucket_size + 1;
+    histogram = mc_zalloc(sizeof(*histogram) * num_buckets);
+    buf = mc_alloc(SLABCLASS_MAX_IDS * MC_UINT32_MAXLEN);
+    if (histogram == NULL || buf == NULL) {
+        goto done;
+    }
+
+    /* build the histogram */
+    nitem = nbyte = footprint_curr = 0;
+    for (id = SLABCLASS_MIN_ID; id <= slabclass_max_id; id++) {
+        struct item *iter;
+        size_t footprint = slab_item_footprint(slab_item_size(id));
+
+        item_lruq_lock(id);
+        for (iter = item_q_first(&item_lruq[id]); iter != NULL;
+             iter = item_q_next(iter)) {
+            size_t ntotal;
+
+            if (item_is_chunked(iter) || item_is_chunk(iter)) {
+                continue;
+            }
+
+            ntotal = item_size(iter);
+            histogram[(ntotal - 1) / bucket_size]++;
+            nitem++;
+            nbyte += ntotal;
+            footprint_curr += footprint;
+        }
+        item_lruq_unlock(id);
+    }
+
+    last_id = slab_profile_tune(histogram, num_buckets, bucket_size, profile,
+                                &footprint_tuned);
+    if (last_id == SLABCLASS_INVALID_ID) {
+        goto done;
+    }
+
+    /* too long for stats_print() */
+    for (len = 0, id = SLABCLASS_MIN_ID; id <= last_id; id++) {
+        len += sprintf(buf + len, "%s%zu", id == SLABCLASS_MIN_ID ? "" : ",",
+                       profile[id]);
+    }
+    stats_append(c, "profile", sizeof("profile") - 1, buf, len);
+
+    stats_print(c, "nclass", "%u", last_id - SLABCLASS_MIN_ID + 1);
+    stats_print(c, "nitem", "%"PRIu64, nitem);
+    stats_print(c, "nbyte_item", "%"PRIu64, nbyte);
+    stats_print(c, "nbyte_slab_curr", "%"PRIu64, footprint_curr);
+    stats_print(c, "nbyte_slab_profile", "%"PRIu64, footprint_tuned);
+    stats_print(c, "nbyte_saved", "%"PRId64,
+                (int64_t)footprint_curr - (int64_t)footprint_tuned);
+
+done:
+    if (histogram != NULL) {
+        mc_free(histogram);
+    }
+    if (buf != NULL) {
+        mc_free(buf);
+    }
+    stats_append(c, NULL, 0, NULL, 0);
+}
+
+/*
+ * Process command "stats mrc\r\n". Dumps the hit ratio of gets estimated
+ * for caches of half, as much, twice and four times as much memory as this
+ * one, from the sampled gets replayed against the shadow caches.
+ *
+ * A few hot keys that happen to fall in or out of the sample skew the
+ * sampled gets away from their expected share of all gets. As in SHARDS_adj,
+ * the difference between the expected and the sampled # gets is credited
+ * to every size as hits, which are mostly what the skew is made of. Both
+ * are taken as of the last aggregation, so that they count the same gets;
+ * until then, the curve is reported as sampled.
+ */
+void
+stats_mrc(struct conn *c)
+{
+    static const char *name[MRC_NSIZE] = { "0.5x", "1x", "2x", "4x" };
+    struct mrc_curve curve;
+    char key[STATS_KEY_LEN];
+    int64_t nget, adj;
+    double ratio;
+    uint32_t i;
+
+    sem_wait(&aggregator.stats_sem);
+    curve = stats_mrc_curve;
+    nget = stats_metric_val(&aggregator.stats_thread[THREAD_get_key]) +
+           stats_metric_val(&aggregator.stats_thread[THREAD_gets_key]);
+    sem_post(&aggregator.stats_sem);
+
+    if (curve.rate == 0) {
+        mrc_curve(&curve);
+        nget = 0;
+    }
+
+    adj = nget == 0 ? 0 : nget / curve.rate - (int64_t)curve.nget;
+
+    stats_print(c, "sample_rate", "1/%"PRIu32, curve.rate);
+    stats_print(c, "sample_key", "%"PRIu32, curve.nentry);
+    stats_print(c, "sample_get", "%"PRIu64, curve.nget);
+    stats_print(c, "sample_usec", "%"PRIu64, curve.usec);
+    for (i = 0; i < MRC_NSIZE; i++) {
+        snprintf(key, sizeof(key), "size_%s", name[i]);
+        stats_print(c, key, "%zu", curve.size[i]);
+        snprintf(key, sizeof(key), "hit_ratio_%s", name[i]);
+        if ((int64_t)curve.nget + adj <= 0) {
+            ratio = 0.0;
+        } else {
+            ratio = (double)((int64_t)curve.nhit[i] + adj) /
+                    ((int64_t)curve.nget + adj);
+            ratio = MIN(MAX(ratio, 0.0), 1.0);
+        }
+        stats_print(c, key, "%.4f", ratio);
+    }
+
+    stats_append(c, NULL, 0, NULL, 0);
 }
 
 /*
@@ -634,8 +801,26 @@ stats_sizes(void *c)
 void
 stats_settings(void *c)
 {
+    stats_print(c, "compact_items", "%u", (unsigned int)MC_COMPACT_ITEMS);
     stats_print(c, "prealloc", "%u", (unsigned int)settings.prealloc);
     stats_print(c, "lock_page", "%u", (unsigned int)settings.lock_page);
+    stats_print(c, "large_pages", "%s", slab_heap_pages());
+    stats_print(c, "numa_policy", "%s",
+                settings.numa_policy == NUMA_POLICY_INTERLEAVE ? "interleave" :
+                "local");
+    stats_print(c, "heap_file", "%s",
+                settings.heap_file ? settings.heap_file : "NULL");
+    stats_print(c, "snapshot_file", "%s",
+                settings.snapshot_file ? settings.snapshot_file : "NULL");
+    stats_print(c, "ext_file", "%s",
+                settings.ext_file ? settings.ext_file : "NULL");
+    stats_print(c, "ext_size", "%zu", settings.ext_size);
+    stats_print(c, "admission", "%s",
+                settings.admission == ADMIT_TINYLFU ? "tinylfu" : "none");
+    stats_print(c, "eviction_policy", "%s",
+                settings.policy == POLICY_CLOCK ? "clock" :
+                settings.policy == POLICY_SLRU ? "slru" :
+                settings.policy == POLICY_S3FIFO ? "s3fifo" : "lru");
     stats_print(c, "accepting_conns", "%u", (unsigned int)settings.accepting_conns);
     stats_print(c, "daemonize", "%u", (unsigned int)settings.daemonize);
     stats_print(c, "max_corefile", "%u", (unsigned int)settings.max_corefile);
@@ -653,15 +838,25 @@ stats_settings(void *c)
                 settings.socketpath ? settings.socketpath : "NULL");
     stats_print(c, "umask", "%o", settings.access);
     stats_print(c, "tcp_backlog", "%d", settings.backlog);
+    stats_print(c, "storage_engine", "%s",
+                settings.storage == STORAGE_SEG ? "segment" : "slab");
     stats_print(c, "evictions", "%d", settings.evict_opt);
+    stats_print(c, "slab_automove", "%d", settings.slab_automove);
+    stats_print(c, "expiry_wheel", "%u", (unsigned int)settings.expiry_wheel);
     stats_print(c, "growth_factor", "%.2f", settings.factor);
     stats_print(c, "maxbytes", "%zu", settings.maxbytes);
     stats_print(c, "chunk_size", "%d", settings.chunk_size);
     stats_print(c, "slab_size", "%d", settings.slab_size);
+    stats_print(c, "max_item_size", "%zu", settings.max_item_size);
     stats_print(c, "username", "%s", settings.username);
     stats_print(c, "stats_agg_intvl", "%10.6f", settings.stats_agg_intvl.tv_sec +
                 1.0 * settings.stats_agg_intvl.tv_usec / 1000000);
     stats_print(c, "hash_power", "%d", settings.hash_power);
+    stats_print(c, "hash_table", "%s",
+                settings.hash_table == HASH_TABLE_BUCKETIZED ? "bucketized" :
+                "chained");
+    stats_print(c, "hash_function", "%s", hash_name(settings.hash_type));
+    stats_print(c, "lock_power", "%d", settings.lock_power);
     stats_print(c, "klog_name", "%s", settings.klog_name);
     stats_print(c, "klog_sampling_rate", "%d", settings.klog_sampling_rate);
     stats_print(c, "klog_entry", "%d", settings.klog_entry);
@@ -678,12 +873,15 @@ stats_default(struct conn *c)
     struct stats_metric *slab;
     struct stats_metric *thread;
     uint32_t i;
+    uint8_t id;
+    int64_t item_curr, nitem;
+    size_t nbyte;
     struct rusage usage;
     rel_time_t uptime;
     long int abstime;
     char name[64];
 
-    uptime = time_now();
+    uptime = time_uptime();
     abstime = (long int)time_started() + time_now();
     slab = aggregator.stats_slabs[0];
     thread = aggregator.stats_thread;
@@ -707,6 +905,20 @@ stats_default(struct conn *c)
     stats_print(c, "rusage_nivcsw", "%ld", usage.ru_nivcsw);
     stats_print(c, "nbyte_primary", "%zu", nbyte_primary);
     stats_print(c, "nbyte_old", "%zu", nbyte_old);
+    stats_print(c, "nbucket_old", "%"PRIu32, nbucket_old);
+    stats_print(c, "nbucket_moved", "%"PRIu32, nbucket_moved);
+    stats_print(c, "nbyte_heap", "%zu", slab_heap_nbyte());
+    stats_print(c, "nbyte_heap_huge", "%zu", slab_heap_nbyte_huge());
+    stats_print(c, "heap_ready", "%u", (unsigned int)slab_heap_ready());
+    stats_print(c, "heap_prefault_usec", "%"PRIu64, slab_heap_prefault_usec());
+    stats_print(c, "heap_restore_nitem", "%"PRIu64, slab_heap_restore_nitem());
+    stats_print(c, "heap_restore_usec", "%"PRIu64, slab_heap_restore_usec());
+    stats_print(c, "nbyte_expiry", "%zu", expiry_nbyte());
+    stats_print(c, "snapshot_dumping", "%u", (unsigned int)snapshot_dumping());
+    stats_print(c, "snapshot_dump_nitem", "%"PRIu64, snapshot_dump_nitem());
+    stats_print(c, "snapshot_dump_usec", "%"PRIu64, snapshot_dump_usec());
+    stats_print(c, "snapshot_load_nitem", "%"PRIu64, snapshot_load_nitem());
+    stats_print(c, "snapshot_load_usec", "%"PRIu64, snapshot_load_usec());
 
     sem_wait(&aggregator.stats_sem);
 
@@ -725,6 +937,26 @@ stats_default(struct conn *c)
         /* skipping slab-level max */
     }
 
+    /*
+     * memory per item, including item header and slab slack: the share of
+     * slab memory of a chunk times the items held in each class, or the
+     * bytes appended to segments, over the items held
+     */
+    item_curr = stats_metric_val(&slab[SLAB_item_curr]);
+    if (settings.storage == STORAGE_SEG) {
+        nbyte = (size_t)stats_metric_val(&slab[SLAB_data_curr]);
+    } else {
+        for (nbyte = 0, id = SLABCLASS_MIN_ID; id <= slabclass_max_id; id++) {
+            struct stats_metric *stats_slab = aggregator.stats_slabs[id];
+
+            nitem = stats_metric_val(&stats_slab[SLAB_item_curr]);
+            nbyte += (size_t)nitem * slab_item_footprint(slab_item_size(id));
+        }
+    }
+    stats_print(c, "item_hdr_size", "%zu", ITEM_HDR_SIZE);
+    stats_print(c, "nbyte_per_item", "%zu",
+                item_curr > 0 ? nbyte / (size_t)item_curr : 0);
+
     sem_post(&aggregator.stats_sem);
 }
 
@@ -80,6 +80,24 @@
     ACTION( cmd_total,          STATS_COUNTER,      "# total requests")                                     \
     ACTION( cmd_error,          STATS_COUNTER,      "# invalid requests")                                   \
     ACTION( server_error,       STATS_COUNTER,      "# requests that resulted in server errors")            \
+    ACTION( seg_curr,           STATS_GAUGE,        "# current segments")                                   \
+    ACTION( seg_expire,         STATS_COUNTER,      "# segments reclaimed once expired or emptied")         \
+    ACTION( seg_evict,          STATS_COUNTER,      "# segments evicted")                                   \
+    ACTION( seg_merge,          STATS_COUNTER,      "# times segments were merged on eviction")             \
+    ACTION( expiry_curr,        STATS_GAUGE,        "# entries in expiry wheels, stale ones included")      \
+    ACTION( expiry_reap,        STATS_COUNTER,      "# expired items reclaimed by expiry wheels")           \
+    ACTION( expiry_stale,       STATS_COUNTER,      "# expiry wheel entries of items gone or not expired")  \
+    ACTION( expiry_full,        STATS_COUNTER,      "# items left out of full expiry wheels")               \
+    ACTION( ext_write,          STATS_COUNTER,      "# items written out to the extstore")                  \
+    ACTION( ext_write_byte,     STATS_COUNTER,      "# bytes written out to the extstore")                  \
+    ACTION( ext_write_error,    STATS_COUNTER,      "# failed writes to the extstore")                      \
+    ACTION( ext_drop,           STATS_COUNTER,      "# evicted items not written out to the extstore")      \
+    ACTION( ext_hit,            STATS_COUNTER,      "# items read back from the extstore")                  \
+    ACTION( ext_miss,           STATS_COUNTER,      "# items gone from the extstore once looked up")        \
+    ACTION( ext_read_error,     STATS_COUNTER,      "# failed reads from the extstore")                     \
+    ACTION( ext_read_usec,      STATS_COUNTER,      "# usec spent reading from the extstore")               \
+    ACTION( admit_accept,       STATS_COUNTER,      "# sets that evict admitted by the admission filter")   \
+    ACTION( admit_reject,       STATS_COUNTER,      "# sets that evict rejected by the admission filter")   \
     ACTION( klog_logged,        STATS_COUNTER,      "# commands logged in buffer when klog is turned on")   \
     ACTION( klog_discarded,     STATS_COUNTER,      "# commands discarded when klog is turned on")          \
     ACTION( klog_skipped,       STATS_COUNTER,      "# commands skipped by sampling when klog is turned on")\
@@ -113,12 +131,19 @@
     ACTION( item_unlink,        STATS_COUNTER,      "# items unlinked")                                     \
     ACTION( item_expire,        STATS_COUNTER,      "# items expired")                                      \
     ACTION( item_evict,         STATS_COUNTER,      "# items evicted")                                      \
-    ACTION( item_free,          STATS_GAUGE,        "# items in free q")                                    \
+    ACTION( item_requeue,       STATS_COUNTER,      "# items requeued by the eviction policy")              \
+    ACTION( item_free,          STATS_GAUGE,        "# items in free q and worker magazines")               \
+    ACTION( item_refill,        STATS_COUNTER,      "# batches of free items moved into worker magazines")  \
+    ACTION( item_spill,         STATS_COUNTER,      "# batches of free items moved out of worker magazines")\
     ACTION( slab_req,           STATS_COUNTER,      "# slab allocation requests")                           \
     ACTION( slab_error,         STATS_COUNTER,      "# slabs allocation failures")                          \
     ACTION( slab_alloc,         STATS_COUNTER,      "# allocated slabs until now")                          \
     ACTION( slab_curr,          STATS_GAUGE,        "# current slabs")                                      \
     ACTION( slab_evict,         STATS_COUNTER,      "# slabs evicted")                                      \
+    ACTION( slab_evict_hit,     STATS_COUNTER,      "# hits of slabs evicted by hit density")               \
+    ACTION( slab_evict_byte,    STATS_COUNTER,      "# bytes of slabs evicted by hit density")              \
+    ACTION( slab_move_in,       STATS_COUNTER,      "# slabs moved in by the rebalancer")                   \
+    ACTION( slab_move_out,      STATS_COUNTER,      "# slabs moved out by the rebalancer")                  \
     ACTION( set_success,        STATS_COUNTER,      "# set requests tht was a success")                     \
     ACTION( add_success,        STATS_COUNTER,      "# add requests that was a success")                    \
     ACTION( replace_success,    STATS_COUNTER,      "# replace requests that was a success")                \
@@ -255,10 +280,14 @@ void _stats_slab_decr(uint8_t cls_id, stats_smetric_t name);
 void _stats_slab_incr_by(uint8_t cls_id, stats_smetric_t name, int64_t delta);
 void _stats_slab_decr_by(uint8_t cls_id, stats_smetric_t name, int64_t delta);
 
+void stats_slab_snapshot(stats_smetric_t name, int64_t *val);
+
 void stats_default(struct conn *c);
 void stats_settings(void *c);
 void stats_slabs(struct conn *c);
 void stats_sizes(void *c);
+void stats_profile(struct conn *c);
+void stats_mrc(struct conn *c);
 void stats_append(struct conn *c, const char *key, uint16_t klen, char *val, uint32_t vlen);
 
 #endif
@@ -28,6 +28,7 @@
  */
 
 #include <stdlib.h>
+#include <sched.h>
 
 #include <mc_core.h>
 
@@ -36,6 +37,7 @@ extern struct settings settings;
 struct thread_worker *threads;       /* worker threads */
 struct thread_aggregator aggregator; /* aggregator thread */
 struct thread_klogger klogger;       /* klogger thread */
+struct thread_rebalancer rebalancer; /* slab rebalancer thread */
 struct thread_key keys;              /* thread-locak keys */
 static int last_thread;              /* last thread we assigned connection to most recently */
 
@@ -57,6 +59,73 @@ thread_get(pthread_key_t key)
     return ptr;
 }
 
+/*
+ * Epochs let workers read the hash table and items without holding any
+ * lock (see item_get). A worker bumps its epoch when it starts and again
+ * when it is done with such a read, so its epoch is odd while it may hold
+ * pointers into the cache that are protected neither by a lock nor by a
+ * refcount. Memory that can be reached through such pointers, like a slab
+ * that is about to be carved anew or a retired hash table, is only reused
+ * after thread_epoch_synchronize() has waited out every worker that was
+ * reading when the memory was unpublished.
+ *
+ * Returns false when the calling thread is not a worker and has no epoch.
+ */
+bool
+thread_epoch_enter(void)
+{
+    uint64_t *epoch;
+
+    epoch = pthread_getspecific(keys.epoch);
+    if (epoch == NULL) {
+        return false;
+    }
+
+    ASSERT((*epoch & 1) == 0);
+    __atomic_add_fetch(epoch, 1, __ATOMIC_SEQ_CST);
+
+    return true;
+}
+
+void
+thread_epoch_exit(void)
+{
+    uint64_t *epoch;
+
+    epoch = pthread_getspecific(keys.epoch);
+    ASSERT(epoch != NULL && (*epoch & 1) == 1);
+    __atomic_add_fetch(epoch, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Wait until every worker that is inside a lockless read has left it.
+ * Readers never block, so this can be called with any lock held; it must
+ * not be called from within a lockless read.
+ */
+void
+thread_epoch_synchronize(void)
+{
+    uint64_t epoch;
+    int i;
+
+    if (threads == NULL) {
+        return;
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (i = 0; i <= settings.num_workers; i++) {
+        epoch = __atomic_load_n(&threads[i].epoch, __ATOMIC_ACQUIRE);
+        if ((epoch & 1) == 0) {
+            continue;
+        }
+
+        while (__atomic_load_n(&threads[i].epoch, __ATOMIC_ACQUIRE) == epoch) {
+            sched_yield();
+        }
+    }
+}
+
 static rstatus_t
 thread_create(thread_func_t func, void *arg)
 {
@@ -148,16 +217,52 @@ thread_setkeys(struct thread_worker *t)
         return MC_ERROR;
     }
 
+    err = pthread_setspecific(keys.epoch, &t->epoch);
+    if (err != 0) {
+        log_error("pthread setspecific failed: %s", strerror(err));
+        return MC_ERROR;
+    }
+
+    err = pthread_setspecific(keys.expiry, t->expiry);
+    if (err != 0) {
+        log_error("pthread setspecific failed: %s", strerror(err));
+        return MC_ERROR;
+    }
+
+    err = pthread_setspecific(keys.mag, t->mag);
+    if (err != 0) {
+        log_error("pthread setspecific failed: %s", strerror(err));
+        return MC_ERROR;
+    }
+
+    err = pthread_setspecific(keys.access, t->access);
+    if (err != 0) {
+        log_error("pthread setspecific failed: %s", strerror(err));
+        return MC_ERROR;
+    }
+
     return MC_OK;
 }
 
+/*
+ * Let the calling thread stand in for the worker thread with a given
+ * index, sharing its thread local data, while the worker has no
+ * connections yet. See slab_restore().
+ */
+rstatus_t
+thread_stand_in(int idx)
+{
+    return thread_setkeys(&threads[idx]);
+}
+
 /*
  * Worker thread new connection event loop
  *
  * Processes an incoming "handle a new connection" item. This is called when
  * input arrives on the libevent wakeup pipe. Each libevent instance has a
  * wakeup pipe, which other threads (dispatcher thread) uses to signal that
- * they've put a new connection on its queue.
+ * they've put a new connection on its queue. The extstore io threads use
+ * it as well, to hand back connections whose reads are done.
  */
 static void
 thread_libevent_process(int fd, short which, void *arg)
@@ -173,6 +278,10 @@ thread_libevent_process(int fd, short which, void *arg)
         log_warn("read from notify pipe %d failed: %s", fd, strerror(errno));
     }
 
+    while ((c = conn_cq_pop(&t->ext_cq)) != NULL) {
+        core_ext_done(c);
+    }
+
     c = conn_cq_pop(&t->new_cq);
     if (c == NULL) {
         return;
@@ -248,6 +357,28 @@ thread_setup(struct thread_worker *t)
         return status;
     }
 
+    if (settings.expiry_wheel) {
+        t->expiry = expiry_wheel_create();
+        if (t->expiry == NULL) {
+            return MC_ENOMEM;
+        }
+    }
+
+    /* freed items are never reused without the item free q */
+    if (settings.storage != STORAGE_SEG && settings.use_freeq) {
+        t->mag = slab_mag_create();
+        if (t->mag == NULL) {
+            return MC_ENOMEM;
+        }
+    }
+
+    if (settings.storage != STORAGE_SEG) {
+        t->access = item_access_create();
+        if (t->access == NULL) {
+            return MC_ENOMEM;
+        }
+    }
+
     t->kbuf = klog_buf_create();
     if (t->kbuf == NULL) {
         log_error("klog buf create failed: %s", strerror(errno));
@@ -255,6 +386,7 @@ thread_setup(struct thread_worker *t)
     }
 
     conn_cq_init(&t->new_cq);
+    conn_cq_init(&t->ext_cq);
 
     suffix_size = settings.use_cas ? (CAS_SUFFIX_SIZE + SUFFIX_SIZE + 1) :
                   (SUFFIX_SIZE + 1);
@@ -410,6 +542,97 @@ thread_setup_klogger(void)
     return MC_OK;
 }
 
+/*
+ * Rebalancer thread event loop
+ */
+static void
+thread_rebalance_slabs(int fd, short ev, void *arg)
+{
+    struct timeval interval;
+
+    interval.tv_sec = SLAB_AUTOMOVE_INTERVAL;
+    interval.tv_usec = 0;
+    evtimer_add(&rebalancer.ev, &interval);
+
+    if (settings.storage == STORAGE_SEG) {
+        seg_expire();
+    } else {
+        item_access_drain(UINT32_MAX);
+        expiry_reap();
+        slab_automove();
+    }
+}
+
+/*
+ * Rebalancer thread main
+ */
+static void *
+thread_rebalancer_main(void *arg)
+{
+    struct thread_worker *dispatcher = &threads[settings.num_workers];
+
+    pthread_setspecific(keys.stats_mutex, dispatcher->stats_mutex);
+    pthread_setspecific(keys.stats_thread, dispatcher->stats_thread);
+    pthread_setspecific(keys.stats_slabs, dispatcher->stats_slabs);
+
+    pthread_mutex_lock(&init_lock);
+    rebalancer.tid = pthread_self();
+    init_count++;
+    pthread_cond_signal(&init_cond);
+    pthread_mutex_unlock(&init_lock);
+
+    event_base_dispatch(rebalancer.base);
+
+    return NULL;
+}
+
+/*
+ * Setup rebalancer thread
+ */
+static rstatus_t
+thread_setup_rebalancer(void)
+{
+    struct timeval interval;
+    int status;
+
+    rebalancer.base = event_base_new();
+    if (NULL == rebalancer.base) {
+        log_error("event init failed: %s", strerror(errno));
+        return MC_ERROR;
+    }
+
+    evtimer_set(&rebalancer.ev, thread_rebalance_slabs, NULL);
+    event_base_set(rebalancer.base, &rebalancer.ev);
+
+    interval.tv_sec = SLAB_AUTOMOVE_INTERVAL;
+    interval.tv_usec = 0;
+    status = evtimer_add(&rebalancer.ev, &interval);
+    if (status < 0) {
+        log_error("evtimer add failed: %s", strerror(errno));
+        return status;
+    }
+
+    return MC_OK;
+}
+
+/*
+ * Hand connection c back to its worker thread once the last extstore read
+ * of its get is done, see core_ext_done().
+ */
+void
+thread_ext_done(struct conn *c)
+{
+    struct thread_worker *t = c->thread;
+    ssize_t n;
+
+    conn_cq_push(&t->ext_cq, c);
+
+    n = write(t->notify_send_fd, "", 1);
+    if (n != 1) {
+        log_warn("write to notify pipe %d failed: %s", t->notify_send_fd,
+                 strerror(errno));
+    }
+}
 
 /*
  * Dispatches a new connection to another thread. This is only ever called
@@ -503,6 +726,30 @@ thread_init(struct event_base *main_base)
         return MC_ERROR;
     }
 
+    err = pthread_key_create(&keys.epoch, NULL);
+    if (err != 0) {
+        log_error("pthread key create failed: %s", strerror(err));
+        return MC_ERROR;
+    }
+
+    err = pthread_key_create(&keys.expiry, NULL);
+    if (err != 0) {
+        log_error("pthread key create failed: %s", strerror(err));
+        return MC_ERROR;
+    }
+
+    err = pthread_key_create(&keys.mag, NULL);
+    if (err != 0) {
+        log_error("pthread key create failed: %s", strerror(err));
+        return MC_ERROR;
+    }
+
+    err = pthread_key_create(&keys.access, NULL);
+    if (err != 0) {
+        log_error("pthread key create failed: %s", strerror(err));
+        return MC_ERROR;
+    }
+
     dispatcher->base = main_base;
     dispatcher->tid = pthread_self();
 
@@ -548,6 +795,18 @@ thread_init(struct event_base *main_base)
     }
     pthread_mutex_unlock(&init_lock);
 
+    /* restore the slab heap before anything reaps or moves items */
+    slab_restore();
+
+    /* and warm it up with a snapshot, if any */
+    snapshot_load();
+
+    /* start writing evicted items out to the extstore, if any */
+    status = ext_start();
+    if (status != MC_OK) {
+        return status;
+    }
+
     /* for stats module */
 
     /* setup thread data structures */
@@ -576,9 +835,23 @@ thread_init(struct event_base *main_base)
         return status;
     }
 
+    /* for slab rebalancer */
+
+    /* Setup thread data structure */
+    status = thread_setup_rebalancer();
+    if (status != MC_OK) {
+        return status;
+    }
+
+    /* create thread */
+    status = thread_create(thread_rebalancer_main, NULL);
+    if (status != MC_OK) {
+        return status;
+    }
+
     /* wait for all the workers and dispatcher to set themselves up */
     pthread_mutex_lock(&init_lock);
-    while (init_count < nworkers + 2) { /* +2: aggregator & klogger */
+    while (init_count < nworkers + 3) { /* +3: aggregator, klogger & rebalancer */
         pthread_cond_wait(&init_cond, &init_lock);
     }
     pthread_mutex_unlock(&init_lock);
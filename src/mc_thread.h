@@ -42,6 +42,10 @@ struct thread_key {
     pthread_key_t stats_thread; /* thread stats */
     pthread_key_t stats_slabs;  /* slab stats */
     pthread_key_t kbuf;         /* klog buffer */
+    pthread_key_t epoch;        /* lockless read epoch */
+    pthread_key_t expiry;       /* expiry wheel */
+    pthread_key_t mag;          /* slab item magazines */
+    pthread_key_t access;       /* item access log */
 };
 
 typedef void * (*thread_func_t)(void *);
@@ -55,12 +59,18 @@ struct thread_worker {
     int                 notify_send_fd;    /* sending end of notify pipe */
 
     struct conn_q       new_cq;            /* new connection q */
+    struct conn_q       ext_cq;            /* q of connections done with extstore reads */
     cache_t             *suffix_cache;     /* suffix cache */
 
     pthread_mutex_t     *stats_mutex;      /* lock for stats update/aggregation */
     struct stats_metric *stats_thread;     /* per-thread thread-level stats */
     struct stats_metric **stats_slabs;     /* per-thread slab-level stats */
     struct kbuf         *kbuf;             /* per-thread klog buffer */
+
+    uint64_t            epoch;             /* odd while reading without locks */
+    struct expiry_wheel *expiry;           /* per-thread expiry wheel */
+    struct slab_mag     *mag;              /* per-thread slab item magazines */
+    struct item_access_log *access;        /* per-thread item access log */
 };
 
 /*
@@ -123,10 +133,37 @@ struct thread_klogger {
     struct event        ev;         /* event object */
 };
 
+/*
+ * The slab rebalancer model:
+ *
+ * rebalancer wakes itself up through libevent every second, and lets
+ * slab_automove() decide whether a slab should move from a cold class to
+ * a class under eviction pressure, right after it reclaimed the items
+ * that expired through expiry_reap(). With the segment engine, it reclaims
+ * expired segments through seg_expire() instead. Its stats are accounted
+ * to the dispatcher's, which are lock protected like those of any other
+ * thread.
+ *
+ * Configuration:
+ * aggressiveness: settings.slab_automove
+ * - default: 0, i.e. slabs are never moved in the background
+ */
+struct thread_rebalancer {
+    pthread_t           tid;        /* unique ID of this thread */
+    struct event_base   *base;      /* libevent handle for this thread */
+    struct event        ev;         /* event object */
+};
+
 void *thread_get(pthread_key_t key);
 
 rstatus_t thread_init(struct event_base *main_base);
 void thread_deinit(void);
 rstatus_t thread_dispatch(int sd, conn_state_t state, int ev_flags, int udp);
+rstatus_t thread_stand_in(int idx);
+void thread_ext_done(struct conn *c);
+
+bool thread_epoch_enter(void);
+void thread_epoch_exit(void);
+void thread_epoch_synchronize(void);
 
 #endif
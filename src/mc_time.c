@@ -53,6 +53,13 @@ extern struct settings settings;
  */
 static time_t process_started;
 
+/*
+ * Time when this process was started, relative to process_started. It
+ * is 0, unless the clock of a previous run was taken over to restore the
+ * slab heap it left (see time_restore).
+ */
+static rel_time_t process_restarted;
+
 /*
  * We keep a cache of the current time of day in a global variable now
  * that is updated periodically by a timer event every second. This
@@ -121,6 +128,15 @@ time_started(void)
     return process_started;
 }
 
+/*
+ * Return the # secs this process has been up for
+ */
+rel_time_t
+time_uptime(void)
+{
+    return now - process_restarted;
+}
+
 /*
  * Given time value that's either unix time or delta from current unix
  * time, return the time relative to process start.
@@ -182,8 +198,31 @@ time_init(void)
      * values are now false in boolean context.
      */
     process_started = time(NULL) - 2;
+    process_restarted = 0;
 
     time_clock_handler(0, 0, NULL);
 
     log_debug(LOG_DEBUG, "process started at %"PRId64, (int64_t)process_started);
 }
+
+/*
+ * Carry on with the clock of a previous run that was started at a given
+ * time, so that the relative times kept in the slab heap it left hold
+ * for this run too. Must be called before anything else reads the clock
+ * after time_init().
+ */
+void
+time_restore(time_t started)
+{
+    if (started > process_started) {
+        return;
+    }
+
+    process_restarted = (rel_time_t)(process_started - started);
+    process_started = started;
+
+    time_update();
+
+    log_debug(LOG_DEBUG, "process clock restored to start at %"PRId64,
+              (int64_t)process_started);
+}
@@ -45,7 +45,9 @@ rel_time_t time_now(void);
 rel_time_t time_now_usec(void);
 time_t time_now_abs(void);
 time_t time_started(void);
+rel_time_t time_uptime(void);
 rel_time_t time_reltime(time_t exptime);
 void time_init(void);
+void time_restore(time_t started);
 
 #endif
@@ -541,6 +541,27 @@ _mc_realloc(void *ptr, size_t size, const char *name, int line)
     return p;
 }
 
+void *
+_mc_memalign(size_t alignment, size_t size, const char *name, int line)
+{
+    void *p;
+    int err;
+
+    ASSERT(size != 0);
+
+    err = posix_memalign(&p, alignment, size);
+    if (err != 0) {
+        log_error("posix_memalign(%zu, %zu) failed @ %s:%d", alignment, size,
+                  name, line);
+        return NULL;
+    }
+
+    log_debug(LOG_VVERB, "posix_memalign(%zu, %zu) at %p @ %s:%d", alignment,
+              size, p, name, line);
+
+    return p;
+}
+
 void
 _mc_free(void *ptr, const char *name, int line)
 {
@@ -73,6 +73,12 @@
 #define MC_ALIGN_PTR(p, n)  \
     (void *) (((uintptr_t) (p) + ((uintptr_t) n - 1)) & ~((uintptr_t) n - 1))
 
+/*
+ * Hint the cpu to bring the cache line at 'p' in ahead of a read. This
+ * never faults, even if p is NULL or otherwise invalid.
+ */
+#define mc_prefetch(_p)     __builtin_prefetch((const void *)(_p), 0, 3)
+
 /*
  * Memory allocation and free wrappers.
  *
@@ -91,6 +97,9 @@
 #define mc_realloc(_p, _s)              \
     _mc_realloc(_p, (size_t)(_s), __FILE__, __LINE__)
 
+#define mc_memalign(_a, _s)             \
+    _mc_memalign((size_t)(_a), (size_t)(_s), __FILE__, __LINE__)
+
 #define mc_free(_p) do {                \
     _mc_free(_p, __FILE__, __LINE__);   \
     (_p) = NULL;                        \
@@ -100,6 +109,7 @@ void *_mc_alloc(size_t size, const char *name, int line);
 void *_mc_zalloc(size_t size, const char *name, int line);
 void *_mc_calloc(size_t nmemb, size_t size, const char *name, int line);
 void *_mc_realloc(void *ptr, size_t size, const char *name, int line);
+void *_mc_memalign(size_t alignment, size_t size, const char *name, int line);
 void _mc_free(void *ptr, const char *name, int line);
 
 int mc_set_blocking(int sd);
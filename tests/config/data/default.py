@@ -0,0 +1,5 @@
+# general
+KEY_SIZE = 32 # bytes/characters
+
+# uniform
+WIDTH = 20
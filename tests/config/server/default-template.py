@@ -9,7 +9,8 @@ ARGS_UNARY = {
     'LICENSE':'-i',
     'LARGEPAGE':'-L',
     'PREALLOC':'-E',
-    'CAS':'-C'
+    'CAS':'-C',
+    'EXPIRY_WHEEL':'-Q'
 }
 
 ARGS_BINARY = {
@@ -20,6 +21,7 @@ ARGS_BINARY = {
     'SERVER':'-l',
     'USER':'-u',
     'EVICTION':'-M',
+    'SLAB_AUTOMOVE':'-g',
     'MAX_MEMORY':'-m',
     'CONNECTIONS':'-c',
     'VERBOSITY':'-v',
@@ -31,7 +33,19 @@ ARGS_BINARY = {
     'BACKLOG':'-b',
     'SLAB_SIZE':'-I',
     'AGGR_INTERVAL':'-A',
-    'SLAB_PROFILE':'-z'
+    'SLAB_PROFILE':'-z',
+    'LOCK_POWER':'-K',
+    'HASH_TABLE':'-G',
+    'HASH_FUNCTION':'-F',
+    'STORAGE_ENGINE':'-W',
+    'NUMA_POLICY':'-Z',
+    'MAX_ITEM_SIZE':'-w',
+    'HEAP_FILE':'-J',
+    'SNAPSHOT_FILE':'--snapshot-file',
+    'EXT_FILE':'--ext-file',
+    'EXT_SIZE':'--ext-size',
+    'ADMISSION':'--admission',
+    'EVICTION_POLICY':'--eviction-policy'
 }
 
 EXEC = 'twemcache' # command to launch twemcache
@@ -60,6 +74,7 @@ LICENSE = False
 LARGEPAGE = False
 PREALLOC = False
 CAS = False
+EXPIRY_WHEEL = False
 
 # Binary arguments
 PORT = '11211' # server (TCP) port (-p)
@@ -81,6 +96,19 @@ BACKLOG = 1024
 SLAB_SIZE = NATIVE_SLAB_SIZE # (-I)
 AGGR_INTERVAL = 100000 # aggregation interval of stats, in milliseconds (-A)
 SLAB_PROFILE = None # (-z)
+LOCK_POWER = None # item lock stripes, as power of 2 (-K)
+HASH_TABLE = None # hash table type, chained or bucketized (-G)
+HASH_FUNCTION = None # hash function for keys, lookup3, crc32c or xxh32 (-F)
+SLAB_AUTOMOVE = None # slab rebalancing aggressiveness, 0, 1 or 2 (-g)
+STORAGE_ENGINE = None # item storage, slab or segment (-W)
+NUMA_POLICY = None # numa placement of slab memory, local or interleave (-Z)
+MAX_ITEM_SIZE = None # largest item, chunked beyond the largest slab item (-w)
+HEAP_FILE = None # file backing the slab heap, restored on restart (-J)
+SNAPSHOT_FILE = None # file to dump items to and load them from (--snapshot-file)
+EXT_FILE = None # file of second tier for evicted items (--ext-file)
+EXT_SIZE = None # size of second tier file, in MB (--ext-size)
+ADMISSION = None # admission filter of sets that evict, none or tinylfu (--admission)
+EVICTION_POLICY = None # order of item eviction, lru, clock, slru or s3fifo (--eviction-policy)
 
 # internals, not used by launching service but useful for data generation
 ALIGNMENT = 8 # bytes
@@ -92,12 +120,25 @@ CAS_LEN = 8 # cas adds another 8 bytes
 STATS_KEYS = [ # system/service info
     'pid', 'uptime', 'time', 'version', 'pointer_size', 'aggregate_ts',
     'rusage_user', 'rusage_system', 'rusage_maxrss', 'rusage_nvcsw', 'rusage_nivcsw',
-    'nbyte_primary', 'nbyte_old',
+    'nbyte_primary', 'nbyte_old', 'nbucket_old', 'nbucket_moved',
+    'nbyte_heap', 'nbyte_heap_huge', 'heap_ready', 'heap_prefault_usec',
+    'heap_restore_nitem', 'heap_restore_usec', 'nbyte_expiry',
+    'snapshot_dumping', 'snapshot_dump_nitem', 'snapshot_dump_usec',
+    'snapshot_load_nitem', 'snapshot_load_usec',
      # connection related
     'conn_disabled', 'conn_total', 'conn_struct', 'conn_yield', 'conn_curr', 'conn_curr_max',
      # item/slab related
     'item_curr', 'item_free', 'item_acquire', 'item_remove', 'item_link', 'item_unlink', 'item_evict', 'item_expire',
+    'item_requeue', 'item_refill', 'item_spill',
     'slab_req', 'slab_error', 'slab_alloc', 'slab_curr', 'slab_evict',
+    'slab_evict_hit', 'slab_evict_byte',
+    'slab_move_in', 'slab_move_out',
+    'seg_curr', 'seg_curr_max', 'seg_expire', 'seg_evict', 'seg_merge',
+    'expiry_curr', 'expiry_curr_max', 'expiry_reap', 'expiry_stale', 'expiry_full',
+    'ext_write', 'ext_write_byte', 'ext_write_error', 'ext_drop',
+    'ext_hit', 'ext_miss', 'ext_read_error', 'ext_read_usec',
+    'admit_accept', 'admit_reject',
+    'item_hdr_size', 'nbyte_per_item',
      # things in bytes
     'data_read', 'data_written', 'data_curr', 'data_value_curr',
      # command related
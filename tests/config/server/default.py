@@ -0,0 +1,177 @@
+import subprocess
+from time import sleep
+
+ARGS_UNARY = {
+    'DAEMON':'-d',
+    'MAX_CORE':'-r',
+    'LOCK_PAGE':'-k',
+    'HELP':'-h',
+    'LICENSE':'-i',
+    'LARGEPAGE':'-L',
+    'PREALLOC':'-E',
+    'CAS':'-C',
+    'EXPIRY_WHEEL':'-Q'
+}
+
+ARGS_BINARY = {
+    'PORT':'-p',
+    'UDP':'-U',
+    'SOCKET':'-s',
+    'ACCESS':'-a',
+    'SERVER':'-l',
+    'USER':'-u',
+    'EVICTION':'-M',
+    'SLAB_AUTOMOVE':'-g',
+    'MAX_MEMORY':'-m',
+    'CONNECTIONS':'-c',
+    'VERBOSITY':'-v',
+    'PIDFILE':'-P',
+    'FACTOR':'-f',
+    'ITEM_MIN_SIZE':'-n',
+    'DELIMITER':'-D',
+    'THREADS':'-t',
+    'BACKLOG':'-b',
+    'SLAB_SIZE':'-I',
+    'AGGR_INTERVAL':'-A',
+    'SLAB_PROFILE':'-z',
+    'LOCK_POWER':'-K',
+    'HASH_TABLE':'-G',
+    'HASH_FUNCTION':'-F',
+    'STORAGE_ENGINE':'-W',
+    'NUMA_POLICY':'-Z',
+    'MAX_ITEM_SIZE':'-w',
+    'HEAP_FILE':'-J',
+    'SNAPSHOT_FILE':'--snapshot-file',
+    'EXT_FILE':'--ext-file',
+    'EXT_SIZE':'--ext-size',
+    'ADMISSION':'--admission',
+    'EVICTION_POLICY':'--eviction-policy'
+}
+
+EXEC = '/root/repo/_gate_build/src/twemcache' # command to launch twemcache
+INIT_DELAY = 0.3 # time before twemcache is ready to serve traffic
+SHUTDOWN_DELAY = 0.3 # time before twemcache is completely shut down
+
+# Machine/Build dependent arguments- sizes
+tc = subprocess.Popen([EXEC, '-S'], stderr=subprocess.PIPE)
+output = tc.stderr.readlines()[2:]
+args = {}
+for line in output:
+  key,val = line.split()
+  args[key] = val
+NATIVE_ITEM_OVERHEAD = int(args['item_hdr_size'])
+NATIVE_ITEM_SIZE = int(args['item_chunk_size'])
+NATIVE_SLAB_OVERHEAD = int(args['slab_hdr_size'])
+NATIVE_SLAB_SIZE = int(args['slab_size'])
+
+
+# Unary arguments
+DAEMON = False
+MAX_CORE = False
+LOCK_PAGE = False
+HELP = False
+LICENSE = False
+LARGEPAGE = False
+PREALLOC = False
+CAS = False
+EXPIRY_WHEEL = False
+
+# Binary arguments
+PORT = '11211' # server (TCP) port (-p)
+UDP = None
+SOCKET = None
+ACCESS = None
+SERVER = '127.0.0.1' # server IP (-l)
+USER = 'root'
+EVICTION = 2 # random slab eviction by default
+MAX_MEMORY = 64 # max amount memory allocated, in MB (-m)
+CONNECTIONS = 256 # max number of concurrent connections allowed (-c)
+VERBOSITY = 5 # logging verbosity
+PIDFILE = None
+FACTOR = 1.25 # factor of slab growth (-f)
+ITEM_MIN_SIZE = NATIVE_ITEM_SIZE # item size, smallest (-n)
+DELIMITER = None
+THREADS = 2 # number of threads (-t)
+BACKLOG = 1024
+SLAB_SIZE = NATIVE_SLAB_SIZE # (-I)
+AGGR_INTERVAL = 100000 # aggregation interval of stats, in milliseconds (-A)
+SLAB_PROFILE = None # (-z)
+LOCK_POWER = None # item lock stripes, as power of 2 (-K)
+HASH_TABLE = None # hash table type, chained or bucketized (-G)
+HASH_FUNCTION = None # hash function for keys, lookup3, crc32c or xxh32 (-F)
+SLAB_AUTOMOVE = None # slab rebalancing aggressiveness, 0, 1 or 2 (-g)
+STORAGE_ENGINE = None # item storage, slab or segment (-W)
+NUMA_POLICY = None # numa placement of slab memory, local or interleave (-Z)
+MAX_ITEM_SIZE = None # largest item, chunked beyond the largest slab item (-w)
+HEAP_FILE = None # file backing the slab heap, restored on restart (-J)
+SNAPSHOT_FILE = None # file to dump items to and load them from (--snapshot-file)
+EXT_FILE = None # file of second tier for evicted items (--ext-file)
+EXT_SIZE = None # size of second tier file, in MB (--ext-size)
+ADMISSION = None # admission filter of sets that evict, none or tinylfu (--admission)
+EVICTION_POLICY = None # order of item eviction, lru, clock, slru or s3fifo (--eviction-policy)
+
+# internals, not used by launching service but useful for data generation
+ALIGNMENT = 8 # bytes
+SLAB_OVERHEAD = NATIVE_SLAB_OVERHEAD # per-slab storage overhead at the server
+ITEM_OVERHEAD = NATIVE_ITEM_OVERHEAD # per-item storage overhead at the server
+CAS_LEN = 8 # cas adds another 8 bytes
+
+# global stats (returns of "stats" command)
+STATS_KEYS = [ # system/service info
+    'pid', 'uptime', 'time', 'version', 'pointer_size', 'aggregate_ts',
+    'rusage_user', 'rusage_system', 'rusage_maxrss', 'rusage_nvcsw', 'rusage_nivcsw',
+    'nbyte_primary', 'nbyte_old', 'nbucket_old', 'nbucket_moved',
+    'nbyte_heap', 'nbyte_heap_huge', 'heap_ready', 'heap_prefault_usec',
+    'heap_restore_nitem', 'heap_restore_usec', 'nbyte_expiry',
+    'snapshot_dumping', 'snapshot_dump_nitem', 'snapshot_dump_usec',
+    'snapshot_load_nitem', 'snapshot_load_usec',
+     # connection related
+    'conn_disabled', 'conn_total', 'conn_struct', 'conn_yield', 'conn_curr', 'conn_curr_max',
+     # item/slab related
+    'item_curr', 'item_free', 'item_acquire', 'item_remove', 'item_link', 'item_unlink', 'item_evict', 'item_expire',
+    'item_requeue', 'item_refill', 'item_spill',
+    'slab_req', 'slab_error', 'slab_alloc', 'slab_curr', 'slab_evict',
+    'slab_evict_hit', 'slab_evict_byte',
+    'slab_move_in', 'slab_move_out',
+    'seg_curr', 'seg_curr_max', 'seg_expire', 'seg_evict', 'seg_merge',
+    'expiry_curr', 'expiry_curr_max', 'expiry_reap', 'expiry_stale', 'expiry_full',
+    'ext_write', 'ext_write_byte', 'ext_write_error', 'ext_drop',
+    'ext_hit', 'ext_miss', 'ext_read_error', 'ext_read_usec',
+    'admit_accept', 'admit_reject',
+    'item_hdr_size', 'nbyte_per_item',
+     # things in bytes
+    'data_read', 'data_written', 'data_curr', 'data_value_curr',
+     # command related
+    'set', 'set_success',
+    'add', 'add_exist', 'add_success',
+    'replace', 'replace_miss', 'replace_success',
+    'append', 'append_hit', 'append_miss', 'append_success',
+    'prepend', 'prepend_hit', 'prepend_miss', 'prepend_success',
+    'appendrl', 'appendrl_hit', 'appendrl_miss', 'appendrl_success',
+    'prependrl', 'prependrl_hit', 'prependrl_miss', 'prependrl_success',
+    'delete', 'delete_hit', 'delete_miss',
+    'incr', 'incr_miss', 'incr_success',
+    'decr', 'decr_miss', 'decr_success',
+    'cas', 'cas_badval', 'cas_miss', 'cas_success',
+    'get', 'get_key', 'get_key_hit', 'get_key_miss',
+    'gets', 'gets_key', 'gets_key_hit', 'gets_key_miss',
+    'cmd_total',
+     # general errors
+    'cmd_error', 'server_error',
+    'accept_eagain', 'accept_eintr', 'accept_emfile', 'accept_error',
+    'read_eagain', 'read_error', 'write_eagain', 'write_error',
+    'klog_logged', 'klog_discarded', 'klog_skipped',
+     # memory related
+    'mem_cache_curr', 'mem_conn_curr', 'mem_rbuf_curr', 'mem_wbuf_curr',
+    'mem_cache_curr_max', 'mem_conn_curr_max', 'mem_rbuf_curr_max', 'mem_wbuf_curr_max',
+    'mem_ilist_curr', 'mem_slist_curr', 'mem_iov_curr', 'mem_msg_curr',
+    'mem_ilist_curr_max', 'mem_slist_curr_max', 'mem_iov_curr_max', 'mem_msg_curr_max'
+    ]
+SETTINGS_KEYS = [
+    'prealloc', 'lock_page', 'accepting_conns', 'daemonize', 'max_corefile',
+    'cas_enabled', 'num_workers', 'reqs_per_event', 'oldest',
+    'log_filename', 'verbosity', 'maxconns', 'tcpport', 'udpport', 'inter',
+    'domain_socket', 'umask', 'tcp_backlog', 'evictions', 'growth_factor', 'maxbytes',
+    'chunk_size', 'slab_size', 'username', 'stats_agg_intvl']
+STATS_DELAY = float(AGGR_INTERVAL) * 1.5 / 1000000
+# time we wait before getting for stats
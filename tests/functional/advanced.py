@@ -68,6 +68,25 @@ class FunctionalAdvanced(unittest.TestCase):
         for i in range(evictions, 10):
             self.assertEqual(str(i) * size, self.mc.get("big%d" % i))
 
+    def test_itemlrutouch(self):
+        ''' test item eviction order updated by gets before evicting '''
+        # lru only requeues items not touched for a minute, which none of
+        # them is by then, so test clock, which takes every get into account
+        args = Args(command='MAX_MEMORY = 8\nEVICTION = 1\nTHREADS = 1\n'
+                            'EVICTION_POLICY = "clock"') #lru eviction
+        size = SLAB_SIZE - ITEM_OVERHEAD - SLAB_OVERHEAD - CAS_LEN - len("big10\0") - 2
+        self.server = startServer(args)
+        for i in range(10):
+            self.assertTrue(self.mc.set("big%d" % i, str(i % 10) * size))
+        time.sleep(STATS_DELAY)
+        evictions = int(self.mc.get_stats()[0][1]['item_evict'])
+        self.assertTrue(evictions >= 2 and evictions < 9)
+        # reading the least recently used item spares it from the next eviction
+        self.assertEqual(str(evictions) * size, self.mc.get("big%d" % evictions))
+        self.assertTrue(self.mc.set("big10", '0' * size))
+        self.assertEqual(str(evictions) * size, self.mc.get("big%d" % evictions))
+        self.assertIsNone(self.mc.get("big%d" % (evictions + 1)))
+
     def test_slablra(self):
         ''' test slab lra algorithm '''
         args = Args(command='MAX_MEMORY = 8\nEVICTION = 4\nTHREADS = 1') #lra eviction
@@ -105,6 +124,96 @@ class FunctionalAdvanced(unittest.TestCase):
         self.mc.set(str(i), '0' * sizes[i]) # shouldn't use the free item
         self.assertEqual('1', self.mc.get_stats()[0][1]['item_free'])
 
+    def test_slabhd(self):
+        ''' test slab hit density algorithm '''
+        args = Args(command='MAX_MEMORY = 8\nEVICTION = 16\nTHREADS = 1') #hit density eviction
+        sizes = [10, 40, 80, 160, 320, 640, 1280, 2560, 5120, 10240, 20480]
+        self.server = startServer(args)
+        for i in range(8):
+            data = '0' * sizes[i]
+            self.assertTrue(self.mc.set(str(i), data))
+        for j in range(10):
+            self.assertIsNotNone(self.mc.get("7"))
+        self.assertEqual("0", self.mc.get_stats()[0][1]['slab_evict'])
+        # all slabs but the one read hold a single item that was never hit
+        for i in range(8, 11):
+            data = '0' * sizes[i]
+            self.assertTrue(self.mc.set(str(i), data))
+            self.assertEqual('0' * sizes[7], self.mc.get("7"))
+        stats = self.mc.get_stats()[0][1]
+        self.assertEqual("3", stats['slab_evict'])
+        self.assertEqual("0", stats['slab_evict_hit'])
+        self.assertTrue(int(stats['slab_evict_byte']) > 0)
+
+    def test_magazine(self):
+        ''' test per-thread magazines of free items '''
+        args = Args(command='MAX_MEMORY = 8\nEVICTION = 2\nTHREADS = 1') #random eviction
+        self.server = startServer(args)
+        nkey = 1000
+        data = dict(("foo%d" % i, '0' * 100) for i in range(nkey))
+        self.mc.set_multi(data)
+        stats = self.mc.get_stats()[0][1]
+        # items are taken from and given back to their class in batches
+        self.assertTrue(0 < int(stats['item_refill']) < nkey / 4)
+        self.mc.delete_multi(data.keys())
+        stats = self.mc.get_stats()[0][1]
+        self.assertTrue(0 < int(stats['item_spill']) < nkey / 4)
+        self.assertTrue(int(stats['item_free']) >= nkey)
+        self.mc.set_multi(data)
+        self.assertEqual(data, self.mc.get_multi(data.keys()))
+        # free items in the magazine don't keep their slabs from being evicted
+        self.mc.delete_multi(data.keys())
+        for i in range(100):
+            self.assertTrue(self.mc.set("big%d" % i, '0' * 100000))
+        stats = self.mc.get_stats()[0][1]
+        self.assertTrue(int(stats['slab_evict']) > 0)
+        self.assertEqual("0", stats['server_error'])
+
+    def test_automove(self):
+        ''' test moving slabs from a cold class to an evicting one '''
+        args = Args(command='MAX_MEMORY = 8\nEVICTION = 1\nSLAB_AUTOMOVE = 2\nTHREADS = 1')
+        self.server = startServer(args)
+        # small items take all but one of the slabs, and then stay cold
+        for i in range(6 * SLAB_SIZE / 256):
+            self.mc.set("small%d" % i, '0' * 100)
+        stats = self.mc.get_stats()[0][1]
+        self.assertEqual("0", stats['slab_move_in'])
+        # large items only get what is left, and evict each other
+        for i in range(200):
+            self.mc.set("large%d" % i, '0' * 8000)
+        time.sleep(1)
+        for i in range(200, 400):
+            self.mc.set("large%d" % i, '0' * 8000)
+        time.sleep(3)
+        stats = self.mc.get_stats()[0][1]
+        self.assertEqual(stats['slab_move_in'], stats['slab_move_out'])
+        self.assertTrue(int(stats['slab_move_in']) >= 1)
+
+    def test_segment(self):
+        ''' test ttl bucketed segments: expiration and eviction '''
+        args = Args(command='MAX_MEMORY = 8\nEVICTION = 1\nTHREADS = 1\nSTORAGE_ENGINE = "segment"')
+        self.server = startServer(args)
+        for i in range(100):
+            self.assertTrue(self.mc.set("short%d" % i, '0' * 1000, time=2))
+        for i in range(100):
+            self.assertTrue(self.mc.set("long%d" % i, '1' * 1000))
+        stats = self.mc.get_stats()[0][1]
+        self.assertEqual("2", stats['seg_curr']) # one per ttl bucket
+        self.assertEqual("0" * 1000, self.mc.get("short0"))
+        # expired segments are reclaimed as a whole in the background
+        time.sleep(4)
+        stats = self.mc.get_stats()[0][1]
+        self.assertEqual("1", stats['seg_expire'])
+        self.assertEqual("1", stats['seg_curr'])
+        self.assertIsNone(self.mc.get("short0"))
+        self.assertEqual("1" * 1000, self.mc.get("long0"))
+        # once memory is full, the oldest segments are evicted
+        for i in range(100, 10000):
+            self.assertTrue(self.mc.set("long%d" % i, '1' * 1000))
+        stats = self.mc.get_stats()[0][1]
+        self.assertTrue(int(stats['seg_evict']) >= 1)
+        self.assertEqual("1" * 1000, self.mc.get("long9999"))
+
 
 if __name__ == '__main__':
     functional_advanced = unittest.TestLoader().loadTestsFromTestCase(FunctionalAdvanced)
@@ -209,6 +209,13 @@ class FunctionalBasic(unittest.TestCase):
                                "megafoo2": "megabar2",\
                                "megafoo3": "megabar3"})
 
+    def test_mget_large(self):
+        '''retrieval: multi_get of more keys than are looked up at once'''
+        data = dict(("megafoo%d" % i, "megabar%d" % i) for i in range(0, 100, 2))
+        self.mc.set_multi(data)
+        val = self.mc.get_multi(["megafoo%d" % i for i in range(100)])
+        self.assertEqual(val, data)
+
     def test_gets(self):
         '''retrieval: gets, we call it for cas tests, safe to skip here'''
         pass
@@ -242,6 +242,22 @@ class FunctionalExpiry(unittest.TestCase):
         val = self.mc.get_multi(["foo", "FOO"]) # should have expired
         self.assertEqual(val, {})
 
+    def test_wheel(self):
+        '''removal: expired items reaped by the timer wheel without a get'''
+        global server
+        stopServer(server)
+        server = startServer(Args(command='EXPIRY_WHEEL = True'))
+        self.mc.set_multi(dict(("foo%d" % i, "bar") for i in range(100)), TIMER_LONG)
+        self.mc.set("FOO", "BAR")
+        stats = self.mc.get_stats()[0][1]
+        self.assertEqual("100", stats['expiry_curr'])
+        time.sleep(TIMER_LLONG + TIMER_LONG)
+        stats = self.mc.get_stats()[0][1]
+        self.assertEqual("100", stats['expiry_reap'])
+        self.assertEqual("0", stats['expiry_curr'])
+        self.assertEqual("1", stats['item_curr'])
+        self.assertEqual("BAR", self.mc.get("FOO"))
+
 
 if __name__ == '__main__':
     functional_expiry = unittest.TestLoader().loadTestsFromTestCase(FunctionalExpiry)
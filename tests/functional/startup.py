@@ -115,6 +115,33 @@ class FunctionalStartup(unittest.TestCase):
             conns[i] = memcache.Client(["%s:%s" % (SERVER, PORT)])
             self.assertTrue(conns[i].set("%d" % i, "%d" % i))
 
+    def test_hashfunction(self):
+        '''hash function for keys, -F'''
+        args = Args(command='HASH_FUNCTION = "xxh32"')
+        self.server = startServer(args)
+        self.assertIsNotNone(self.server)
+        stats = self.mc.get_stats('settings')
+        self.assertEqual('xxh32', stats[0][1]['hash_function'])
+        data = dict(("foo%d" % i, "bar%d" % i) for i in range(100))
+        self.mc.set_multi(data)
+        self.assertEqual(data, self.mc.get_multi(data.keys()))
+
+    def test_largepages(self):
+        '''huge pages and numa interleaving for slab memory, -L and -Z'''
+        args = Args(command='LARGEPAGE = True\nNUMA_POLICY = "interleave"\nMAX_MEMORY = 8')
+        self.server = startServer(args)
+        self.assertIsNotNone(self.server)
+        settings = self.mc.get_stats('settings')[0][1]
+        self.assertEqual('1', settings['prealloc'])
+        self.assertEqual('interleave', settings['numa_policy'])
+        self.assertTrue(settings['large_pages'] in ['hugetlb', 'thp', 'normal'])
+        data = dict(("foo%d" % i, "bar%d" % i) for i in range(100))
+        self.mc.set_multi(data)
+        self.assertEqual(data, self.mc.get_multi(data.keys()))
+        stats = self.mc.get_stats()[0][1]
+        self.assertEqual(str(8 * 1024 * 1024), stats['nbyte_heap'])
+        self.assertTrue(int(stats['nbyte_heap_huge']) <= 8 * 1024 * 1024)
+
     def test_aggrintrvl(self):
         '''aggregation interval, -A'''
         args = Args(command='AGGR_INTERVAL = 1000000')
@@ -135,6 +162,201 @@ class FunctionalStartup(unittest.TestCase):
         mc.set("lval", 'a' * (slabsize - 512))
         self.assertEqual(slabsize - 512, len(mc.get("lval")))
 
+    def test_maxitemsize(self):
+        '''Store items larger than a slab in chunks, -w'''
+        args = Args(command='MAX_ITEM_SIZE = "4m"')
+        itemsize = 1024 * 1024 * 4
+        self.server = startServer(args)
+        self.assertIsNotNone(self.server)
+        stats = self.mc.get_stats('settings')
+        self.assertEqual(str(itemsize), stats[0][1]['max_item_size'])
+        mc = memcache.Client(["%s:%s" % (SERVER, PORT)], debug=0, server_max_value_length=itemsize)
+        value = ''.join(chr(i % 251) for i in range(itemsize - 1024 * 1024 + 17))
+        self.assertTrue(mc.set("lval", value))
+        self.assertEqual(value, mc.get("lval"))
+        mc.append("lval", "bar")
+        mc.prepend("lval", "foo")
+        self.assertEqual("foo" + value + "bar", mc.get("lval"))
+        self.assertTrue(mc.set("sval", "bar"))
+        mc.prepend("sval", value)
+        self.assertEqual(value + "bar", mc.get("sval"))
+        mc.delete("lval")
+        self.assertEqual(None, mc.get("lval"))
+
+    def test_heapfile(self):
+        '''Restore items from the heap file on restart, -J'''
+        if os.path.exists("/tmp/mcheap"):
+            os.remove("/tmp/mcheap")
+        command = 'HEAP_FILE = "/tmp/mcheap"\nMAX_MEMORY = 8\nMAX_ITEM_SIZE = "2m"'
+        itemsize = 1024 * 1024 * 2
+        self.server = startServer(Args(command=command))
+        self.assertIsNotNone(self.server)
+        mc = memcache.Client(["%s:%s" % (SERVER, PORT)], debug=0, server_max_value_length=itemsize)
+        stats = mc.get_stats('settings')
+        self.assertEqual('/tmp/mcheap', stats[0][1]['heap_file'])
+        self.assertEqual('1', stats[0][1]['prealloc'])
+        data = dict(("foo%d" % i, "bar%d" % i) for i in range(1000))
+        mc.set_multi(data)
+        value = ''.join(chr(i % 251) for i in range(itemsize - 1024))
+        self.assertTrue(mc.set("lval", value))
+        mc.delete("foo0")
+        del data["foo0"]
+        mc.disconnect_all()
+        # a clean shutdown leaves the items for the next run to restore
+        stopServer(self.server)
+        self.server = startServer(Args(command=command))
+        self.assertIsNotNone(self.server)
+        self.assertEqual(data, mc.get_multi(["foo%d" % i for i in range(1000)]))
+        self.assertEqual(value, mc.get("lval"))
+        stats = mc.get_stats()[0][1]
+        self.assertEqual(str(len(data) + 1), stats['heap_restore_nitem'])
+        self.assertEqual(str(len(data) + 1), stats['item_curr'])
+        # restored items are served and replaced as any other
+        self.assertTrue(mc.set("foo1", "baz"))
+        self.assertEqual("baz", mc.get("foo1"))
+        mc.disconnect_all()
+
+    def test_snapshotfile(self):
+        '''Dump items to the snapshot file, and load them on startup, --snapshot-file'''
+        if os.path.exists("/tmp/mcsnapshot"):
+            os.remove("/tmp/mcsnapshot")
+        command = 'SNAPSHOT_FILE = "/tmp/mcsnapshot"\nMAX_ITEM_SIZE = "2m"'
+        itemsize = 1024 * 1024 * 2
+        self.server = startServer(Args(command=command))
+        self.assertIsNotNone(self.server)
+        mc = memcache.Client(["%s:%s" % (SERVER, PORT)], debug=0, server_max_value_length=itemsize)
+        stats = mc.get_stats('settings')
+        self.assertEqual('/tmp/mcsnapshot', stats[0][1]['snapshot_file'])
+        data = dict(("foo%d" % i, "bar%d" % i) for i in range(1000))
+        mc.set_multi(data)
+        value = ''.join(chr(i % 251) for i in range(itemsize - 1024))
+        self.assertTrue(mc.set("lval", value))
+        self.assertTrue(mc.set("ttl", "val", time=3600))
+        self.assertTrue(mc.set("expired", "val", time=1))
+        mc.gets("foo1")
+        casid = mc.cas_ids["foo1"]
+        time.sleep(2)
+        server = mc.servers[0]
+        server.send_cmd("config snapshot dump")
+        server.expect("OK")
+        for i in range(100):
+            stats = mc.get_stats()[0][1]
+            if stats['snapshot_dumping'] == "0":
+                break
+            time.sleep(0.1)
+        self.assertEqual(str(len(data) + 2), stats['snapshot_dump_nitem'])
+        mc.disconnect_all()
+        # the next run loads all but the expired items, with their cas
+        stopServer(self.server)
+        self.server = startServer(Args(command=command))
+        self.assertIsNotNone(self.server)
+        self.assertEqual(data, mc.get_multi(["foo%d" % i for i in range(1000)]))
+        self.assertEqual(value, mc.get("lval"))
+        self.assertEqual("val", mc.get("ttl"))
+        self.assertEqual(None, mc.get("expired"))
+        mc.gets("foo1")
+        self.assertEqual(casid, mc.cas_ids["foo1"])
+        stats = mc.get_stats()[0][1]
+        self.assertEqual(str(len(data) + 2), stats['snapshot_load_nitem'])
+        # cas ids handed out from then on are larger than those loaded
+        self.assertTrue(mc.set("foo2", "baz"))
+        mc.gets("foo2")
+        self.assertTrue(mc.cas_ids["foo2"] > casid)
+        mc.disconnect_all()
+
+    def test_extfile(self):
+        '''Write evicted items out to the ext file, and read them back, --ext-file'''
+        command = 'EXT_FILE = "/tmp/mcext"\nEXT_SIZE = 64\nMAX_MEMORY = 8\nEVICTION = 8'
+        self.server = startServer(Args(command=command))
+        self.assertIsNotNone(self.server)
+        mc = memcache.Client(["%s:%s" % (SERVER, PORT)], debug=0)
+        stats = mc.get_stats('settings')[0][1]
+        self.assertEqual('/tmp/mcext', stats['ext_file'])
+        self.assertEqual(str(64 * 1024 * 1024), stats['ext_size'])
+        # with slab lrc eviction, the slab of the keys set first is the first
+        # one evicted, so that none of them is left in memory once the cache
+        # is filled over with other keys
+        data = dict(("foo%d" % i, ("%06d" % i) * 100) for i in range(1000))
+        mc.set_multi(data)
+        for i in range(0, 16000, 1000):
+            mc.set_multi(dict(("baz%d" % j, ("%06d" % j) * 100)
+                              for j in range(i, i + 1000)))
+        # wait for the writer to be done with the items evicted
+        nwrite = None
+        for i in range(100):
+            stats = mc.get_stats()[0][1]
+            if int(stats['ext_write']) + int(stats['ext_drop']) == nwrite:
+                break
+            nwrite = int(stats['ext_write']) + int(stats['ext_drop'])
+            time.sleep(1.5)
+        self.assertTrue(int(stats['ext_write']) > 0)
+        nhit = int(stats['ext_hit'])
+        # evicted items are read back as they were, every one of them
+        found = {}
+        for i in range(0, 1000, 100):
+            found.update(mc.get_multi(["foo%d" % j for j in range(i, i + 100)]))
+        self.assertEqual(len(data), len(found))
+        for key in found:
+            self.assertEqual(data[key], found[key])
+        stats = mc.get_stats()[0][1]
+        self.assertEqual(nhit + len(found), int(stats['ext_hit']))
+        self.assertEqual("0", stats['ext_read_error'])
+        # a deleted key stays deleted
+        key = found.keys()[0]
+        self.assertTrue(mc.delete(key))
+        self.assertEqual(None, mc.get(key))
+        mc.disconnect_all()
+
+    def test_admission(self):
+        '''Keep frequent keys over sets of keys never read, --admission'''
+        command = 'ADMISSION = "tinylfu"\nEVICTION = 1\nMAX_MEMORY = 8'
+        self.server = startServer(Args(command=command))
+        self.assertIsNotNone(self.server)
+        mc = memcache.Client(["%s:%s" % (SERVER, PORT)], debug=0)
+        stats = mc.get_stats('settings')[0][1]
+        self.assertEqual('tinylfu', stats['admission'])
+        value = 'x' * 400
+        hot = ["hot%06d" % i for i in range(1000)]
+        mc.set_multi(dict((key, value) for key in hot))
+        for i in range(3):
+            self.assertEqual(len(hot), len(mc.get_multi(hot)))
+        # fill memory several times over with keys set once and never read
+        for i in range(0, 60000, 1000):
+            mc.set_multi(dict(("cold%d" % j, value)
+                              for j in range(i, i + 1000)))
+        stats = mc.get_stats()[0][1]
+        self.assertTrue(int(stats['admit_reject']) > 0)
+        self.assertEqual(len(hot), len(mc.get_multi(hot)))
+        mc.disconnect_all()
+
+    def test_evictionpolicy(self):
+        '''Keep items read since queued over those never read, --eviction-policy'''
+        value = 'x' * 400
+        hot = ["hot%06d" % i for i in range(1000)]
+        for policy in ['clock', 'slru', 's3fifo']:
+            command = ('EVICTION = 1\nEVICTION_POLICY = "%s"\nMAX_MEMORY = 8'
+                       % policy)
+            self.server = startServer(Args(command=command))
+            self.assertIsNotNone(self.server)
+            mc = memcache.Client(["%s:%s" % (SERVER, PORT)], debug=0)
+            stats = mc.get_stats('settings')[0][1]
+            self.assertEqual(policy, stats['eviction_policy'])
+            mc.set_multi(dict((key, value) for key in hot))
+            # fill memory several times over, reading the same keys meanwhile
+            for i in range(0, 60000, 1000):
+                if i % 5000 == 0:
+                    self.assertEqual(len(hot), len(mc.get_multi(hot)))
+                mc.set_multi(dict(("cold%05d" % j, value)
+                                  for j in range(i, i + 1000)))
+            self.assertEqual(len(hot), len(mc.get_multi(hot)))
+            time.sleep(STATS_DELAY)
+            stats = mc.get_stats()[0][1]
+            self.assertTrue(int(stats['item_evict']) > 0)
+            self.assertTrue(int(stats['item_requeue']) > 0)
+            mc.disconnect_all()
+            stopServer(self.server)
+            self.server = None
+
     def test_slabfile(self):
         '''Initalize slab classes with a size profile, -z'''
         # create a slab profile first
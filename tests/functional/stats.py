@@ -217,6 +217,115 @@ class FunctionalStats(unittest.TestCase):
         self.assertEqual("1", stats['prepend_success'])
         self.assertEqual("5", stats['cmd_total'])
 
+    def test_hashmigrate(self):
+        '''hash table migration when growing and shrinking'''
+        stats = self.mc.get_stats()[0][1]
+        nbyte = int(stats['nbyte_primary'])
+        self.assertEqual("0", stats['nbucket_old'])
+        # enough keys to grow a default chained or bucketized hash table
+        settings = self.mc.get_stats("settings")[0][1]
+        if settings['hash_table'] == 'bucketized':
+            nkey = 300000
+        else:
+            nkey = 100000
+        keys = ["foo%d" % i for i in range(nkey)]
+        self.mc.set_multi(dict((key, "bar") for key in keys))
+        for i in range(100):
+            stats = self.mc.get_stats()[0][1]
+            if stats['nbucket_old'] == "0" and int(stats['nbyte_primary']) > nbyte:
+                break
+            time.sleep(TIMER_SHORT)
+        self.assertEqual(2 * nbyte, int(stats['nbyte_primary']))
+        self.assertEqual("0", stats['nbyte_old'])
+        self.assertEqual("bar", self.mc.get(keys[0]))
+        self.assertEqual("bar", self.mc.get(keys[-1]))
+        # and shrink back once most of them are gone
+        self.mc.delete_multi(keys[1:])
+        for i in range(100):
+            stats = self.mc.get_stats()[0][1]
+            if stats['nbucket_old'] == "0" and int(stats['nbyte_primary']) == nbyte:
+                break
+            time.sleep(TIMER_SHORT)
+        self.assertEqual(nbyte, int(stats['nbyte_primary']))
+        self.assertEqual("bar", self.mc.get(keys[0]))
+
+    def test_itemmemory(self):
+        '''memory per item, and items linked through their headers'''
+        stats = self.mc.get_stats()[0][1]
+        self.assertEqual(NATIVE_ITEM_OVERHEAD, int(stats['item_hdr_size']))
+        self.assertEqual("0", stats['nbyte_per_item'])
+        nkey = 1000
+        data = dict(("foo%d" % i, "bar%d" % i) for i in range(nkey))
+        self.mc.set_multi(data)
+        stats = self.mc.get_stats()[0][1]
+        self.assertEqual(nkey, int(stats['item_curr']))
+        # all of them fit in the smallest chunk, and a slab holds as many of
+        # these as fit past its header, which share the slack at its end
+        self.assertTrue(ITEM_OVERHEAD + len("foo999") + len("bar999") + 2 <=
+                        ITEM_MIN_SIZE)
+        nbyte = SLAB_SIZE - SLAB_OVERHEAD
+        self.assertEqual(nbyte / (nbyte / ITEM_MIN_SIZE),
+                         int(stats['nbyte_per_item']))
+        # items are still found through hash chains and lru q once some of
+        # their neighbours are gone
+        self.assertEqual(data, self.mc.get_multi(data.keys()))
+        deleted = ["foo%d" % i for i in range(0, nkey, 3)]
+        self.mc.delete_multi(deleted)
+        for key in deleted:
+            del data[key]
+        self.assertEqual(data, self.mc.get_multi(["foo%d" % i for i in range(nkey)]))
+        self.mc.flush_all()
+        self.assertEqual({}, self.mc.get_multi(data.keys()))
+
+    def test_profile(self):
+        '''slab profile tuned to the item sizes, and restarted with'''
+        data = dict(("foo%d" % i, "x" * (i % 2 and 300 or 2000 + i))
+                    for i in range(1000))
+        self.mc.set_multi(data)
+        stats = self.mc.get_stats("profile")[0][1]
+        profile = [int(size) for size in stats['profile'].split(',')]
+        self.assertEqual(sorted(set(profile)), profile)
+        self.assertEqual(len(profile), int(stats['nclass']))
+        self.assertEqual(1000, int(stats['nitem']))
+        self.assertTrue(int(stats['nbyte_saved']) > 0)
+        self.assertEqual(int(stats['nbyte_slab_curr']) - int(stats['nbyte_saved']),
+                         int(stats['nbyte_slab_profile']))
+        # the same items restarted with the tuned profile take up no less
+        global server
+        self.mc.disconnect_all()
+        stopServer(server)
+        server = startServer(Args(command='SLAB_PROFILE = "%s"' % stats['profile']))
+        self.mc.set_multi(data)
+        self.assertEqual(data, self.mc.get_multi(data.keys()))
+        stats = self.mc.get_stats("profile")[0][1]
+        self.assertEqual("0", stats['nbyte_saved'])
+
+    def test_mrc(self):
+        '''miss ratio curve estimated from the sampled keys'''
+        stats = self.mc.get_stats("mrc")[0][1]
+        self.assertEqual("1/%d" % MAX_MEMORY, stats['sample_rate'])
+        self.assertEqual("0", stats['sample_get'])
+        self.assertEqual(str(MAX_MEMORY * 1024 * 1024), stats['size_1x'])
+        nkey = 10000
+        data = dict(("foo%d" % i, "bar%d" % i) for i in range(nkey))
+        self.mc.set_multi(data)
+        self.assertEqual(data, self.mc.get_multi(data.keys()))
+        self.mc.get_multi(["baz%d" % i for i in range(nkey)])
+        stats = self.mc.get_stats("mrc")[0][1]
+        self.assertTrue(int(stats['sample_key']) > 0)
+        self.assertTrue(int(stats['sample_get']) > int(stats['sample_key']))
+        self.assertTrue(int(stats['sample_usec']) > 0)
+        # everything fits in the smallest cache, every key set was hit and
+        # none of the others
+        for size in ["0.5x", "1x", "2x", "4x"]:
+            ratio = float(stats['hit_ratio_%s' % size])
+            self.assertTrue(0.4 < ratio < 0.6)
+        # deleted keys are forgotten
+        self.mc.delete_multi(data.keys())
+        self.mc.get_multi(data.keys())
+        stats = self.mc.get_stats("mrc")[0][1]
+        self.assertTrue(float(stats['hit_ratio_1x']) < 0.4)
+
 
 if __name__ == '__main__':
     functional_stats = unittest.TestLoader().loadTestsFromTestCase(FunctionalStats)
@@ -7,6 +7,8 @@ __version__ = "0.1-1.45"
 import sys
 import time
 import random
+import bisect
+import socket
 try:
     from lib import memcache
 except ImportError:
@@ -361,3 +363,74 @@ class Data():
                 items.append((key,val))
             self.rows[bucket] = Row(width, items)
         self.buckets = self.rows.keys()
+
+
+#
+# raw connections, for scripts that time the server rather than the client
+#
+POLL = 0.01             # seconds between two polls of the server
+
+def connect(server=SERVER, port=PORT):
+    '''connect to the server, waiting for it to listen'''
+    while True:
+        try:
+            return socket.create_connection((server, int(port)))
+        except socket.error:
+            time.sleep(POLL)
+
+def request(sock, req, nrsp, end='\r\n'):
+    '''send requests over a raw connection, and wait for nrsp responses'''
+    sock.sendall(req)
+    buf = ''
+    while buf.count(end) < nrsp:
+        buf += sock.recv(65536)
+    return buf
+
+def stats(sock, sub=''):
+    '''fetch server stats, or those of a stats subcommand such as mrc'''
+    cmd = 'stats %s' % sub if sub else 'stats'
+    buf = request(sock, cmd + '\r\n', 1, 'END\r\n')
+    return dict(line.split()[1:3] for line in buf.split('\r\n')
+                if line.startswith('STAT '))
+
+
+#
+# look-aside traces, replayed to compare hit ratios across servers
+#
+def trace(nreq, nkey=100000, skew=0.9, one_hit=0.3):
+    '''
+    generate the keys of nreq requests, the same ones on every call: keys
+    drawn from a Zipf distribution of nkey keys and exponent skew, mixed with
+    a fraction one_hit of keys that are never asked for again
+    '''
+    rand = random.Random(0)
+    cdf, total = [], 0.0
+    for i in range(nkey):
+        total += 1.0 / (i + 1) ** skew
+        cdf.append(total)
+    keys = []
+    for i in range(nreq):
+        if rand.random() < one_hit:
+            keys.append('once%d' % i)
+        else:
+            keys.append('key%d' % bisect.bisect(cdf, rand.random() * total))
+    return keys
+
+def replay(sock, keys, value='x' * 1000, batch=100):
+    '''
+    replay a trace, batch gets at a time, setting the key of every get that
+    misses to value, and return the # gets that hit
+    '''
+    nhit = 0
+    for i in range(0, len(keys), batch):
+        gets = keys[i:i + batch]
+        buf = request(sock, 'get %s\r\n' % ' '.join(gets), 1, 'END\r\n')
+        found = set(line.split()[1] for line in buf.split('\r\n')
+                    if line.startswith('VALUE '))
+        missed = set(key for key in gets if key not in found)
+        nhit += sum(1 for key in gets if key in found)
+        if missed:
+            req = ''.join('set %s 0 0 %d noreply\r\n%s\r\n' %
+                          (key, len(value), value) for key in missed)
+            sock.sendall(req)
+    return nhit
@@ -0,0 +1,44 @@
+__doc__='''
+Measure the hit ratio of a look-aside cache with and without the admission
+filter, by replaying the same trace against both. The trace mixes gets of
+keys drawn from a Zipf distribution with gets of keys that are never asked
+for again, and every get that misses is followed by a set of its key, as a
+client filling the cache from a backing store would do.
+
+Usage: python performance/admission.py [# requests]
+
+The cache holds about a tenth of the Zipf keys, so that it is under memory
+pressure for most of the trace.
+'''
+
+import sys
+
+from lib.utilities import *
+from lib.common import connect, stats, trace, replay
+
+ADMISSIONS = ['none', 'tinylfu']
+EVICTIONS = [1, 2]      # lru and random slab eviction
+MAX_MEMORY = 16         # MB
+NREQ = int(sys.argv[-1]) if len(sys.argv) > 1 else 500000
+
+keys = trace(NREQ)
+
+print "%-9s %-10s %12s %12s %10s %14s %14s" % ("eviction", "admission",
+                                               "requests", "hits", "hit ratio",
+                                               "admit_accept", "admit_reject")
+for eviction in EVICTIONS:
+    for admission in ADMISSIONS:
+        command = ('EVICTION = %d\nADMISSION = "%s"\nMAX_MEMORY = %d\n' %
+                   (eviction, admission, MAX_MEMORY))
+        server = startServer(Args(command=command))
+        try:
+            sock = connect()
+            nhit = replay(sock, keys)
+            st = stats(sock)
+            sock.close()
+            print "%-9d %-10s %12d %12d %10.4f %14s %14s" % (
+                eviction, admission, len(keys), nhit, float(nhit) / len(keys),
+                st['admit_accept'], st['admit_reject'])
+            sys.stdout.flush()
+        finally:
+            stopServer(server)
@@ -0,0 +1,43 @@
+__doc__='''
+Measure the hit ratio of a look-aside cache under every eviction policy,
+by replaying the same trace against each, with item eviction. The trace
+mixes gets of keys drawn from a Zipf distribution with gets of keys that
+are never asked for again, and every get that misses is followed by a set
+of its key, as a client filling the cache from a backing store would do.
+
+Usage: python performance/eviction.py [# requests]
+
+The cache holds about a tenth of the Zipf keys, so that it is under memory
+pressure for most of the trace.
+'''
+
+import sys
+
+from lib.utilities import *
+from lib.common import connect, stats, trace, replay
+
+POLICIES = ['lru', 'clock', 'slru', 's3fifo']
+MAX_MEMORY = 16         # MB
+NREQ = int(sys.argv[-1]) if len(sys.argv) > 1 else 500000
+
+keys = trace(NREQ)
+
+print "%-9s %12s %12s %10s %14s %14s" % ("policy", "requests", "hits",
+                                         "hit ratio", "item_evict",
+                                         "item_requeue")
+for policy in POLICIES:
+    command = ('EVICTION = 1\nEVICTION_POLICY = "%s"\nMAX_MEMORY = %d\n' %
+               (policy, MAX_MEMORY))
+    server = startServer(Args(command=command))
+    try:
+        sock = connect()
+        nhit = replay(sock, keys)
+        st = stats(sock)
+        sock.close()
+        print "%-9s %12d %12d %10.4f %14s %14s" % (policy, len(keys), nhit,
+                                                   float(nhit) / len(keys),
+                                                   st['item_evict'],
+                                                   st['item_requeue'])
+        sys.stdout.flush()
+    finally:
+        stopServer(server)
@@ -0,0 +1,77 @@
+__doc__='''
+Compare lookup throughput of the chained and the bucketized hash tables.
+The cache is first filled with nkeys small items, then clients issue
+multigets of keys that are all present (hits) or all absent (misses).
+
+Usage: python performance/hashtable.py [nkeys]
+
+The default of 1M keys fits a small box; the interesting point of
+comparison, 100M keys, needs about 16GB of memory for the server.
+'''
+
+import sys
+import time
+import random
+from multiprocessing import Process, Queue
+
+from lib.utilities import *
+from lib.common import connect, request, stats
+
+DURATION = 10           # seconds per lookup run
+CLIENTS = 8             # client processes
+MULTIGET = 100          # keys per multiget
+BATCH = 1000            # sets per batch while filling the cache
+ITEM_SIZE = 128         # conservative estimate of per-item memory, in bytes
+ENGINES = ['chained', 'bucketized']
+NKEYS = int(sys.argv[-1]) if len(sys.argv) > 1 else 1000000
+
+def fill(nkeys):
+    '''set keys 0..nkeys-1, pipelining a batch at a time'''
+    sock = connect()
+    for start in range(0, nkeys, BATCH):
+        end = min(start + BATCH, nkeys)
+        request(sock, ''.join(['set key:%d 0 0 1\r\nx\r\n' % i
+                               for i in range(start, end)]), end - start)
+    sock.close()
+
+def lookup(queue, nkeys, prefix):
+    '''multiget random keys for DURATION seconds and report the count'''
+    sock = connect()
+    nkey = 0
+    deadline = time.time() + DURATION
+    while time.time() < deadline:
+        keys = ['%s:%d' % (prefix, random.randrange(nkeys))
+                for i in range(MULTIGET)]
+        request(sock, 'get %s\r\n' % ' '.join(keys), 1, 'END\r\n')
+        nkey += MULTIGET
+    sock.close()
+    queue.put(nkey)
+
+def run(engine, prefix):
+    queue = Queue()
+    clients = [Process(target=lookup, args=[queue, NKEYS, prefix])
+               for i in range(CLIENTS)]
+    for p in clients:
+        p.start()
+    nkey = sum(queue.get() for p in clients)
+    for p in clients:
+        p.join()
+    return nkey / float(DURATION)
+
+print "%-12s %12s %12s %14s" % ("hash table", "hits/sec", "misses/sec",
+                                 "table bytes")
+for engine in ENGINES:
+    command = ('HASH_TABLE = "%s"\nMAX_MEMORY = %d\nTHREADS = 4\nVERBOSITY = 4\n' %
+               (engine, NKEYS * ITEM_SIZE / 1024 / 1024 + 64))
+    server = startServer(Args(command=command))
+    try:
+        fill(NKEYS)
+        hits = run(engine, 'key')
+        misses = run(engine, 'miss')
+        sock = connect()
+        nbyte = stats(sock)['nbyte_primary']
+        sock.close()
+        print "%-12s %12.0f %12.0f %14s" % (engine, hits, misses, nbyte)
+        sys.stdout.flush()
+    finally:
+        stopServer(server)
@@ -0,0 +1,76 @@
+__doc__='''
+Measure how throughput of a mixed get/set load scales with the number of
+worker threads, with the item locks collapsed into a single stripe (the
+equivalent of one global cache lock) and with the default number of stripes.
+
+Usage: python performance/lockscale.py [clients]
+'''
+
+import sys
+import os
+import time
+import random
+from multiprocessing import Process, Queue
+
+from lib.utilities import *
+from lib.common import connect, request
+
+DURATION = 10           # seconds per run
+KEYSPACE = 100000       # number of distinct keys
+VALUE_LEN = 100         # bytes per value
+GET_RATIO = 0.9         # fraction of requests that are gets
+PIPELINE = 32           # requests in flight per client
+THREADS = [1, 2, 4, 8]  # worker threads to try
+LOCK_POWERS = [0, None] # single stripe vs. default stripes
+CLIENTS = int(sys.argv[-1]) if len(sys.argv) > 1 else 16
+
+def client(queue):
+    '''issue pipelined requests for DURATION seconds and report the count'''
+    sock = connect()
+    value = 'x' * VALUE_LEN
+    nop = 0
+    deadline = time.time() + DURATION
+    while time.time() < deadline:
+        reqs = []
+        for i in range(PIPELINE):
+            key = 'key:%d' % random.randrange(KEYSPACE)
+            if random.random() < GET_RATIO:
+                reqs.append('get %s\r\n' % key)
+            else:
+                reqs.append('set %s 0 0 %d\r\n%s\r\n' % (key, VALUE_LEN, value))
+        # replies come in order, so with sets sent ahead of gets, the last
+        # get is answered once all requests are
+        reqs.sort(key=lambda req: req.startswith('get'))
+        nget = sum(1 for req in reqs if req.startswith('get'))
+        if nget > 0:
+            request(sock, ''.join(reqs), nget, 'END\r\n')
+        else:
+            request(sock, ''.join(reqs), PIPELINE)
+        nop += PIPELINE
+    sock.close()
+    queue.put(nop)
+
+def run(nthread, lock_power):
+    command = ('THREADS = %d\nLOCK_POWER = %s\nMAX_MEMORY = 64\nVERBOSITY = 4\n' %
+               (nthread, lock_power))
+    server = startServer(Args(command=command))
+    try:
+        queue = Queue()
+        clients = [Process(target=client, args=[queue]) for i in range(CLIENTS)]
+        for p in clients:
+            p.start()
+        nop = sum(queue.get() for p in clients)
+        for p in clients:
+            p.join()
+    finally:
+        stopServer(server)
+    return nop / float(DURATION)
+
+print "%-8s %-12s %12s" % ("threads", "lock power", "ops/sec")
+for lock_power in LOCK_POWERS:
+    for nthread in THREADS:
+        qps = run(nthread, lock_power)
+        print "%-8d %-12s %12.0f" % (nthread,
+                                     'default' if lock_power is None else lock_power,
+                                     qps)
+        sys.stdout.flush()
@@ -0,0 +1,60 @@
+__doc__='''
+Compare the miss ratio curve a server estimates, from the keys it samples,
+with the hit ratios of caches of half, as much, twice and four times as
+much memory, by replaying the same trace against all of them with item lru
+eviction. The trace mixes gets of keys drawn from a Zipf distribution with
+gets of keys that are never asked for again, and every get that misses is
+followed by a set of its key, as a client filling the cache from a backing
+store would do.
+
+Usage: python performance/mrc.py [# requests]
+
+The estimate is read from `stats mrc` of the cache of MAX_MEMORY, along
+with the time spent on sampled keys, which is reported as a share of the
+cpu time of the server, to be kept under 1%.
+'''
+
+import sys
+import time
+
+from lib.utilities import *
+from lib.common import connect, stats, trace, replay
+
+SIZES = ['0.5x', '1x', '2x', '4x']
+MAX_MEMORY = 16         # MB
+NREQ = int(sys.argv[-1]) if len(sys.argv) > 1 else 500000
+
+def run(max_memory):
+    '''replay the trace against a cache, and return its hits, mrc and cpu'''
+    command = 'EVICTION = 1\nMAX_MEMORY = %d\n' % max_memory
+    server = startServer(Args(command=command))
+    try:
+        sock = connect()
+        nhit = replay(sock, keys)
+        time.sleep(STATS_DELAY)
+        mrc = stats(sock, 'mrc')
+        usage = stats(sock)
+        sock.close()
+        cpu = float(usage['rusage_user']) + float(usage['rusage_system'])
+        return nhit, mrc, cpu
+    finally:
+        stopServer(server)
+
+keys = trace(NREQ)
+
+base, mrc, cpu = run(MAX_MEMORY)
+print "sampled 1 in %s keys, %s gets" % (mrc['sample_rate'].split('/')[1],
+                                        mrc['sample_get'])
+print "sampling took %.3fs of %.3fs cpu (%.2f%%)" % (
+    int(mrc['sample_usec']) / 1e6, cpu, int(mrc['sample_usec']) / 1e4 / cpu)
+print "%-6s %12s %12s %16s" % ("size", "memory (MB)", "hit ratio",
+                              "estimated ratio")
+for size in SIZES:
+    max_memory = int(mrc['size_' + size]) / 1024 / 1024
+    if size == '1x':
+        nhit = base
+    else:
+        nhit, _, _ = run(max_memory)
+    print "%-6s %12d %12.4f %16s" % (size, max_memory, float(nhit) / len(keys),
+                                     mrc['hit_ratio_' + size])
+    sys.stdout.flush()
@@ -0,0 +1,65 @@
+__doc__='''
+Measure how fast a snapshot is loaded at startup, with an increasing number
+of worker threads doing it in parallel. The cache is first filled with
+small items and dumped to a snapshot file, which each run then loads
+before it listens, reporting how many items it loaded and how long it took.
+
+Usage: python performance/snapshot.py [# items]
+
+The default of 1M items fits a small box; the file is a little over the
+size of the items, under /tmp.
+'''
+
+import os
+import sys
+import time
+
+from lib.utilities import *
+from lib.common import POLL, connect, request, stats
+
+THREADS = [1, 2, 4, 8, 16]
+BATCH = 1000            # # sets sent at once
+VALUE = 'x' * 100       # value of every item
+SNAPSHOT_FILE = '/tmp/mcsnapshot'
+NITEM = int(sys.argv[-1]) if len(sys.argv) > 1 else 1000000
+
+command = ('SNAPSHOT_FILE = "%s"\nMAX_MEMORY = %d\n' %
+           (SNAPSHOT_FILE, max(NITEM * 256 / 1024 / 1024, 64)))
+
+if os.path.exists(SNAPSHOT_FILE):
+    os.remove(SNAPSHOT_FILE)
+
+server = startServer(Args(command=command))
+try:
+    sock = connect()
+    for i in range(0, NITEM, BATCH):
+        req = ''.join('set key%d 0 0 %d\r\n%s\r\n' % (j, len(VALUE), VALUE)
+                      for j in range(i, min(i + BATCH, NITEM)))
+        request(sock, req, min(BATCH, NITEM - i))
+    request(sock, 'config snapshot dump\r\n', 1)
+    st = stats(sock)
+    while st['snapshot_dumping'] != '0':
+        time.sleep(POLL)
+        st = stats(sock)
+    print "dumped %s items in %s usec" % (st['snapshot_dump_nitem'],
+                                          st['snapshot_dump_usec'])
+    sock.close()
+finally:
+    stopServer(server)
+
+print "%-8s %14s %16s %16s" % ("threads", "items", "load(usec)", "items/sec")
+for nthread in THREADS:
+    server = startServer(Args(command=command + 'THREADS = %d\n' % nthread))
+    try:
+        sock = connect()
+        st = stats(sock)
+        sock.close()
+        nitem = int(st['snapshot_load_nitem'])
+        usec = int(st['snapshot_load_usec'])
+        print "%-8d %14d %16d %16d" % (nthread, nitem, usec,
+                                       nitem * 1000000 / max(usec, 1))
+        sys.stdout.flush()
+    finally:
+        stopServer(server)
+
+os.remove(SNAPSHOT_FILE)
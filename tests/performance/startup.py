@@ -0,0 +1,44 @@
+__doc__='''
+Measure how long it takes to prefault a preallocated slab heap at startup,
+with an increasing number of worker threads doing it in parallel. The
+server answers stats as soon as it listens, and reports heap_ready once the
+whole heap is faulted in, along with the time it took.
+
+Usage: python performance/startup.py [max memory in MB]
+
+The default of 4GB fits a small box; prefault time grows linearly with the
+heap, so a few runs at production sizes are worth the wait. Add
+LOCK_PAGE = True to the command below to also lock the pages, which needs
+a large enough RLIMIT_MEMLOCK for the server user.
+'''
+
+import sys
+import time
+
+from lib.utilities import *
+from lib.common import POLL, connect, stats
+
+THREADS = [1, 2, 4, 8, 16]
+MAX_MEMORY = int(sys.argv[-1]) if len(sys.argv) > 1 else 4096
+
+print "%-8s %14s %14s %16s" % ("threads", "listening(s)", "ready(s)",
+                                "prefault(usec)")
+for nthread in THREADS:
+    command = ('PREALLOC = True\nMAX_MEMORY = %d\nTHREADS = %d\nVERBOSITY = 4\n' %
+               (MAX_MEMORY, nthread))
+    start = time.time()
+    server = startServer(Args(command=command))
+    try:
+        sock = connect()
+        st = stats(sock)
+        listening = time.time() - start
+        while st['heap_ready'] != '1':
+            time.sleep(POLL)
+            st = stats(sock)
+        ready = time.time() - start
+        sock.close()
+        print "%-8d %14.3f %14.3f %16s" % (nthread, listening, ready,
+                                           st['heap_prefault_usec'])
+        sys.stdout.flush()
+    finally:
+        stopServer(server)